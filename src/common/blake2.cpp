@@ -15,9 +15,16 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
+#include <vector>
+#include <algorithm>
 
 #include "blake2.hpp"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BLAKE2B_HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+
 #if !defined(__cplusplus) && (!defined(__STDC_VERSION__) || __STDC_VERSION__ < 199901L)
   #if   defined(_MSC_VER)
     #define BLAKE2_INLINE __inline
@@ -465,6 +472,254 @@ int blake2( void *out, size_t outlen, const void *in, size_t inlen, const void *
   return blake2b(out, outlen, in, inlen, key, keylen);
 }
 
+/*
+   Multi-buffer BLAKE2b.
+
+   Four independent messages are compressed in lock step; word i of
+   lane j is word i of the state of message j. A lane that has no
+   more blocks is still computed but its state is kept (masked), so
+   the messages may have different lengths. Messages are processed in
+   order of their number of blocks to keep the lanes busy.
+*/
+
+#define BLAKE2B_LANES 4
+
+typedef struct blake2b_lanes__
+{
+  uint64_t h[8][BLAKE2B_LANES];
+  uint64_t t[BLAKE2B_LANES];
+  uint64_t f[BLAKE2B_LANES];
+  uint64_t active[BLAKE2B_LANES];
+  const uint8_t *block[BLAKE2B_LANES];
+} blake2b_lanes;
+
+typedef void (*blake2b_compress_lanes_fn)( blake2b_lanes *L );
+
+static void blake2b_compress_lanes_portable( blake2b_lanes *L )
+{
+  size_t i, j;
+  blake2b_state S[1];
+
+  memset( S, 0, sizeof( blake2b_state ) );
+  for( j = 0; j < BLAKE2B_LANES; ++j ) {
+    if( !L->active[j] ) continue;
+    for( i = 0; i < 8; ++i ) S->h[i] = L->h[i][j];
+    S->t[0] = L->t[j];
+    S->f[0] = L->f[j];
+    blake2b_compress( S, L->block[j] );
+    for( i = 0; i < 8; ++i ) L->h[i][j] = S->h[i];
+  }
+}
+
+#if defined(BLAKE2B_HAVE_AVX2)
+
+#define ADD4(a,b) _mm256_add_epi64(a, b)
+#define XOR4(a,b) _mm256_xor_si256(a, b)
+#define ROTR32_4(x) _mm256_shuffle_epi32(x, _MM_SHUFFLE(2,3,0,1))
+#define ROTR24_4(x) _mm256_shuffle_epi8(x, r24)
+#define ROTR16_4(x) _mm256_shuffle_epi8(x, r16)
+#define ROTR63_4(x) XOR4(_mm256_srli_epi64(x, 63), ADD4(x, x))
+
+#define G4(r,i,a,b,c,d)                             \
+  do {                                              \
+    a = ADD4(ADD4(a, b), m[blake2b_sigma[r][2*i+0]]); \
+    d = ROTR32_4(XOR4(d, a));                       \
+    c = ADD4(c, d);                                 \
+    b = ROTR24_4(XOR4(b, c));                       \
+    a = ADD4(ADD4(a, b), m[blake2b_sigma[r][2*i+1]]); \
+    d = ROTR16_4(XOR4(d, a));                       \
+    c = ADD4(c, d);                                 \
+    b = ROTR63_4(XOR4(b, c));                       \
+  } while(0)
+
+#define ROUND4(r)                    \
+  do {                               \
+    G4(r,0,v[ 0],v[ 4],v[ 8],v[12]); \
+    G4(r,1,v[ 1],v[ 5],v[ 9],v[13]); \
+    G4(r,2,v[ 2],v[ 6],v[10],v[14]); \
+    G4(r,3,v[ 3],v[ 7],v[11],v[15]); \
+    G4(r,4,v[ 0],v[ 5],v[10],v[15]); \
+    G4(r,5,v[ 1],v[ 6],v[11],v[12]); \
+    G4(r,6,v[ 2],v[ 7],v[ 8],v[13]); \
+    G4(r,7,v[ 3],v[ 4],v[ 9],v[14]); \
+  } while(0)
+
+__attribute__((target("avx2")))
+static void blake2b_compress_lanes_avx2( blake2b_lanes *L )
+{
+  const __m256i r16 = _mm256_setr_epi8( 2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+                                        2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9 );
+  const __m256i r24 = _mm256_setr_epi8( 3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+                                        3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10 );
+  __m256i m[16];
+  __m256i v[16];
+  __m256i active;
+  size_t i;
+
+  for( i = 0; i < 16; ++i ) {
+    m[i] = _mm256_set_epi64x( (long long)load64( L->block[3] + i * sizeof( uint64_t ) ),
+                              (long long)load64( L->block[2] + i * sizeof( uint64_t ) ),
+                              (long long)load64( L->block[1] + i * sizeof( uint64_t ) ),
+                              (long long)load64( L->block[0] + i * sizeof( uint64_t ) ) );
+  }
+
+  for( i = 0; i < 8; ++i ) {
+    v[i] = _mm256_loadu_si256( (const __m256i *)L->h[i] );
+  }
+
+  v[ 8] = _mm256_set1_epi64x( (long long)blake2b_IV[0] );
+  v[ 9] = _mm256_set1_epi64x( (long long)blake2b_IV[1] );
+  v[10] = _mm256_set1_epi64x( (long long)blake2b_IV[2] );
+  v[11] = _mm256_set1_epi64x( (long long)blake2b_IV[3] );
+  v[12] = XOR4( _mm256_set1_epi64x( (long long)blake2b_IV[4] ),
+                _mm256_loadu_si256( (const __m256i *)L->t ) );
+  v[13] = _mm256_set1_epi64x( (long long)blake2b_IV[5] );
+  v[14] = XOR4( _mm256_set1_epi64x( (long long)blake2b_IV[6] ),
+                _mm256_loadu_si256( (const __m256i *)L->f ) );
+  v[15] = _mm256_set1_epi64x( (long long)blake2b_IV[7] );
+
+  ROUND4( 0 );
+  ROUND4( 1 );
+  ROUND4( 2 );
+  ROUND4( 3 );
+  ROUND4( 4 );
+  ROUND4( 5 );
+  ROUND4( 6 );
+  ROUND4( 7 );
+  ROUND4( 8 );
+  ROUND4( 9 );
+  ROUND4( 10 );
+  ROUND4( 11 );
+
+  active = _mm256_loadu_si256( (const __m256i *)L->active );
+  for( i = 0; i < 8; ++i ) {
+    __m256i h = _mm256_loadu_si256( (const __m256i *)L->h[i] );
+    __m256i nh = XOR4( h, XOR4( v[i], v[i + 8] ) );
+    _mm256_storeu_si256( (__m256i *)L->h[i], _mm256_blendv_epi8( h, nh, active ) );
+  }
+}
+
+#undef G4
+#undef ROUND4
+#undef ADD4
+#undef XOR4
+#undef ROTR32_4
+#undef ROTR24_4
+#undef ROTR16_4
+#undef ROTR63_4
+
+#endif
+
+static size_t blake2b_num_blocks( size_t inlen )
+{
+  return inlen == 0 ? 1 : ( inlen + BLAKE2B_BLOCKBYTES - 1 ) / BLAKE2B_BLOCKBYTES;
+}
+
+static int blake2b_many_with( blake2b_compress_lanes_fn compress, void *const *out, size_t outlen, const void *const *in, const size_t *inlen, size_t n )
+{
+  static const uint8_t zero_block[BLAKE2B_BLOCKBYTES] = {0};
+  uint8_t tail[BLAKE2B_LANES][BLAKE2B_BLOCKBYTES];
+  uint8_t buffer[BLAKE2B_OUTBYTES];
+  blake2b_state S0[1];
+  blake2b_lanes L[1];
+  std::vector<size_t> order(n);
+  size_t first, i, j, b;
+
+  if( n == 0 ) return 0;
+  if( NULL == out || NULL == in || NULL == inlen ) return -1;
+  if( blake2b_init( S0, outlen ) < 0 ) return -1;
+
+  for( i = 0; i < n; ++i ) {
+    if( NULL == out[i] ) return -1;
+    if( NULL == in[i] && inlen[i] > 0 ) return -1;
+    order[i] = i;
+  }
+  std::sort( order.begin(), order.end(), [inlen](size_t a, size_t c) {
+      return blake2b_num_blocks( inlen[a] ) < blake2b_num_blocks( inlen[c] );
+  } );
+
+  for( first = 0; first < n; first += BLAKE2B_LANES ) {
+    size_t lanes = ( n - first < BLAKE2B_LANES ) ? n - first : BLAKE2B_LANES;
+    size_t nblocks[BLAKE2B_LANES];
+    size_t max_blocks = 0;
+
+    for( j = 0; j < BLAKE2B_LANES; ++j ) {
+      for( i = 0; i < 8; ++i ) L->h[i][j] = S0->h[i];
+      nblocks[j] = ( j < lanes ) ? blake2b_num_blocks( inlen[order[first + j]] ) : 0;
+      if( nblocks[j] > max_blocks ) max_blocks = nblocks[j];
+    }
+
+    for( b = 0; b < max_blocks; ++b ) {
+      for( j = 0; j < BLAKE2B_LANES; ++j ) {
+        if( b >= nblocks[j] ) {
+          L->block[j] = zero_block;
+          L->t[j] = 0;
+          L->f[j] = 0;
+          L->active[j] = 0;
+          continue;
+        }
+        const uint8_t *p = ( const uint8_t * )in[order[first + j]];
+        size_t len = inlen[order[first + j]];
+        size_t offset = b * BLAKE2B_BLOCKBYTES;
+        L->active[j] = (uint64_t)-1;
+        if( b + 1 < nblocks[j] ) {
+          L->block[j] = p + offset;
+          L->t[j] = offset + BLAKE2B_BLOCKBYTES;
+          L->f[j] = 0;
+        } else {
+          /* Last block is zero padded */
+          size_t rest = len - offset;
+          if( rest > 0 ) memcpy( tail[j], p + offset, rest );
+          memset( tail[j] + rest, 0, BLAKE2B_BLOCKBYTES - rest );
+          L->block[j] = tail[j];
+          L->t[j] = len;
+          L->f[j] = (uint64_t)-1;
+        }
+      }
+      compress( L );
+    }
+
+    for( j = 0; j < lanes; ++j ) {
+      for( i = 0; i < 8; ++i )
+        store64( buffer + sizeof( uint64_t ) * i, L->h[i][j] );
+      memcpy( out[order[first + j]], buffer, outlen );
+    }
+  }
+  return 0;
+}
+
+static blake2b_compress_lanes_fn blake2b_select_lanes( void )
+{
+#if defined(BLAKE2B_HAVE_AVX2)
+  __builtin_cpu_init();
+  if( __builtin_cpu_supports( "avx2" ) ) {
+    return blake2b_compress_lanes_avx2;
+  }
+#endif
+  return blake2b_compress_lanes_portable;
+}
+
+static blake2b_compress_lanes_fn blake2b_lanes_compress( void )
+{
+  static const blake2b_compress_lanes_fn fn = blake2b_select_lanes();
+  return fn;
+}
+
+int blake2b_many( void *const *out, size_t outlen, const void *const *in, const size_t *inlen, size_t n )
+{
+  return blake2b_many_with( blake2b_lanes_compress(), out, outlen, in, inlen, n );
+}
+
+int blake2b_many_portable( void *const *out, size_t outlen, const void *const *in, const size_t *inlen, size_t n )
+{
+  return blake2b_many_with( blake2b_compress_lanes_portable, out, outlen, in, inlen, n );
+}
+
+const char * blake2b_many_impl( void )
+{
+  return blake2b_lanes_compress() == blake2b_compress_lanes_portable ? "portable" : "avx2";
+}
+
 #if defined(SUPERCOP)
 int crypto_hash( unsigned char *out, unsigned char *in, unsigned long long inlen )
 {
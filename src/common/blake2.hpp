@@ -185,6 +185,15 @@ int blake2xb( void *out, size_t outlen, const void *in, size_t inlen, const void
 /* This is simply an alias for blake2b */
 int blake2( void *out, size_t outlen, const void *in, size_t inlen, const void *key, size_t keylen );
 
+/* Multi-buffer API: hashes n independent (unkeyed) messages, in[i]
+   of length inlen[i] into out[i], four at a time. Same result as
+   calling blake2b for each message. Uses AVX2 if the CPU has it. */
+int blake2b_many( void *const *out, size_t outlen, const void *const *in, const size_t *inlen, size_t n );
+/* Same as above but never uses SIMD */
+int blake2b_many_portable( void *const *out, size_t outlen, const void *const *in, const size_t *inlen, size_t n );
+/* "avx2" or "portable" */
+const char * blake2b_many_impl( void );
+
 }}
 
 #endif
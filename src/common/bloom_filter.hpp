@@ -0,0 +1,84 @@
+#pragma once
+
+#ifndef _common_bloom_filter_hpp
+#define _common_bloom_filter_hpp
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <algorithm>
+
+namespace epilog { namespace common {
+
+//
+// Bloom filter over 64-bit hashes. The bit positions are derived from
+// the two halves of the hash (double hashing), so the caller only has
+// to provide one good 64-bit hash per element.
+//
+class bloom_filter {
+public:
+    inline bloom_filter() : num_hashes_(0), mask_(0), size_(0), capacity_(0) { }
+    inline bloom_filter(size_t capacity, size_t bits_per_element = 10) {
+	reset(capacity, bits_per_element);
+    }
+
+    inline void reset(size_t capacity, size_t bits_per_element = 10) {
+	size_t num_bits = 64;
+	while (num_bits < capacity * bits_per_element) {
+	    num_bits *= 2;
+	}
+	bits_.assign(num_bits / 64, 0);
+	mask_ = num_bits - 1;
+	// k = ln(2) * bits per element is optimal
+	num_hashes_ = (bits_per_element * 7 + 5) / 10;
+	if (num_hashes_ == 0) num_hashes_ = 1;
+	if (num_hashes_ > 16) num_hashes_ = 16;
+	size_ = 0;
+	capacity_ = capacity;
+    }
+
+    inline void clear() {
+	std::fill(bits_.begin(), bits_.end(), 0);
+	size_ = 0;
+    }
+
+    // Number of added elements (including duplicates)
+    inline size_t size() const { return size_; }
+    inline size_t capacity() const { return capacity_; }
+    inline size_t num_bits() const { return bits_.size() * 64; }
+    inline bool is_full() const { return size_ >= capacity_; }
+
+    inline void add(uint64_t h) {
+	uint64_t h1 = h & 0xffffffff, h2 = (h >> 32) | 1;
+	for (size_t i = 0; i < num_hashes_; i++, h1 += h2) {
+	    auto bit = h1 & mask_;
+	    bits_[bit >> 6] |= static_cast<uint64_t>(1) << (bit & 63);
+	}
+	size_++;
+    }
+
+    inline bool maybe_contains(uint64_t h) const {
+	if (bits_.empty()) {
+	    return true;
+	}
+	uint64_t h1 = h & 0xffffffff, h2 = (h >> 32) | 1;
+	for (size_t i = 0; i < num_hashes_; i++, h1 += h2) {
+	    auto bit = h1 & mask_;
+	    if ((bits_[bit >> 6] & (static_cast<uint64_t>(1) << (bit & 63))) == 0) {
+		return false;
+	    }
+	}
+	return true;
+    }
+
+private:
+    std::vector<uint64_t> bits_;
+    size_t num_hashes_;
+    uint64_t mask_;
+    size_t size_;
+    size_t capacity_;
+};
+
+}}
+
+#endif
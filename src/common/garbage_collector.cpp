@@ -1,143 +1,363 @@
+#include <algorithm>
+#include <deque>
+#include <boost/thread.hpp>
 #include "term.hpp"
+#include "utime.hpp"
 #include "garbage_collector.hpp"
 
 namespace epilog { namespace common {
 
-garbage_collector::live_block_t
-garbage_collector::get_live_block(live_t &live, size_t index) {
-  return live[index];
+//
+// Work queue of one marking thread. The owner pushes and pops at the
+// back, other threads steal from the front.
+//
+class garbage_collector::mark_deque {
+public:
+  mark_deque() : size_(0) { }
+
+  inline size_t size() const { return size_.load(std::memory_order_relaxed); }
+
+  void push(const size_t *items, size_t n) {
+    boost::lock_guard<boost::mutex> lockit(lock_);
+    items_.insert(items_.end(), items, items + n);
+    size_.store(items_.size(), std::memory_order_relaxed);
+  }
+
+  // Take up to n items from the back (owner) or at most half from
+  // the front (thief.)
+  bool take(std::vector<size_t> &out, size_t n, bool steal) {
+    boost::lock_guard<boost::mutex> lockit(lock_);
+    if (items_.empty()) {
+      return false;
+    }
+    n = std::min(n, steal ? (items_.size() + 1) / 2 : items_.size());
+    for (size_t i = 0; i < n; i++) {
+      if (steal) {
+	out.push_back(items_.front());
+	items_.pop_front();
+      } else {
+	out.push_back(items_.back());
+	items_.pop_back();
+      }
+    }
+    size_.store(items_.size(), std::memory_order_relaxed);
+    return true;
   }
 
-void garbage_collector::set_live_block(live_t &live, size_t index, live_block_t block) {
-  //  if (live.size() < (index+1)) {
-  //    live.resize(index+1);
-  //  }
-  live[index] = block;
+private:
+  boost::mutex lock_;
+  std::deque<size_t> items_;
+  std::atomic<size_t> size_;
+};
+
+bool garbage_collector::is_allocated(size_t index) const {
+  auto block_index = index / heap_block::MAX_SIZE;
+  if (block_index >= heap_.blocks_.size()) {
+    return false;
+  }
+  auto block = heap_.blocks_[block_index];
+  return index - block->offset() < block->size();
+}
+
+bool garbage_collector::is_live(size_t index) const {
+  auto block_index = index / heap_block::MAX_SIZE;
+  if (block_index >= live_.size() || live_[block_index] == nullptr) {
+    return false;
+  }
+  return live_[block_index]->test(index % heap_block::MAX_SIZE);
 }
 
 garbage_collector::live_block_t
-garbage_collector::mark_live_block(live_t &live, size_t block_index) {
-  auto block_live = get_live_block(live, block_index);
-  if(block_live == nullptr) {
-    std::cout << "block_live: " << block_index << "\n";
-    //    std::cout << "creating new bitvector\n";
-    block_live = new std::bitset<heap_block::MAX_SIZE>();
-    set_live_block(live, block_index, block_live);
+garbage_collector::mark_live_block(size_t block_index) {
+  auto block_live = live_[block_index];
+  if (block_live == nullptr) {
+    block_live = new live_bits();
+    live_[block_index] = block_live;
   }
   return block_live;
 }
 
-bool garbage_collector::mark_live_word(live_t &live, size_t index) {
+// Concurrent markers require that all live blocks have been allocated.
+template<bool Atomic> bool garbage_collector::mark_live_word(size_t index) {
   auto block_index = index / heap_block::MAX_SIZE;
-  auto &block_vector = (*mark_live_block(live, block_index));
-  auto bit_index = index - (block_index*heap_block::MAX_SIZE);
-  if(!block_vector[bit_index]) {
-    block_vector.set(bit_index, 1);
-    return true;
+  auto bit_index = index % heap_block::MAX_SIZE;
+  if (Atomic) {
+    return live_[block_index]->atomic_set(bit_index);
   } else {
-    return false;
+    return mark_live_block(block_index)->set(bit_index);
   }
 }
 
-void garbage_collector::mark(std::vector<ptr_cell *> &roots, live_t &live) {
-  std::vector<size_t> worklist;
-  //  std::cout << "Pushing roots\n----------\n";
-  for(auto &root : roots) {
-    //    std::cout << "Pushing index: " << root->index() << "\n";
-    worklist.push_back(root->index());
+void garbage_collector::mark_seeds(std::vector<ptr_cell *> &roots,
+				   std::vector<size_t> &seeds) {
+  for (auto &root : roots) {
+    seeds.push_back(root->index());
+  }
+  for (auto *trail : trails_) {
+    for (auto index : *trail) {
+      if (index >= young_start_) {
+	seeds.push_back(index);
+      } else if (is_allocated(index)) {
+	// An old variable bound after the last choice point
+	push_pointer(cell_at(index), seeds);
+      }
+    }
+  }
+}
+
+template<bool Atomic> void garbage_collector::mark_item(size_t current, std::vector<size_t> &worklist) {
+  if (current < young_start_ || !is_allocated(current)) {
+    return;
+  }
+  if (!mark_live_word<Atomic>(current)) {
+    return;
   }
-  //  std::cout << "Pushing roots - done\n----------\n";
-  while(worklist.size() > 0) {
+  const cell &c = cell_at(current);
+  if (c.tag() == tag_t::DAT) {
+    // The data cells are raw (untagged), keep them without
+    // looking inside. Big nums may span over several blocks.
+    auto &dc = reinterpret_cast<const dat_cell &>(c);
+    size_t nc = dc.num_cells();
+    for (size_t i = 1; i < nc; i++) {
+      if (is_allocated(current + i)) {
+	mark_live_word<Atomic>(current + i);
+      }
+    }
+  } else {
+    push_children(current, worklist);
+  }
+}
+
+void garbage_collector::mark(std::vector<size_t> &worklist) {
+  while (worklist.size() > 0) {
     auto current = worklist.back();
     worklist.pop_back();
-    //    std::cout << "Current index: " << current << "\n";
-    if (mark_live_word(live, current)) {
-      cell c = heap_[current];
-      // Mark extra blocks beloning to DAT, if it spans over many blocks
-      if (c.tag() == tag_t::DAT) {
-	auto &dc = reinterpret_cast<const dat_cell&>(c);
-	size_t nc = dc.num_cells();
-	size_t dat_index = current + heap_block::MAX_SIZE;
-	size_t block_index = dat_index / heap_block::MAX_SIZE;
-	while (dat_index < (current + nc)) {
-	  mark_live_block(live, block_index);
-	  block_index = block_index + 1;
-	  dat_index = dat_index + heap_block::MAX_SIZE;
+    mark_item<false>(current, worklist);
+  }
+}
+
+void garbage_collector::mark_parallel(std::vector<size_t> &seeds) {
+  size_t first_block = young_start_ / heap_block::MAX_SIZE;
+  for (size_t b = first_block; b < live_.size(); b++) {
+    mark_live_block(b);
+  }
+
+  std::vector<mark_deque *> deques;
+  for (size_t i = 0; i < num_threads_; i++) {
+    deques.push_back(new mark_deque());
+  }
+  size_t chunk = (seeds.size() + num_threads_ - 1) / num_threads_;
+  for (size_t i = 0; i < num_threads_ && i * chunk < seeds.size(); i++) {
+    size_t n = std::min(chunk, seeds.size() - i * chunk);
+    deques[i]->push(&seeds[i * chunk], n);
+  }
+
+  std::atomic<size_t> active(num_threads_);
+  boost::thread_group threads;
+  for (size_t i = 1; i < num_threads_; i++) {
+    threads.create_thread( [&,i]{ mark_worker(i, deques, active); } );
+  }
+  mark_worker(0, deques, active);
+  threads.join_all();
+
+  for (auto *d : deques) {
+    delete d;
+  }
+}
+
+//
+// A marker works on its own (private) stack. When that grows it
+// shares half of it through its deque. When it runs out of work it
+// takes from its deque and then steals from the others. We're done
+// when no marker is active and all deques are empty.
+//
+void garbage_collector::mark_worker(size_t id, std::vector<mark_deque *> &deques, std::atomic<size_t> &active) {
+  static const size_t BATCH = 256;
+  static const size_t SHARE_THRESHOLD = 2 * BATCH;
+
+  size_t n = deques.size();
+  std::vector<size_t> local;
+
+  auto take_work = [&]() {
+    if (deques[id]->take(local, BATCH, false)) {
+      return true;
+    }
+    for (size_t i = 1; i < n; i++) {
+      if (deques[(id + i) % n]->take(local, BATCH, true)) {
+	return true;
+      }
+    }
+    return false;
+  };
+  auto has_work = [&]() {
+    for (auto *d : deques) {
+      if (d->size() > 0) return true;
+    }
+    return false;
+  };
+
+  for (;;) {
+    if (local.empty() && !take_work()) {
+      active.fetch_sub(1);
+      bool found = false;
+      while (!found) {
+	if (active.load() == 0 && !has_work()) {
+	  return;
+	}
+	if (has_work()) {
+	  active.fetch_add(1);
+	  found = take_work();
+	  if (!found) {
+	    active.fetch_sub(1);
+	  }
+	} else {
+	  boost::this_thread::yield();
 	}
-	mark_live_block(live, (current + nc)/heap_block::MAX_SIZE);
       }
-      push_children(current, worklist);
+    }
+    while (!local.empty()) {
+      auto current = local.back();
+      local.pop_back();
+      mark_item<true>(current, local);
+      if (local.size() > SHARE_THRESHOLD && deques[id]->size() == 0) {
+	size_t half = local.size() / 2;
+	deques[id]->push(&local[0], half);
+	local.erase(local.begin(), local.begin() + half);
+      }
     }
   }
 }
 
-void garbage_collector::push_children(size_t index, std::vector<size_t> &worklist) {
-  //  std::cout << "Pushing children\n----------\n";
-  cell c = heap_[index];
+void garbage_collector::push_pointer(cell c, std::vector<size_t> &worklist) {
   switch (c.tag()) {
-  case tag_t::INT:
-  case tag_t::DAT:
-    break;
-  case tag_t::CON: {
-    auto &con = reinterpret_cast<const con_cell &>(c);
-    auto arity = con.arity();
-    for(size_t i = 1; i <= arity; i++) {
-      //      std::cout << "Pushing index: " << index + i << "\n";
-      worklist.push_back(index+i);
-    }
-    break;
-  }
   case tag_t::RFW:
   case tag_t::BIG:
   case tag_t::REF:
   case tag_t::STR: {
-    auto &pc = reinterpret_cast<const ptr_cell&>(c);
-    //    std::cout << "Pushing index: " << pc.index() << "\n";
+    auto &pc = reinterpret_cast<const ptr_cell &>(c);
     worklist.push_back(pc.index());
+    break;
   }
+  default:
+    break;
   }
-  //  std::cout << "Pushing children - done\n----------\n";
 }
 
-size_t garbage_collector::calculate_deltas(std::unordered_map<size_t, size_t> &block_index_to_delta,
-                                           live_t &live) {
-  size_t current_delta = 0;
-  size_t size = live.size();
-  for(size_t i = 0; i < size; i++) {
-    if(get_live_block(live,i) == nullptr) {
-      current_delta += heap_block::MAX_SIZE;
-    } else {
-      std::cout << "Delta Block[" << i << "] = " << current_delta << "\n";
-      block_index_to_delta[i] = current_delta;
+void garbage_collector::push_children(size_t index, std::vector<size_t> &worklist) {
+  const cell &c = cell_at(index);
+  if (c.tag() == tag_t::CON) {
+    auto &con = reinterpret_cast<const con_cell &>(c);
+    auto arity = con.arity();
+    for (size_t i = 1; i <= arity; i++) {
+      worklist.push_back(index+i);
     }
+  } else {
+    push_pointer(c, worklist);
+  }
+}
+
+// A functor and its arguments (or a big num) must stay together.
+size_t garbage_collector::object_size(size_t index) {
+  const cell &c = cell_at(index);
+  switch (c.tag()) {
+  case tag_t::CON:
+    return 1 + reinterpret_cast<const con_cell &>(c).arity();
+  case tag_t::DAT:
+    return reinterpret_cast<const dat_cell &>(c).num_cells();
+  default:
+    return 1;
   }
-  return current_delta;
 }
 
-size_t garbage_collector::calculate_new_index(std::unordered_map<size_t, size_t> &block_index_to_delta,
-					      size_t index) {
-  size_t block_index = heap_.find_block_index(index);
-  size_t new_index = index - block_index_to_delta[block_index];
-  return new_index;
+//
+// Assign new addresses to all live cells (in order.) Objects that are
+// not allowed to span blocks are moved to the next block if they don't
+// fit in what remains of the current one. Returns the new heap top.
+//
+size_t garbage_collector::calculate_forward() {
+  size_t num_blocks = live_.size();
+  size_t first_block = young_start_ / heap_block::MAX_SIZE;
+
+  forward_.resize(num_blocks);
+  block_used_.assign(num_blocks, 0);
+  block_skip_.assign(num_blocks, 0);
+  if (first_block < num_blocks) {
+    block_used_[first_block] = young_start_ - first_block * heap_block::MAX_SIZE;
+  }
+
+  std::sort(boundaries_.begin(), boundaries_.end(),
+	    [](size_t *a, size_t *b) { return *a < *b; });
+  size_t bi = 0;
+  while (bi < boundaries_.size() && *boundaries_[bi] < young_start_) {
+    bi++;
+  }
+
+  size_t dest = young_start_;
+  size_t object_end = 0;
+  size_t dat_end = 0;
+  for (size_t b = first_block; b < num_blocks; b++) {
+    if (live_[b] == nullptr) {
+      continue;
+    }
+    size_t block_start = b * heap_block::MAX_SIZE;
+    if (dat_end > block_start) {
+      // Continues raw data from the previous block
+      size_t skip = dat_end - block_start;
+      block_skip_[b] = skip < heap_block::MAX_SIZE ? skip : heap_block::MAX_SIZE;
+    }
+    auto &bits = *live_[b];
+    auto &fwd = forward_[b];
+    fwd.resize(heap_block::MAX_SIZE);
+    for (size_t wi = 0; wi < live_bits::NUM_WORDS; wi++) {
+      uint64_t w = bits.word(wi);
+      while (w != 0) {
+	size_t j = wi * 64 + __builtin_ctzll(w);
+	w &= w - 1;
+	size_t i = block_start + j;
+	if (i < young_start_) {
+	  continue;
+	}
+	if (i >= object_end) {
+	  size_t n = object_size(i);
+	  bool span = cell_at(i).tag() == tag_t::DAT;
+	  if (!span && (dest % heap_block::MAX_SIZE) + n > heap_block::MAX_SIZE) {
+	    dest = (dest / heap_block::MAX_SIZE + 1) * heap_block::MAX_SIZE;
+	  }
+	  object_end = i + n;
+	  if (span) {
+	    dat_end = object_end;
+	  }
+	  while (bi < boundaries_.size() && *boundaries_[bi] <= i) {
+	    *boundaries_[bi] = dest;
+	    bi++;
+	  }
+	}
+	fwd[j] = dest;
+	size_t dest_block = dest / heap_block::MAX_SIZE;
+	block_used_[dest_block] = dest - dest_block * heap_block::MAX_SIZE + 1;
+	dest++;
+	stats_.live_cells++;
+      }
+    }
+  }
+  while (bi < boundaries_.size()) {
+    *boundaries_[bi] = dest;
+    bi++;
+  }
+  return dest;
 }
 
-void garbage_collector::rewrite_cell(size_t i, heap_block &block,
-                                     std::unordered_map<size_t, size_t> &block_index_to_delta) {
-  auto &c = block.get(i);
-  switch(c.tag()) {
+void garbage_collector::rewrite_cell(cell &c) {
+  switch (c.tag()) {
   case tag_t::RFW:
   case tag_t::BIG:
   case tag_t::REF:
   case tag_t::STR: {
-    auto &pcell = reinterpret_cast<ptr_cell&>(c);
-    size_t old_index = pcell.index();
-    size_t new_index = calculate_new_index(block_index_to_delta, old_index);
-    if (old_index != new_index) {
-      std::cout << "Rewriting cell: " << old_index << " -> " << new_index << "\n";
-      pcell.set_index(new_index);
-      block.set(i, pcell);
-    }
-    assert(reinterpret_cast<ptr_cell&>(block.get(i)).index() == new_index);
+    auto &pc = reinterpret_cast<ptr_cell &>(c);
+    size_t old_index = pc.index();
+    if (is_live(old_index)) {
+      pc.set_index(forward(old_index));
+    }
     break;
   }
   default:
@@ -145,94 +365,221 @@ void garbage_collector::rewrite_cell(size_t i, heap_block &block,
   }
 }
 
-void garbage_collector::rewrite_blocks(std::unordered_map<size_t, size_t> &block_index_to_delta,
-                                       live_t &live) {
-  size_t size = live.size();
-  for(size_t i = 0; i < size; i++) {
-    if(get_live_block(live, i) != nullptr) {
-      auto block = heap_.find_block_from_index(i);
-      auto &live_block = *get_live_block(live, i);
-      for(size_t j = 0; j < heap_block::MAX_SIZE; j++) {
-        if(live_block[j]) {
-          rewrite_cell(j, *block, block_index_to_delta);
-        }
+// Only writes to its own block, so blocks can be done in parallel.
+void garbage_collector::rewrite_block(size_t b) {
+  if (live_[b] == nullptr) {
+    return;
+  }
+  auto &bits = *live_[b];
+  auto *block = heap_.blocks_[b];
+  const heap_block *const_block = block;
+  size_t block_start = b * heap_block::MAX_SIZE;
+  size_t skip_end = block_start + block_skip_[b];
+  for (size_t wi = 0; wi < live_bits::NUM_WORDS; wi++) {
+    uint64_t w = bits.word(wi);
+    while (w != 0) {
+      size_t j = wi * 64 + __builtin_ctzll(w);
+      w &= w - 1;
+      size_t i = block_start + j;
+      if (i < young_start_ || i < skip_end) {
+	continue;
+      }
+      cell c = const_block->get(j);
+      if (c.tag() == tag_t::DAT) {
+	skip_end = i + object_size(i);
+	continue;
+      }
+      cell new_c = c;
+      rewrite_cell(new_c);
+      if (new_c.raw_value() != c.raw_value()) {
+	block->set(j, new_c);
       }
     }
   }
 }
 
-void garbage_collector::rewrite_roots(std::unordered_map<size_t, size_t> &block_index_to_delta,
-				      std::vector<ptr_cell *> &roots) {
-  for(auto &root : roots) {
-    size_t old_index = root->index();
-    size_t new_index = calculate_new_index(block_index_to_delta, old_index);
-    if (old_index != new_index) {
-      std::cout << "Rewriting ROOT: " << old_index << " -> " << new_index << "\n";
-      root->set_index(new_index);
+void garbage_collector::rewrite_blocks() {
+  size_t first_block = young_start_ / heap_block::MAX_SIZE;
+  for (size_t b = first_block; b < live_.size(); b++) {
+    rewrite_block(b);
+  }
+}
+
+void garbage_collector::rewrite_blocks_parallel() {
+  std::atomic<size_t> next_block(young_start_ / heap_block::MAX_SIZE);
+  auto worker = [&]() {
+    for (;;) {
+      size_t b = next_block.fetch_add(1);
+      if (b >= live_.size()) {
+	return;
+      }
+      rewrite_block(b);
     }
+  };
+  boost::thread_group threads;
+  for (size_t i = 1; i < num_threads_; i++) {
+    threads.create_thread(worker);
   }
+  worker();
+  threads.join_all();
 }
 
-void garbage_collector::cleanup_blocks(live_t &live) {
-  size_t size = live.size();
-  size_t new_index = 0;
-  for(size_t i = 0; i < size; i++) {
-    auto block = heap_.find_block_from_index(i);
-    if(get_live_block(live, i) != nullptr) {
-      block->set_index(new_index);
-      heap_.blocks_[new_index] = block;
-      heap_.head_block_ = block;
-      //      if(i == 0) {
-      //        heap_.head_block_ = block;
-      //      }
-      new_index++;
-      std::cout << "New index: " << new_index << "\n";
-    } else {
-      std::cout << "Deleting block: " << i << "\n";
-      delete block;
+// Old cells on the trail may point into the young generation. Then
+// update the trail itself and the watched addresses.
+void garbage_collector::rewrite_trail() {
+  for (auto *trail : trails_) {
+    for (auto &index : *trail) {
+      if (index < young_start_) {
+	if (is_allocated(index)) {
+	  cell c = cell_at(index);
+	  cell new_c = c;
+	  rewrite_cell(new_c);
+	  if (new_c.raw_value() != c.raw_value()) {
+	    heap_[index] = new_c;
+	  }
+	}
+      } else if (is_live(index)) {
+	index = forward(index);
+      }
     }
   }
-  // Must set heap top?
 
-  auto new_heap_size = heap_.size_ - ((size - new_index) * heap_block::MAX_SIZE);
-  std::cout << "Heap size: " << heap_.size_ << " -> " << new_heap_size << "\n";
-  heap_.size_ = new_heap_size;
-  heap_.blocks_.resize(new_index);
-  std::cout << "New heap num blocks: " << heap_.num_blocks() << "\n";
+  auto &watched = heap_.watched_;
+  std::vector<size_t> new_watched;
+  for (auto index : watched) {
+    if (index < young_start_) {
+      new_watched.push_back(index);
+    } else if (is_live(index)) {
+      new_watched.push_back(forward(index));
+    }
+  }
+  watched = new_watched;
 }
 
-void garbage_collector::free_live_sets(live_t &live) {
-  for (auto live_block : live) {
-    delete live_block;
+void garbage_collector::rewrite_heap() {
+  if (num_threads_ > 1) {
+    rewrite_blocks_parallel();
+  } else {
+    rewrite_blocks();
+  }
+  rewrite_trail();
+}
+
+void garbage_collector::rewrite_roots(std::vector<ptr_cell *> &roots) {
+  for (auto &root : roots) {
+    rewrite_cell(*root);
   }
 }
 
-size_t garbage_collector::collect(live_t &live, std::vector<ptr_cell *> &roots) {
-  std::unordered_map<size_t, size_t> block_index_to_delta;
-  size_t result = calculate_deltas(block_index_to_delta, live);
-  rewrite_blocks(block_index_to_delta, live);
-  rewrite_roots(block_index_to_delta, roots);
-  cleanup_blocks(live);
-  free_live_sets(live);
-  return result/heap_block::MAX_SIZE;
+// As live cells only move down (and in order) we can just copy them.
+void garbage_collector::move_cells() {
+  size_t first_block = young_start_ / heap_block::MAX_SIZE;
+  for (size_t b = first_block; b < live_.size(); b++) {
+    if (live_[b] == nullptr) {
+      continue;
+    }
+    auto &bits = *live_[b];
+    const heap_block *block = heap_.blocks_[b];
+    size_t block_start = b * heap_block::MAX_SIZE;
+    for (size_t wi = 0; wi < live_bits::NUM_WORDS; wi++) {
+      uint64_t w = bits.word(wi);
+      while (w != 0) {
+	size_t j = wi * 64 + __builtin_ctzll(w);
+	w &= w - 1;
+	size_t i = block_start + j;
+	if (i < young_start_) {
+	  continue;
+	}
+	size_t dest = forward(i);
+	if (dest != i) {
+	  auto *dest_block = heap_.blocks_[dest / heap_block::MAX_SIZE];
+	  dest_block->set(dest % heap_block::MAX_SIZE, block->get(j));
+	}
+      }
+    }
+  }
+}
+
+void garbage_collector::cleanup_blocks(size_t new_top) {
+  size_t first_block = young_start_ / heap_block::MAX_SIZE;
+  size_t keep = (new_top + heap_block::MAX_SIZE - 1) / heap_block::MAX_SIZE;
+  size_t num_blocks = heap_.blocks_.size();
+  for (size_t b = first_block; b < num_blocks; b++) {
+    auto *block = heap_.blocks_[b];
+    if (b < keep) {
+      block->trim(block_used_[b]);
+    } else {
+      delete block;
+    }
+  }
+  if (keep < num_blocks) {
+    heap_.blocks_.resize(keep);
+  }
+  heap_.head_block_ = nullptr;
+  heap_.size_ = 0;
+  if (keep > 0) {
+    heap_.set_head_block(heap_.blocks_[keep-1]);
+  }
 }
 
-void garbage_collector::dump_marked(live_t &live) {
+void garbage_collector::free_live_sets() {
+  for (auto live_block : live_) {
+    delete live_block;
+  }
+  live_.clear();
+  forward_.clear();
+  block_used_.clear();
+  block_skip_.clear();
 }
 
 size_t garbage_collector::do_collection(std::vector<ptr_cell *> &roots)
 {
-  live_t live;
-  live.resize(heap_.num_blocks());
-  std::cout << "num_blocks: " << heap_.num_blocks() << "\n";
-  for(size_t i = 0; i < live.size(); i++) {
-    live[i] = nullptr;
+  stats_ = stats();
+
+  // Only heaps with all blocks in memory can be compacted.
+  if (heap_.get_block_fn_ != &heap::get_block_default) {
+    return 0;
+  }
+  size_t old_size = heap_.size();
+  if (young_start_ >= old_size) {
+    return 0;
   }
-  mark(roots, live);
-  auto collected = collect(live, roots);
 
-  std::cout << "Num collected blocks: " << collected << "\n";
-  return collected;
+  auto start = utime::now();
+
+  // A root must only be rewritten once.
+  std::sort(roots.begin(), roots.end());
+  roots.erase(std::unique(roots.begin(), roots.end()), roots.end());
+
+  live_.resize(heap_.blocks_.size(), nullptr);
+  std::vector<size_t> seeds;
+  mark_seeds(roots, seeds);
+  if (num_threads_ > 1) {
+    mark_parallel(seeds);
+  } else {
+    mark(seeds);
+  }
+  auto t_mark = utime::now();
+
+  size_t new_top = calculate_forward();
+  auto t_forward = utime::now();
+
+  rewrite_heap();
+  rewrite_roots(roots);
+  auto t_rewrite = utime::now();
+
+  move_cells();
+  cleanup_blocks(new_top);
+  free_live_sets();
+  auto t_end = utime::now();
+
+  stats_.mark_us = (t_mark - start).in_us();
+  stats_.forward_us = (t_forward - t_mark).in_us();
+  stats_.rewrite_us = (t_rewrite - t_forward).in_us();
+  stats_.move_us = (t_end - t_rewrite).in_us();
+  stats_.total_us = (t_end - start).in_us();
+
+  return (old_size - heap_.size()) * sizeof(cell);
 }
 
 }}
@@ -2,47 +2,158 @@
 #ifndef _common_garbage_collector_hpp
 #define _common_garbage_collector_hpp
 
-#include <bitset>
+#include <atomic>
 #include <vector>
 #include <map>
+#include "term.hpp"
 
 namespace epilog { namespace common {
 
+//
+// Sliding (mark-compact) garbage collector for the term heap.
+//
+// Live cells are marked into per-block bitsets and then slid down
+// towards the bottom of the heap, across block boundaries, keeping
+// their relative order. Keeping the order means that heap boundaries
+// (e.g. the heap top saved in choice points) can be moved along with
+// the cells above them, so backtracking still works after a
+// collection.
+//
+// A young generation collection only considers cells at or above
+// young_start (normally HB, the heap top of the last choice point.)
+// Older cells are never moved and are not scanned except for the
+// trailed ones: an old cell pointing into the young generation must
+// be a variable bound after the choice point, and those are always
+// on the trail.
+//
+// With more than one thread the mark phase uses work stealing
+// between the threads and the pointers are rewritten in parallel
+// (one block at a time.) Computing the new addresses and moving the
+// cells is always sequential.
+//
 class garbage_collector {
 
 public:
-  garbage_collector(heap &h) : heap_(h) {};
+  garbage_collector(heap &h) : heap_(h), young_start_(0), num_threads_(1) {};
+
+  inline void set_young_start(size_t addr) { young_start_ = addr; }
+  inline size_t young_start() const { return young_start_; }
+
+  inline void set_num_threads(size_t n) { num_threads_ = n == 0 ? 1 : n; }
+  inline size_t num_threads() const { return num_threads_; }
+
+  // Trailed cells are kept alive and the trail is updated.
+  inline void add_trail(std::vector<size_t> &trail) { trails_.push_back(&trail); }
+
+  // Heap boundaries (like the heap top in choice points) are moved to
+  // the new address of the first live cell at or above them.
+  inline void add_boundary(size_t *addr) { boundaries_.push_back(addr); }
+
   // Garbage collects and returns number of collected bytes.
   size_t do_collection(std::vector<ptr_cell *> &roots);
 
+  // Time spent (in microseconds) in the last collection
+  struct stats {
+    stats() : mark_us(0), forward_us(0), rewrite_us(0), move_us(0),
+	      total_us(0), live_cells(0) { }
+    uint64_t mark_us;
+    uint64_t forward_us;
+    uint64_t rewrite_us;
+    uint64_t move_us;
+    uint64_t total_us;
+    size_t live_cells;
+  };
+
+  inline const stats & get_stats() const { return stats_; }
+
 private:
-  typedef std::bitset<heap_block::MAX_SIZE> * live_block_t;
+  // Live bits for one heap block. Concurrent markers use atomic_set.
+  class live_bits {
+  public:
+    static const size_t NUM_WORDS = heap_block::MAX_SIZE / 64;
+
+    live_bits() {
+      for (auto &w : words_) w.store(0, std::memory_order_relaxed);
+    }
+
+    inline bool test(size_t i) const {
+      return (word(i / 64) >> (i % 64)) & 1;
+    }
+    inline uint64_t word(size_t wi) const {
+      return words_[wi].load(std::memory_order_relaxed);
+    }
+    // Returns true if the bit wasn't set before.
+    inline bool set(size_t i) {
+      uint64_t mask = static_cast<uint64_t>(1) << (i % 64);
+      auto &w = words_[i / 64];
+      uint64_t old = w.load(std::memory_order_relaxed);
+      if (old & mask) {
+	return false;
+      }
+      w.store(old | mask, std::memory_order_relaxed);
+      return true;
+    }
+    inline bool atomic_set(size_t i) {
+      uint64_t mask = static_cast<uint64_t>(1) << (i % 64);
+      return (words_[i / 64].fetch_or(mask, std::memory_order_relaxed) & mask) == 0;
+    }
+
+  private:
+    std::atomic<uint64_t> words_[NUM_WORDS];
+  };
+
+  class mark_deque;
+
+  typedef live_bits * live_block_t;
   typedef std::vector<live_block_t> live_t;
   heap &heap_;
+  size_t young_start_;
+  size_t num_threads_;
+  std::vector<std::vector<size_t> *> trails_;
+  std::vector<size_t *> boundaries_;
+  live_t live_;
+  std::vector<std::vector<size_t> > forward_;
+  std::vector<size_t> block_used_;
+  std::vector<size_t> block_skip_;
+  stats stats_;
 
-  live_block_t get_live_block(live_t &live, size_t index);
-  void set_live_block(live_t &live, size_t index, live_block_t block);
+  inline const cell & cell_at(size_t index) const {
+    const heap_block *block = heap_.blocks_[index / heap_block::MAX_SIZE];
+    return block->get(index % heap_block::MAX_SIZE);
+  }
 
-  live_block_t mark_live_block(live_t &live, size_t block_index);
-  bool mark_live_word(live_t &live, size_t index);
-  void mark(std::vector<ptr_cell *> &roots, live_t &live);
+  bool is_allocated(size_t index) const;
+  bool is_live(size_t index) const;
+  live_block_t mark_live_block(size_t block_index);
+  template<bool Atomic> bool mark_live_word(size_t index);
+  void mark_seeds(std::vector<ptr_cell *> &roots, std::vector<size_t> &seeds);
+  void mark(std::vector<size_t> &worklist);
+  void mark_parallel(std::vector<size_t> &seeds);
+  void mark_worker(size_t id, std::vector<mark_deque *> &deques,
+		   std::atomic<size_t> &active);
+  template<bool Atomic> void mark_item(size_t index, std::vector<size_t> &worklist);
+  void push_pointer(cell c, std::vector<size_t> &worklist);
   void push_children(size_t index, std::vector<size_t> &worklist);
 
-  size_t calculate_deltas(std::unordered_map<size_t, size_t> &block_index_to_delta,
-                          live_t &live);
-  size_t calculate_new_index(std::unordered_map<size_t, size_t> &block_index_to_delta,
-			     size_t index);
-
-  void rewrite_cell(size_t i, heap_block &block,
-                    std::unordered_map<size_t, size_t> &block_index_to_delta);
-  void rewrite_blocks(std::unordered_map<size_t, size_t> &block_index_to_delta,
-                              live_t &live);
-  void rewrite_roots(std::unordered_map<size_t, size_t> &block_index_to_delta,
-		     std::vector<ptr_cell *> &roots);
-  void cleanup_blocks(live_t &live);
-  void free_live_sets(live_t &live);
-  void dump_marked(live_t &live);
-  size_t collect(live_t &live, std::vector<ptr_cell *> &roots);
+  size_t object_size(size_t index);
+  size_t calculate_forward();
+  inline size_t forward(size_t index) const {
+    if (index < young_start_) {
+      return index;
+    }
+    auto &fwd = forward_[index / heap_block::MAX_SIZE];
+    return fwd[index % heap_block::MAX_SIZE];
+  }
+  void rewrite_cell(cell &c);
+  void rewrite_heap();
+  void rewrite_block(size_t block_index);
+  void rewrite_blocks();
+  void rewrite_blocks_parallel();
+  void rewrite_trail();
+  void rewrite_roots(std::vector<ptr_cell *> &roots);
+  void move_cells();
+  void cleanup_blocks(size_t new_top);
+  void free_live_sets();
 };
 
 }}
@@ -0,0 +1,189 @@
+#pragma once
+
+#ifndef _common_golomb_filter_hpp
+#define _common_golomb_filter_hpp
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <algorithm>
+#include "blake2.hpp"
+
+namespace epilog { namespace common {
+
+//
+// Compact set filter (Golomb-Rice coded set.) The 64-bit element
+// hashes are mapped to [0, N*M), sorted, and the differences are
+// stored with a P bit remainder and a unary quotient. That's about
+// P+2 bits per element for a false positive rate of 1/M. Unlike a
+// Bloom filter it's immutable and has to be decoded sequentially,
+// which is fine for matching a handful of elements against it.
+//
+// Encoded as the number of elements (u32 LE) followed by the bits
+// (most significant bit first.)
+//
+class golomb_filter {
+public:
+    static const unsigned P = 19;
+    static const uint64_t M = 784931;
+
+    inline golomb_filter() : n_(0) { }
+
+    inline golomb_filter(const std::vector<uint64_t> &hashes) : n_(0) {
+	build(hashes);
+    }
+
+    // Hash of an element (e.g. the bytes of an address.) It needs to
+    // be uniform over all 64 bits; fast_hash isn't good enough.
+    static inline uint64_t hash(const uint8_t *bytes, size_t len) {
+	uint8_t h[sizeof(uint64_t)];
+	blake2b_state s;
+	blake2b_init(&s, sizeof(h));
+	blake2b_update(&s, bytes, len);
+	blake2b_final(&s, h, sizeof(h));
+	uint64_t v = 0;
+	for (size_t i = 0; i < sizeof(h); i++) {
+	    v = (v << 8) | h[i];
+	}
+	return v;
+    }
+
+    inline void build(const std::vector<uint64_t> &hashes) {
+	n_ = hashes.size();
+	bytes_.clear();
+	for (size_t i = 0; i < 4; i++) {
+	    bytes_.push_back(static_cast<uint8_t>(n_ >> (8*i)));
+	}
+	auto values = map_values(hashes);
+	bit_writer out(bytes_);
+	uint64_t last = 0;
+	for (auto v : values) {
+	    auto delta = v - last;
+	    for (uint64_t q = delta >> P; q > 0; q--) {
+		out.write(1, 1);
+	    }
+	    out.write(0, 1);
+	    out.write(delta, P);
+	    last = v;
+	}
+    }
+
+    // Takes a copy of the encoded filter; false if it's malformed
+    inline bool read(const uint8_t *data, size_t size) {
+	if (size < 4) {
+	    return false;
+	}
+	n_ = 0;
+	for (size_t i = 0; i < 4; i++) {
+	    n_ |= static_cast<size_t>(data[i]) << (8*i);
+	}
+	bytes_.assign(data, data + size);
+	return true;
+    }
+
+    inline const std::vector<uint8_t> & bytes() const { return bytes_; }
+    inline size_t size() const { return n_; }
+    inline bool empty() const { return n_ == 0; }
+
+    inline bool match(uint64_t h) const {
+	return match_any(std::vector<uint64_t>{h});
+    }
+
+    // True if (probably) any of these are in the set
+    inline bool match_any(const std::vector<uint64_t> &hashes) const {
+	if (n_ == 0 || hashes.empty()) {
+	    return false;
+	}
+	auto values = map_values(hashes);
+	bit_reader in(bytes_);
+	uint64_t v = 0;
+	size_t i = 0;
+	for (size_t k = 0; k < n_; k++) {
+	    uint64_t q = 0, b = 0, r = 0;
+	    while (in.read(b, 1) && b == 1) {
+		q++;
+	    }
+	    if (!in.read(r, P)) {
+		return false;
+	    }
+	    v += (q << P) | r;
+	    while (values[i] < v) {
+		if (++i == values.size()) {
+		    return false;
+		}
+	    }
+	    if (values[i] == v) {
+		return true;
+	    }
+	}
+	return false;
+    }
+
+private:
+    class bit_writer {
+    public:
+	inline bit_writer(std::vector<uint8_t> &out) : out_(out), bit_(8) { }
+	inline void write(uint64_t value, unsigned nbits) {
+	    while (nbits > 0) {
+		if (bit_ == 8) {
+		    out_.push_back(0);
+		    bit_ = 0;
+		}
+		nbits--;
+		if ((value >> nbits) & 1) {
+		    out_.back() |= static_cast<uint8_t>(0x80 >> bit_);
+		}
+		bit_++;
+	    }
+	}
+    private:
+	std::vector<uint8_t> &out_;
+	unsigned bit_;
+    };
+
+    class bit_reader {
+    public:
+	inline bit_reader(const std::vector<uint8_t> &in) : in_(in), pos_(4*8) { }
+	inline bool read(uint64_t &value, unsigned nbits) {
+	    if (pos_ + nbits > in_.size() * 8) {
+		return false;
+	    }
+	    value = 0;
+	    for (; nbits > 0; nbits--, pos_++) {
+		value = (value << 1) | ((in_[pos_ >> 3] >> (7 - (pos_ & 7))) & 1);
+	    }
+	    return true;
+	}
+    private:
+	const std::vector<uint8_t> &in_;
+	size_t pos_;
+    };
+
+    // (a * b) >> 64 without 128-bit integers
+    static inline uint64_t mul_high(uint64_t a, uint64_t b) {
+	uint64_t a_lo = a & 0xffffffff, a_hi = a >> 32;
+	uint64_t b_lo = b & 0xffffffff, b_hi = b >> 32;
+	uint64_t lo_lo = a_lo * b_lo, hi_lo = a_hi * b_lo;
+	uint64_t lo_hi = a_lo * b_hi, hi_hi = a_hi * b_hi;
+	uint64_t mid = (lo_lo >> 32) + (hi_lo & 0xffffffff) + lo_hi;
+	return hi_hi + (hi_lo >> 32) + (mid >> 32);
+    }
+
+    inline std::vector<uint64_t> map_values(const std::vector<uint64_t> &hashes) const {
+	uint64_t range = static_cast<uint64_t>(n_) * M;
+	std::vector<uint64_t> values;
+	values.reserve(hashes.size());
+	for (auto h : hashes) {
+	    values.push_back(mul_high(h, range));
+	}
+	std::sort(values.begin(), values.end());
+	return values;
+    }
+
+    size_t n_;
+    std::vector<uint8_t> bytes_;
+};
+
+}}
+
+#endif
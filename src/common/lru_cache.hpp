@@ -1,5 +1,8 @@
-#include <unordered_map>
-#include <list>
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
 #include <vector>
 #include <functional>
 
@@ -10,78 +13,241 @@ template<typename K, typename V> struct lru_cache_callback_nop {
     inline void evicted(const K &key, V &value) { }
     inline void accessed(const K &key, V &value) { }
 };
-    
+
+//
+// Cache with (approximate) LRU eviction using the CLOCK algorithm.
+//
+// Entries live in a slab that grows (up to capacity) but is never
+// shrunk, and they are found through an open addressing (linear
+// probing) index. A find() only sets a reference bit, so there are
+// no allocations once the cache has been filled. When something needs
+// to be evicted, the clock hand sweeps over the slab and picks the
+// first entry that has not been referenced since the last sweep. Entries
+// that are never accessed are evicted in insertion order.
+//
+// The capacity is the maximum number of entries. Optionally a budget
+// in bytes can also be set (see set_max_bytes); then each entry is
+// inserted with its size in bytes and entries are evicted until the
+// total fits within the budget.
+//
+// Pointers returned by find() are valid until the next insert.
+//
 template<typename K, typename V, typename C = lru_cache_callback_nop<K,V> > class lru_cache {
 public:
     using key_type = K;
     using value_type = V;
 
-    inline lru_cache(std::size_t capacity) : capacity_(capacity), callback_() { }
-    inline lru_cache(std::size_t capacity, const C &callback) : capacity_(capacity), callback_(callback) { }
+    inline lru_cache(std::size_t capacity) : lru_cache(capacity, C()) { }
+    inline lru_cache(std::size_t capacity, const C &callback)
+        : capacity_(capacity), max_bytes_(0), num_bytes_(0), size_(0),
+	  hand_(0), callback_(callback) {
+        if (capacity_ == 0) capacity_ = 1;
+    }
     inline ~lru_cache() { clear(); }
 
     inline void set_callback(C &callback) { callback_ = callback; }
 
-    inline void insert(const K &key, const V &value) {
-        auto it = map_.find(key);
-	if (it == map_.end()) {
-	    if (access_.size() >= capacity_) {
-	        auto removed_key = access_.back();
-		erase(removed_key);
-	    }
-	    access_.push_front(key);
-	    map_[key] = std::make_pair(value, access_.begin());
+    // 0 means no limit (other than the capacity.)
+    inline void set_max_bytes(std::size_t max_bytes) { max_bytes_ = max_bytes; }
+    inline std::size_t max_bytes() const { return max_bytes_; }
+    inline std::size_t num_bytes() const { return num_bytes_; }
+
+    inline std::size_t capacity() const { return capacity_; }
+    inline std::size_t size() const { return size_; }
+
+    inline void insert(const K &key, const V &value, std::size_t num_bytes = 0) {
+        if (lookup(key) != NONE) {
+	    return;
+	}
+	while (size_ > 0 &&
+	       (size_ >= capacity_ ||
+		(max_bytes_ != 0 && num_bytes_ + num_bytes > max_bytes_))) {
+	    evict_one();
+	}
+	uint32_t slot_index;
+	if (!free_.empty()) {
+	    slot_index = free_.back();
+	    free_.pop_back();
+	} else {
+	    slot_index = static_cast<uint32_t>(slots_.size());
+	    slots_.push_back(slot());
+	}
+	auto &s = slots_[slot_index];
+	s.key = key;
+	s.value = value;
+	s.num_bytes = num_bytes;
+	s.used = true;
+	s.referenced = false;
+	size_++;
+	num_bytes_ += num_bytes;
+	if (2*size_ > index_.size()) {
+	    rehash(index_.empty() ? 16 : 2*index_.size());
+	} else {
+	    index_insert(slot_index);
 	}
     }
 
     inline V * find(const K &key)
     {
-        auto it = map_.find(key);
-	if (it == map_.end()) {
+        auto slot_index = lookup(key);
+	if (slot_index == NONE) {
 	    return nullptr;
 	}
-	auto &v = it->second.first;
-	auto &access_it = it->second.second;
-	access_.erase(access_it);
-	access_.push_front(key);
-	it->second.second = access_.begin();
-	
-	return &v;
+	auto &s = slots_[slot_index];
+	s.referenced = true;
+	callback_.accessed(s.key, s.value);
+	return &s.value;
     }
 
     inline void erase(const K &key) {
-	auto removed_it = map_.find(key);
-	if (removed_it == map_.end()) {
+        auto slot_index = lookup(key);
+	if (slot_index == NONE) {
 	    return;
 	}
-	auto removed_key = removed_it->first;
-	auto removed_value = removed_it->second.first;
-        auto access_it = removed_it->second.second;
-	access_.erase(access_it);
-	map_.erase(removed_it);
-	callback_.evicted(removed_key, removed_value); 
+	remove(slot_index);
     }
 
+    // Evict everything (in the order they would have been evicted
+    // if nothing was referenced.)
     inline void clear() {
-        while (!access_.empty()) {
-	    erase(access_.back());
-        }
+        std::size_t n = slots_.size();
+	for (std::size_t i = 0; i < n && size_ > 0; i++) {
+	    auto slot_index = static_cast<uint32_t>((hand_ + i) % n);
+	    if (slots_[slot_index].used) {
+	        remove(slot_index);
+	    }
+	}
+	hand_ = 0;
+	slots_.clear();
+	free_.clear();
+	std::fill(index_.begin(), index_.end(), NONE);
     }
 
     inline void foreach(const std::function<void(const K &key, V &value)> &apply) {
-        for (auto &e : map_) {
-	    apply(e.first, e.second.first);
+        for (auto &s : slots_) {
+	    if (s.used) {
+	        apply(s.key, s.value);
+	    }
         }
     }
 
 private:
-    typedef typename std::list<K>::iterator access_iterator_type;
+    static const uint32_t NONE = static_cast<uint32_t>(-1);
+
+    struct slot {
+        slot() : key(), value(), num_bytes(0), used(false), referenced(false) { }
+        K key;
+        V value;
+	std::size_t num_bytes;
+	bool used;
+	bool referenced;
+    };
+
+    inline std::size_t home(const K &key) const {
+        // Spread the bits (keys are often offsets with low bits zero)
+        uint64_t h = static_cast<uint64_t>(std::hash<K>()(key));
+	h *= 0x9e3779b97f4a7c15ULL;
+	return static_cast<std::size_t>(h >> 32) & (index_.size() - 1);
+    }
+
+    inline uint32_t lookup(const K &key) const {
+        if (index_.empty()) {
+	    return NONE;
+	}
+        std::size_t mask = index_.size() - 1;
+        for (std::size_t i = home(key);; i = (i + 1) & mask) {
+	    auto slot_index = index_[i];
+	    if (slot_index == NONE) {
+	        return NONE;
+	    }
+	    if (slots_[slot_index].key == key) {
+	        return slot_index;
+	    }
+	}
+    }
+
+    inline void index_insert(uint32_t slot_index) {
+        std::size_t mask = index_.size() - 1;
+	std::size_t i = home(slots_[slot_index].key);
+	while (index_[i] != NONE) {
+	    i = (i + 1) & mask;
+	}
+	index_[i] = slot_index;
+    }
+
+    // Remove from index using backward shift deletion (no tombstones.)
+    inline void index_remove(const K &key) {
+        std::size_t mask = index_.size() - 1;
+	std::size_t i = home(key);
+	while (slots_[index_[i]].key != key) {
+	    i = (i + 1) & mask;
+	}
+	std::size_t j = i;
+	for (;;) {
+	    j = (j + 1) & mask;
+	    if (index_[j] == NONE) {
+	        break;
+	    }
+	    std::size_t k = home(slots_[index_[j]].key);
+	    // Can the entry at j be moved to i?
+	    if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+	        index_[i] = index_[j];
+		i = j;
+	    }
+	}
+	index_[i] = NONE;
+    }
+
+    inline void rehash(std::size_t new_size) {
+        index_.assign(new_size, NONE);
+	for (uint32_t slot_index = 0; slot_index < slots_.size(); slot_index++) {
+	    if (slots_[slot_index].used) {
+	        index_insert(slot_index);
+	    }
+	}
+    }
+
+    inline void remove(uint32_t slot_index) {
+        auto &s = slots_[slot_index];
+	index_remove(s.key);
+	K removed_key = s.key;
+	V removed_value = s.value;
+	num_bytes_ -= s.num_bytes;
+	s = slot();
+	size_--;
+	free_.push_back(slot_index);
+	callback_.evicted(removed_key, removed_value);
+    }
+
+    inline void evict_one() {
+        std::size_t n = slots_.size();
+        for (;;) {
+	    auto &s = slots_[hand_];
+	    auto slot_index = static_cast<uint32_t>(hand_);
+	    hand_ = (hand_ + 1) % n;
+	    if (!s.used) {
+	        continue;
+	    }
+	    if (s.referenced) {
+	        s.referenced = false;
+		continue;
+	    }
+	    remove(slot_index);
+	    return;
+	}
+    }
+
     std::size_t capacity_;
-    std::unordered_map<K, std::pair<V , access_iterator_type> > map_;
-    std::list<K> access_;
+    std::size_t max_bytes_;
+    std::size_t num_bytes_;
+    std::size_t size_;
+    std::size_t hand_;
+    std::vector<slot> slots_;
+    std::vector<uint32_t> free_;
+    std::vector<uint32_t> index_;
     C callback_;
-
 };
 
-}}
+template<typename K, typename V, typename C> const uint32_t lru_cache<K,V,C>::NONE;
 
+}}
@@ -1,5 +1,7 @@
 #include <boost/random/uniform_int_distribution.hpp>
 #include <boost/random/random_device.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/lock_guard.hpp>
 #include <limits>
 #include "random.hpp"
 #include "fast_hash.hpp"
@@ -11,6 +13,9 @@ static fast_hash testing_rnd_;
 
 static boost::random::random_device random_;
 
+// Sessions are created on several threads (e.g. the session pool)
+static boost::mutex lock_;
+
 void random::set_for_testing(bool for_testing)
 {
     for_testing_ = for_testing;
@@ -48,6 +53,7 @@ std::string random::next(size_t entropy_bits)
 
     size_t n = (entropy_bits * 1000 + 5953) / 5954;
     std::string s(n, ' ');
+    boost::lock_guard<boost::mutex> guard(lock_);
     for (size_t i = 0; i < n; ++i) {
 	if (for_testing_) {
 	    s[i] = chars[index_dist(for_testing_random_)];
@@ -60,6 +66,7 @@ std::string random::next(size_t entropy_bits)
 
 int random::next_int(int max)
 {
+    boost::lock_guard<boost::mutex> guard(lock_);
     if (for_testing_) {
 	return static_cast<int>(for_testing_random_() % max);
     } else {
@@ -69,6 +76,7 @@ int random::next_int(int max)
 
 uint64_t random::next_int(uint64_t max)
 {
+    boost::lock_guard<boost::mutex> guard(lock_);
     if (for_testing_) {
 	return static_cast<uint64_t>(for_testing_random_() % max);
     } else {
@@ -792,21 +792,48 @@ public:
     friend class garbage_collector;
     static const size_t MAX_SIZE = 8192; // 64k
 
+    // Modifications can also be tracked per chunk of cells so that
+    // only the changed parts of a block needs to be persisted. This is
+    // off unless enabled with set_track_dirty() (only the global heap
+    // needs it.)
+    static const size_t DIRTY_CHUNK_BITS = 6;
+    static const size_t DIRTY_CHUNK_SIZE = 1 << DIRTY_CHUNK_BITS; // cells
+    static const size_t NUM_DIRTY_CHUNKS = MAX_SIZE / DIRTY_CHUNK_SIZE;
+
     inline heap_block(heap &h) : heap_block(h, 0) { }
     inline heap_block(heap &h, size_t index)
         : heap_(h), index_(index), offset_(index*MAX_SIZE),
-	  size_(0), changed_(false) {
+	  size_(0), changed_(false), track_dirty_(false) {
     }
     ~heap_block() = default;
 
     inline const cell * cells() const { return &cells_[0]; }
-    inline cell * cells() { return &cells_[0]; }  
+    // We don't know what will be written through the pointer
+    inline cell * cells() { mark_all_dirty(); return &cells_[0]; }
 
     inline bool has_changed() const {
         return changed_;
     }
     inline void clear_changed() {
         changed_ = false;
+	dirty_.reset();
+    }
+
+    inline bool is_track_dirty() const {
+        return track_dirty_;
+    }
+    inline void set_track_dirty(bool b) {
+        track_dirty_ = b;
+    }
+
+    inline bool is_dirty_chunk(size_t chunk) const {
+        return dirty_[chunk];
+    }
+    inline size_t num_dirty_chunks() const {
+        return dirty_.count();
+    }
+    inline void mark_all_dirty() {
+        if (track_dirty_) dirty_.set();
     }
 
     bool is_head_block() const;
@@ -823,6 +850,7 @@ public:
 
     inline cell & operator [] (size_t addr) {
         if (!changed_) { changed_ = true; modified(); }
+	mark_dirty(addr - offset_);
 	return cells_[addr - offset_];
     }
 
@@ -835,10 +863,12 @@ public:
     }
 
     inline cell & get(size_t index) {
+        mark_dirty(index);
         return cells_[index];
     }
 
     inline void set(size_t index, cell c) {
+        mark_dirty(index);
         cells_[index] = c;
     }
 
@@ -848,6 +878,13 @@ public:
 
     inline size_t allocate(size_t n) {
 	size_t addr = offset_ + size_;
+	// Callers write directly to the allocated cells
+	if (track_dirty_ && n > 0) {
+	    for (size_t i = size_; i < size_ + n; i += DIRTY_CHUNK_SIZE) {
+		dirty_[i >> DIRTY_CHUNK_BITS] = true;
+	    }
+	    dirty_[(size_ + n - 1) >> DIRTY_CHUNK_BITS] = true;
+	}
 	size_ += n;
 	return addr;
     }
@@ -865,6 +902,7 @@ public:
     //      transform RFW into REF if value is false.
     inline void watch(size_t addr, bool value) {
         cell &c = cells_[addr - offset_];
+	mark_dirty(addr - offset_);
 	if (c.tag() == tag_t::REF && value) {
 	    ref_cell &r = static_cast<ref_cell &>(c);
 	    r = ref_cell(r.index(), true);
@@ -882,11 +920,17 @@ public:
     void modified();
     
 private:
+    inline void mark_dirty(size_t index) {
+        if (track_dirty_) dirty_[index >> DIRTY_CHUNK_BITS] = true;
+    }
+
     heap &heap_;
     size_t index_;
     size_t offset_;
     size_t size_;
     bool changed_;
+    bool track_dirty_;
+    std::bitset<NUM_DIRTY_CHUNKS> dirty_;
     cell cells_[MAX_SIZE];
 };
 
@@ -1345,7 +1389,7 @@ public:
     inline big_iterator begin(const big_cell &big) {
 	auto dc = deref(big);
 	big_cell &b = reinterpret_cast<big_cell &>(dc);
-	auto &hdr = reinterpret_cast<const big_header &>(untagged_at(b.index()));
+	auto &hdr = reinterpret_cast<const big_header &>(get(b.index()));
 	size_t n = (hdr.num_bits() + 7) / 8;
 	return big_iterator(*this, b.index(), n);
     }
@@ -1353,7 +1397,7 @@ public:
     inline big_iterator end(const big_cell &big) {
 	auto dc = deref(big);
 	big_cell &b = reinterpret_cast<big_cell &>(dc);
-	auto &hdr = reinterpret_cast<const big_header &>(untagged_at(b.index()));
+	auto &hdr = reinterpret_cast<const big_header &>(get(b.index()));
 	size_t n = (hdr.num_bits() + 7) / 8;
 	return big_iterator(*this, b.index(), n, true);
     }
@@ -1815,7 +1859,10 @@ template<typename T> inline big_iterator_base<T> & big_iterator_base<T>::operato
 	if ((index_ % heap_block::MAX_SIZE) == 0) {
 	    // Are we stepping over a heap block boundary?
 	    // Then we need to switch base address for cell_byte
-	    cell_byte_.set_address(&heap_.untagged_at(index_), 0);
+	    // (unless this is the end; there may be no next block.)
+	    if (i_ != end_) {
+		cell_byte_.set_address(&heap_.untagged_at(index_), 0);
+	    }
 	} else {
 	    ++cell_byte_;	    
 	}
@@ -1970,10 +2017,7 @@ public:
     }
     void trim_names(size_t heap_limit) {
 	ref_cell r(heap_limit);
-	auto it_end = ref_2_name_.end();
-	for (auto it = ref_2_name_.lower_bound(r); it != it_end; ++it) {
-	    ref_2_name_.erase(it);
-	}
+	ref_2_name_.erase(ref_2_name_.lower_bound(r), ref_2_name_.end());
     }
     
 private:
@@ -563,8 +563,167 @@ int term_utils::standard_order(term a, term b, uint64_t &cost)
     return 0;
 }
 
+void forward_table::grow()
+{
+    std::vector<entry> old;
+    old.swap(entries_);
+    size_t n = old.empty() ? 1024 : 2 * old.size();
+    entries_.resize(n);
+    mask_ = n - 1;
+    count_ = 0;
+    for (auto &e : old) {
+	if (e.generation == generation_) {
+	    put(cell(e.key), cell(e.value));
+	}
+    }
+}
+
 term term_utils::copy(term c, naming_map &names,
 		      heap &src, naming_map *src_names, uint64_t &cost)
+{
+    size_t heap_start = heap_size();
+    term result;
+    if (copy_acyclic(c, names, src, src_names, cost, result)) {
+	return result;
+    }
+    // We ran into a cycle. Throw away what we got so far and
+    // start over.
+    env_.trim_heap(heap_start);
+    names.trim_names(heap_start);
+    return copy_cyclic(c, names, src, src_names, cost);
+}
+
+con_cell term_utils::copy_functor(con_cell f, heap &src)
+{
+    if (f.is_direct()) {
+	return f;
+    }
+    auto &fwd = get_forward_table();
+    cell dst_f;
+    if (!fwd.find(f, dst_f)) {
+	dst_f = functor(src.atom_name(f), f.arity());
+	fwd.put(f, dst_f);
+    }
+    return reinterpret_cast<con_cell &>(dst_f);
+}
+
+//
+// Same traversal (and thus the same cost and heap layout) as
+// copy_cyclic, but with the forwarding table of the environment
+// instead of hash maps. A structure is marked as being copied on
+// the way down, so meeting it again before it's done means a cycle,
+// and then we give up (return false.)
+//
+bool term_utils::copy_acyclic(term c, naming_map &names,
+			      heap &src, naming_map *src_names,
+			      uint64_t &cost, term &result)
+{
+    static const cell COPYING = int_cell(0);
+
+    auto &fwd = get_forward_table();
+    fwd.clear();
+    temp_clear();
+
+    size_t current_stack = stack_size();
+
+    uint64_t cost_tmp = 0;
+
+    push(src.deref(c));
+    push(int_cell(0));
+    while (stack_size() > current_stack) {
+	cost_tmp++;
+
+	bool processed = pop() == int_cell(1);
+	c = pop();
+
+	switch (c.tag()) {
+	case tag_t::REF:
+	case tag_t::RFW: {
+	    cell v;
+	    if (!fwd.find(c, v)) {
+		v = new_ref();
+		fwd.put(c, v);
+		if (src_names) {
+		    auto r = reinterpret_cast<ref_cell &>(c);
+		    auto vr = reinterpret_cast<ref_cell &>(v);
+		    auto vn = src_names->get_name(r);
+		    if (!vn.empty()) {
+			names.set_name(vr, vn);
+		    }
+		}
+	    }
+	    temp_push(v);
+	    break;
+	}
+	case tag_t::CON:
+	    temp_push(copy_functor(reinterpret_cast<con_cell &>(c), src));
+	    break;
+	case tag_t::INT:
+	    temp_push(c);
+	    break;
+	case tag_t::STR: {
+	    if (processed) {
+		con_cell f = src.functor(c);
+		size_t num_args = f.arity();
+		cell newstr = new_term(copy_functor(f, src));
+		for (size_t i = 0; i < num_args; i++) {
+		    set_arg(newstr, num_args-i-1, temp_pop());
+		}
+		fwd.put(c, newstr);
+		temp_push(newstr);
+		break;
+	    }
+	    cell v;
+	    if (fwd.find(c, v)) {
+		if (v == COPYING) {
+		    trim_stack(current_stack);
+		    temp_clear();
+		    return false;
+		}
+		temp_push(v);
+		break;
+	    }
+	    fwd.put(c, COPYING);
+	    push(c);
+	    push(int_cell(1));
+	    size_t num_args = src.functor(c).arity();
+	    for (size_t i = 0; i < num_args; i++) {
+		push(src.arg(c, num_args-i-1));
+		push(int_cell(0));
+	    }
+	    break;
+	}
+	case tag_t::BIG: {
+	    auto &big = reinterpret_cast<big_cell &>(c);
+	    if (dont_copy_big()) {
+		temp_push(big);
+		break;
+	    }
+	    size_t index = big.index();
+	    auto datc = src[index];
+	    auto &dat = reinterpret_cast<const dat_cell &>(datc);
+	    auto newbigc = new_big(dat.num_bits());
+	    auto &newbig = reinterpret_cast<const big_cell &>(newbigc);
+	    auto newindex = newbig.index();
+	    size_t n = dat.num_cells();
+	    for (size_t i = 0; i < n; i++) {
+		heap_set(newindex+i, src[index+i]);
+	    }
+	    temp_push(newbig);
+	    break;
+	}
+	default:
+	    break;
+	}
+    }
+
+    cost = cost_tmp;
+    result = temp_pop();
+    return true;
+}
+
+term term_utils::copy_cyclic(term c, naming_map &names,
+			     heap &src, naming_map *src_names, uint64_t &cost)
 {
     std::unordered_map<term, term> term_map;
     std::unordered_map<con_cell, con_cell> con_map;
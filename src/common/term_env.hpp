@@ -313,6 +313,82 @@ public:
        { return T::get_heap().disable_coin_security(); }
 };
 
+//
+// Reusable open addressing map from (source) cells to cells, used by
+// copy to remember what has already been copied. clear() only bumps
+// a generation counter, so the table keeps its memory between
+// copies and a small copy doesn't pay for a large one.
+//
+class forward_table {
+public:
+    inline forward_table() : mask_(0), count_(0), generation_(1) { }
+
+    inline void clear() {
+	count_ = 0;
+	if (++generation_ == 0) {
+	    for (auto &e : entries_) e.generation = 0;
+	    generation_ = 1;
+	}
+    }
+
+    inline size_t size() const { return count_; }
+
+    inline bool find(const cell key, cell &value) const {
+	if (entries_.empty()) {
+	    return false;
+	}
+	for (size_t i = slot(key); ; i = (i + 1) & mask_) {
+	    auto &e = entries_[i];
+	    if (e.generation != generation_) {
+		return false;
+	    }
+	    if (e.key == key.raw_value()) {
+		value = cell(e.value);
+		return true;
+	    }
+	}
+    }
+
+    inline void put(const cell key, const cell value) {
+	if ((count_ + 1) * 2 > entries_.size()) {
+	    grow();
+	}
+	for (size_t i = slot(key); ; i = (i + 1) & mask_) {
+	    auto &e = entries_[i];
+	    if (e.generation != generation_) {
+		e.key = key.raw_value();
+		e.value = value.raw_value();
+		e.generation = generation_;
+		count_++;
+		return;
+	    }
+	    if (e.key == key.raw_value()) {
+		e.value = value.raw_value();
+		return;
+	    }
+	}
+    }
+
+private:
+    struct entry {
+	cell::value_t key;
+	cell::value_t value;
+	uint32_t generation;
+    };
+
+    inline size_t slot(const cell key) const {
+	uint64_t h = key.raw_value() * 0x9e3779b97f4a7c15ULL;
+	return static_cast<size_t>(h >> 32) & mask_;
+    }
+
+    void grow();
+
+    std::vector<entry> entries_;
+    size_t mask_;
+    size_t count_;
+    uint32_t generation_;
+};
+
 class stacks {
 public:
     inline stacks & get_stacks() { return *this; }
@@ -325,6 +401,7 @@ public:
     inline const std::vector<term> & get_temp() const { return temp_; }
     inline std::vector<size_t> & get_temp_trail() { return temp_trail_; }
     inline const std::vector<size_t> & get_temp_trail() const { return temp_trail_; }
+    inline forward_table & get_forward_table() { return forward_table_; }
     inline size_t get_register_hb() const { return register_hb_; }
     inline void set_register_hb(size_t hb) { register_hb_ = hb; }
 
@@ -333,6 +410,7 @@ public:
 	trail_.clear();
 	temp_.clear();
 	temp_trail_.clear();
+	forward_table_.clear();
 	register_hb_ = 0;
     }
 
@@ -341,6 +419,7 @@ private:
     std::vector<size_t> trail_;
     std::vector<term> temp_;
     std::vector<size_t> temp_trail_;
+    forward_table forward_table_;
     size_t register_hb_;
 };
 
@@ -430,6 +509,8 @@ public:
       { T::get_temp_trail().push_back(i); }
   inline size_t temp_trail_pop()
       { auto i = T::get_temp_trail().back(); T::get_temp_trail().pop_back(); return i; }
+  inline forward_table & get_forward_table()
+      { return T::get_forward_table(); }
 
 };
 
@@ -478,6 +559,7 @@ public:
     size_t temp_trail_size() const;
     void temp_trail_push(const size_t i);
     size_t temp_trail_pop();
+    forward_table & get_forward_table();
     
     void push(const term t);
     term pop();
@@ -496,6 +578,11 @@ public:
     term copy(const term t, naming_map &names, uint64_t &cost);
     term copy(const term t, naming_map &names,
 	      heap &src, naming_map *src_names, uint64_t &cost);
+    // Same as copy, but always tracks the current path to be able
+    // to copy cyclic terms. copy falls back to this when it runs
+    // into a cycle.
+    term copy_cyclic(const term t, naming_map &names,
+		     heap &src, naming_map *src_names, uint64_t &cost);
     bool equal(term a, term b, uint64_t &cost);
     bool big_equal(term t1, term t2, uint64_t &cost) const;
     uint64_t hash(term t);
@@ -543,6 +630,11 @@ private:
     void bind(const ref_cell &a, term b);
     void unwind_trail(size_t from, size_t to);
 
+    bool copy_acyclic(const term t, naming_map &names,
+		      heap &src, naming_map *src_names, uint64_t &cost,
+		      term &result);
+    con_cell copy_functor(con_cell f, heap &src);
+
     inline bool dont_copy_big() {
         return dont_copy_big_;
     }
@@ -1258,6 +1350,10 @@ inline size_t term_utils::temp_trail_pop() {
     return env_.temp_trail_pop();
 }
 
+inline forward_table & term_utils::get_forward_table() {
+    return env_.get_forward_table();
+}
+
 inline void term_utils::heap_watch(size_t addr, bool b) {
     env_.heap_watch(addr, b);
 }
@@ -1,12 +1,19 @@
 #include <iomanip>
 #include <queue>
+#include <algorithm>
+#include <string.h>
 #include "term_serializer.hpp"
 #include "blake2.hpp"
 #include "bits.hpp"
 
 namespace epilog { namespace common {
 
-term_serializer::term_serializer(term_env &env) : env_(env)
+const uint8_t term_serializer::COMPACT_MAGIC;
+const uint8_t term_serializer::COMPACT_COMPRESSED;
+const size_t term_serializer::COMPRESS_MIN_SIZE;
+
+term_serializer::term_serializer(term_env &env, format_t format)
+    : env_(env), format_(format), compress_(false)
 {
 }
 
@@ -56,6 +63,11 @@ int_cell term_serializer::hash_small(term_env &env, term t)
 
 void term_serializer::write(buffer_t &bytes, const term t)
 {
+    if (format_ == FORMAT_COMPACT) {
+	write_compact(bytes, t);
+	return;
+    }
+
     term_index_.clear();
     
     write_all_header(bytes, t);
@@ -212,6 +224,10 @@ term term_serializer::read(const buffer_t &bytes)
 
 term term_serializer::read(const buffer_t &bytes, size_t n)
 {
+    if (format_of(bytes, n) == FORMAT_COMPACT) {
+	return read_compact(bytes, n);
+    }
+
     std::vector<bool> used;
     size_t offset = 0;
     size_t heap_start = env_.heap_size();
@@ -673,6 +689,492 @@ void term_serializer::integrity_check(size_t heap_start, size_t heap_end,
     }
 }
 
+term_serializer::format_t term_serializer::format_of(const buffer_t &bytes, size_t n)
+{
+    if (n > 0 && bytes[0] == COMPACT_MAGIC) {
+	return FORMAT_COMPACT;
+    }
+    return FORMAT_VER1;
+}
+
+//
+// Compact format. After the magic and flags byte (and the
+// uncompressed size if compressed) comes a pre-order sequence of
+// tokens. Each token starts with a varint whose lower 3 bits are the
+// kind; the remaining bits are:
+//
+//   K_INT      zigzag encoded value
+//   K_CON      functor id (0 = new, followed by arity and name)
+//   K_STR      functor id, followed by the arguments
+//   K_REF      variable id (0 = new, followed by its name or "")
+//   K_BIG      number of cells, followed by the raw cells (DAT first)
+//   K_BACKREF  index of an earlier STR, LIST or BIG
+//   K_LIST     number of elements, followed by them and the tail
+//
+
+void term_serializer::clear_compact()
+{
+    functor_ids_.clear();
+    functors_.clear();
+    var_ids_.clear();
+    vars_.clear();
+    subterm_ids_.clear();
+    subterm_hashes_.clear();
+    subterms_.clear();
+}
+
+void term_serializer::write_compact(buffer_t &bytes, const term t)
+{
+    buffer_t body;
+    write_compact_body(body, t);
+
+    bytes.push_back(COMPACT_MAGIC);
+    if (compress_ && body.size() >= COMPRESS_MIN_SIZE) {
+	buffer_t packed;
+	lz_compress(&body[0], body.size(), packed);
+	if (packed.size() < body.size()) {
+	    bytes.push_back(COMPACT_COMPRESSED);
+	    write_varint(bytes, body.size());
+	    bytes.insert(bytes.end(), packed.begin(), packed.end());
+	    return;
+	}
+    }
+    bytes.push_back(0);
+    bytes.insert(bytes.end(), body.begin(), body.end());
+}
+
+void term_serializer::write_compact_functor(buffer_t &bytes, compact_kind kind, con_cell f)
+{
+    auto it = functor_ids_.find(f);
+    if (it != functor_ids_.end()) {
+	write_varint(bytes, ((it->second + 1) << 3) | kind);
+	return;
+    }
+    size_t id = functor_ids_.size();
+    functor_ids_[f] = id;
+    auto name = env_.atom_name(f);
+    write_varint(bytes, kind);
+    write_varint(bytes, f.arity());
+    write_varint(bytes, name.size());
+    bytes.insert(bytes.end(), name.begin(), name.end());
+}
+
+bool term_serializer::small_hash(const term t, uint64_t &h)
+{
+    // Only small subterms are looked up structurally; large ones
+    // are only shared if they are the same on the heap.
+    static const size_t MAX_CELLS = 16;
+
+    uint64_t acc = 0xcbf29ce484222325ULL;
+    size_t n = 0;
+    hash_stack_.clear();
+    hash_stack_.push_back(t);
+    while (!hash_stack_.empty()) {
+	auto t1 = env_.deref(hash_stack_.back());
+	hash_stack_.pop_back();
+	if (++n > MAX_CELLS) {
+	    return false;
+	}
+	if (t1.tag() == tag_t::RFW) {
+	    t1 = reinterpret_cast<ref_cell &>(t1).unwatch();
+	}
+	if (t1.tag() == tag_t::STR) {
+	    auto f = env_.functor(t1);
+	    acc = (acc ^ f.raw_value()) * 0x100000001b3ULL;
+	    for (size_t i = 0; i < f.arity(); i++) {
+		hash_stack_.push_back(env_.arg(t1, i));
+	    }
+	} else {
+	    acc = (acc ^ t1.raw_value()) * 0x100000001b3ULL;
+	}
+    }
+    h = acc;
+    return true;
+}
+
+bool term_serializer::write_compact_backref(buffer_t &bytes, const term t)
+{
+    auto it = subterm_ids_.find(t);
+    if (it != subterm_ids_.end()) {
+	write_varint(bytes, (it->second << 3) | K_BACKREF);
+	return true;
+    }
+    uint64_t h = 0;
+    bool hashed = t.tag() == tag_t::STR && small_hash(t, h);
+    if (hashed) {
+	auto range = subterm_hashes_.equal_range(h);
+	for (auto it = range.first; it != range.second; ++it) {
+	    uint64_t cost = 0;
+	    if (env_.equal(t, subterms_[it->second], cost)) {
+		write_varint(bytes, (it->second << 3) | K_BACKREF);
+		return true;
+	    }
+	}
+    }
+    // The reader numbers STR, LIST and BIG tokens in the same order
+    size_t id = subterms_.size();
+    subterms_.push_back(t);
+    subterm_ids_[t] = id;
+    if (hashed) {
+	subterm_hashes_.insert(std::make_pair(h, id));
+    }
+    return false;
+}
+
+void term_serializer::write_compact_body(buffer_t &bytes, const term t)
+{
+    static const con_cell dotted_pair(".", 2);
+
+    clear_compact();
+
+    temp_stack_.clear();
+    temp_stack_.push_back(t);
+    while (!temp_stack_.empty()) {
+	auto t1 = env_.deref(temp_stack_.back());
+	temp_stack_.pop_back();
+
+	switch (t1.tag()) {
+	case tag_t::INT: {
+	    auto v = static_cast<uint64_t>(reinterpret_cast<const int_cell &>(t1).value());
+	    auto zz = (v << 1) ^ (static_cast<int64_t>(v) < 0 ? ~0ULL : 0);
+	    write_varint(bytes, (zz << 3) | K_INT);
+	    break;
+	    }
+	case tag_t::CON:
+	    write_compact_functor(bytes, K_CON, reinterpret_cast<const con_cell &>(t1));
+	    break;
+	case tag_t::RFW:
+	    t1 = reinterpret_cast<ref_cell &>(t1).unwatch();
+	    // Fall through
+	case tag_t::REF: {
+	    auto it = var_ids_.find(t1);
+	    if (it != var_ids_.end()) {
+		write_varint(bytes, ((it->second + 1) << 3) | K_REF);
+		break;
+	    }
+	    size_t id = var_ids_.size();
+	    var_ids_[t1] = id;
+	    write_varint(bytes, K_REF);
+	    auto &ref = reinterpret_cast<const ref_cell &>(t1);
+	    if (env_.has_name(ref)) {
+		auto &name = env_.get_name(ref);
+		write_varint(bytes, name.size());
+		bytes.insert(bytes.end(), name.begin(), name.end());
+	    } else {
+		write_varint(bytes, 0);
+	    }
+	    break;
+	    }
+	case tag_t::BIG: {
+	    if (write_compact_backref(bytes, t1)) {
+		break;
+	    }
+	    auto index = reinterpret_cast<const big_cell &>(t1).index();
+	    auto big_header = env_.heap_get(index);
+	    auto &dat = reinterpret_cast<const dat_cell &>(big_header);
+	    auto num_dat = dat.num_cells();
+	    write_varint(bytes, (num_dat << 3) | K_BIG);
+	    for (size_t i = 0; i < num_dat; i++) {
+		write_cell(bytes, bytes.size(), env_.heap_get_untagged(index+i));
+	    }
+	    break;
+	    }
+	case tag_t::STR: {
+	    if (write_compact_backref(bytes, t1)) {
+		break;
+	    }
+	    auto f = env_.functor(t1);
+	    if (f != dotted_pair) {
+		write_compact_functor(bytes, K_STR, f);
+		size_t arity = f.arity();
+		for (size_t i = 0; i < arity; i++) {
+		    temp_stack_.push_back(env_.arg(t1, arity-i-1));
+		}
+		break;
+	    }
+	    // A run of list cells; stop at a tail that can be referred to
+	    size_t start = temp_stack_.size();
+	    size_t num_elements = 0;
+	    term tail = t1;
+	    do {
+		temp_stack_.push_back(env_.arg(tail, 0));
+		num_elements++;
+		tail = env_.deref(env_.arg(tail, 1));
+	    } while (tail.tag() == tag_t::STR &&
+		     env_.functor(tail) == dotted_pair &&
+		     subterm_ids_.find(tail) == subterm_ids_.end());
+	    temp_stack_.push_back(tail);
+	    std::reverse(temp_stack_.begin() + start, temp_stack_.end());
+	    write_varint(bytes, (num_elements << 3) | K_LIST);
+	    break;
+	    }
+	default:
+	    throw serializer_exception_illegal_cell(t1, bytes.size(),
+						    "cannot be serialized");
+	}
+    }
+}
+
+uint64_t term_serializer::read_varint(const buffer_t &bytes, size_t &offset, size_t n)
+{
+    uint64_t v = 0;
+    for (size_t shift = 0; shift < 64; shift += 7) {
+	if (offset >= n) {
+	    throw serializer_exception_unexpected_end(offset, "reading varint");
+	}
+	uint8_t b = bytes[offset++];
+	v |= static_cast<uint64_t>(b & 0x7f) << shift;
+	if ((b & 0x80) == 0) {
+	    return v;
+	}
+    }
+    throw serializer_exception_illegal_compact(offset, "varint is too long");
+}
+
+term term_serializer::read_compact(const buffer_t &bytes, size_t n)
+{
+    if (n < 2) {
+	throw serializer_exception_unexpected_end(n, "reading compact header");
+    }
+    uint8_t flags = bytes[1];
+    if ((flags & ~COMPACT_COMPRESSED) != 0) {
+	throw serializer_exception_illegal_compact(1, "unknown flags");
+    }
+    if ((flags & COMPACT_COMPRESSED) == 0) {
+	return read_compact_body(bytes, 2, n);
+    }
+    size_t offset = 2;
+    auto size = read_varint(bytes, offset, n);
+    buffer_t body;
+    lz_decompress(bytes, offset, n, body, size);
+    return read_compact_body(body, 0, body.size());
+}
+
+con_cell term_serializer::read_compact_functor(const buffer_t &bytes, size_t &offset, size_t n, uint64_t id)
+{
+    if (id > 0) {
+	if (id > functors_.size()) {
+	    throw serializer_exception_illegal_compact(offset, "unknown functor");
+	}
+	return functors_[id-1];
+    }
+    auto arity = read_varint(bytes, offset, n);
+    auto len = read_varint(bytes, offset, n);
+    if (arity > con_cell::MAX_ARITY) {
+	throw serializer_exception_illegal_compact(offset, "arity is too large");
+    }
+    if (len > n - offset) {
+	throw serializer_exception_unexpected_end(offset, "reading functor name");
+    }
+    std::string name(bytes.begin() + offset, bytes.begin() + offset + len);
+    offset += len;
+    auto f = env_.functor(name, arity);
+    functors_.push_back(f);
+    return f;
+}
+
+term term_serializer::read_compact_body(const buffer_t &bytes, size_t offset, size_t n)
+{
+    static const con_cell dotted_pair(".", 2);
+
+    clear_compact();
+
+    term result;
+    slots_.clear();
+    slots_.push_back(std::make_pair(term(), 0));
+
+    while (!slots_.empty()) {
+	auto slot = slots_.back();
+	slots_.pop_back();
+
+	size_t token_offset = offset;
+	auto op = read_varint(bytes, offset, n);
+	auto payload = op >> 3;
+	term v;
+
+	switch (op & 7) {
+	case K_INT: {
+	    auto value = static_cast<int64_t>(payload >> 1) ^ -static_cast<int64_t>(payload & 1);
+	    v = int_cell(value);
+	    break;
+	    }
+	case K_CON:
+	    v = read_compact_functor(bytes, offset, n, payload);
+	    break;
+	case K_STR: {
+	    auto f = read_compact_functor(bytes, offset, n, payload);
+	    if (f.arity() > n - offset) {
+		throw serializer_exception_unexpected_end(offset, "reading arguments");
+	    }
+	    v = env_.new_term(f);
+	    subterms_.push_back(v);
+	    for (size_t i = f.arity(); i > 0; i--) {
+		slots_.push_back(std::make_pair(v, i-1));
+	    }
+	    break;
+	    }
+	case K_REF: {
+	    if (payload > 0) {
+		if (payload > vars_.size()) {
+		    throw serializer_exception_illegal_compact(token_offset, "unknown variable");
+		}
+		v = vars_[payload-1];
+		break;
+	    }
+	    auto len = read_varint(bytes, offset, n);
+	    if (len > n - offset) {
+		throw serializer_exception_unexpected_end(offset, "reading variable name");
+	    }
+	    v = env_.new_ref();
+	    if (len > 0) {
+		std::string name(bytes.begin() + offset, bytes.begin() + offset + len);
+		env_.set_name(reinterpret_cast<ref_cell &>(v), name);
+	    }
+	    offset += len;
+	    vars_.push_back(v);
+	    break;
+	    }
+	case K_BIG: {
+	    if (payload == 0 || payload > (n - offset) / sizeof(cell)) {
+		throw serializer_exception_illegal_compact(token_offset, "bad bignum size");
+	    }
+	    cell c = read_cell(bytes, offset, "reading bignum");
+	    auto &dc = reinterpret_cast<const dat_cell &>(c);
+	    if (c.tag() != tag_t::DAT || dc.num_bits() < 1 || dc.num_cells() != payload) {
+		throw serializer_exception_illegal_compact(offset, "bad DAT cell");
+	    }
+	    auto index = env_.new_cell0(c);
+	    offset += sizeof(cell);
+	    for (size_t i = 1; i < payload; i++) {
+		env_.new_dat_cell(read_cell(bytes, offset, "reading bignum"));
+		offset += sizeof(cell);
+	    }
+	    v = big_cell(index);
+	    subterms_.push_back(v);
+	    break;
+	    }
+	case K_BACKREF:
+	    if (payload >= subterms_.size()) {
+		throw serializer_exception_illegal_compact(token_offset, "unknown subterm");
+	    }
+	    v = subterms_[payload];
+	    break;
+	case K_LIST: {
+	    if (payload == 0 || payload > n - offset) {
+		throw serializer_exception_illegal_compact(token_offset, "bad list length");
+	    }
+	    v = env_.new_term(dotted_pair);
+	    subterms_.push_back(v);
+	    term last = v;
+	    std::vector<term> cells;
+	    cells.push_back(last);
+	    for (size_t i = 1; i < payload; i++) {
+		term next = env_.new_term(dotted_pair);
+		env_.set_arg(last, 1, next);
+		cells.push_back(next);
+		last = next;
+	    }
+	    slots_.push_back(std::make_pair(last, 1));
+	    for (size_t i = payload; i > 0; i--) {
+		slots_.push_back(std::make_pair(cells[i-1], 0));
+	    }
+	    break;
+	    }
+	default:
+	    throw serializer_exception_illegal_compact(token_offset, "unknown token");
+	}
+
+	if (slot.first == term()) {
+	    result = v;
+	} else {
+	    env_.set_arg(slot.first, slot.second, v);
+	}
+    }
+
+    if (offset != n) {
+	throw serializer_exception_illegal_compact(offset, "trailing data");
+    }
+    return result;
+}
+
+//
+// A small LZ77 block compressor (in the spirit of LZ4.) The output
+// is a sequence of: literal count, literals, match length (0 = end)
+// and match distance, all lengths as varints.
+//
+
+void term_serializer::lz_compress(const uint8_t *src, size_t n, buffer_t &out)
+{
+    static const size_t HASH_BITS = 13;
+    static const size_t MIN_MATCH = 4;
+    static const size_t MAX_DISTANCE = 1 << 16;
+
+    std::vector<size_t> table(1 << HASH_BITS, ~static_cast<size_t>(0));
+    auto read32 = [src](size_t i) {
+	uint32_t v;
+	memcpy(&v, src + i, sizeof(v));
+	return v;
+    };
+
+    size_t anchor = 0, i = 0;
+    while (i + MIN_MATCH <= n) {
+	auto v = read32(i);
+	auto h = (v * 2654435761U) >> (32 - HASH_BITS);
+	auto candidate = table[h];
+	table[h] = i;
+	if (candidate == ~static_cast<size_t>(0) || i - candidate > MAX_DISTANCE ||
+	    read32(candidate) != v) {
+	    i++;
+	    continue;
+	}
+	size_t len = MIN_MATCH;
+	while (i + len < n && src[candidate + len] == src[i + len]) {
+	    len++;
+	}
+	write_varint(out, i - anchor);
+	out.insert(out.end(), src + anchor, src + i);
+	write_varint(out, len - MIN_MATCH + 1);
+	write_varint(out, i - candidate);
+	i += len;
+	anchor = i;
+    }
+    write_varint(out, n - anchor);
+    out.insert(out.end(), src + anchor, src + n);
+    write_varint(out, 0);
+}
+
+void term_serializer::lz_decompress(const buffer_t &bytes, size_t offset, size_t n, buffer_t &out, size_t out_size)
+{
+    static const size_t MIN_MATCH = 4;
+
+    out.clear();
+    out.reserve(std::min(out_size, n * 64));
+    for (;;) {
+	auto lit = read_varint(bytes, offset, n);
+	if (lit > n - offset || lit > out_size - out.size()) {
+	    throw serializer_exception_illegal_compact(offset, "bad literal length");
+	}
+	out.insert(out.end(), bytes.begin() + offset, bytes.begin() + offset + lit);
+	offset += lit;
+	auto m = read_varint(bytes, offset, n);
+	if (m == 0) {
+	    break;
+	}
+	auto len = m - 1 + MIN_MATCH;
+	auto dist = read_varint(bytes, offset, n);
+	if (dist == 0 || dist > out.size() || len > out_size - out.size()) {
+	    throw serializer_exception_illegal_compact(offset, "bad match");
+	}
+	size_t from = out.size() - dist;
+	for (size_t i = 0; i < len; i++) {
+	    out.push_back(out[from + i]);
+	}
+    }
+    if (offset != n || out.size() != out_size) {
+	throw serializer_exception_illegal_compact(offset, "size mismatch");
+    }
+}
+
 void term_serializer::print_buffer(const buffer_t &bytes, size_t n)
 {
     print_buffer(std::cout, bytes, n);
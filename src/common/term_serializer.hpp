@@ -158,6 +158,15 @@ public:
 
 };
 
+class serializer_exception_illegal_compact : public serializer_exception
+{
+public:
+    serializer_exception_illegal_compact(size_t offset, const std::string &why) :
+	serializer_exception("Illegal compact data at offset "
+			     + boost::lexical_cast<std::string>(offset)
+			     + "; " + why) { }
+};
+
 class serializer_exception_cyclic_reference : public serializer_exception
 {
 public:
@@ -212,9 +221,31 @@ class term_serializer {
 public:
     typedef std::vector<uint8_t> buffer_t;
 
-    term_serializer(term_env &env);
+    //
+    // FORMAT_VER1 writes every cell as 8 bytes, preceded by a remap
+    // header of atom and variable names. FORMAT_COMPACT writes tagged
+    // varints, keeps tables of functors and variables (so each name is
+    // written once), writes lists as runs, refers back to repeated
+    // subterms and optionally LZ compresses the result. read() accepts
+    // both (a compact buffer starts with COMPACT_MAGIC, which can't be
+    // the first byte of "ver1".) Hashes are always computed on ver1.
+    //
+    enum format_t { FORMAT_VER1, FORMAT_COMPACT };
+
+    static const uint8_t COMPACT_MAGIC = 0xc5;
+    static const uint8_t COMPACT_COMPRESSED = 0x1;
+    static const size_t COMPRESS_MIN_SIZE = 256;
+
+    term_serializer(term_env &env, format_t format = FORMAT_VER1);
     ~term_serializer();
 
+    inline format_t format() const { return format_; }
+    inline void set_format(format_t format) { format_ = format; }
+    inline bool compress() const { return compress_; }
+    inline void set_compress(bool b) { compress_ = b; }
+
+    static format_t format_of(const buffer_t &bytes, size_t n);
+
     void write(buffer_t &bytes, const term t);
     term read(const buffer_t &bytes);
     term read(const buffer_t &bytes, size_t n);
@@ -327,13 +358,53 @@ private:
     void read_index(const buffer_t &bytes, size_t &offset, cell c);
     std::string read_encoded_string(const buffer_t &bytes, size_t &offset);
 
+    // Compact format
+    enum compact_kind { K_INT = 0, K_CON = 1, K_STR = 2, K_REF = 3,
+			K_BIG = 4, K_BACKREF = 5, K_LIST = 6 };
+
+    void write_compact(buffer_t &bytes, const term t);
+    void write_compact_body(buffer_t &bytes, const term t);
+    void write_compact_functor(buffer_t &bytes, compact_kind kind, con_cell f);
+    bool write_compact_backref(buffer_t &bytes, const term t);
+    bool small_hash(const term t, uint64_t &h);
+    term read_compact(const buffer_t &bytes, size_t n);
+    term read_compact_body(const buffer_t &bytes, size_t offset, size_t n);
+    con_cell read_compact_functor(const buffer_t &bytes, size_t &offset,
+				  size_t n, uint64_t id);
+    void clear_compact();
+
+    static inline void write_varint(buffer_t &bytes, uint64_t v)
+        { while (v >= 0x80) {
+	      bytes.push_back(static_cast<uint8_t>(v | 0x80));
+	      v >>= 7;
+	  }
+	  bytes.push_back(static_cast<uint8_t>(v));
+	}
+    static uint64_t read_varint(const buffer_t &bytes, size_t &offset, size_t n);
+
+    static void lz_compress(const uint8_t *src, size_t n, buffer_t &out);
+    static void lz_decompress(const buffer_t &bytes, size_t offset, size_t n,
+			      buffer_t &out, size_t out_size);
+
     term_env &env_;
+    format_t format_;
+    bool compress_;
 
     indexor<term> term_index_;
     std::unordered_map<cell,cell> new_to_old_;
     std::vector<std::pair<size_t, term> > stack_;
     std::vector<term> temp_stack_;
     std::unordered_set<term> temp_set_;
+
+    std::unordered_map<cell, size_t> functor_ids_;
+    std::vector<con_cell> functors_;
+    std::unordered_map<term, size_t> var_ids_;
+    std::vector<term> vars_;
+    std::unordered_map<term, size_t> subterm_ids_;
+    std::unordered_multimap<uint64_t, size_t> subterm_hashes_;
+    std::vector<term> subterms_;
+    std::vector<term> hash_stack_;
+    std::vector<std::pair<term, size_t> > slots_;
 };
 
 }}
@@ -0,0 +1,136 @@
+#include <iostream>
+#include <iomanip>
+#include <assert.h>
+#include <string.h>
+#include <vector>
+#include <common/blake2.hpp>
+#include <common/hex.hpp>
+#include <common/utime.hpp>
+
+using namespace epilog::common;
+
+static void header( const std::string &str )
+{
+    std::cout << "\n";
+    std::cout << "--- [" + str + "] " + std::string(60 - str.length(), '-') << "\n";
+    std::cout << "\n";
+}
+
+typedef int (*many_fn)(void *const *, size_t, const void *const *,
+		       const size_t *, size_t);
+
+static std::vector<std::vector<uint8_t> > make_messages(size_t n, size_t min_len, size_t max_len, uint64_t seed)
+{
+    std::vector<std::vector<uint8_t> > msgs(n);
+    for (size_t i = 0; i < n; i++) {
+	seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+	size_t len = min_len + static_cast<size_t>(seed >> 33) % (max_len - min_len + 1);
+	msgs[i].resize(len);
+	for (size_t j = 0; j < len; j++) {
+	    msgs[i][j] = static_cast<uint8_t>(i * 31 + j * 7 + (seed >> 40));
+	}
+    }
+    return msgs;
+}
+
+static void hash_many(many_fn fn, std::vector<std::vector<uint8_t> > &msgs,
+		      size_t outlen, std::vector<uint8_t> &result)
+{
+    size_t n = msgs.size();
+    result.resize(n * outlen);
+    std::vector<void *> out(n);
+    std::vector<const void *> in(n);
+    std::vector<size_t> inlen(n);
+    for (size_t i = 0; i < n; i++) {
+	out[i] = &result[i * outlen];
+	in[i] = msgs[i].empty() ? nullptr : &msgs[i][0];
+	inlen[i] = msgs[i].size();
+    }
+    int r = fn(&out[0], outlen, &in[0], &inlen[0], n);
+    assert(r == 0);
+}
+
+static void hash_scalar(std::vector<std::vector<uint8_t> > &msgs,
+			size_t outlen, std::vector<uint8_t> &result)
+{
+    result.resize(msgs.size() * outlen);
+    for (size_t i = 0; i < msgs.size(); i++) {
+	blake2b(&result[i * outlen], outlen,
+		msgs[i].empty() ? nullptr : &msgs[i][0], msgs[i].size(),
+		nullptr, 0);
+    }
+}
+
+static void test_blake2b_many()
+{
+    header( "test_blake2b_many" );
+
+    std::cout << "Implementation: " << blake2b_many_impl() << std::endl;
+
+    // Every length around the block boundaries, different number
+    // of messages (so that some lanes are unused.)
+    for (size_t outlen : {32, 64}) {
+	for (size_t n = 1; n <= 9; n++) {
+	    auto msgs = make_messages(n * 37, 0, 3*BLAKE2B_BLOCKBYTES + 1, n);
+	    std::vector<uint8_t> expect, actual, portable;
+	    hash_scalar(msgs, outlen, expect);
+	    hash_many(&blake2b_many, msgs, outlen, actual);
+	    hash_many(&blake2b_many_portable, msgs, outlen, portable);
+	    assert(actual == expect);
+	    assert(portable == expect);
+	}
+    }
+
+    // Empty message (known answer)
+    std::vector<std::vector<uint8_t> > empty(1);
+    std::vector<uint8_t> h;
+    hash_many(&blake2b_many, empty, 64, h);
+    auto s = hex::to_string(&h[0], h.size());
+    std::cout << "BLAKE2b(\"\"): " << s << std::endl;
+    assert(s == "786a02f742015903c6c6fd852552d272912f4740e15847618a86e217f71f5419"
+	        "d25e1031afee585313896444934eb04b903a685b1448b755d56f701afe9be2ce");
+}
+
+static void test_blake2b_many_benchmark()
+{
+    header( "test_blake2b_many_benchmark" );
+
+    // Typical trie node sizes: leaves (key + small data) and branches
+    // (depth + mask + child hashes.)
+    const size_t N = 20000;
+    for (size_t len : {16, 64, 261, 1029}) {
+	auto msgs = make_messages(N, len, len, len);
+	std::vector<uint8_t> expect, actual, portable;
+
+	auto start0 = utime::now();
+	hash_scalar(msgs, 32, expect);
+	auto end0 = utime::now();
+
+	auto start1 = utime::now();
+	hash_many(&blake2b_many_portable, msgs, 32, portable);
+	auto end1 = utime::now();
+
+	auto start2 = utime::now();
+	hash_many(&blake2b_many, msgs, 32, actual);
+	auto end2 = utime::now();
+
+	assert(actual == expect && portable == expect);
+
+	auto rate = [N](utime t) {
+	    auto us = t.in_us();
+	    return us == 0 ? 0 : N * 1000000 / us;
+	};
+	std::cout << "Message size: " << std::setw(4) << len
+		  << "  Scalar: " << std::setw(8) << rate(end0 - start0) << " hashes/s"
+		  << "  Portable: " << std::setw(8) << rate(end1 - start1) << " hashes/s"
+		  << "  " << blake2b_many_impl() << ": " << std::setw(8)
+		  << rate(end2 - start2) << " hashes/s" << std::endl;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    test_blake2b_many();
+    test_blake2b_many_benchmark();
+    return 0;
+}
@@ -0,0 +1,72 @@
+#include <common/bloom_filter.hpp>
+#include <common/fast_hash.hpp>
+#include <cassert>
+#include <string>
+#include <iostream>
+#include <iomanip>
+
+using namespace epilog::common;
+
+static void header( const std::string &str )
+{
+    std::cout << "\n";
+    std::cout << "--- [" + str + "] " + std::string(60 - str.length(), '-') << "\n";
+    std::cout << "\n";
+}
+
+static uint64_t hash_of(const std::string &s)
+{
+    fast_hash h1, h2;
+    h1 << s;
+    h2 << s << 1;
+    return (static_cast<uint64_t>(h1.finalize()) << 32) | h2.finalize();
+}
+
+static void test_bloom_filter()
+{
+    header("test_bloom_filter");
+
+    static const size_t N = 100000;
+
+    for (size_t bits : {8, 10, 16}) {
+	bloom_filter bloom(N, bits);
+	for (size_t i = 0; i < N; i++) {
+	    bloom.add(hash_of("atom_" + std::to_string(i)));
+	}
+	assert(bloom.size() == N && bloom.is_full());
+
+	// No false negatives
+	for (size_t i = 0; i < N; i++) {
+	    assert(bloom.maybe_contains(hash_of("atom_" + std::to_string(i))));
+	}
+
+	size_t false_positives = 0;
+	for (size_t i = 0; i < N; i++) {
+	    if (bloom.maybe_contains(hash_of("other_" + std::to_string(i)))) {
+		false_positives++;
+	    }
+	}
+	double rate = static_cast<double>(false_positives) / N;
+	std::cout << "Bits per element: " << std::setw(2) << bits
+		  << "  Bits: " << bloom.num_bits()
+		  << "  False positive rate: " << std::setprecision(4)
+		  << (rate * 100) << "%" << std::endl;
+	// The number of bits is rounded up to a power of two, so this
+	// is at most the textbook rate (0.6^bits)
+	assert(rate < (bits == 8 ? 0.03 : (bits == 10 ? 0.01 : 0.001)));
+
+	bloom.clear();
+	assert(bloom.size() == 0);
+	assert(!bloom.maybe_contains(hash_of("atom_0")));
+    }
+
+    // An empty (unsized) filter can't tell
+    bloom_filter none;
+    assert(none.maybe_contains(hash_of("anything")));
+}
+
+int main(int argc, char *argv[])
+{
+    test_bloom_filter();
+    return 0;
+}
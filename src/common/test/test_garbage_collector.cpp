@@ -0,0 +1,241 @@
+#include <iostream>
+#include <iomanip>
+#include <assert.h>
+#include <boost/thread.hpp>
+#include <common/term_env.hpp>
+#include <common/garbage_collector.hpp>
+
+using namespace epilog::common;
+
+static void header( const std::string &str )
+{
+    std::cout << "\n";
+    std::cout << "--- [" + str + "] " + std::string(60 - str.length(), '-') << "\n";
+    std::cout << "\n";
+}
+
+static std::vector<ptr_cell *> roots_of(std::vector<term> &terms)
+{
+    std::vector<ptr_cell *> roots;
+    for (auto &t : terms) {
+	roots.push_back(reinterpret_cast<ptr_cell *>(&t));
+    }
+    return roots;
+}
+
+static void make_garbage(term_env &env, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+	env.parse("garbage(" + std::to_string(i) + ", [a,b,c], foo(bar)).");
+    }
+}
+
+static void test_full_collection()
+{
+    header( "test_full_collection()" );
+
+    term_env env;
+
+    std::vector<term> live;
+    std::vector<std::string> expect;
+    for (size_t i = 0; i < 20; i++) {
+	make_garbage(env, 500);
+	std::string s = "keep(" + std::to_string(i) + ", [x,y,z], "
+	    "16'" + std::string(100 + i * 20, 'f') + ").";
+	live.push_back(env.parse(s));
+	expect.push_back(env.to_string(live.back()));
+    }
+    // Variables shared between terms must still be shared
+    auto shared = env.parse("shared(X, g(X), h(X)).");
+    live.push_back(shared);
+    make_garbage(env, 500);
+
+    size_t before = env.heap_size();
+
+    garbage_collector gc(env.get_heap());
+    auto roots = roots_of(live);
+    size_t collected = gc.do_collection(roots);
+
+    size_t after = env.heap_size();
+    std::cout << "Heap size: " << before << " -> " << after
+	      << " (collected " << collected << " bytes)" << std::endl;
+    assert(after < before / 10);
+    assert(collected == (before - after) * sizeof(cell));
+
+    for (size_t i = 0; i < expect.size(); i++) {
+	auto actual = env.to_string(live[i]);
+	if (actual != expect[i]) {
+	    std::cout << "ACTUAL: " << actual << std::endl;
+	    std::cout << "EXPECT: " << expect[i] << std::endl;
+	    assert(actual == expect[i]);
+	}
+    }
+
+    shared = live.back();
+    uint64_t cost = 0;
+    assert(env.unify(env.arg(shared, 0), env.parse("value."), cost));
+    auto shared_str = env.to_string(shared);
+    std::cout << "Shared: " << shared_str << std::endl;
+    assert(shared_str == "shared(value, g(value), h(value))");
+
+    // New terms can be allocated on the compacted heap
+    auto t = env.parse("after(gc, [1,2,3]).");
+    assert(env.to_string(t) == "after(gc, [1,2,3])");
+}
+
+static void test_young_collection()
+{
+    header( "test_young_collection()" );
+
+    term_env env;
+
+    make_garbage(env, 1000);
+    auto old_term = env.parse("old(X, [1,2,3]).");
+    auto old_var = env.arg(old_term, 0);
+    auto old_str_index = reinterpret_cast<ptr_cell &>(old_term).index();
+
+    // Here's our "choice point"
+    size_t hb = env.heap_size();
+    env.set_register_hb(hb);
+
+    make_garbage(env, 1000);
+    size_t middle = env.heap_size();
+    make_garbage(env, 1000);
+    auto young_term = env.parse("young(1, 2, three).");
+    make_garbage(env, 1000);
+
+    // Binding an old variable to a young term gets trailed
+    uint64_t cost = 0;
+    assert(env.unify(old_var, young_term, cost));
+    assert(env.get_trail().size() == 1);
+
+    size_t before = env.heap_size();
+
+    garbage_collector gc(env.get_heap());
+    gc.set_young_start(hb);
+    gc.add_trail(env.get_trail());
+    gc.add_boundary(&middle);
+    std::vector<term> live;
+    live.push_back(old_term);
+    auto roots = roots_of(live);
+    gc.do_collection(roots);
+
+    size_t after = env.heap_size();
+    std::cout << "Heap size: " << before << " -> " << after << std::endl;
+    assert(after < hb + 100);
+
+    // Old cells don't move
+    assert(reinterpret_cast<ptr_cell &>(live[0]).index() == old_str_index);
+    auto s = env.to_string(live[0]);
+    std::cout << "Old term: " << s << std::endl;
+    assert(s == "old(young(1, 2, three), [1,2,3])");
+
+    // Nothing was live between hb and middle
+    std::cout << "Boundary: " << middle << std::endl;
+    assert(middle == hb);
+}
+
+static void test_long_running()
+{
+    header( "test_long_running()" );
+
+    term_env env;
+
+    std::vector<term> live;
+    live.push_back(env.parse("state(0)."));
+    size_t max_size = 0;
+    for (size_t i = 1; i <= 100; i++) {
+	make_garbage(env, 200);
+	live[0] = env.parse("state(" + std::to_string(i) + ").");
+	garbage_collector gc(env.get_heap());
+	auto roots = roots_of(live);
+	gc.do_collection(roots);
+	max_size = std::max(max_size, env.heap_size());
+    }
+    std::cout << "Max heap size after collection: " << max_size << std::endl;
+    assert(max_size < 16);
+    assert(env.to_string(live[0]) == "state(100)");
+}
+
+static term build_list(term_env &env, size_t n)
+{
+    term lst = con_cell("[]", 0);
+    for (size_t i = 0; i < n; i++) {
+	env.new_term(con_cell("junk", 2), {int_cell(i), int_cell(i)});
+	lst = env.new_term(con_cell(".", 2), {int_cell(i), lst});
+    }
+    return lst;
+}
+
+static term build_tree(term_env &env, size_t depth)
+{
+    if (depth == 0) {
+	return env.new_term(con_cell("leaf", 1), {int_cell(depth)});
+    }
+    auto left = build_tree(env, depth - 1);
+    env.new_term(con_cell("junk", 1), {int_cell(depth)});
+    auto right = build_tree(env, depth - 1);
+    return env.new_term(con_cell("node", 2), {left, right});
+}
+
+// Run the pause benchmark at full size (--bench); by default it only
+// checks that all thread counts agree on a heap of a few blocks.
+static bool full_benchmarks = false;
+
+static garbage_collector::stats run_pause(size_t num_threads, std::string &result)
+{
+    term_env env;
+
+    size_t list_length = full_benchmarks ? 200000 : 5000;
+    size_t tree_depth = full_benchmarks ? 16 : 10;
+
+    std::vector<term> live;
+    live.push_back(build_list(env, list_length));
+    live.push_back(build_tree(env, tree_depth));
+    live.push_back(build_list(env, list_length));
+
+    garbage_collector gc(env.get_heap());
+    gc.set_num_threads(num_threads);
+    auto roots = roots_of(live);
+    gc.do_collection(roots);
+
+    result.clear();
+    for (auto &t : live) {
+	result += env.to_string(t);
+    }
+    return gc.get_stats();
+}
+
+static void test_pause_benchmark()
+{
+    header( "test_pause_benchmark()" );
+
+    size_t max_threads = std::max(4u, boost::thread::hardware_concurrency());
+    std::string expect;
+    for (size_t n = 1; n <= max_threads; n *= 2) {
+	std::string actual;
+	auto stats = run_pause(n, actual);
+	if (n == 1) {
+	    expect = actual;
+	}
+	assert(actual == expect);
+	std::cout << "Threads: " << std::setw(2) << n
+		  << " Live cells: " << stats.live_cells
+		  << " Mark: " << std::setw(7) << stats.mark_us << "us"
+		  << " Rewrite: " << std::setw(7) << stats.rewrite_us << "us"
+		  << " Total: " << std::setw(7) << stats.total_us << "us"
+		  << std::endl;
+    }
+}
+
+int main( int argc, char *argv[] )
+{
+    full_benchmarks = argc == 2 && strcmp(argv[1], "--bench") == 0;
+
+    test_full_collection();
+    test_young_collection();
+    test_long_running();
+    test_pause_benchmark();
+
+    return 0;
+}
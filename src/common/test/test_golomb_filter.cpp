@@ -0,0 +1,90 @@
+#include <common/golomb_filter.hpp>
+#include <cassert>
+#include <string>
+#include <iostream>
+#include <iomanip>
+
+using namespace epilog::common;
+
+static void header( const std::string &str )
+{
+    std::cout << "\n";
+    std::cout << "--- [" + str + "] " + std::string(60 - str.length(), '-') << "\n";
+    std::cout << "\n";
+}
+
+static uint64_t hash_of(const std::string &s)
+{
+    return golomb_filter::hash(reinterpret_cast<const uint8_t *>(s.c_str()), s.size());
+}
+
+static void test_golomb_filter()
+{
+    header("test_golomb_filter");
+
+    static const size_t N = 10000;
+
+    std::vector<uint64_t> hashes;
+    for (size_t i = 0; i < N; i++) {
+	hashes.push_back(hash_of("addr_" + std::to_string(i)));
+    }
+    golomb_filter filter(hashes);
+    assert(filter.size() == N);
+
+    // No false negatives
+    for (size_t i = 0; i < N; i++) {
+	assert(filter.match(hashes[i]));
+    }
+
+    // Read back from the encoded form
+    golomb_filter copy;
+    assert(copy.read(&filter.bytes()[0], filter.bytes().size()));
+    assert(copy.size() == N);
+
+    size_t false_positives = 0;
+    const size_t NUM_OTHERS = 100000;
+    std::vector<uint64_t> others;
+    for (size_t i = 0; i < NUM_OTHERS; i++) {
+	auto h = hash_of("other_" + std::to_string(i));
+	if (copy.match(h)) {
+	    false_positives++;
+	}
+	if (i < 100) {
+	    others.push_back(h);
+	}
+    }
+
+    double bits = 8.0 * filter.bytes().size() / N;
+    std::cout << "Elements: " << N << "  Bytes: " << filter.bytes().size()
+	      << "  Bits per element: " << std::setprecision(4) << bits
+	      << "  False positives: " << false_positives << "/" << NUM_OTHERS
+	      << std::endl;
+    assert(bits < golomb_filter::P + 3);
+    assert(false_positives < 5);
+
+    // Several at once
+    assert(!copy.match_any(others));
+    others.push_back(hashes[N/2]);
+    assert(copy.match_any(others));
+
+    // A truncated filter only matches what's before the cut
+    golomb_filter truncated;
+    assert(truncated.read(&filter.bytes()[0], filter.bytes().size() / 2));
+    size_t num_matches = 0;
+    for (size_t i = 0; i < N; i++) {
+	if (truncated.match(hashes[i])) num_matches++;
+    }
+    assert(num_matches > N / 3 && num_matches < N);
+    assert(!truncated.read(&filter.bytes()[0], 3));
+
+    // Empty filter matches nothing
+    golomb_filter none(std::vector<uint64_t>{});
+    assert(none.empty() && none.bytes().size() == 4);
+    assert(!none.match(hashes[0]));
+}
+
+int main(int argc, char *argv[])
+{
+    test_golomb_filter();
+    return 0;
+}
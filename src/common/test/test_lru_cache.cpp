@@ -1,8 +1,13 @@
 #include <common/lru_cache.hpp>
 #include <common/checked_cast.hpp>
+#include <common/random.hpp>
+#include <common/utime.hpp>
 #include <cassert>
 #include <string>
 #include <iostream>
+#include <list>
+#include <map>
+#include <unordered_map>
 
 using namespace epilog::common;
 
@@ -91,10 +96,171 @@ static void test_lru_cache_2()
     }
 }
 
+static void test_lru_cache_3()
+{
+    header("test_lru_cache_3");
+
+    // Referenced entries get a second chance
+    static const size_t CACHE_SIZE = 10;
+
+    size_t num_accessed = 0;
+    struct my_callback_t : public lru_cache_callback_nop<int,int> {
+        my_callback_t(size_t &n) : n_(n) { }
+        void accessed(int, int) { n_++; }
+        size_t &n_;
+    } my_callback(num_accessed);
+
+    lru_cache<int, int, my_callback_t> cache(CACHE_SIZE, my_callback);
+    for (size_t i = 0; i < CACHE_SIZE; i++) {
+        cache.insert(i, i);
+    }
+    // Touch the oldest
+    assert(cache.find(0) != nullptr);
+    assert(num_accessed == 1);
+    cache.insert(100, 100);
+    std::cout << "Check that 1 (not 0) was evicted" << std::endl;
+    assert(cache.find(0) != nullptr);
+    assert(cache.find(1) == nullptr);
+    assert(cache.size() == CACHE_SIZE);
+
+    std::cout << "Compare with reference under random operations" << std::endl;
+    std::map<int, int> ref;
+    struct ref_callback_t : public lru_cache_callback_nop<int,int> {
+        ref_callback_t(std::map<int,int> &r) : ref_(r) { }
+        void evicted(int key, int value) {
+	    assert(ref_.count(key) && ref_[key] == value);
+	    ref_.erase(key);
+	}
+        std::map<int,int> &ref_;
+    } ref_callback(ref);
+    lru_cache<int, int, ref_callback_t> cache2(64, ref_callback);
+    for (size_t i = 0; i < 100000; i++) {
+        int key = random::next_int(200);
+	switch (random::next_int(3)) {
+	case 0: {
+	    auto *v = cache2.find(key);
+	    assert((v == nullptr) == (ref.count(key) == 0));
+	    if (v != nullptr) assert(*v == ref[key]);
+	    break;
+	}
+	case 1:
+	    if (!ref.count(key)) {
+	        cache2.insert(key, key * 3);
+		ref[key] = key * 3;
+	    }
+	    break;
+	case 2:
+	    cache2.erase(key);
+	    assert(ref.count(key) == 0);
+	    break;
+	}
+	assert(cache2.size() == ref.size() && ref.size() <= 64);
+    }
+    cache2.clear();
+    assert(ref.empty());
+}
+
+static void test_lru_cache_bytes()
+{
+    header("test_lru_cache_bytes");
+
+    // Capacity is not the limit here, the number of bytes is
+    lru_cache<int, int> cache(1000);
+    cache.set_max_bytes(1000);
+
+    for (size_t i = 0; i < 100; i++) {
+        cache.insert(i, i, 100 + (i % 3) * 50);
+	assert(cache.num_bytes() <= 1000);
+    }
+    std::cout << "Entries: " << cache.size() << " bytes: " << cache.num_bytes() << std::endl;
+    assert(cache.size() >= 5 && cache.size() <= 10);
+    assert(cache.find(99) != nullptr);
+    assert(cache.find(0) == nullptr);
+}
+
+//
+// The previous implementation (an unordered_map and a list), kept
+// here to compare with.
+//
+template<typename K, typename V> class list_lru_cache {
+public:
+    list_lru_cache(size_t capacity) : capacity_(capacity) { }
+    void insert(const K &key, const V &value) {
+        if (map_.find(key) == map_.end()) {
+	    if (access_.size() >= capacity_) {
+	        map_.erase(access_.back());
+		access_.pop_back();
+	    }
+	    access_.push_front(key);
+	    map_[key] = std::make_pair(value, access_.begin());
+	}
+    }
+    V * find(const K &key) {
+        auto it = map_.find(key);
+	if (it == map_.end()) {
+	    return nullptr;
+	}
+	access_.erase(it->second.second);
+	access_.push_front(key);
+	it->second.second = access_.begin();
+	return &it->second.first;
+    }
+private:
+    size_t capacity_;
+    std::unordered_map<K, std::pair<V, typename std::list<K>::iterator> > map_;
+    std::list<K> access_;
+};
+
+template<typename Cache> static uint64_t bench_cache(Cache &cache, const std::vector<size_t> &keys, size_t &hits)
+{
+    auto start = utime::now();
+    hits = 0;
+    for (auto key : keys) {
+        auto *v = cache.find(key);
+	if (v == nullptr) {
+	    cache.insert(key, key);
+	} else {
+	    hits++;
+	}
+    }
+    auto end = utime::now();
+    return (end - start).in_us();
+}
+
+static void test_lru_cache_bench()
+{
+    header("test_lru_cache_bench");
+
+    static const size_t CACHE_SIZE = 65536;
+    static const size_t NUM_OPS = 2000000;
+
+    // Skewed accesses (most hit a hot set) over file offset like keys
+    std::vector<size_t> keys(NUM_OPS);
+    for (size_t i = 0; i < NUM_OPS; i++) {
+        size_t k = random::next_int(10) < 9 ? random::next_int(CACHE_SIZE / 2)
+	                                      : random::next_int(CACHE_SIZE * 4);
+        keys[i] = k * 64;
+    }
+
+    size_t hits1 = 0, hits2 = 0;
+    list_lru_cache<size_t, size_t> cache1(CACHE_SIZE);
+    auto t1 = bench_cache(cache1, keys, hits1);
+    lru_cache<size_t, size_t> cache2(CACHE_SIZE);
+    auto t2 = bench_cache(cache2, keys, hits2);
+
+    std::cout << "list+unordered_map: " << t1 / 1000 << " ms (hits: " << hits1 << ")" << std::endl;
+    std::cout << "clock+open addr:    " << t2 / 1000 << " ms (hits: " << hits2 << ")" << std::endl;
+}
+
 int main(int argc, char *argv[])
 {
+    random::set_for_testing(true);
+
     test_lru_cache_1();
     test_lru_cache_2();    
+    test_lru_cache_3();
+    test_lru_cache_bytes();
+    test_lru_cache_bench();
 
     return 0;
 }
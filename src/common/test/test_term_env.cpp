@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <common/term_env.hpp>
 #include <common/term_ops.hpp>
+#include <common/utime.hpp>
 
 using namespace epilog::common;
 
@@ -325,6 +326,117 @@ static void test_copy_term_heaps()
     assert(src_str == unify_str);
 }
 
+static void test_copy_term_cyclic()
+{
+    header( "test_copy_term_cyclic()" );
+
+    term_env env;
+
+    // X = f(a, X) without occurs check.
+    auto t = env.parse("foo(g(X, Y), f(a, X), Y).");
+    auto f = env.arg(t, 1);
+    uint64_t cost = 0;
+    assert(env.unify(env.arg(f, 1), f, cost));
+
+    term_utils utils(env);
+    uint64_t cost1 = 0, cost2 = 0;
+    auto t1 = env.copy(t, cost1);
+    auto t2 = utils.copy_cyclic(t, env.var_naming(), env.get_heap(),
+				&env.var_naming(), cost2);
+
+    std::cout << "Cost: " << cost1 << " (cyclic " << cost2 << ")" << std::endl;
+    assert(cost1 == cost2);
+
+    for (auto c : {t1, t2}) {
+	auto g = env.arg(c, 0);
+	auto f1 = env.arg(c, 1);
+	assert(env.functor(f1) == env.functor(f));
+	assert(env.arg(f1, 1) == f1);
+	assert(env.arg(g, 0) == f1);
+	assert(env.arg(g, 1) == env.arg(c, 2));
+	assert(env.arg(g, 1).tag() == tag_t::REF);
+    }
+}
+
+static term make_list(term_env &env, size_t n)
+{
+    term lst = heap::EMPTY_LIST;
+    term shared = env.new_term(con_cell("point",2), {env.new_ref(), int_cell(1)});
+    for (size_t i = 0; i < n; i++) {
+	term elem;
+	switch (i % 4) {
+	case 0: elem = int_cell(static_cast<int64_t>(i)); break;
+	case 1: elem = env.new_ref(); break;
+	case 2: elem = shared; break;
+	default: elem = env.new_term(env.functor("element_with_a_long_name",1), {int_cell(static_cast<int64_t>(i))}); break;
+	}
+	lst = env.new_dotted_pair(elem, lst);
+    }
+    return lst;
+}
+
+static term make_tree(term_env &env, size_t depth)
+{
+    if (depth == 0) {
+	return env.new_ref();
+    }
+    auto left = make_tree(env, depth - 1);
+    auto right = make_tree(env, depth - 1);
+    return env.new_term(con_cell("node",3), {left, int_cell(static_cast<int64_t>(depth)), right});
+}
+
+static void test_copy_term_benchmark()
+{
+    header( "test_copy_term_benchmark()" );
+
+    const size_t ROUNDS = 10;
+    const char *names[] = { "List", "Tree" };
+
+    for (size_t k = 0; k < 2; k++) {
+	// Two identical environments, one for each implementation
+	term_env env_cyclic, env_fast;
+	term_utils utils(env_cyclic);
+	auto t = k == 0 ? make_list(env_cyclic, 100000) : make_tree(env_cyclic, 16);
+	auto t2 = k == 0 ? make_list(env_fast, 100000) : make_tree(env_fast, 16);
+	assert(t == t2);
+	auto h = env_cyclic.heap_size();
+
+	// Both produce the very same term (variables are named after
+	// their addresses) at the same cost
+	uint64_t cost_fast = 0, cost_cyclic = 0;
+	auto copy_cyclic = utils.copy_cyclic(t, env_cyclic.var_naming(),
+					     env_cyclic.get_heap(), nullptr,
+					     cost_cyclic);
+	auto copy_fast = env_fast.copy_without_names(t, cost_fast);
+	assert(cost_fast == cost_cyclic);
+	assert(copy_fast == copy_cyclic);
+	assert(env_fast.heap_size() == env_cyclic.heap_size());
+	assert(env_fast.to_string(copy_fast) == env_cyclic.to_string(copy_cyclic));
+	auto cells = env_fast.heap_size() - h;
+
+	auto start0 = utime::now();
+	for (size_t i = 0; i < ROUNDS; i++) {
+	    env_cyclic.trim_heap(h);
+	    utils.copy_cyclic(t, env_cyclic.var_naming(), env_cyclic.get_heap(),
+			      nullptr, cost_cyclic);
+	}
+	auto end0 = utime::now();
+
+	auto start1 = utime::now();
+	for (size_t i = 0; i < ROUNDS; i++) {
+	    env_fast.trim_heap(h);
+	    env_fast.copy_without_names(t, cost_fast);
+	}
+	auto end1 = utime::now();
+
+	auto us0 = (end0 - start0).in_us(), us1 = (end1 - start1).in_us();
+	std::cout << names[k] << ": cost " << cost_fast << ", " << cells
+		  << " cells. Hash maps: " << std::setw(6) << us0 / ROUNDS
+		  << " us  Forwarding table: " << std::setw(6) << us1 / ROUNDS
+		  << " us" << std::endl;
+    }
+}
+
 static void test_list_string()
 {
     header( "test_list_string()" );
@@ -364,6 +476,8 @@ int main( int argc, char *argv[] )
     test_copy_term_bignum();
     test_dfs_iterator();
     test_copy_term_heaps();
+    test_copy_term_cyclic();
+    test_copy_term_benchmark();
     test_list_string();
 
     return 0;
@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <common/term_env.hpp>
 #include <common/term_serializer.hpp>
+#include <common/utime.hpp>
 
 using namespace epilog::common;
 
@@ -178,6 +179,192 @@ static void test_term_serializer_clause()
     assert(str1 == str2);
 }
 
+static std::string round_trip(const std::string &str, bool compress, size_t &size)
+{
+    term_env env;
+    term t = env.parse(str);
+
+    term_serializer ser(env, term_serializer::FORMAT_COMPACT);
+    ser.set_compress(compress);
+    term_serializer::buffer_t buf;
+    ser.write(buf, t);
+    size = buf.size();
+    assert(term_serializer::format_of(buf, buf.size()) == term_serializer::FORMAT_COMPACT);
+
+    term_env env2;
+    term_serializer ser2(env2);
+    term t2 = ser2.read(buf);
+    return env2.to_string(t2);
+}
+
+static void test_term_serializer_compact()
+{
+    header( "test_term_serializer_compact()" );
+
+    std::vector<std::string> terms = {
+	"foo(1, bar(kallekula, [1,2,baz]), Foo, kallekula, world, test4711, Foo, Bar, Bar, Bar, Bar).",
+	"foo(1, bar(58'4atLG7Hb9u2NH7HrRBedKHJ5hQ3z4QQcEWA3b8ACU), baz(16'110022003300440055006600770088009900AA00BB00CC00DD00EE00FF), Var).",
+	"[].",
+	"hello.",
+	"-1152921504606846976.",
+	"[-1,0,1,63,64,-64,-65,100000,1152921504606846975].",
+	"[a,b,c|Tail].",
+	"f(g(X), g(X), g(Y), [g(X),g(X),g(Y)|T], 'a longer atom with spaces').",
+	"setup_numbers(N, M) :- T is N*M, write(generate_numbers), nl, generate_numbers(T, Xs), write(split_numbers), nl, split_numbers(Xs, M, Ys), write('sort chunks'), nl, findall(Y, (member(X, Ys), sort(X, Y)), Cs), write('store numbers'), nl, store_numbers(Cs, 0)."
+    };
+
+    // Long enough to be compressed
+    std::string lst = "[";
+    for (size_t i = 0; i < 200; i++) {
+	if (i > 0) lst += ",";
+	lst += "tx(" + std::to_string(i % 7) + ", coin(" + std::to_string(i) + ", X), [p" + std::to_string(i % 3) + "])";
+    }
+    terms.push_back(lst + "].");
+
+    for (auto &str : terms) {
+	term_env env;
+	auto expect = env.to_string(env.parse(str));
+	for (bool compress : {false, true}) {
+	    size_t size = 0;
+	    auto actual = round_trip(str, compress, size);
+	    if (actual != expect) {
+		std::cout << "ACTUAL: " << actual << "\n";
+		std::cout << "EXPECT: " << expect << "\n";
+		assert(actual == expect);
+	    }
+	}
+    }
+
+    // Variables are still shared and repeated subterms are read back
+    // as one.
+    term_env env;
+    term t = env.parse("f(g(X), g(X), Y, Y).");
+    term_serializer ser(env, term_serializer::FORMAT_COMPACT);
+    term_serializer::buffer_t buf;
+    ser.write(buf, t);
+    term_env env2;
+    term_serializer ser2(env2);
+    term t2 = ser2.read(buf);
+    assert(env2.arg(t2, 0) == env2.arg(t2, 1));
+    uint64_t cost = 0;
+    assert(env2.unify(env2.arg(t2, 2), int_cell(42), cost));
+    assert(env2.to_string(t2) == "f(g(X), g(X), 42, 42)");
+}
+
+static void test_term_serializer_compact_exceptions()
+{
+    header( "test_term_serializer_compact_exceptions()" );
+
+    term_env env;
+    term t = env.parse("foo(bar, [1,2,3], X, X, 16'ff00ff00ff00ff00ff).");
+    term_serializer ser(env, term_serializer::FORMAT_COMPACT);
+    term_serializer::buffer_t buf;
+    ser.write(buf, t);
+
+    // Every truncation must be detected
+    for (size_t n = 0; n < buf.size(); n++) {
+	term_serializer::buffer_t part(buf.begin(), buf.begin() + n);
+	if (n > 0) part[0] = term_serializer::COMPACT_MAGIC;
+	bool thrown = false;
+	try {
+	    term_serializer ser2(env);
+	    static_cast<void>(ser2.read(part));
+	} catch (serializer_exception &ex) {
+	    thrown = true;
+	}
+	assert(n == 0 || thrown);
+    }
+
+    auto expect_exception = [&](term_serializer::buffer_t bytes, const std::string &expect_str) {
+	try {
+	    term_serializer ser2(env);
+	    static_cast<void>(ser2.read(bytes));
+	    assert("No exception as expected" == nullptr);
+	} catch (serializer_exception &ex) {
+	    std::string actual_str = ex.what();
+	    std::cout << "actual: " << actual_str << "; expected: " << expect_str << "\n";
+	    assert(actual_str.find(expect_str) != std::string::npos);
+	}
+    };
+
+    // Unknown functor (K_CON with id 3)
+    expect_exception({term_serializer::COMPACT_MAGIC, 0, (3 << 3) | 1}, "unknown functor");
+    // Back reference to nothing (K_BACKREF 0)
+    expect_exception({term_serializer::COMPACT_MAGIC, 0, 5}, "unknown subterm");
+    // Trailing data after INT 0
+    expect_exception({term_serializer::COMPACT_MAGIC, 0, 0, 0}, "trailing data");
+    // Unknown flags
+    expect_exception({term_serializer::COMPACT_MAGIC, 0x80, 0}, "unknown flags");
+    // Compressed data that expands beyond its stated size
+    expect_exception({term_serializer::COMPACT_MAGIC, 1, 1, 2, 'a', 'b', 0}, "bad literal length");
+}
+
+static term make_payload(term_env &env, const std::string &kind, size_t n)
+{
+    std::string str = "[";
+    for (size_t i = 0; i < n; i++) {
+	if (i > 0) str += ",";
+	if (kind == "ints") {
+	    str += std::to_string(i % 1000);
+	} else if (kind == "functors") {
+	    str += "tx(" + std::to_string(i) + ", coin(" + std::to_string(i % 100) + ", _), [in(a), out(b)])";
+	} else {
+	    str += "(p" + std::to_string(i % 10) + "(X, Y) :- q(X, Z), r(Z, Y), X > " + std::to_string(i) + ")";
+	}
+    }
+    return env.parse(str + "].");
+}
+
+static void test_term_serializer_benchmark()
+{
+    header( "test_term_serializer_benchmark()" );
+
+    const size_t N = 20000;
+    const size_t ROUNDS = 5;
+
+    for (auto kind : {"ints", "functors", "clauses"}) {
+	term_env env;
+	term t = make_payload(env, kind, N);
+	auto expect = env.to_string(t);
+
+	std::cout << "Payload: " << kind << " (" << N << " elements)" << std::endl;
+	for (int mode = 0; mode < 3; mode++) {
+	    term_serializer ser(env, mode == 0 ? term_serializer::FORMAT_VER1
+				               : term_serializer::FORMAT_COMPACT);
+	    ser.set_compress(mode == 2);
+	    term_serializer::buffer_t buf;
+
+	    auto start_w = utime::now();
+	    for (size_t i = 0; i < ROUNDS; i++) {
+		buf.clear();
+		ser.write(buf, t);
+	    }
+	    auto end_w = utime::now();
+
+	    term_env env2;
+	    term_serializer ser2(env2);
+	    term t2;
+	    auto start_r = utime::now();
+	    for (size_t i = 0; i < ROUNDS; i++) {
+		t2 = ser2.read(buf);
+	    }
+	    auto end_r = utime::now();
+	    assert(env2.to_string(t2) == expect);
+
+	    auto per_s = [&](utime dt) {
+		auto us = dt.in_us();
+		return us == 0 ? 0 : N * ROUNDS * 1000000 / us;
+	    };
+	    static const char *names[] = { "ver1", "compact", "compact+lz" };
+	    std::cout << " " << std::setw(10) << names[mode] << ": "
+		      << std::setw(8) << buf.size() << " bytes"
+		      << "  write " << std::setw(8) << per_s(end_w - start_w) << " elements/s"
+		      << "  read " << std::setw(8) << per_s(end_r - start_r) << " elements/s"
+		      << std::endl;
+	}
+    }
+}
+
 
 namespace epilog { namespace common { namespace test {
 
@@ -386,6 +573,9 @@ int main( int argc, char *argv[] )
     test_term_serializer_bignum();
     test_term_serializer_clause();
     test_term_serializer_exceptions();
+    test_term_serializer_compact();
+    test_term_serializer_compact_exceptions();
+    test_term_serializer_benchmark();
 
     return 0;
 }
@@ -358,6 +358,300 @@ static void test_increasing()
     
 }
 
+static void check_same_trie(const triedb &db1, const triedb_branch *br1,
+			    const triedb &db2, const triedb_branch *br2)
+{
+    assert(*br1 == *br2);
+    assert(br1->mask() == br2->mask());
+    assert(br1->depth() == br2->depth());
+    assert(br1->num_entries() == br2->num_entries());
+    for (size_t i = 0; i < triedb_params::MAX_BRANCH; i++) {
+	if (br1->is_branch(i)) {
+	    assert(br2->is_branch(i));
+	    check_same_trie(db1, db1.get_branch(br1, i),
+			    db2, db2.get_branch(br2, i));
+	} else if (br1->is_leaf(i)) {
+	    assert(br2->is_leaf(i));
+	    auto *lf1 = db1.get_leaf(br1, i);
+	    auto *lf2 = db2.get_leaf(br2, i);
+	    assert(lf1->key() == lf2->key());
+	    assert(static_cast<const node_hash &>(*lf1) == *lf2);
+	    assert(static_cast<const custom_data_t &>(*lf1) == *lf2);
+	}
+    }
+}
+
+static void test_batch()
+{
+    header("test_batch");
+
+    const size_t NUM_INITIAL = 5000;
+    const size_t NUM_BATCH = 5000;
+    std::string test_dir2 = test_dir + "_batch";
+
+    triedb::erase_all(test_dir);
+    triedb::erase_all(test_dir2);
+    triedb db1(test_dir);
+    triedb db2(test_dir2);
+
+    auto value_of = [](uint64_t key, size_t version, uint8_t *data) {
+	write_uint64(data, key * 7 + version);
+    };
+
+    // Same initial trie in both
+    std::vector<uint64_t> keys;
+    std::set<uint64_t> used;
+    auto root1 = db1.new_root();
+    auto root2 = db2.new_root();
+    uint8_t data[sizeof(uint64_t)];
+    while (keys.size() < NUM_INITIAL) {
+	uint64_t key = random::next_int(static_cast<uint64_t>(1000000));
+	if (!used.insert(key).second) continue;
+	keys.push_back(key);
+	value_of(key, 0, data);
+	db1.insert(root1, key, data, sizeof(data));
+	db2.insert(root2, key, data, sizeof(data));
+    }
+
+    // New keys (some far away to grow the trie) and updates
+    std::vector<std::pair<uint64_t, bool> > ops;
+    while (ops.size() < NUM_BATCH) {
+	if (random::next_int(4) == 0) {
+	    ops.push_back(std::make_pair(keys[random::next_int(keys.size())], false));
+	} else {
+	    uint64_t key = random::next_int(static_cast<uint64_t>(100000000));
+	    if (!used.insert(key).second) continue;
+	    ops.push_back(std::make_pair(key, true));
+	}
+    }
+
+    root1 = db1.new_root(root1);
+    root2 = db2.new_root(root2);
+
+    std::cout << "Apply " << ops.size() << " changes one by one..." << std::endl;
+    auto start1 = utime::now();
+    auto bytes_start1 = db1.bytes_written();
+    for (size_t i = 0; i < ops.size(); i++) {
+	value_of(ops[i].first, i + 1, data);
+	if (ops[i].second) {
+	    db1.insert(root1, ops[i].first, data, sizeof(data));
+	} else {
+	    db1.update(root1, ops[i].first, data, sizeof(data));
+	}
+    }
+    auto end1 = utime::now();
+    auto bytes1 = db1.bytes_written() - bytes_start1;
+
+    std::cout << "Apply " << ops.size() << " changes as a batch..." << std::endl;
+    auto start2 = utime::now();
+    auto bytes_start2 = db2.bytes_written();
+    db2.begin_batch(root2);
+    for (size_t i = 0; i < ops.size(); i++) {
+	value_of(ops[i].first, i + 1, data);
+	if (ops[i].second) {
+	    db2.insert(root2, ops[i].first, data, sizeof(data));
+	} else {
+	    db2.update(root2, ops[i].first, data, sizeof(data));
+	}
+    }
+    // Pending changes are visible before commit
+    auto *pending = db2.find(root2, ops.back().first);
+    assert(pending != nullptr && memcmp(pending->custom_data(), data, sizeof(data)) == 0);
+    db2.commit_batch(root2);
+    auto end2 = utime::now();
+
+    std::cout << "One by one: " << (end1 - start1).in_ms() << " ms" << std::endl;
+    std::cout << "Batch:      " << (end2 - start2).in_ms() << " ms" << std::endl;
+    std::cout << "Bytes written (one by one): " << bytes1 << std::endl;
+    std::cout << "Bytes written (batch):      " << db2.bytes_written() - bytes_start2 << std::endl;
+
+    assert(db1.num_entries(root1) == db2.num_entries(root2));
+    assert(db1.get_root_hash(root1) == db2.get_root_hash(root2));
+    check_same_trie(db1, db1.get_root_branch(root1),
+		    db2, db2.get_root_branch(root2));
+
+    // Inserting an existing key is detected at commit
+    auto root3 = db2.new_root(root2);
+    db2.begin_batch(root3);
+    db2.insert(root3, keys[0], data, sizeof(data));
+    bool thrown = false;
+    try {
+	db2.commit_batch(root3);
+    } catch (triedb_key_already_exists_exception &) {
+	thrown = true;
+    }
+    assert(thrown);
+    assert(db2.get_root_hash(root3) == db2.get_root_hash(root2));
+
+    // A scoped batch that isn't committed is aborted
+    auto root4 = db2.new_root(root2);
+    thrown = false;
+    try {
+	triedb_batch batch(db2, root4);
+	db2.update(root4, keys[0], data, sizeof(data));
+	throw triedb_exception("Failure while in batch");
+    } catch (triedb_exception &) {
+	thrown = true;
+    }
+    assert(thrown);
+    assert(!db2.in_batch(root4));
+    assert(db2.get_root_hash(root4) == db2.get_root_hash(root2));
+    db2.remove(root4, keys[0]);
+    assert(db2.num_entries(root4) == db2.num_entries(root2) - 1);
+}
+
+static void test_batch_remove()
+{
+    header("test_batch_remove");
+
+    const size_t NUM_KEYS = 5000;
+    std::string test_dir2 = test_dir + "_batch";
+
+    triedb::erase_all(test_dir);
+    triedb::erase_all(test_dir2);
+    triedb db1(test_dir);
+    triedb db2(test_dir2);
+
+    // Runs of adjacent keys end up in the same branches
+    std::set<uint64_t> keys;
+    while (keys.size() < NUM_KEYS) {
+	uint64_t key = random::next_int(static_cast<uint64_t>(1000000));
+	for (size_t i = 0; i < 4; i++) keys.insert(key + i);
+    }
+    std::set<uint64_t> removed;
+    auto max_key = *keys.rbegin();
+    for (auto key : keys) {
+	if (key != max_key && random::next_int(3) == 0) removed.insert(key);
+    }
+
+    // db1 never has the removed keys, db2 removes them in a batch
+    uint8_t data[sizeof(uint64_t)];
+    auto root1 = db1.new_root();
+    auto root2 = db2.new_root();
+    for (auto key : keys) {
+	write_uint64(data, key);
+	if (!removed.count(key)) db1.insert(root1, key, data, sizeof(data));
+	db2.insert(root2, key, data, sizeof(data));
+    }
+    root2 = db2.new_root(root2);
+
+    std::cout << "Remove " << removed.size() << " of " << keys.size() << " keys as a batch..." << std::endl;
+    {
+	triedb_batch batch(db2, root2);
+	for (auto key : removed) {
+	    db2.remove(root2, key);
+	}
+	// Pending removes are visible before commit
+	assert(db2.find(root2, *removed.begin()) == nullptr);
+	// Inserted and removed again in the same batch
+	write_uint64(data, 1);
+	db2.insert(root2, 2000000, data, sizeof(data));
+	db2.remove(root2, 2000000);
+	batch.commit();
+    }
+
+    assert(db1.num_entries(root1) == db2.num_entries(root2));
+    assert(db1.get_root_hash(root1) == db2.get_root_hash(root2));
+    auto it1 = db1.begin(root1), it2 = db2.begin(root2);
+    for (; !it1.at_end(); ++it1, ++it2) {
+	assert(!it2.at_end() && it1->key() == it2->key());
+    }
+    assert(it2.at_end());
+
+    // Removing a key that isn't there is detected at commit
+    auto root3 = db2.new_root(root2);
+    db2.begin_batch(root3);
+    db2.remove(root3, *removed.begin());
+    bool thrown = false;
+    try {
+	db2.commit_batch(root3);
+    } catch (triedb_key_not_found_exception &) {
+	thrown = true;
+    }
+    assert(thrown);
+    assert(db2.get_root_hash(root3) == db2.get_root_hash(root2));
+
+    // The trie shrinks back after removing a key that made it grow
+    static const uint64_t FAR_KEY = static_cast<uint64_t>(1) << 60;
+    auto root4 = db2.new_root(root2);
+    db2.insert(root4, FAR_KEY, data, sizeof(data));
+    assert(db2.get_root_branch(root4)->depth() > db2.get_root_branch(root2)->depth());
+    auto root5 = db2.new_root(root4);
+    {
+	triedb_batch batch(db2, root5);
+	db2.remove(root5, FAR_KEY);
+	batch.commit();
+    }
+    assert(db2.get_root_hash(root5) == db2.get_root_hash(root2));
+    assert(db2.num_entries(root5) == db2.num_entries(root2));
+}
+
+static void test_read_throughput()
+{
+    header("test_read_throughput");
+
+    const size_t NUM_ENTRIES = 20000;
+    const size_t DATA_SIZE = 256;
+    const size_t NUM_ROUNDS = 5;
+
+    std::cout << "Test directory: " << test_dir << std::endl;
+    triedb::erase_all(test_dir);
+
+    auto make_data = [](uint64_t key, uint8_t *data) {
+	for (size_t j = 0; j < DATA_SIZE; j++) {
+	    data[j] = static_cast<uint8_t>((key * 31 + j) & 0xff);
+	}
+    };
+
+    std::vector<uint64_t> keys;
+    root_id root;
+    {
+	triedb_params params;
+	params.set_bucket_size(1024*1024);
+	triedb db(params, test_dir);
+	root = db.new_root();
+	uint8_t data[DATA_SIZE];
+	for (size_t i = 0; i < NUM_ENTRIES; i++) {
+	    uint64_t key = random::next_int(static_cast<uint64_t>(100000000));
+	    make_data(key, data);
+	    try {
+		db.insert(root, key, data, DATA_SIZE);
+		keys.push_back(key);
+	    } catch (triedb_key_already_exists_exception &) {
+	    }
+	}
+	db.flush();
+    }
+
+    // Use small caches so most lookups go to the bucket files
+    uint64_t times[2];
+    for (int mmap = 0; mmap < 2; mmap++) {
+	triedb_params params;
+	params.set_bucket_size(1024*1024);
+	params.set_cache_num_nodes(256);
+	params.set_use_mmap(mmap != 0);
+	triedb db(params, test_dir);
+	uint8_t data[DATA_SIZE];
+	auto start = utime::now();
+	for (size_t round = 0; round < NUM_ROUNDS; round++) {
+	    for (auto key : keys) {
+		auto *leaf = db.find(root, key);
+		assert(leaf != nullptr && leaf->key() == key);
+		assert(leaf->custom_data_size() == DATA_SIZE);
+		make_data(key, data);
+		assert(memcmp(leaf->custom_data(), data, DATA_SIZE) == 0);
+	    }
+	}
+	auto end = utime::now();
+	times[mmap] = (end - start).in_us();
+	std::cout << "Lookups (" << (mmap ? "mmap" : "stream") << "): "
+		  << keys.size() * NUM_ROUNDS << " in "
+		  << times[mmap] / 1000 << " ms ("
+		  << (keys.size() * NUM_ROUNDS * 1000000) / (times[mmap] + 1)
+		  << " lookups/s)" << std::endl;
+    }
+}
+
 int main(int argc, char *argv[])
 {
     home_dir = find_home_dir(argv[0]);
@@ -368,6 +662,9 @@ int main(int argc, char *argv[])
      
     test_basic();
     test_increasing();
+    test_batch();
+    test_batch_remove();
+    test_read_throughput();
 
     return 0;
 }
@@ -327,6 +327,196 @@ static void test_merkle2()
     assert(j == NUM_KEYS);
 
     std::cout << "Num keys in root: " << db2.num_entries(at_root2) << std::endl;
+
+    // The next key after a gap (only keys in the range count)
+    merkle_root mk;
+    mk.set_num_keys(1);
+    db.get(at_root, 16, std::numeric_limits<uint64_t>::max(), true, mk);
+    std::vector<uint64_t> next_keys;
+    mk.get_keys(16, 1, next_keys);
+    std::cout << "Next key after 16: " << (next_keys.empty() ? 0 : next_keys[0]) << std::endl;
+    assert(next_keys.size() == 1 && next_keys[0] == keys[16]);
+}
+
+static void test_merkle_binary()
+{
+    header("test_merkle_binary");
+
+    triedb::erase_all(test_dir);
+    triedb::erase_all(test_dir2);
+
+    const size_t NUM_KEYS = 2000;
+    const size_t DATA_SIZE = 1024;
+
+    triedb db(test_dir);
+    triedb db2(test_dir2);
+
+    auto at_root = db.new_root();
+    uint8_t data[DATA_SIZE];
+    for (size_t i = 0; i < NUM_KEYS; i++) {
+	for (size_t j = 0; j < DATA_SIZE; j++) {
+	    data[j] = static_cast<uint8_t>((i * 7 + j) & 0xff);
+	}
+	db.insert(at_root, i * 3, data, sizeof(data));
+    }
+
+    // Transfer the trie in ranges through the binary form
+    auto at_root2 = db2.new_root();
+    const uint64_t RANGE = 1000;
+    size_t total_bytes = 0, num_leaves = 0;
+    uint64_t t_write = 0, t_read = 0;
+    for (uint64_t from = 0; from < NUM_KEYS * 3; from += RANGE) {
+	uint64_t to = from + RANGE - 1;
+	merkle_root mr;
+	db.get(at_root, from, to, true, mr);
+
+	std::vector<uint8_t> bytes;
+	auto start = utime::now();
+	mr.write(bytes);
+	auto mid = utime::now();
+	merkle_root mr2;
+	bool ok = mr2.read(&bytes[0], bytes.size());
+	auto end = utime::now();
+	assert(ok);
+	t_write += (mid - start).in_us();
+	t_read += (end - mid).in_us();
+	total_bytes += bytes.size();
+
+	assert(mr2.equal_hash(mr));
+	assert(mr2.validate(&db, from, to));
+	assert(mr2.num_leaves(from, to) == mr.num_leaves(from, to));
+	num_leaves += mr2.num_leaves(from, to);
+
+	// Same bytes when written again
+	std::vector<uint8_t> bytes2;
+	mr2.write(bytes2);
+	assert(bytes == bytes2);
+
+	// Truncated or altered data is rejected
+	merkle_root mr3, mr4;
+	assert(!mr3.read(&bytes[0], bytes.size() - 1));
+	bytes[bytes.size() / 2] ^= 1;
+	assert(!mr4.read(&bytes[0], bytes.size()) || !mr4.validate(&db, from, to));
+
+	db2.update(at_root2, mr2);
+    }
+
+    assert(num_leaves == NUM_KEYS);
+    assert(db2.num_entries(at_root2) == NUM_KEYS);
+    assert(db2.get_root_hash(at_root2) == db.get_root_hash(at_root));
+
+    std::cout << "Leaves: " << num_leaves << " in " << total_bytes << " bytes" << std::endl;
+    std::cout << "Write:  " << t_write << " us" << std::endl;
+    std::cout << "Read:   " << t_read << " us" << std::endl;
+}
+
+static void test_delta_leaves()
+{
+    header("test_delta_leaves");
+
+    // Simulate heap blocks of 64k where only a few cells (8 bytes)
+    // are changed per commit.
+    const size_t NUM_BLOCKS = 16;
+    const size_t NUM_COMMITS = 64;
+    const size_t BLOCK_SIZE = 65536;
+    const size_t CHUNK_SIZE = 512;
+
+    std::vector<std::vector<uint8_t> > blocks(NUM_BLOCKS);
+    for (size_t i = 0; i < NUM_BLOCKS; i++) {
+	blocks[i].resize(BLOCK_SIZE);
+	for (size_t j = 0; j < BLOCK_SIZE; j++) {
+	    blocks[i][j] = static_cast<uint8_t>((i + j) & 0xff);
+	}
+    }
+
+    triedb::erase_all(test_dir);
+    triedb::erase_all(test_dir2);
+
+    triedb_params delta_params;
+    delta_params.set_use_delta_leaves(true);
+
+    std::vector<root_id> roots;
+    uint64_t full_bytes = 0, delta_bytes = 0;
+
+    {
+	triedb db_full(test_dir);
+	triedb db_delta(delta_params, test_dir2);
+
+	auto root_full = db_full.new_root();
+	auto root_delta = db_delta.new_root();
+	for (size_t i = 0; i < NUM_BLOCKS; i++) {
+	    db_full.insert(root_full, i, &blocks[i][0], BLOCK_SIZE);
+	    db_delta.insert(root_delta, i, &blocks[i][0], BLOCK_SIZE);
+	}
+	roots.push_back(root_delta);
+
+	auto full_start = db_full.bytes_written();
+	auto delta_start = db_delta.bytes_written();
+	for (size_t c = 0; c < NUM_COMMITS; c++) {
+	    root_full = db_full.new_root(root_full);
+	    root_delta = db_delta.new_root(root_delta);
+	    for (size_t k = 0; k < 4; k++) {
+		size_t i = random::next_int(NUM_BLOCKS);
+		leaf_ranges changed;
+		for (size_t n = 0; n < 3; n++) {
+		    size_t cell = random::next_int(BLOCK_SIZE / 8);
+		    blocks[i][cell*8] ^= static_cast<uint8_t>(c + 1);
+		    size_t chunk = (cell*8) / CHUNK_SIZE;
+		    changed.push_back(std::make_pair(chunk*CHUNK_SIZE, CHUNK_SIZE));
+		}
+		db_full.update(root_full, i, &blocks[i][0], BLOCK_SIZE);
+		// Odd commits let the database find the changes itself
+		if (c % 2 == 0) {
+		    db_delta.update(root_delta, i, &blocks[i][0], BLOCK_SIZE,
+				    changed);
+		} else {
+		    db_delta.update(root_delta, i, &blocks[i][0], BLOCK_SIZE);
+		}
+	    }
+	    // Deltas are a storage detail; the merkle trie must be identical
+	    assert(db_full.get_root_hash(root_full) ==
+		   db_delta.get_root_hash(root_delta));
+	    roots.push_back(root_delta);
+	}
+	full_bytes = db_full.bytes_written() - full_start;
+	delta_bytes = db_delta.bytes_written() - delta_start;
+
+	// A change that isn't in the ranges must still end up in the leaf
+	root_full = db_full.new_root(root_full);
+	root_delta = db_delta.new_root(root_delta);
+	blocks[0][0] ^= 0xff;
+	blocks[0][BLOCK_SIZE / 2] ^= 0xff;
+	leaf_ranges missed;
+	missed.push_back(std::make_pair(BLOCK_SIZE / 2, CHUNK_SIZE));
+	db_full.update(root_full, 0, &blocks[0][0], BLOCK_SIZE);
+	db_delta.update(root_delta, 0, &blocks[0][0], BLOCK_SIZE, missed);
+	assert(db_full.get_root_hash(root_full) ==
+	       db_delta.get_root_hash(root_delta));
+	roots.push_back(root_delta);
+
+	db_full.flush();
+	db_delta.flush();
+    }
+
+    std::cout << "Bytes written per commit (full):  "
+	      << full_bytes / NUM_COMMITS << std::endl;
+    std::cout << "Bytes written per commit (delta): "
+	      << delta_bytes / NUM_COMMITS << std::endl;
+    assert(delta_bytes * 4 < full_bytes);
+
+    // Reopen (with empty caches) and check that the last root
+    // reconstructs the same data (both with streams and mmap.)
+    for (int mmap = 0; mmap < 2; mmap++) {
+	delta_params.set_use_mmap(mmap != 0);
+	triedb db_delta(delta_params, test_dir2);
+	for (size_t i = 0; i < NUM_BLOCKS; i++) {
+	    auto *leaf = db_delta.find(roots.back(), i);
+	    assert(leaf != nullptr);
+	    assert(leaf->custom_data_size() == BLOCK_SIZE);
+	    assert(memcmp(leaf->custom_data(), &blocks[i][0], BLOCK_SIZE) == 0);
+	}
+    }
+    std::cout << "Reopened delta database: Ok" << std::endl;
 }
 
 int main(int argc, char *argv[])
@@ -342,6 +532,8 @@ int main(int argc, char *argv[])
     test_basic();
     test_merkle();
     test_merkle2();    
+    test_merkle_binary();
+    test_delta_leaves();
 
     return 0;
 }
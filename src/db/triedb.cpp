@@ -81,15 +81,27 @@ static void triedb_version_check(fstream *f, const std::string &file_path) {
 //
 
 void triedb_leaf::read(const uint8_t *buffer) {
+    size_t sz = 0;
+    const uint8_t *p = read_header(buffer, sz);
+    assert(!is_delta(buffer));
+
+    // Remaining is custom data
+    auto custom_data_sz = sz - (p - buffer);
+    assert((static_cast<size_t>(p - buffer) + custom_data_sz) < MAX_SIZE_IN_BYTES);
+    set_custom_data(p, custom_data_sz);
+    delta_depth_ = 0;
+}
+
+const uint8_t * triedb_leaf::read_header(const uint8_t *buffer, size_t &sz) {
     const uint8_t *p = buffer;
 
     // First read total size
     assert(((p - buffer) + sizeof(uint32_t)) < MAX_SIZE_IN_BYTES);
-    size_t sz = read_uint32(p); p += sizeof(uint32_t);
+    sz = read_uint32(p); p += sizeof(uint32_t);
 
     // Read hash size (1 byte)
     assert(((p - buffer) + sizeof(uint8_t)) < MAX_SIZE_IN_BYTES);	
-    auto hash_size = *p; p++;
+    auto hash_size = *p & ~triedb_leaf::DELTA_FLAG; p++;
 
     // Read key
     assert(((p - buffer) + sizeof(uint64_t)) < MAX_SIZE_IN_BYTES);	
@@ -100,10 +112,7 @@ void triedb_leaf::read(const uint8_t *buffer) {
     set_hash(p, hash_size);
     p += hash_size;
 
-    // Remaining is custom data
-    auto custom_data_sz = sz - (p - buffer);
-    assert((static_cast<size_t>(p - buffer) + custom_data_sz) < MAX_SIZE_IN_BYTES);
-    set_custom_data(p, custom_data_sz);
+    return p;
 }
 
 void triedb_leaf::write(uint8_t *buffer) const {
@@ -234,22 +243,43 @@ void triedb_branch::write(uint8_t *buffer) const
 // triedb
 //
 
+// Branch hash = H(depth | mask | child hashes in index order)
+void triedb::branch_hash_input(const triedb_branch *branch,
+			       std::vector<uint8_t> &in) const {
+    uint32_t m = branch->mask();
+    in.resize(1 + sizeof(uint32_t));
+    in[0] = branch->depth();
+    write_uint32(&in[1], m);
+    while (m != 0) {
+	size_t i = common::lsb(m);
+	m &= (static_cast<uint32_t>(-1) << i) << 1;
+	if (branch->is_branch(i)) {
+	    auto *sub_branch = get_branch(branch, i);
+	    in.insert(in.end(), sub_branch->hash(),
+		      sub_branch->hash() + sub_branch->hash_size());
+	} else if (branch->is_leaf(i)) {
+	    auto *sub_leaf = get_leaf(branch, i);
+	    in.insert(in.end(), sub_leaf->hash(),
+		      sub_leaf->hash() + sub_leaf->hash_size());
+	}
+    }
+}
+
 void triedb::branch_hasher(triedb_branch *branch) {
     if (!use_hashing()) {
 	branch->set_hash(nullptr, 0);
 	return;
     }
+    // Same as hashing branch_hash_input(), but without building it
     uint8_t final_hash[32];
 
     blake2b_state s;
     blake2b_init(&s, sizeof(final_hash));
-    uint8_t depth_buffer[1];
-    depth_buffer[0] = branch->depth();
-    blake2b_update(&s, depth_buffer, sizeof(depth_buffer));
+    uint8_t header[1 + sizeof(uint32_t)];
     uint32_t m = branch->mask();
-    uint8_t mask_buffer[sizeof(uint32_t)];
-    write_uint32(mask_buffer, m);
-    blake2b_update(&s, mask_buffer, sizeof(mask_buffer));
+    header[0] = branch->depth();
+    write_uint32(&header[1], m);
+    blake2b_update(&s, header, sizeof(header));
     while (m != 0) {
 	size_t i = common::lsb(m);
 	m &= (static_cast<uint32_t>(-1) << i) << 1;
@@ -265,7 +295,17 @@ void triedb::branch_hasher(triedb_branch *branch) {
     branch->set_hash(final_hash, sizeof(final_hash));
 }
 
+// Leaf hash = H(key | custom data)
+void triedb::leaf_hash_input(const triedb_leaf *leaf, std::vector<uint8_t> &in) {
+    in.resize(sizeof(uint64_t) + leaf->custom_data_size());
+    write_uint64(&in[0], leaf->key());
+    if (leaf->custom_data_size() > 0) {
+	memcpy(&in[sizeof(uint64_t)], leaf->custom_data(), leaf->custom_data_size());
+    }
+}
+
 void triedb::leaf_hasher(triedb_leaf *leaf) {
+    // Same as hashing leaf_hash_input(), but without the copy
     uint8_t final_hash[32];
 
     blake2b_state s;
@@ -273,7 +313,6 @@ void triedb::leaf_hasher(triedb_leaf *leaf) {
 
     uint8_t key_serialized[sizeof(uint64_t)];
     write_uint64(key_serialized, leaf->key());
-
     blake2b_update(&s, key_serialized, sizeof(uint64_t));
 
     if (leaf->custom_data_size() > 0) {
@@ -282,6 +321,33 @@ void triedb::leaf_hasher(triedb_leaf *leaf) {
     blake2b_final(&s, &final_hash[0], sizeof(final_hash));
     leaf->set_hash(final_hash, sizeof(final_hash));
 }
+
+void triedb::hash_many(const std::vector<node_hash *> &nodes,
+		       const std::vector<std::vector<uint8_t> > &inputs) {
+    static const size_t HASH_SIZE = 32;
+    size_t n = nodes.size();
+    if (n == 0) {
+	return;
+    }
+    std::vector<uint8_t> hashes(n * HASH_SIZE);
+    std::vector<void *> out(n);
+    std::vector<const void *> in(n);
+    std::vector<size_t> inlen(n);
+    for (size_t i = 0; i < n; i++) {
+	out[i] = &hashes[i * HASH_SIZE];
+	in[i] = &inputs[i][0];
+	inlen[i] = inputs[i].size();
+    }
+    blake2b_many(&out[0], HASH_SIZE, &in[0], &inlen[0], n);
+    for (size_t i = 0; i < n; i++) {
+	nodes[i]->set_hash(&hashes[i * HASH_SIZE], HASH_SIZE);
+    }
+}
+
+bool triedb::has_default_leaf_hasher() const {
+    auto *fn = leaf_hasher_fn_.target<void (*)(triedb_leaf *)>();
+    return fn != nullptr && *fn == &triedb::leaf_hasher;
+}
     
 triedb::triedb(const std::string &dir_path) : triedb(triedb_params(), dir_path) {
 }
@@ -291,11 +357,16 @@ triedb::triedb(const triedb_params &params, const std::string &dir_path)
     dir_path_(dir_path),
     stream_flusher_(),
     stream_cache_(triedb_params::cache_num_streams(), stream_flusher_),
+    mapped_flusher_(),
+    mapped_cache_(triedb_params::cache_num_streams(), mapped_flusher_),
     leaf_flusher_(),
     leaf_cache_(triedb_params::cache_num_nodes(), leaf_flusher_),
     branch_flusher_(),
     branch_cache_(triedb_params::cache_num_nodes(), branch_flusher_),
     roots_stream_(nullptr),
+    bytes_written_(0),
+    buffer_writes_(false),
+    write_buffer_offset_(0),
     cache_shutdown_(false)
 {
     read_roots();
@@ -315,7 +386,10 @@ void triedb::erase_all()
 {
     branch_cache_.clear();
     leaf_cache_.clear();
+    mapped_cache_.clear();
     stream_cache_.clear();
+    batches_.clear();
+    write_buffer_.clear();
     roots_stream_->close();
     delete roots_stream_;
     roots_stream_ = nullptr;
@@ -416,14 +490,40 @@ bool triedb::has_root(const root_id &id) const {
 }
 
 void triedb::insert(const root_id &at_root, uint64_t key, const uint8_t *data, size_t data_size) {
-    return insert_or_update(at_root, key, data, data_size, true);
+    return insert_or_update(at_root, key, data, data_size, true, nullptr);
 }
 
 void triedb::update(const root_id &at_root, uint64_t key, const uint8_t *data, size_t data_size) {
-    return insert_or_update(at_root, key, data, data_size, false);
+    return insert_or_update(at_root, key, data, data_size, false, nullptr);
+}
+
+void triedb::update(const root_id &at_root, uint64_t key, const uint8_t *data, size_t data_size, const leaf_ranges &changed) {
+    return insert_or_update(at_root, key, data, data_size, false, &changed);
 }
 
-void triedb::insert_or_update(const root_id &at_root, uint64_t key, const uint8_t *data, size_t data_size, bool do_insert)
+void triedb::insert_or_update(const root_id &at_root, uint64_t key, const uint8_t *data, size_t data_size, bool do_insert, const leaf_ranges *changed)
+{
+    if (!batches_.empty()) {
+	auto b = batches_.find(at_root);
+	if (b != batches_.end()) {
+	    add_to_batch(b->second, key, data, data_size, do_insert, changed);
+	    return;
+	}
+    }
+
+    const triedb_branch *current_root = nullptr;
+    std::tie(current_root, std::ignore) = grow_root(at_root, key);
+    const triedb_branch *new_branch = nullptr;
+    uint64_t new_branch_ptr = 0;
+
+    bool new_entry = false;
+    std::tie(new_branch, new_branch_ptr)
+       = update_part(current_root, key, data, data_size, do_insert, changed, new_entry);
+    if (new_entry) increment_num_entries(at_root);
+    set_root(at_root, new_branch_ptr);
+}
+
+std::pair<const triedb_branch *, uint64_t> triedb::grow_root(const root_id &at_root, uint64_t key)
 {
     auto some_root = roots_.find(at_root);
     if (some_root == roots_.end()) {
@@ -439,8 +539,6 @@ void triedb::insert_or_update(const root_id &at_root, uint64_t key, const uint8_
     }
     uint64_t current_root_ptr = some_root->second.ptr();
     const triedb_branch *current_root = get_branch(current_root_ptr);
-    const triedb_branch *new_branch = nullptr;
-    uint64_t new_branch_ptr = 0;
     size_t current_depth = current_root->depth();
     size_t current_key_bits = current_depth * triedb_params::MAX_BRANCH_BITS;
     size_t key_bits = triedb_branch::compute_max_key_bits(key);
@@ -456,19 +554,404 @@ void triedb::insert_or_update(const root_id &at_root, uint64_t key, const uint8_
 	current_root = new_root;
 	current_root_ptr = new_root_ptr;
     }
+    return std::make_pair(current_root, current_root_ptr);
+}
 
-    bool new_entry = false;
-    std::tie(new_branch, new_branch_ptr)
-       = update_part(current_root, key, data, data_size, do_insert, new_entry);
-    if (new_entry) increment_num_entries(at_root);
+void triedb::begin_batch(const root_id &at_root)
+{
+    assert(!in_batch(at_root));
+    batches_[at_root];
+}
+
+void triedb::abort_batch(const root_id &at_root)
+{
+    batches_.erase(at_root);
+}
+
+void triedb::add_to_batch(batch &b, uint64_t key,
+			  const uint8_t *data, size_t data_size,
+			  bool do_insert, const leaf_ranges *changed)
+{
+    auto found = b.find(key);
+    if (found == b.end()) {
+	auto &op = b[key];
+	op.leaf.reset(new triedb_leaf(key, data, data_size));
+	op.do_insert = do_insert;
+	op.must_exist = false;
+	op.has_changed = changed != nullptr;
+	if (changed != nullptr) op.changed = *changed;
+	return;
+    }
+    if (found->second.leaf == nullptr) {
+	// Removed earlier in the batch
+	auto &op = found->second;
+	op.leaf.reset(new triedb_leaf(key, data, data_size));
+	op.do_insert = false;
+	op.has_changed = false;
+	op.changed.clear();
+	return;
+    }
+    if (do_insert) {
+	throw triedb_key_already_exists_exception(
+		    "There's already a key '"
+		    + boost::lexical_cast<std::string>(key)
+		    + "' in the database.");
+    }
+    // Update of a pending insert/update. The changed ranges are
+    // relative to the version in the database, so accumulate them.
+    auto &op = found->second;
+    op.leaf.reset(new triedb_leaf(key, data, data_size));
+    if (op.has_changed && changed != nullptr) {
+	op.changed.insert(op.changed.end(), changed->begin(), changed->end());
+    } else {
+	op.has_changed = false;
+	op.changed.clear();
+    }
+}
+
+void triedb::remove_in_batch(batch &b, uint64_t key)
+{
+    auto found = b.find(key);
+    if (found == b.end()) {
+	auto &op = b[key];
+	op.do_insert = false;
+	op.must_exist = true;
+	op.has_changed = false;
+	return;
+    }
+    // A pending insert or update. The key need not be in the
+    // database (but it's there after an update.)
+    auto &op = found->second;
+    if (op.leaf == nullptr) {
+	throw triedb_key_not_found_exception(
+	    "Key '" + boost::lexical_cast<std::string>(key) + "' was already removed");
+    }
+    op.leaf.reset();
+    op.do_insert = false;
+    op.has_changed = false;
+    op.changed.clear();
+}
+
+static void batch_key_not_found(uint64_t key)
+{
+    throw triedb_key_not_found_exception(
+	"Key '" + boost::lexical_cast<std::string>(key) + "' not found");
+}
+
+void triedb::commit_batch(const root_id &at_root)
+{
+    auto found = batches_.find(at_root);
+    assert(found != batches_.end());
+    batch ops;
+    std::swap(ops, found->second);
+    batches_.erase(found);
+    if (ops.empty()) {
+	return;
+    }
+
+    // Only inserted and updated keys grow the trie. Removed keys that
+    // are beyond it can't be there.
+    uint64_t max_key = 0;
+    bool any_leaf = false;
+    for (auto &op : ops) {
+	if (op.second.leaf != nullptr) {
+	    max_key = op.first;
+	    any_leaf = true;
+	}
+    }
+    const triedb_branch *current_root = nullptr;
+    if (any_leaf) {
+	std::tie(current_root, std::ignore) = grow_root(at_root, max_key);
+    } else {
+	current_root = get_root_branch(at_root);
+    }
+    size_t root_key_bits = current_root->depth() * MAX_BRANCH_BITS;
+    for (auto it = ops.begin(); it != ops.end();) {
+	if (it->second.leaf == nullptr &&
+	    triedb_branch::compute_max_key_bits(it->first) > root_key_bits) {
+	    if (it->second.must_exist) {
+		batch_key_not_found(it->first);
+	    }
+	    it = ops.erase(it);
+	} else {
+	    ++it;
+	}
+    }
+    if (ops.empty()) {
+	return;
+    }
+
+    hash_batch_leaves(ops);
+
+    uint64_t new_branch_ptr = 0;
+    size_t new_entries = 0, removed_entries = 0;
+    batch_branches pending(current_root->depth() + 1);
+    triedb_branch *new_root = nullptr;
+    buffer_writes_ = true;
+    try {
+	new_root = update_batch(current_root, ops.begin(), ops.end(),
+				false, new_entries, removed_entries,
+				pending);
+	if (removed_entries > 0) {
+	    new_root = shrink_batch_root(new_root, pending, new_branch_ptr);
+	}
+	if (new_root != nullptr) {
+	    pending[new_root->depth()].push_back(batch_branch{new_root, nullptr, 0});
+	}
+    } catch (...) {
+	for (auto &level : pending) {
+	    for (auto &b : level) delete b.branch;
+	}
+	buffer_writes_ = false;
+	flush_write_buffer();
+	throw;
+    }
+    if (new_root != nullptr) {
+	new_branch_ptr = append_batch_branches(pending);
+    }
+    buffer_writes_ = false;
+    flush_write_buffer();
+
+    set_num_entries(at_root, num_entries(at_root) + new_entries - removed_entries);
     set_root(at_root, new_branch_ptr);
 }
+
+//
+// grow_root() puts the old root as the first sub branch of the new
+// one. Undo that if removes left nothing else, so that the root depth
+// is the same as if the removed keys had never been inserted. Returns
+// nullptr if the root is then an existing branch (at 'ptr'.)
+//
+triedb_branch * triedb::shrink_batch_root(triedb_branch *root,
+					  batch_branches &pending,
+					  uint64_t &ptr)
+{
+    while (root->depth() > 1 && root->mask() == 1 && root->is_branch(0)) {
+	auto &level = pending[root->depth() - 1];
+	auto sub = std::find_if(level.begin(), level.end(),
+			[&](const batch_branch &b) { return b.parent == root; });
+	if (sub == level.end()) {
+	    // Unchanged by the batch
+	    ptr = root->get_child_pointer(0);
+	    delete root;
+	    auto *br = get_branch(ptr);
+	    while (br->depth() > 1 && br->mask() == 1 && br->is_branch(0)) {
+		ptr = br->get_child_pointer(0);
+		br = get_branch(ptr);
+	    }
+	    return nullptr;
+	}
+	auto *next = sub->branch;
+	level.erase(sub);
+	delete root;
+	root = next;
+    }
+    return root;
+}
+
+// The new leaves don't depend on each other (or on the trie) so
+// they can all be hashed at once.
+void triedb::hash_batch_leaves(batch &ops)
+{
+    if (!use_hashing() || !has_default_leaf_hasher()) {
+	return;
+    }
+    std::vector<node_hash *> nodes;
+    std::vector<std::vector<uint8_t> > inputs(ops.size());
+    size_t i = 0;
+    for (auto &op : ops) {
+	if (op.second.leaf == nullptr) {
+	    continue;
+	}
+	leaf_hash_input(op.second.leaf.get(), inputs[i++]);
+	nodes.push_back(op.second.leaf.get());
+    }
+    inputs.resize(i);
+    hash_many(nodes, inputs);
+}
+
+uint64_t triedb::append_batch_leaf(batch_op &op, uint64_t base_offset,
+				   const triedb_leaf *base)
+{
+    auto *new_leaf = op.leaf.release();
+    if (use_hashing()) {
+	if (new_leaf->hash_size() == 0) {
+	    leaf_hasher_fn_(new_leaf);
+	}
+    } else {
+	new_leaf->set_hash(nullptr, 0);
+    }
+    auto leaf_ptr = (base != nullptr && use_delta_leaves()) ?
+	append_leaf_node(*new_leaf, base_offset, *base,
+			 op.has_changed ? &op.changed : nullptr)
+      : append_leaf_node(*new_leaf);
+    leaf_cache_.insert(leaf_ptr, new_leaf);
+    return leaf_ptr;
+}
+
+//
+// Apply the (sorted) batch operations [first, last) to 'node'. All
+// keys belong to the subtree of node. The shape of the result (and
+// the number of entries of each branch) mirrors what update_part()
+// would produce if the operations were applied one at a time.
+//
+// 'new_branch' is true if 'node' is created by this batch at an
+// empty position. A branch created by pushing down a leaf never
+// counts that leaf, so neither do we count the first of the
+// entries here.
+//
+// A sub branch that removes leave with a single leaf is replaced by
+// that leaf, and an empty one is dropped (see begin_batch.)
+//
+// The returned branch is neither hashed nor appended; the new sub
+// branches are added to 'pending' (see append_batch_branches.)
+//
+triedb_branch * triedb::update_batch(const triedb_branch *node,
+				     batch::iterator first,
+				     batch::iterator last,
+				     bool new_branch,
+				     size_t &new_entries,
+				     size_t &removed_entries,
+				     batch_branches &pending)
+{
+    size_t depth = node->depth();
+    size_t shift = (depth-1) * MAX_BRANCH_BITS;
+    // (Freed if a duplicate insert is detected below)
+    std::unique_ptr<triedb_branch> result(new triedb_branch(*node));
+    size_t added = 0, removed = 0;
+    auto add_pending = [&](triedb_branch *sub, size_t sub_index) {
+	if (sub->mask() == 0) {
+	    delete sub;
+	    if (!result->is_empty(sub_index)) result->set_empty(sub_index);
+	    return;
+	}
+	auto only = common::lsb(sub->mask());
+	if (sub->num_children() == 1 && sub->is_leaf(only)) {
+	    auto leaf_ptr = sub->get_child_pointer(only);
+	    delete sub;
+	    result->set_child_pointer(sub_index, leaf_ptr);
+	    result->set_leaf(sub_index);
+	    return;
+	}
+	// The pointer is set when the sub branch is appended
+	result->set_child_pointer(sub_index, 0);
+	result->set_branch(sub_index);
+	pending[sub->depth()].push_back(batch_branch{sub, result.get(), sub_index});
+    };
+
+    auto it = first;
+    while (it != last) {
+	size_t sub_index = (it->first >> shift) & (MAX_BRANCH-1);
+	auto group_end = it;
+	size_t num_set = 0;
+	while (group_end != last &&
+	       ((group_end->first >> shift) & (MAX_BRANCH-1)) == sub_index) {
+	    if (group_end->second.leaf != nullptr) num_set++;
+	    ++group_end;
+	}
+	bool single = std::next(it) == group_end;
+
+	if (node->is_empty(sub_index)) {
+	    // Nothing to remove here
+	    auto set_op = group_end;
+	    for (auto op = it; op != group_end; ++op) {
+		if (op->second.leaf != nullptr) {
+		    set_op = op;
+		} else if (op->second.must_exist) {
+		    batch_key_not_found(op->first);
+		}
+	    }
+	    if (num_set == 1) {
+		auto leaf_ptr = append_batch_leaf(set_op->second, 0, nullptr);
+		result->set_child_pointer(sub_index, leaf_ptr);
+		result->set_leaf(sub_index);
+		added++;
+	    } else if (num_set > 1) {
+		triedb_branch tmp_branch;
+		tmp_branch.set_depth(depth - 1);
+		add_pending(update_batch(&tmp_branch, it, group_end, true, added, removed, pending), sub_index);
+	    }
+	} else if (node->is_leaf(sub_index)) {
+	    auto *leaf = get_leaf(node, sub_index);
+	    if (single && it->first == leaf->key()) {
+		if (it->second.leaf == nullptr) {
+		    result->set_empty(sub_index);
+		    removed++;
+		} else {
+		    if (it->second.do_insert) {
+			throw triedb_key_already_exists_exception(
+			    "There's already a key '"
+			    + boost::lexical_cast<std::string>(it->first)
+			    + "' in the database.");
+		    }
+		    auto leaf_ptr = append_batch_leaf(it->second,
+				      node->get_child_pointer(sub_index), leaf);
+		    result->set_child_pointer(sub_index, leaf_ptr);
+		    result->set_leaf(sub_index);
+		}
+	    } else {
+		// Push down the current leaf one level
+		size_t sub_depth = depth - 1;
+		size_t sub_sub_index = (leaf->key() >> ((sub_depth-1) * MAX_BRANCH_BITS)) & (MAX_BRANCH-1);
+		triedb_branch tmp_branch;
+		tmp_branch.set_depth(sub_depth);
+		tmp_branch.set_child_pointer(sub_sub_index, node->get_child_pointer(sub_index));
+		tmp_branch.set_leaf(sub_sub_index);
+		add_pending(update_batch(&tmp_branch, it, group_end, false, added, removed, pending), sub_index);
+	    }
+	} else {
+	    auto *child = get_branch(node, sub_index);
+	    add_pending(update_batch(child, it, group_end, false, added, removed, pending), sub_index);
+	}
+	it = group_end;
+    }
+
+    auto n = result->num_entries() + (new_branch ? added - 1 : added);
+    result->set_num_entries(n > removed ? n - removed : 0);
+    new_entries += added;
+    removed_entries += removed;
+    return result.release();
+}
+
+//
+// Hash and append the pending branches of a batch, lowest depth
+// first. All branches at the same depth only depend on nodes below
+// them, so they're hashed at once. Once appended, the pointer is set
+// in the parent (which is at the next level.) The root comes last.
+//
+uint64_t triedb::append_batch_branches(batch_branches &pending)
+{
+    uint64_t ptr = 0;
+    std::vector<node_hash *> nodes;
+    std::vector<std::vector<uint8_t> > inputs;
+    for (auto &level : pending) {
+	if (use_hashing()) {
+	    nodes.clear();
+	    inputs.resize(level.size());
+	    for (size_t i = 0; i < level.size(); i++) {
+		branch_hash_input(level[i].branch, inputs[i]);
+		nodes.push_back(level[i].branch);
+	    }
+	    hash_many(nodes, inputs);
+	} else {
+	    for (auto &b : level) b.branch->set_hash(nullptr, 0);
+	}
+	for (auto &b : level) {
+	    ptr = append_branch_node(b.branch);
+	    if (b.parent != nullptr) {
+		b.parent->set_child_pointer(b.sub_index, ptr);
+	    }
+	}
+    }
+    return ptr;
+}
     
 std::pair<const triedb_branch *, uint64_t> triedb::update_part(const triedb_branch *node,
 							 uint64_t key,
 							 const uint8_t *data,
 							 size_t data_size,
 							 bool do_insert,
+							 const leaf_ranges *changed,
 							 bool &new_entry)
 {
     size_t depth = node->depth();
@@ -509,7 +992,11 @@ std::pair<const triedb_branch *, uint64_t> triedb::update_part(const triedb_bran
 	    } else {
 		new_leaf->set_hash(nullptr, 0);
 	    }
-	    auto leaf_ptr = append_leaf_node(*new_leaf);
+	    auto leaf_ptr = use_delta_leaves() ?
+		append_leaf_node(*new_leaf,
+				 node->get_child_pointer(sub_index),
+				 *leaf, changed)
+	      : append_leaf_node(*new_leaf);
 	    leaf_cache_.insert(leaf_ptr, new_leaf);
 	    auto *new_branch = new triedb_branch(*node);
 	    new_branch->set_child_pointer(sub_index, leaf_ptr);
@@ -531,7 +1018,7 @@ std::pair<const triedb_branch *, uint64_t> triedb::update_part(const triedb_bran
 	    const triedb_branch *new_child = nullptr;
             uint64_t new_child_ptr = 0;
 	    bool before_new_entry = new_entry;
-            std::tie(new_child, new_child_ptr) = update_part(&tmp_branch, key, data, data_size, do_insert, new_entry);
+            std::tie(new_child, new_child_ptr) = update_part(&tmp_branch, key, data, data_size, do_insert, changed, new_entry);
             auto *new_branch = new triedb_branch(*node);
             new_branch->set_child_pointer(sub_index, new_child_ptr);
             new_branch->set_branch(sub_index);
@@ -546,7 +1033,7 @@ std::pair<const triedb_branch *, uint64_t> triedb::update_part(const triedb_bran
     const triedb_branch *new_child = nullptr;
     uint64_t new_child_ptr = 0;
     bool before_new_entry = new_entry;
-    std::tie(new_child, new_child_ptr) = update_part(child, key, data, data_size, do_insert, new_entry);
+    std::tie(new_child, new_child_ptr) = update_part(child, key, data, data_size, do_insert, changed, new_entry);
     auto *new_branch = new triedb_branch(*node);
     new_branch->set_child_pointer(sub_index, new_child_ptr);
     if (before_new_entry != new_entry) {
@@ -558,6 +1045,13 @@ std::pair<const triedb_branch *, uint64_t> triedb::update_part(const triedb_bran
 }
 
 void triedb::remove(const root_id &at_root, uint64_t key) {
+    if (!batches_.empty()) {
+	auto b = batches_.find(at_root);
+	if (b != batches_.end()) {
+	    remove_in_batch(b->second, key);
+	    return;
+	}
+    }
     auto found_root = roots_.find(at_root);
     if (found_root == roots_.end()) {
 	std::stringstream msg;
@@ -734,7 +1228,6 @@ bool triedb::get(const triedb_branch *br, uint64_t from_key, uint64_t to_key,
 		sub_merkle, sub_offset, sub_step,
 		current_size, limit_size, num_keys, limit_num_keys);
 	    current_size += sub_merkle->size();
-	    num_keys++;
 	} else {
 	    auto *sub_leaf = get_leaf(br, sub_index);
 	    auto *sub_merkle = mbr->new_leaf(sub_index);
@@ -746,6 +1239,11 @@ bool triedb::get(const triedb_branch *br, uint64_t from_key, uint64_t to_key,
 	    auto p = std::unique_ptr<custom_data_t>(data_entry);
 	    sub_merkle->set_data(p);
 	    current_size += sub_merkle->size();
+	    // Only keys in the range count (not the leaves that are
+	    // here for the hashes.)
+	    if (sub_leaf->key() >= from_key && sub_leaf->key() <= to_key) {
+		num_keys++;
+	    }
 	}
 	if (current_size > limit_size) {
 	    return false;
@@ -914,6 +1412,9 @@ fstream * triedb::get_bucket_stream(size_t bucket_index) const {
 
 fstream * triedb::set_file_offset(uint64_t offset) const
 {
+    if (!write_buffer_.empty() && offset >= write_buffer_offset_) {
+	flush_write_buffer();
+    }
     size_t bucket_index = offset / bucket_size();
     auto *f = get_bucket_stream(bucket_index);
     size_t first_offset = bucket_index * bucket_size();
@@ -922,6 +1423,51 @@ fstream * triedb::set_file_offset(uint64_t offset) const
     return f;
 }
 
+const uint8_t * triedb::get_mapped(uint64_t offset, size_t n) const
+{
+    if (!write_buffer_.empty() && offset + n > write_buffer_offset_) {
+	flush_write_buffer();
+    }
+    size_t bucket_index = offset / bucket_size();
+    size_t first_offset = bucket_index * bucket_size();
+    size_t file_offset = offset - first_offset + VERSION_SZ;
+    mapped_bucket *m = nullptr;
+    auto *found = mapped_cache_.find(bucket_index);
+    if (found != nullptr) {
+	m = *found;
+    } else {
+	// Make sure the file exists and has the right version
+	get_bucket_stream(bucket_index);
+	auto file_path = bucket_file_path(bucket_index).string();
+	try {
+	    m = new mapped_bucket();
+	    m->file_ = boost::interprocess::file_mapping(
+		      file_path.c_str(), boost::interprocess::read_only);
+	    m->region_ = boost::interprocess::mapped_region(
+		      m->file_, boost::interprocess::read_only, 0,
+		      bucket_size() + VERSION_SZ);
+	    m->flushed_size_ = 0;
+	} catch (boost::interprocess::interprocess_exception &ex) {
+	    delete m;
+	    throw triedb_exception("Failed to map '" + file_path + "': "
+				   + ex.what());
+	}
+	mapped_cache_.insert(bucket_index, m);
+    }
+    if (file_offset + n > m->flushed_size_) {
+	// Data may still be buffered in the stream
+	auto *f = stream_cache_.find(bucket_index);
+	if (f != nullptr) {
+	    (*f)->flush();
+	}
+	m->flushed_size_ = boost::filesystem::file_size(
+			     bucket_file_path(bucket_index));
+	assert(file_offset + n <= m->flushed_size_);
+    }
+    return reinterpret_cast<const uint8_t *>(m->region_.get_address())
+	+ file_offset;
+}
+
 const triedb_root & triedb::get_root(const root_id &id)
 {
     auto found = roots_.find(id);
@@ -931,6 +1477,19 @@ const triedb_root & triedb::get_root(const root_id &id)
     
 void triedb::read_leaf_node(uint64_t offset, triedb_leaf &node) const
 {
+    if (use_mmap()) {
+	uint32_t size = read_uint32(get_mapped(offset, sizeof(uint32_t)));
+	assert(size >= 4 && size < triedb_leaf::MAX_SIZE_IN_BYTES);
+	const uint8_t *p = get_mapped(offset, size);
+	if (triedb_leaf::is_delta(p)) {
+	    // Reading the base may unmap this bucket, so take a copy
+	    std::vector<uint8_t> buffer(p, p + size);
+	    read_delta_leaf_node(&buffer[0], node);
+	} else {
+	    node.read(p);
+	}
+	return;
+    }
     std::vector<uint8_t> buffer(4);
     auto *f = set_file_offset(offset);
     f->read(reinterpret_cast<char *>(&buffer[0]), sizeof(uint32_t));
@@ -939,34 +1498,243 @@ void triedb::read_leaf_node(uint64_t offset, triedb_leaf &node) const
     buffer.resize(4+size);
     f->read(reinterpret_cast<char *>(&buffer[sizeof(uint32_t)]),
 	    size-sizeof(uint32_t));
-    node.read(&buffer[0]);
+    if (triedb_leaf::is_delta(&buffer[0])) {
+	read_delta_leaf_node(&buffer[0], node);
+    } else {
+	node.read(&buffer[0]);
+    }
+}
+
+//
+// A delta leaf is stored as:
+//
+//    [total size][hash size | DELTA_FLAG][key][hash]
+//    [base offset (64 bits)][full data size (32 bits)]
+//    [delta depth (32 bits)][number of ranges (32 bits)]
+//    followed by [offset (32 bits)][length (32 bits)][bytes] per range
+//
+// The leaf is rebuilt by taking the (full) data of the base leaf and
+// then applying the ranges on top of it. The hash is always the hash
+// of the full data, so delta leaves are invisible to the merkle trie.
+//
+
+static const size_t DELTA_HEADER_SIZE = sizeof(uint64_t) + 3*sizeof(uint32_t);
+static const size_t DELTA_RANGE_HEADER_SIZE = 2*sizeof(uint32_t);
+static const size_t DELTA_CHUNK_SIZE = 64;
+
+void triedb::read_delta_leaf_node(const uint8_t *buffer, triedb_leaf &node) const
+{
+    size_t sz = 0;
+    const uint8_t *p = node.read_header(buffer, sz);
+    const uint8_t *end = buffer + sz;
+    uint64_t base_offset = read_uint64(p); p += sizeof(uint64_t);
+    size_t full_size = read_uint32(p); p += sizeof(uint32_t);
+    size_t depth = read_uint32(p); p += sizeof(uint32_t);
+    size_t num_ranges = read_uint32(p); p += sizeof(uint32_t);
+
+    // This will recursively rebuild the base leaf (if it is also a delta)
+    auto *base = get_leaf(base_offset);
+
+    std::vector<uint8_t> data(full_size);
+    size_t n = std::min(full_size, base->custom_data_size());
+    if (n > 0) {
+	memcpy(&data[0], base->custom_data(), n);
+    }
+    for (size_t i = 0; i < num_ranges; i++) {
+	assert(p + DELTA_RANGE_HEADER_SIZE <= end);
+	size_t offset = read_uint32(p); p += sizeof(uint32_t);
+	size_t len = read_uint32(p); p += sizeof(uint32_t);
+	assert(p + len <= end && offset + len <= full_size);
+	memcpy(&data[offset], p, len);
+	p += len;
+    }
+    assert(p == end);
+    (void)end;
+    node.set_custom_data(full_size > 0 ? &data[0] : nullptr, full_size);
+    node.set_delta_depth(depth);
+}
+
+void triedb::compute_delta_ranges(const triedb_leaf &node,
+				  const triedb_leaf &base,
+				  const leaf_ranges *changed,
+				  leaf_ranges &ranges) const
+{
+    size_t new_size = node.custom_data_size();
+    size_t base_size = std::min(base.custom_data_size(), new_size);
+
+    auto add_range = [&ranges](size_t offset, size_t len) {
+	if (len == 0) {
+	    return;
+	}
+	if (!ranges.empty() &&
+	    ranges.back().first + ranges.back().second >= offset) {
+	    auto end = std::max(ranges.back().first + ranges.back().second,
+				offset + len);
+	    ranges.back().second = end - ranges.back().first;
+	} else {
+	    ranges.push_back(std::make_pair(offset, len));
+	}
+    };
+
+    if (changed != nullptr) {
+	// Start with what the caller says has been changed
+	leaf_ranges sorted(*changed);
+	std::sort(sorted.begin(), sorted.end());
+	for (auto &r : sorted) {
+	    if (r.first >= base_size) {
+		break;
+	    }
+	    add_range(r.first, std::min(r.second, base_size - r.first));
+	}
+	// Data outside the changed ranges must be identical to the
+	// base. A missed change would silently corrupt the leaf (and
+	// the root hash is still computed from the full data), so this
+	// is checked in release builds too. It's a plain memcmp of the
+	// unchanged parts.
+	size_t at = 0;
+	bool ok = true;
+	for (auto &r : ranges) {
+	    if (memcmp(node.custom_data() + at, base.custom_data() + at,
+		       r.first - at) != 0) {
+		ok = false;
+		break;
+	    }
+	    at = r.first + r.second;
+	}
+	if (ok && memcmp(node.custom_data() + at, base.custom_data() + at,
+			 base_size - at) != 0) {
+	    ok = false;
+	}
+	if (!ok) {
+	    ranges.clear();
+	    changed = nullptr;
+	}
+    }
+    if (changed == nullptr) {
+	// Compare with base chunk by chunk
+	const uint8_t *a = node.custom_data(), *b = base.custom_data();
+	for (size_t i = 0; i < base_size; i += DELTA_CHUNK_SIZE) {
+	    size_t len = std::min(DELTA_CHUNK_SIZE, base_size - i);
+	    if (memcmp(a + i, b + i, len) != 0) {
+		add_range(i, len);
+	    }
+	}
+    }
+
+    // Everything beyond the base is always new
+    add_range(base_size, new_size - base_size);
+}
+
+uint64_t triedb::append_leaf_node(triedb_leaf &node, uint64_t base_offset,
+				  const triedb_leaf &base,
+				  const leaf_ranges *changed) const
+{
+    size_t depth = base.delta_depth() + 1;
+    if (depth >= delta_snapshot_interval()) {
+	node.set_delta_depth(0);
+	return append_leaf_node(node);
+    }
+
+    leaf_ranges ranges;
+    compute_delta_ranges(node, base, changed, ranges);
+
+    size_t delta_size = DELTA_HEADER_SIZE;
+    for (auto &r : ranges) {
+	delta_size += DELTA_RANGE_HEADER_SIZE + r.second;
+    }
+
+    // Only worth it if the patch is substantially smaller
+    if (2*delta_size >= node.custom_data_size()) {
+	node.set_delta_depth(0);
+	return append_leaf_node(node);
+    }
+
+    size_t n = node.serialization_size() - node.custom_data_size() + delta_size;
+    assert(n < triedb_leaf::MAX_SIZE_IN_BYTES);
+    std::vector<uint8_t> buffer(n);
+    uint8_t *p = &buffer[0];
+    write_uint32(p, checked_cast<uint32_t>(n)); p += sizeof(uint32_t);
+    *p = checked_cast<uint8_t>(node.hash_size()) | triedb_leaf::DELTA_FLAG; p++;
+    write_uint64(p, node.key()); p += sizeof(uint64_t);
+    if (node.hash_size() > 0) {
+	const triedb_leaf &cnode = node;
+	memcpy(p, cnode.hash(), node.hash_size());
+	p += node.hash_size();
+    }
+    write_uint64(p, base_offset); p += sizeof(uint64_t);
+    write_uint32(p, checked_cast<uint32_t>(node.custom_data_size())); p += sizeof(uint32_t);
+    write_uint32(p, checked_cast<uint32_t>(depth)); p += sizeof(uint32_t);
+    write_uint32(p, checked_cast<uint32_t>(ranges.size())); p += sizeof(uint32_t);
+    for (auto &r : ranges) {
+	write_uint32(p, checked_cast<uint32_t>(r.first)); p += sizeof(uint32_t);
+	write_uint32(p, checked_cast<uint32_t>(r.second)); p += sizeof(uint32_t);
+	memcpy(p, node.custom_data() + r.first, r.second);
+	p += r.second;
+    }
+    assert(static_cast<size_t>(p - &buffer[0]) == n);
+
+    node.set_delta_depth(depth);
+    return append_buffer(&buffer[0], n);
 }
 
 uint64_t triedb::append_leaf_node(const triedb_leaf &node) const
+{
+    size_t n = node.serialization_size();
+    assert(n < triedb_leaf::MAX_SIZE_IN_BYTES);
+    std::vector<uint8_t> buffer(n);
+    node.write(&buffer[0]);
+    return append_buffer(&buffer[0], n);
+}
+
+uint64_t triedb::append_buffer(const uint8_t *buffer, size_t n) const
 {
     auto offset = last_offset_;
-    size_t num_bytes = node.serialization_size();
     size_t bucket_index = offset / bucket_size();
     auto first_offset = bucket_index * bucket_size();
     // Are we crossing the bucket boundary? 
-    if (offset - first_offset + num_bytes >= bucket_size()) {
+    if (offset - first_offset + n >= bucket_size()) {
         // Then switch to the next bucket
         bucket_index++;
         offset = bucket_index*bucket_size();
 	last_offset_ = offset;
     }
-    size_t n = node.serialization_size();
-    assert(n < triedb_leaf::MAX_SIZE_IN_BYTES);
-    std::vector<uint8_t> buffer(n);
-    node.write(&buffer[0]);
-    auto *f = set_file_offset(offset);
-    f->write(reinterpret_cast<char *>(&buffer[0]), n);
+    if (buffer_writes_) {
+	if (!write_buffer_.empty() &&
+	    write_buffer_offset_ + write_buffer_.size() != offset) {
+	    flush_write_buffer();
+	}
+	if (write_buffer_.empty()) {
+	    write_buffer_offset_ = offset;
+	}
+	write_buffer_.insert(write_buffer_.end(), buffer, buffer + n);
+    } else {
+	auto *f = set_file_offset(offset);
+	f->write(reinterpret_cast<const char *>(buffer), n);
+    }
     last_offset_ += n;
+    bytes_written_ += n;
     return offset;
 }
+
+void triedb::flush_write_buffer() const
+{
+    if (write_buffer_.empty()) {
+	return;
+    }
+    std::vector<uint8_t> buffer;
+    std::swap(buffer, write_buffer_);
+    auto *f = set_file_offset(write_buffer_offset_);
+    f->write(reinterpret_cast<const char *>(&buffer[0]), buffer.size());
+}
     
 void triedb::read_branch_node(uint64_t offset, triedb_branch &node) const
 {
+    if (use_mmap()) {
+	uint32_t size = read_uint32(get_mapped(offset, sizeof(uint32_t)));
+	assert(size >= 4 && size < triedb_branch::MAX_SIZE_IN_BYTES);
+	node.read(get_mapped(offset, size));
+	return;
+    }
     uint8_t buffer[triedb_branch::MAX_SIZE_IN_BYTES];
     auto *f = set_file_offset(offset);
     f->read(reinterpret_cast<char *>(&buffer[0]), sizeof(uint32_t));
@@ -979,23 +1747,10 @@ void triedb::read_branch_node(uint64_t offset, triedb_branch &node) const
 
 uint64_t triedb::append_branch_node(triedb_branch *node) const
 {
-    auto offset = last_offset_;
-    size_t num_bytes = node->serialization_size();
-    size_t bucket_index = offset / bucket_size();
-    auto first_offset = bucket_index * bucket_size();
-    // Are we crossing the bucket boundary? 
-    if (offset - first_offset + num_bytes >= bucket_size()) {
-        // Then switch to the next bucket
-        bucket_index++;
-        offset = bucket_index*bucket_size();
-	last_offset_ = offset;	
-    }
     uint8_t buffer[triedb_branch::MAX_SIZE_IN_BYTES];
     size_t n = node->serialization_size();
     node->write(buffer);
-    auto *f = set_file_offset(offset);
-    f->write(reinterpret_cast<char *>(&buffer[0]), n);
-    last_offset_ += n;
+    auto offset = append_buffer(buffer, n);
     if (!cache_shutdown_) branch_cache_.insert(offset, node);
     return offset;
 }
@@ -1288,6 +2043,246 @@ bool merkle_branch::validate_end(const triedb *db, uint64_t key_offset, uint64_t
     return br->validate_end(db, sub_offset, sub_step, from_key);
 }
 
+//
+// Binary form of a merkle tree (merkle_root::write/read). Nodes are
+// written depth first; children in index order:
+//
+//    branch: 'B' [depth (8 bits)][hash size (16 bits)][hash][mask (32 bits)]
+//            followed by the children (one for each bit of the mask)
+//    leaf:   'L' [hash size (16 bits)][hash][key (64 bits)]
+//            [has data (8 bits)] and if so [data size (32 bits)][data]
+//
+// The root is a branch, preceded by MAGIC. Unlike the term form there
+// are no positions; they follow from the mask.
+//
+
+const uint8_t merkle_root::MAGIC[4] = { 'm', 'r', 'k', 1 };
+
+class merkle_writer {
+public:
+    merkle_writer(std::vector<uint8_t> &out) : out_(out) { }
+
+    void put_u8(uint8_t v) {
+	out_.push_back(v);
+    }
+
+    void put_u16(uint16_t v) {
+	out_.push_back(static_cast<uint8_t>(v & 0xff));
+	out_.push_back(static_cast<uint8_t>(v >> 8));
+    }
+
+    void put_u32(uint32_t v) {
+	uint8_t buf[sizeof(uint32_t)];
+	write_uint32(buf, v);
+	put(buf, sizeof(buf));
+    }
+
+    void put_u64(uint64_t v) {
+	uint8_t buf[sizeof(uint64_t)];
+	write_uint64(buf, v);
+	put(buf, sizeof(buf));
+    }
+
+    void put(const uint8_t *data, size_t n) {
+	out_.insert(out_.end(), data, data + n);
+    }
+
+    void put_hash(const node_hash &h) {
+	put_u16(common::checked_cast<uint16_t>(h.hash_size()));
+	put(h.hash(), h.hash_size());
+    }
+
+    void put_branch(const merkle_branch &br) {
+	put_u8('B');
+	put_u8(common::checked_cast<uint8_t>(br.depth()));
+	put_hash(br);
+	put_u32(br.mask());
+	for (auto const &child : br.get_children()) {
+	    if (child == nullptr) {
+		continue;
+	    }
+	    if (child->type() == merkle_node::BRANCH) {
+		put_branch(*reinterpret_cast<const merkle_branch *>(child.get()));
+	    } else {
+		put_leaf(*reinterpret_cast<const merkle_leaf *>(child.get()));
+	    }
+	}
+    }
+
+    void put_leaf(const merkle_leaf &lf) {
+	put_u8('L');
+	put_hash(lf);
+	put_u64(lf.key());
+	bool has_data = lf.has_data() && lf.data().data() != nullptr;
+	put_u8(has_data ? 1 : 0);
+	if (has_data) {
+	    put_u32(common::checked_cast<uint32_t>(lf.data().size()));
+	    put(lf.data().data(), lf.data().size());
+	}
+    }
+
+private:
+    std::vector<uint8_t> &out_;
+};
+
+class merkle_reader {
+public:
+    // Keys are 64 bits, so there can't be deeper trees than this
+    static const size_t MAX_LEVELS = 64 / triedb_params::MAX_BRANCH_BITS + 1;
+
+    merkle_reader(const uint8_t *data, size_t size)
+	: p_(data), end_(data + size) { }
+
+    bool at_end() const {
+	return p_ == end_;
+    }
+
+    bool get(const uint8_t *&data, size_t n) {
+	if (static_cast<size_t>(end_ - p_) < n) {
+	    return false;
+	}
+	data = p_;
+	p_ += n;
+	return true;
+    }
+
+    bool get_u8(uint8_t &v) {
+	const uint8_t *d;
+	if (!get(d, 1)) return false;
+	v = d[0];
+	return true;
+    }
+
+    bool get_u16(uint16_t &v) {
+	const uint8_t *d;
+	if (!get(d, 2)) return false;
+	v = static_cast<uint16_t>(d[0] | (d[1] << 8));
+	return true;
+    }
+
+    bool get_u32(uint32_t &v) {
+	const uint8_t *d;
+	if (!get(d, sizeof(uint32_t))) return false;
+	v = read_uint32(d);
+	return true;
+    }
+
+    bool get_u64(uint64_t &v) {
+	const uint8_t *d;
+	if (!get(d, sizeof(uint64_t))) return false;
+	v = read_uint64(d);
+	return true;
+    }
+
+    bool get_hash(merkle_node &node) {
+	uint16_t n;
+	const uint8_t *h;
+	if (!get_u16(n) || !get(h, n)) return false;
+	node.set_hash(h, n);
+	return true;
+    }
+
+    bool get_branch(merkle_branch &br, size_t level) {
+	uint8_t tag, depth;
+	uint32_t mask;
+	if (level >= MAX_LEVELS || !get_u8(tag) || tag != 'B' ||
+	    !get_u8(depth) || !get_hash(br) || !get_u32(mask)) {
+	    return false;
+	}
+	br.set_depth(depth);
+	uint64_t num = 0;
+	for (size_t i = 0; i < triedb_params::MAX_BRANCH; i++) {
+	    if ((mask & (static_cast<uint32_t>(1) << i)) == 0) {
+		continue;
+	    }
+	    if (p_ == end_) {
+		return false;
+	    }
+	    if (*p_ == 'B') {
+		auto *sub = br.new_branch(i);
+		if (!get_branch(*sub, level + 1)) {
+		    return false;
+		}
+		num += sub->num_entries();
+	    } else {
+		if (!get_leaf(*br.new_leaf(i))) {
+		    return false;
+		}
+		num++;
+	    }
+	}
+	br.set_num_entries(num);
+	// No bits beyond the possible children
+	return br.mask() == mask;
+    }
+
+    bool get_leaf(merkle_leaf &lf) {
+	uint8_t tag, has_data;
+	uint64_t key;
+	if (!get_u8(tag) || tag != 'L' || !get_hash(lf) ||
+	    !get_u64(key) || !get_u8(has_data)) {
+	    return false;
+	}
+	lf.set_key(key);
+	if (has_data) {
+	    uint32_t n;
+	    const uint8_t *d;
+	    if (!get_u32(n) || !get(d, n)) {
+		return false;
+	    }
+	    std::unique_ptr<custom_data_t> data(new custom_data_t(d, n));
+	    lf.set_data(data);
+	}
+	return true;
+    }
+
+private:
+    const uint8_t *p_;
+    const uint8_t *end_;
+};
+
+void merkle_root::write(std::vector<uint8_t> &out) const
+{
+    merkle_writer w(out);
+    w.put(MAGIC, sizeof(MAGIC));
+    w.put_branch(*this);
+}
+
+bool merkle_root::read(const uint8_t *data, size_t size)
+{
+    merkle_reader r(data, size);
+    const uint8_t *magic;
+    if (!r.get(magic, sizeof(MAGIC)) ||
+	!std::equal(magic, magic + sizeof(MAGIC), MAGIC)) {
+	return false;
+    }
+    return r.get_branch(*this, 0) && r.at_end();
+}
+
+static size_t num_leaves(const merkle_branch &br, uint64_t from_key, uint64_t to_key)
+{
+    size_t n = 0;
+    for (auto const &child : br.get_children()) {
+	if (child == nullptr) {
+	    continue;
+	}
+	if (child->type() == merkle_node::BRANCH) {
+	    n += num_leaves(*reinterpret_cast<const merkle_branch *>(child.get()), from_key, to_key);
+	} else {
+	    auto k = reinterpret_cast<const merkle_leaf *>(child.get())->key();
+	    if (from_key <= k && k <= to_key) {
+		n++;
+	    }
+	}
+    }
+    return n;
+}
+
+size_t merkle_root::num_leaves(uint64_t from_key, uint64_t to_key) const
+{
+    return db::num_leaves(*this, from_key, to_key);
+}
+
 bool merkle_leaf::validate(const triedb *db, uint64_t key_offset, uint64_t key_step, uint64_t from_key, uint64_t to_key) const {
     (void)from_key;
     (void)to_key;
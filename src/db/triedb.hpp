@@ -10,10 +10,16 @@
 #include <boost/noncopyable.hpp>
 #include <boost/functional/hash.hpp>
 #include <boost/intrusive_ptr.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 #include <iostream>
 #include <bitset>
 #include <algorithm>
 #include <set>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <vector>
 #include "../common/lru_cache.hpp"
 #include "../common/bits.hpp"
 #include "../common/checked_cast.hpp"
@@ -97,6 +103,12 @@ public:
     ~custom_data_t() {
 	delete [] data_;
     }
+    custom_data_t & operator = (const custom_data_t &other) {
+	if (this != &other) {
+	    set_data(other.data(), other.size());
+	}
+	return *this;
+    }
     const uint8_t * data() const {
 	return data_;
     }
@@ -109,12 +121,8 @@ public:
     void set_data(const uint8_t *dat, size_t sz) {
 	if (sz != size_) {
 	    delete [] data_;
-	    if (sz) {
-		data_ = new uint8_t[sz];
-		size_ = sz;
-	    } else {
-		data_ = nullptr;
-	    }
+	    data_ = sz ? new uint8_t[sz] : nullptr;
+	    size_ = sz;
 	}
 	if (sz) std::copy(dat, dat+sz, data_);
     }
@@ -371,11 +379,20 @@ public:
 	return merkle_branch::validate_end(db, key_offset, key_step, from_key);
     }
 
-    void get_keys(uint64_t from_key, size_t num_keys, std::vector<uint64_t> &keys)
+    void get_keys(uint64_t from_key, size_t num_keys, std::vector<uint64_t> &keys) const
     {
 	get_keys(this, from_key, num_keys, keys);
     }
 
+    // Number of leaves with a key in [from_key, to_key]
+    size_t num_leaves(uint64_t from_key, uint64_t to_key) const;
+
+    // Compact binary form, so a range can be sent, verified and
+    // applied without going through terms. read() returns false if
+    // the data is malformed (it doesn't validate the hashes.)
+    void write(std::vector<uint8_t> &out) const;
+    bool read(const uint8_t *data, size_t size);
+
     size_t limit_size() const {
 	return limit_size_;
     }
@@ -402,7 +419,7 @@ public:
     }
 
 private:
-    void get_keys(const merkle_branch *br, uint64_t from_key, size_t num_keys, std::vector<uint64_t> &keys) {
+    void get_keys(const merkle_branch *br, uint64_t from_key, size_t num_keys, std::vector<uint64_t> &keys) const {
 	if (keys.size() >= num_keys) {
 	    return;
 	}
@@ -427,6 +444,8 @@ private:
 	}
     }
 
+    static const uint8_t MAGIC[4];
+
     size_t limit_size_;
     size_t total_size_;
     size_t limit_num_keys_;
@@ -585,13 +604,17 @@ class triedb_node : public node_hash {
 class triedb_leaf : public triedb_node, public custom_data_t {
 public:
     static const size_t MAX_SIZE_IN_BYTES = 2*triedb_params::MB;
+
+    // Set in the hash size byte if the leaf is stored as a delta
+    // (patch) against a previous version of the same leaf.
+    static const uint8_t DELTA_FLAG = 0x80;
   
     inline triedb_leaf()
-	: key_(0) { }
+	: key_(0), delta_depth_(0) { }
 
-    inline triedb_leaf(const triedb_leaf &other) : triedb_node(other), custom_data_t(other), key_(other.key_) { }
+    inline triedb_leaf(const triedb_leaf &other) : triedb_node(other), custom_data_t(other), key_(other.key_), delta_depth_(other.delta_depth_) { }
 
-    inline triedb_leaf(uint64_t key, const uint8_t *custom_dat, size_t custom_sz) : custom_data_t(custom_dat, custom_sz), key_(key) {
+    inline triedb_leaf(uint64_t key, const uint8_t *custom_dat, size_t custom_sz) : custom_data_t(custom_dat, custom_sz), key_(key), delta_depth_(0) {
     }
 
     inline uint64_t key() const {
@@ -619,13 +642,37 @@ public:
         return sz;
     }
 
+    // Number of patches we need to apply (on top of a full snapshot)
+    // to get to this leaf. 0 means the leaf is stored in full.
+    inline size_t delta_depth() const {
+	return delta_depth_;
+    }
+
+    inline void set_delta_depth(size_t d) {
+	delta_depth_ = d;
+    }
+
+    static inline bool is_delta(const uint8_t *buffer) {
+	return (buffer[sizeof(uint32_t)] & DELTA_FLAG) != 0;
+    }
+
     void read(const uint8_t *buffer);
     void write(uint8_t *buffer) const;
 
+    // Read size, key and hash. Returns a pointer to what follows (the
+    // custom data or the delta.)
+    const uint8_t * read_header(const uint8_t *buffer, size_t &sz);
+
 private:
     uint64_t key_;
+    size_t delta_depth_;
 };
 
+//
+// Byte ranges (offset, length) of custom data that have been changed.
+//
+typedef std::vector<std::pair<size_t, size_t> > leaf_ranges;
+
 //
 // The branch node of a trie.
 //
@@ -694,7 +741,7 @@ public:
     inline void set_empty(size_t sub_index) {
         size_t child_index = std::bitset<triedb_params::MAX_BRANCH>(mask_ & ((static_cast<uint32_t>(1) << sub_index) - 1)).count();
 	size_t n = num_children();
-	for (size_t i = child_index; i < n; i++) {
+	for (size_t i = child_index; i + 1 < n; i++) {
 	    ptr_[i] = ptr_[i+1];
 	}
 	ptr_[n-1] = 0;
@@ -793,8 +840,32 @@ public:
 		const uint8_t *data, size_t data_size);
     void update(const root_id &at_root, uint64_t key,
 		const uint8_t *data, size_t data_size);
+    // Same as above, but 'changed' tells which parts of the data that
+    // differ from the previous version of the leaf. This is only a hint
+    // for delta leaves (if enabled) so we don't need to compute the diff.
+    void update(const root_id &at_root, uint64_t key,
+		const uint8_t *data, size_t data_size,
+		const leaf_ranges &changed);
     void remove(const root_id &at_root, uint64_t key);
 
+    // Group commit. After begin_batch() all inserts, updates and
+    // removes at 'at_root' are kept in memory (and are visible through
+    // find().) commit_batch() then builds the new trie so that every
+    // touched branch is hashed and written exactly once. The resulting
+    // trie is identical to applying the changes one by one, except
+    // that a branch left with a single leaf by a remove is replaced by
+    // that leaf (remove() keeps it.) So the trie is the same as if the
+    // removed keys had never been inserted. Note that duplicate
+    // inserts of keys already in the database, and removes of keys
+    // that aren't there, are detected at commit.
+    void begin_batch(const root_id &at_root);
+    void commit_batch(const root_id &at_root);
+    // Drop the pending changes (nothing has been written yet)
+    void abort_batch(const root_id &at_root);
+    bool in_batch(const root_id &at_root) const {
+	return batches_.find(at_root) != batches_.end();
+    }
+
     void update(const root_id &at_root, const merkle_root &part);
     
 private:
@@ -850,24 +921,79 @@ public:
 
     static void leaf_hasher(triedb_leaf *leaf);
 
+    // Total number of bytes appended to the bucket files.
+    inline uint64_t bytes_written() const {
+	return bytes_written_;
+    }
+
 private:
     friend class triedb_iterator;
   
     void branch_hasher(triedb_branch *branch);
+    void branch_hash_input(const triedb_branch *branch,
+			   std::vector<uint8_t> &in) const;
+    static void leaf_hash_input(const triedb_leaf *leaf,
+				std::vector<uint8_t> &in);
+    // Set the hashes of many nodes at once (multi-buffer BLAKE2b)
+    static void hash_many(const std::vector<node_hash *> &nodes,
+			  const std::vector<std::vector<uint8_t> > &inputs);
+    bool has_default_leaf_hasher() const;
 
     std::function<void (triedb_leaf *leaf)> leaf_hasher_fn_{&triedb::leaf_hasher};
 
     // Return modified branch node
     void insert_or_update(const root_id &at_root, uint64_t key,
-			  const uint8_t *data, size_t data_size, bool do_insert);
+			  const uint8_t *data, size_t data_size, bool do_insert,
+			  const leaf_ranges *changed);
   
     std::pair<const triedb_branch *, uint64_t> update_part(const triedb_branch *node,
 						     uint64_t key,
 						     const uint8_t *data,
 						     size_t data_size,
 						     bool do_insert,
+						     const leaf_ranges *changed,
 						     bool &new_entry);
 
+    std::pair<const triedb_branch *, uint64_t> grow_root(const root_id &at_root,
+							 uint64_t key);
+
+    struct batch_op {
+	std::unique_ptr<triedb_leaf> leaf; // nullptr if removed
+	bool do_insert;
+	bool must_exist; // For a remove
+	bool has_changed;
+	leaf_ranges changed;
+    };
+    typedef std::map<uint64_t, batch_op> batch;
+
+    void add_to_batch(batch &b, uint64_t key,
+		      const uint8_t *data, size_t data_size, bool do_insert,
+		      const leaf_ranges *changed);
+    void remove_in_batch(batch &b, uint64_t key);
+    // New branches of a batch are hashed and appended level by
+    // level (lowest depth first) once the whole batch is applied.
+    struct batch_branch {
+	triedb_branch *branch;
+	triedb_branch *parent;
+	size_t sub_index;
+    };
+    typedef std::vector<std::vector<batch_branch> > batch_branches;
+
+    void hash_batch_leaves(batch &ops);
+    uint64_t append_batch_leaf(batch_op &op, uint64_t base_offset,
+			       const triedb_leaf *base);
+    triedb_branch * update_batch(const triedb_branch *node,
+				 batch::iterator first,
+				 batch::iterator last,
+				 bool new_branch,
+				 size_t &new_entries,
+				 size_t &removed_entries,
+				 batch_branches &pending);
+    uint64_t append_batch_branches(batch_branches &pending);
+    triedb_branch * shrink_batch_root(triedb_branch *root,
+				      batch_branches &pending,
+				      uint64_t &ptr);
+
     std::pair<const triedb_branch *, uint64_t> remove_part(const root_id &at_root,
 						     const triedb_branch *node,
 						     uint64_t key);
@@ -891,10 +1017,21 @@ private:
     size_t scan_last_bucket() const;
     uint64_t scan_last_offset() const;
     fstream * set_file_offset(uint64_t offset) const;
+    const uint8_t * get_mapped(uint64_t offset, size_t n) const;
     const triedb_root & get_root(const root_id &id);
   
     void read_leaf_node(uint64_t offset, triedb_leaf &node) const;
+    void read_delta_leaf_node(const uint8_t *buffer, triedb_leaf &node) const;
     uint64_t append_leaf_node(const triedb_leaf &node) const;
+    uint64_t append_leaf_node(triedb_leaf &node, uint64_t base_offset,
+			      const triedb_leaf &base,
+			      const leaf_ranges *changed) const;
+    void compute_delta_ranges(const triedb_leaf &node,
+			      const triedb_leaf &base,
+			      const leaf_ranges *changed,
+			      leaf_ranges &ranges) const;
+    uint64_t append_buffer(const uint8_t *buffer, size_t n) const;
+    void flush_write_buffer() const;
   
     void read_branch_node(uint64_t offset, triedb_branch &node) const;
     uint64_t append_branch_node(triedb_branch *node) const;
@@ -925,20 +1062,35 @@ private:
 
     std::string dir_path_;
 
-    struct stream_flusher {
+    struct stream_flusher : public common::lru_cache_callback_nop<size_t, fstream *> {
         void evicted(size_t, fstream *f) {
 	    f->close();
 	    delete f;
         }
     };
 
-    struct leaf_flusher {
+    // A bucket file mapped into memory. The whole bucket is mapped
+    // (even beyond the end of file), but we only read what has been
+    // flushed to the file.
+    struct mapped_bucket {
+        boost::interprocess::file_mapping file_;
+        boost::interprocess::mapped_region region_;
+	size_t flushed_size_;
+    };
+
+    struct mapped_flusher : public common::lru_cache_callback_nop<size_t, mapped_bucket *> {
+        void evicted(size_t, mapped_bucket *m) {
+	    delete m;
+        }
+    };
+
+    struct leaf_flusher : public common::lru_cache_callback_nop<size_t, triedb_leaf *> {
         void evicted(size_t, triedb_leaf *leaf) {
 	    delete leaf;
         }
     };
 
-    struct branch_flusher {
+    struct branch_flusher : public common::lru_cache_callback_nop<size_t, triedb_branch *> {
         void evicted(size_t, triedb_branch *br) {
 	    delete br;
         }
@@ -949,6 +1101,11 @@ private:
     stream_flusher stream_flusher_;
     mutable stream_cache stream_cache_;
 
+    // Bucket index to memory mapped bucket
+    typedef common::lru_cache<size_t, mapped_bucket *, mapped_flusher> mapped_cache;
+    mapped_flusher mapped_flusher_;
+    mutable mapped_cache mapped_cache_;
+
     // Leaf cache
     typedef common::lru_cache<size_t, triedb_leaf *, leaf_flusher> leaf_cache;
     leaf_flusher leaf_flusher_;
@@ -965,12 +1122,47 @@ private:
     fstream *roots_stream_;
   
     mutable uint64_t last_offset_;
+    mutable uint64_t bytes_written_;
+
+    // Pending batches
+    std::unordered_map<root_id, batch> batches_;
+
+    // Appended nodes are collected here (while committing a batch)
+    // so they can be written with a single write.
+    mutable bool buffer_writes_;
+    mutable std::vector<uint8_t> write_buffer_;
+    mutable uint64_t write_buffer_offset_;
 
     bool cache_shutdown_;
 
     bool debug_;
 };
 
+//
+// Scoped batch. The batch is aborted unless commit() is called, so
+// an exception while adding to it doesn't leave it open.
+//
+class triedb_batch : private boost::noncopyable {
+public:
+    inline triedb_batch(triedb &db, const root_id &at_root)
+	: db_(db), root_(at_root), done_(false) {
+	db_.begin_batch(root_);
+    }
+    inline ~triedb_batch() {
+	if (!done_) db_.abort_batch(root_);
+    }
+    inline void commit() {
+	// (The batch is gone even if commit_batch throws)
+	done_ = true;
+	db_.commit_batch(root_);
+    }
+
+private:
+    triedb &db_;
+    root_id root_;
+    bool done_;
+};
+
 class triedb_iterator {
 public:
     inline triedb_iterator(const triedb_iterator &other) :
@@ -1128,6 +1320,15 @@ inline const triedb_leaf * triedb::find(const root_id &at_root, uint64_t key,
     if (at_root.is_zero()) {
 	return nullptr;
     }
+    if (!batches_.empty() && path_opt == nullptr) {
+	auto b = batches_.find(at_root);
+	if (b != batches_.end()) {
+	    auto op = b->second.find(key);
+	    if (op != b->second.end()) {
+		return op->second.leaf.get();
+	    }
+	}
+    }
     auto it = begin(at_root, key);
     if (it == end(at_root)) {
         return nullptr;
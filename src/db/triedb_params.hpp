@@ -20,12 +20,16 @@ public:
     static const size_t DEFAULT_BUCKET_SIZE = 128*MB;
     static const size_t DEFAULT_CACHE_NUM_STREAMS = 16;
     static const size_t DEFAULT_CACHE_NUM_NODES = 65536;
+    static const size_t DEFAULT_DELTA_SNAPSHOT_INTERVAL = 16;
 
     inline triedb_params()
       : bucket_size_(DEFAULT_BUCKET_SIZE),
         cache_num_streams_(DEFAULT_CACHE_NUM_STREAMS),
         cache_num_nodes_(DEFAULT_CACHE_NUM_NODES),
-        use_hashing_(true) { }
+        use_hashing_(true),
+        use_delta_leaves_(false),
+        delta_snapshot_interval_(DEFAULT_DELTA_SNAPSHOT_INTERVAL),
+        use_mmap_(false) { }
   
     inline size_t bucket_size() const { return bucket_size_; }
     inline void set_bucket_size(size_t sz) { bucket_size_ = sz; }
@@ -38,12 +42,30 @@ public:
 
     inline bool use_hashing() const { return use_hashing_; }
     inline void set_use_hashing(bool h) { use_hashing_ = h; }
+
+    // If enabled, an updated leaf is stored as a patch against its
+    // previous version (if that is smaller.) Every Nth version
+    // (the snapshot interval) is stored in full to bound the chain
+    // of patches we need to follow when reading it back.
+    inline bool use_delta_leaves() const { return use_delta_leaves_; }
+    inline void set_use_delta_leaves(bool d) { use_delta_leaves_ = d; }
+
+    inline size_t delta_snapshot_interval() const { return delta_snapshot_interval_; }
+    inline void set_delta_snapshot_interval(size_t n) { delta_snapshot_interval_ = n; }
+
+    // If enabled, nodes are decoded directly from memory mapped
+    // bucket files instead of being read through the file streams.
+    inline bool use_mmap() const { return use_mmap_; }
+    inline void set_use_mmap(bool m) { use_mmap_ = m; }
   
 private:
     size_t bucket_size_;
     size_t cache_num_streams_;
     size_t cache_num_nodes_;
     bool use_hashing_;
+    bool use_delta_leaves_;
+    size_t delta_snapshot_interval_;
+    bool use_mmap_;
 };
     
 }}
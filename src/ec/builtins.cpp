@@ -17,6 +17,9 @@
 #include "src/util.h"
 #include "src/hash_impl.h"
 
+#include <atomic>
+#include <boost/thread.hpp>
+
 namespace epilog { namespace ec {
 
 using namespace epilog::common;
@@ -199,6 +202,121 @@ bool musig_session::prepare(const uint8_t * const *nonce_commitments,
     return true;
 }
 
+//
+// Signature checks deferred to a later verify_deferred() (see
+// builtins::set_deferred_verify.) Keys and signatures are parsed when
+// they are queued, so only the verification itself is deferred.
+//
+class signature_queue : public epilog::interp::managed_data {
+public:
+    inline signature_queue() : enabled_(false) { }
+
+    struct entry {
+	bool is_schnorr;
+	uint8_t hash[builtins::RAW_HASH_SIZE];
+	secp256k1_pubkey pubkey;
+	secp256k1_ecdsa_signature ecdsa_sig;
+	secp256k1_schnorrsig schnorr_sig;
+    };
+
+    inline bool is_enabled() const { return enabled_; }
+    inline void set_enabled(bool on) { enabled_ = on; }
+
+    inline std::vector<entry> & entries() { return entries_; }
+
+    inline entry & push(const uint8_t hash[builtins::RAW_HASH_SIZE],
+			const secp256k1_pubkey &pubkey, bool is_schnorr) {
+	entries_.push_back(entry());
+	auto &e = entries_.back();
+	e.is_schnorr = is_schnorr;
+	memcpy(e.hash, hash, sizeof(e.hash));
+	e.pubkey = pubkey;
+	return e;
+    }
+
+    inline bool verify(const secp256k1_context *ctx, const entry &e) const {
+	if (e.is_schnorr) {
+	    return secp256k1_schnorrsig_verify(ctx, &e.schnorr_sig, e.hash, &e.pubkey) == 1;
+	} else {
+	    return secp256k1_ecdsa_verify(ctx, &e.ecdsa_sig, e.hash, &e.pubkey) == 1;
+	}
+    }
+
+private:
+    bool enabled_;
+    std::vector<entry> entries_;
+};
+
+static signature_queue & get_signature_queue(interpreter_base &interp) {
+    static const common::con_cell QUEUE("$sigq", 0);
+    auto *q = reinterpret_cast<signature_queue *>(interp.get_managed_data(QUEUE));
+    if (q == nullptr) {
+	q = new signature_queue();
+	interp.set_managed_data(QUEUE, q);
+    }
+    return *q;
+}
+
+void builtins::set_deferred_verify(interpreter_base &interp, bool on)
+{
+    auto &q = get_signature_queue(interp);
+    if (on) {
+	q.entries().clear();
+    }
+    q.set_enabled(on);
+}
+
+bool builtins::is_deferred_verify(interpreter_base &interp)
+{
+    return get_signature_queue(interp).is_enabled();
+}
+
+size_t builtins::num_deferred(interpreter_base &interp)
+{
+    return get_signature_queue(interp).entries().size();
+}
+
+bool builtins::verify_deferred(interpreter_base &interp, size_t num_threads)
+{
+    // Each thread claims this many signatures at a time
+    static const size_t CHUNK = 16;
+
+    auto &q = get_signature_queue(interp);
+    std::vector<signature_queue::entry> entries;
+    entries.swap(q.entries());
+
+    const secp256k1_context *ctx = get_ctx(interp);
+    if (num_threads == 0) {
+	num_threads = std::max(1u, boost::thread::hardware_concurrency());
+    }
+    num_threads = std::min(num_threads, (entries.size() + CHUNK - 1) / CHUNK);
+
+    // Verifying only reads the context, so the threads can share it
+    std::atomic<bool> ok(true);
+    std::atomic<size_t> next(0);
+    auto work = [&]() {
+	size_t i;
+	while (ok && (i = next.fetch_add(CHUNK)) < entries.size()) {
+	    auto end = std::min(i + CHUNK, entries.size());
+	    for (; i < end; i++) {
+		if (!q.verify(ctx, entries[i])) {
+		    ok = false;
+		    break;
+		}
+	    }
+	}
+    };
+
+    boost::thread_group threads;
+    for (size_t i = 1; i < num_threads; i++) {
+	threads.create_thread(work);
+    }
+    work();
+    threads.join_all();
+
+    return ok;
+}
+
 musig_env & builtins::get_musig_env(interpreter_base &interp) {
     musig_env *env = reinterpret_cast<musig_env *>(interp.get_managed_data(con_cell("$musige",0)));
     if (env == nullptr) {
@@ -661,6 +779,12 @@ bool builtins::verify_signature(interpreter_base &interp,
 	return false;
     }
 
+    auto &q = get_signature_queue(interp);
+    if (q.is_enabled()) {
+	q.push(hash, pubkey1, false).ecdsa_sig = sig;
+	return true;
+    }
+
     if (secp256k1_ecdsa_verify(ctx, &sig, hash, &pubkey1) != 1) {
 	return false;
     }
@@ -1192,6 +1316,12 @@ bool builtins::musig_verify_3(interpreter_base &interp, size_t arity, term args[
         throw interpreter_exception_wrong_arg_type("musig_verify/3: Could not parse schnorr signature in third argument: " + interp.to_string(args[2]));
     }
 
+    auto &q = get_signature_queue(interp);
+    if (q.is_enabled()) {
+	q.push(hash, pubkey, true).schnorr_sig = sig;
+	return true;
+    }
+
     if (secp256k1_schnorrsig_verify(ctx, &sig, hash, &pubkey) != 1) {
 	return false;
     }
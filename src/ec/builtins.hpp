@@ -78,6 +78,16 @@ public:
     // hash(Data, Hash) true iff Hash is the hash of Data.
     static bool hash_2(interpreter_base &interp, size_t arity, term args[] );
 
+    // Deferred signature verification. While it's on, validate/3 and
+    // musig_verify/3 (and pverify/1) only parse the key and signature,
+    // queue the check and succeed. verify_deferred() then checks all
+    // queued signatures (with num_threads threads, 0 = one per core)
+    // and clears the queue.
+    static void set_deferred_verify(interpreter_base &interp, bool on);
+    static bool is_deferred_verify(interpreter_base &interp);
+    static size_t num_deferred(interpreter_base &interp);
+    static bool verify_deferred(interpreter_base &interp, size_t num_threads = 0);
+
     // hash(Data, Mode, Hash) true iff Hash is the hash of Data.
     static bool hash_3(interpreter_base &interp, size_t arity, term args[] );
 
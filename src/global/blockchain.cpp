@@ -15,7 +15,8 @@ blockchain::blockchain(const std::string &data_dir) :
     db_heap_dir_((boost::filesystem::path(data_dir_) / "db" / "heap").string()),
     db_closure_dir_((boost::filesystem::path(data_dir_) / "db" / "closure").string()),
     db_symbols_dir_((boost::filesystem::path(data_dir_) / "db" / "symbols").string()),
-    db_program_dir_((boost::filesystem::path(data_dir_) / "db" / "program").string()) {
+    db_program_dir_((boost::filesystem::path(data_dir_) / "db" / "program").string()),
+    db_index_dir_((boost::filesystem::path(data_dir_) / "db" / "index").string()) {
    init();
 }
 
@@ -97,6 +98,7 @@ void blockchain::init()
     db_closure_ = nullptr;
     db_symbols_ = nullptr;
     db_program_ = nullptr;
+    db_index_ = nullptr;
     
     tip_ = meta_entry();
     at_height_.clear();
@@ -219,6 +221,7 @@ void blockchain::flush_db() {
     closure_db().flush();
     symbols_db().flush();
     program_db().flush();
+    index_db().flush();
     meta_db().flush();
 }
 
@@ -42,8 +42,14 @@ public:
 
     inline db::triedb & get_db_instance(std::unique_ptr<db::triedb> &var,
 					const std::string &dir) const {
+        return get_db_instance(var, dir, db::triedb_params());
+    }
+
+    inline db::triedb & get_db_instance(std::unique_ptr<db::triedb> &var,
+					const std::string &dir,
+					const db::triedb_params &params) const {
         if (var.get() == nullptr) {
-	    var = std::unique_ptr<db::triedb>(new db::triedb(dir));
+	    var = std::unique_ptr<db::triedb>(new db::triedb(params, dir));
         }
 	return *var.get();
     }
@@ -55,7 +61,10 @@ public:
 	return get_db_instance(db_blocks_, db_blocks_dir_);
     }
     inline db::triedb & heap_db() {
-	return get_db_instance(db_heap_, db_heap_dir_);
+	// Heap blocks are large but only a few cells change per commit
+	db::triedb_params params;
+	params.set_use_delta_leaves(true);
+	return get_db_instance(db_heap_, db_heap_dir_, params);
     }
     inline db::triedb & closure_db() {
         return get_db_instance(db_closure_, db_closure_dir_);
@@ -74,6 +83,14 @@ public:
         return get_db_instance(db_program_, db_program_dir_);
     }    
 
+    // Node local (not part of any meta entry), see global::db_index_root
+    inline db::triedb & index_db() {
+        return get_db_instance(db_index_, db_index_dir_);
+    }
+    inline const db::triedb & index_db() const {
+        return get_db_instance(db_index_, db_index_dir_);
+    }
+
     inline db_root_id heap_root() const {
 	return tip_.get_root_id_heap();
     }
@@ -190,6 +207,7 @@ private:
     std::string db_closure_dir_;
     std::string db_symbols_dir_;  
     std::string db_program_dir_;
+    std::string db_index_dir_;
 
     mutable std::unique_ptr<db::triedb> db_meta_;
     mutable std::unique_ptr<db::triedb> db_blocks_;
@@ -197,6 +215,7 @@ private:
     mutable std::unique_ptr<db::triedb> db_closure_;
     mutable std::unique_ptr<db::triedb> db_symbols_;
     mutable std::unique_ptr<db::triedb> db_program_;
+    mutable std::unique_ptr<db::triedb> db_index_;
 
     meta_entry tip_;
     std::map<size_t, std::set<meta_id> > at_height_;
@@ -2,6 +2,7 @@
 #include "../coin/builtins.hpp"
 #include "../coin/coin.hpp"
 #include "global.hpp"
+#include "../common/golomb_filter.hpp"
 
 using namespace epilog::common;
 using namespace epilog::interp;
@@ -18,6 +19,8 @@ void builtins::load(interpreter_base &interp, con_cell *module0)
     const con_cell M = (module0 == nullptr) ? M0 : *module0;
 
     interp.load_builtin(M, interp.functor("current_height", 1), &builtins::current_height_1);
+    interp.load_builtin(M, con_cell("frozena", 2), &builtins::frozena_2);
+    interp.load_builtin(M, con_cell("frozenf", 3), &builtins::frozenf_3);
     
     // This will override the coin::reward_2 builtin (and this will use
     // coin::reward_2 builtin under the hood)
@@ -89,4 +92,118 @@ bool builtins::reward_2(interpreter_base &interp0, size_t arity, term args[] )
     return interp.unify(coin, args[1]);
 }
 
+static uint64_t address_hash(interpreter_base &interp, term address)
+{
+    if (address.tag() != tag_t::BIG) {
+	throw interpreter_exception_wrong_arg_type(
+	   "frozena/2: Address must be a bignum; was " + interp.to_string(address));
+    }
+    auto &big = reinterpret_cast<big_cell &>(address);
+    size_t n = interp.num_bytes(big);
+    std::vector<uint8_t> bytes(n);
+    interp.get_big(big, &bytes[0], n);
+    return golomb_filter::hash(&bytes[0], n);
+}
+
+//
+// frozena(Address, HeapAddrs)
+//  HeapAddrs are the heap addresses (in order) of the frozen closures
+//  paying to Address (or any of the addresses if it's a list.) It can
+//  include closures to other addresses (see the address index in
+//  global.cpp), so these still need to be checked.
+//
+bool builtins::frozena_2(interpreter_base &interp0, size_t arity, term args[] )
+{
+    auto &interp = reinterpret_cast<global_interpreter &>(interp0);
+    auto &g = get_global(interp);
+
+    std::unordered_set<uint64_t> hashes;
+    term lst = args[0];
+    if (interp.is_list(lst)) {
+	while (interp.is_dotted_pair(lst)) {
+	    hashes.insert(address_hash(interp, interp.deref(interp.arg(lst, 0))));
+	    lst = interp.deref(interp.arg(lst, 1));
+	}
+    } else {
+	hashes.insert(address_hash(interp, lst));
+    }
+
+    std::vector<size_t> addrs;
+    for (auto h : hashes) {
+	g.db_get_address_closures(h, addrs);
+    }
+    std::set<size_t> result(addrs.begin(), addrs.end());
+
+    // Closures of the current block aren't indexed yet
+    const auto none = term();
+    uint64_t h = 0;
+    for (auto &cl : interp.modified_closures_) {
+	if (cl.second == none) {
+	    result.erase(cl.first);
+	} else if (global::closure_address(interp, cl.second, h) &&
+		   hashes.count(h)) {
+	    result.insert(cl.first);
+	} else {
+	    result.erase(cl.first);
+	}
+    }
+
+    term heap_addrs = interpreter_base::EMPTY_LIST;
+    for (auto it = result.rbegin(); it != result.rend(); ++it) {
+	heap_addrs = interp.new_dotted_pair(int_cell(static_cast<int64_t>(*it)), heap_addrs);
+    }
+    return interp.unify(args[1], heap_addrs);
+}
+
+//
+// frozenf(Height, K, Filters)
+//  Filters is a list of at most K filter(H, FromAddr, ToAddr, Filter)
+//  for the blocks from Height and on that froze closures. Filter is a
+//  golomb_filter (as a bignum) of the addresses these closures pay to
+//  and they are at heap addresses FromAddr..ToAddr-1. A wallet that
+//  matches its addresses against the filter only needs to look at
+//  the closures of blocks that match.
+//
+bool builtins::frozenf_3(interpreter_base &interp, size_t arity, term args[] )
+{
+    if (args[0].tag() != tag_t::INT) {
+	throw interpreter_exception_wrong_arg_type(
+	   "frozenf/3: First argument, Height, must be an integer; was " + interp.to_string(args[0]));
+    }
+    auto height = reinterpret_cast<int_cell &>(args[0]).value();
+    if (height < 0) {
+	throw interpreter_exception_wrong_arg_type(
+	   "frozenf/3: Height must not be negative; was " + interp.to_string(args[0]));
+    }
+    if (args[1].tag() != tag_t::INT) {
+	throw interpreter_exception_wrong_arg_type(
+	   "frozenf/3: Second argument, the number of filters, must be an integer; was " + interp.to_string(args[1]));
+    }
+    auto k = reinterpret_cast<int_cell &>(args[1]).value();
+    if (k < 0 || k > 255) {
+	throw interpreter_exception_wrong_arg_type(
+	   "frozenf/3: Number of filters must be within 0 and 255; was " + interp.to_string(args[1]));
+    }
+
+    static const con_cell FILTER("filter", 4);
+
+    auto &g = get_global(interp);
+    std::vector<global::closure_filter> found;
+    g.db_get_closure_filters(static_cast<size_t>(height), static_cast<size_t>(k), found);
+    std::vector<term> filters;
+    for (auto &f : found) {
+	filters.push_back(interp.new_term(FILTER,
+			  { int_cell(static_cast<int64_t>(f.height)),
+			    int_cell(static_cast<int64_t>(f.from_addr)),
+			    int_cell(static_cast<int64_t>(f.to_addr)),
+			    interp.new_big(&f.filter[0], f.filter.size()) }));
+    }
+
+    term lst = interpreter_base::EMPTY_LIST;
+    for (auto it = filters.rbegin(); it != filters.rend(); ++it) {
+	lst = interp.new_dotted_pair(*it, lst);
+    }
+    return interp.unify(args[2], lst);
+}
+
 }}
@@ -24,6 +24,12 @@ public:
 
     static bool current_height_1(interpreter_base &interp, size_t arity, term args[] );
 
+    // frozena(+Address, -HeapAddrs), Address can also be a list
+    static bool frozena_2(interpreter_base &interp, size_t arity, term args[] );
+
+    // frozenf(+Height, +K, -Filters)
+    static bool frozenf_3(interpreter_base &interp, size_t arity, term args[] );
+
     // ref(?X, ?HeapAddr)
     // We'll add a new predicate "test(on)", "test(off)" to toggle
     // global interpreter in testing mode. ref_2 will not be available
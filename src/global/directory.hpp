@@ -0,0 +1,159 @@
+#pragma once
+
+#ifndef _global_directory_hpp
+#define _global_directory_hpp
+
+#include <vector>
+#include "../common/bloom_filter.hpp"
+#include "../common/lru_cache.hpp"
+#include "../db/triedb.hpp"
+
+namespace epilog { namespace global {
+
+//
+// In-memory directory of the names (symbols or predicates) stored in
+// one of the global tries. There a name is found by probing the keys
+// hash(name, i), where every probe is a walk from the root and a name
+// that isn't there costs at least one. The directory has
+//
+//   - a Bloom filter of all names at the root, so that misses (new
+//     atoms, predicates not in the DB) don't touch the trie.
+//   - a cache from name to what the probing found.
+//
+// It's valid for one root and number of entries. Names are never
+// removed, so when a block's root is created from it (and all inserts
+// go through here) it just moves on to the new root. For any other
+// root (another fork) or if the trie changed behind our back, it's
+// rebuilt on demand by scanning the trie.
+//
+// A commit is bracketed by begin() and commit(). The names inserted
+// in between are journaled, so if the commit is discarded rollback()
+// drops them and goes back to the old root without a rebuild. (Their
+// Bloom bits stay; a false positive only costs a probe.)
+//
+template<typename K, typename V> class directory {
+public:
+    inline directory(size_t cache_capacity)
+        : valid_(false), num_entries_(0), cache_(cache_capacity),
+	  num_rebuilds_(0), in_commit_(false), saved_valid_(false),
+	  saved_num_entries_(0), saved_rebuilds_(0) { }
+
+    inline bool is_valid(const db::root_id &root, size_t num_entries) const {
+	return valid_ && root == root_ && num_entries == num_entries_;
+    }
+
+    inline void invalidate() {
+	valid_ = false;
+	cache_.clear();
+    }
+
+    // Start a rebuild; then add() all names and call set_num_entries()
+    inline void rebuild(const db::root_id &root, size_t num_names) {
+	valid_ = true;
+	root_ = root;
+	// Room for the names of many blocks before it needs a rebuild
+	bloom_.reset(2 * num_names + 4096);
+	cache_.clear();
+	num_rebuilds_++;
+    }
+
+    // Next block (root 'to' starts as a copy of 'from')
+    inline void advance(const db::root_id &from, const db::root_id &to) {
+	if (valid_ && root_ == from) {
+	    root_ = to;
+	}
+    }
+
+    // After a commit at 'root' (with all inserts through here)
+    inline void set_num_entries(const db::root_id &root, size_t n) {
+	if (valid_ && root_ == root) {
+	    num_entries_ = n;
+	}
+    }
+
+    inline void add(uint64_t h) {
+	if (!valid_) {
+	    return;
+	}
+	if (bloom_.is_full()) {
+	    invalidate();
+	    return;
+	}
+	bloom_.add(h);
+    }
+
+    inline bool maybe_contains(uint64_t h) const {
+	return bloom_.maybe_contains(h);
+    }
+
+    inline const V * find(const K &name) {
+	return cache_.find(name);
+    }
+
+    inline void insert(const K &name, const V &value) {
+	if (valid_) {
+	    cache_.insert(name, value);
+	    if (in_commit_) {
+		journal_.push_back(name);
+	    }
+	}
+    }
+
+    inline size_t num_rebuilds() const {
+	return num_rebuilds_;
+    }
+
+    // Before the commit's roots are created
+    inline void begin() {
+	in_commit_ = true;
+	saved_valid_ = valid_;
+	saved_root_ = root_;
+	saved_num_entries_ = num_entries_;
+	saved_rebuilds_ = num_rebuilds_;
+	journal_.clear();
+    }
+
+    inline void commit() {
+	in_commit_ = false;
+	journal_.clear();
+    }
+
+    inline void rollback() {
+	if (!in_commit_) {
+	    return;
+	}
+	in_commit_ = false;
+	if (!saved_valid_ || !valid_ || num_rebuilds_ != saved_rebuilds_) {
+	    // Rebuilt for another root in between
+	    invalidate();
+	    journal_.clear();
+	    return;
+	}
+	for (auto &name : journal_) {
+	    cache_.erase(name);
+	}
+	journal_.clear();
+	root_ = saved_root_;
+	num_entries_ = saved_num_entries_;
+    }
+
+private:
+    bool valid_;
+    db::root_id root_;
+    size_t num_entries_;
+    common::bloom_filter bloom_;
+    common::lru_cache<K, V> cache_;
+    size_t num_rebuilds_;
+
+    // Current commit
+    bool in_commit_;
+    bool saved_valid_;
+    db::root_id saved_root_;
+    size_t saved_num_entries_;
+    size_t saved_rebuilds_;
+    std::vector<K> journal_;
+};
+
+}}
+
+#endif
@@ -3,6 +3,8 @@
 #include "meta_entry.hpp"
 #include "global_interpreter.hpp"
 #include "../coin/coin.hpp"
+#include "../ec/builtins.hpp"
+#include "../common/golomb_filter.hpp"
 
 using namespace epilog::common;
 using namespace epilog::interp;
@@ -16,7 +18,11 @@ global::global(const std::string &data_dir)
       commit_version_(blockchain::VERSION),
       commit_height_(0),
       commit_time_(),
-      commit_goals_() {
+      commit_goals_(),
+      block_format_(term_serializer::FORMAT_VER1),
+      deferred_verify_(true),
+      symbols_dir_(SYMBOLS_CACHE_SIZE),
+      program_dir_(PROGRAM_CACHE_SIZE) {
     if (!blockchain_.tip().is_partial() || blockchain_.tip().is_zero()) {
 	interp_ = std::unique_ptr<global_interpreter>(new global_interpreter(*this));
 	interp_->init();
@@ -53,88 +59,432 @@ void global::erase_db(const std::string &data_dir)
 
 void global::total_reset() {
     interp_ = nullptr;
+    symbols_dir_.invalidate();
+    program_dir_.invalidate();
     erase_db(data_dir_);
     blockchain_.init();
     interp_ = std::unique_ptr<global_interpreter>(new global_interpreter(*this));
     interp_->init();
 }
 
-bool global::db_get_predicate(const qname &qn,
-			      std::vector<term> &clauses) {
+//
+// Layout of predicates in the program DB. A predicate is found at a
+// (probed) 32-bit key K = hash(qname, i) and its leaf is either
+//
+//    qname, clause_1, ..., clause_n          (n <= MAX_INLINE_CLAUSES)
+//    qname, CHUNKED, n
+//
+// In the latter case clause j is at CLAUSE_SPACE | K << 30 | j and
+// holds the key of its first argument followed by the clause. Every
+// clause is also listed at INDEX_SPACE | hash(K, arg key) << 30 | j.
+// These leaves are lists of (K, arg key), as the hash isn't unique.
+// Clause leaves past n and empty index lists are removed (within the
+// batch of the commit, see triedb::begin_batch), so the root is the
+// same as if the predicate had been written from scratch. The number
+// of leaves above CLAUSE_SPACE is kept at CHUNKS_KEY.
+//
+static const uint64_t CLAUSE_SPACE = static_cast<uint64_t>(2) << 62;
+static const uint64_t INDEX_SPACE = static_cast<uint64_t>(3) << 62;
+static const size_t POSITION_BITS = 30;
+static const uint64_t MAX_CHUNKED_CLAUSES = (static_cast<uint64_t>(1) << POSITION_BITS) - 1;
+static const uint64_t CHUNKS_KEY = ~static_cast<uint64_t>(0);
 
-    if (blockchain_.program_root().is_zero()) {
-	return false;
+// Can't be the first clause of an inlined predicate (not callable)
+static const uint64_t CHUNKED = common::int_cell(0).raw_value();
+
+static inline uint64_t clause_key(uint64_t key, size_t index) {
+    return CLAUSE_SPACE | (key << POSITION_BITS) | index;
+}
+
+static inline uint64_t index_key(uint64_t key, uint64_t arg_key, size_t index) {
+    common::fast_hash h;
+    h << key << arg_key;
+    return INDEX_SPACE | (static_cast<uint64_t>(h.finalize()) << POSITION_BITS) | index;
+}
+
+// Key for the first argument index. It only needs to separate clauses
+// that can't match, so compound terms are keyed on their functor and
+// all bignums share one key. Variables (and no argument) get 0.
+uint64_t global::predicate_arg_key(term_env &env, term arg) {
+    if (arg == term()) {
+	return 0;
+    }
+    arg = env.deref(arg);
+    switch (arg.tag()) {
+    case tag_t::REF:
+    case tag_t::RFW:
+	return 0;
+    case tag_t::STR:
+	return env.functor(arg).raw_value();
+    case tag_t::BIG:
+	return static_cast<uint64_t>(tag_t::BIG);
+    default:
+	return arg.raw_value();
+    }
+}
+
+uint64_t global::symbol_hash(const std::string &name) {
+    common::fast_hash h1, h2;
+    h1 << name;
+    h2 << name << 1;
+    return (static_cast<uint64_t>(h1.finalize()) << 32) | h2.finalize();
+}
+
+uint64_t global::predicate_hash(const qname &qn) {
+    common::fast_hash h1, h2;
+    h1 << qn.first.raw_value() << qn.second.raw_value();
+    h2 << qn.first.raw_value() << qn.second.raw_value() << 1;
+    return (static_cast<uint64_t>(h1.finalize()) << 32) | h2.finalize();
+}
+
+directory<std::string, size_t> * global::symbols_directory() {
+    auto &db = blockchain_.symbols_db();
+    auto root = blockchain_.symbols_root();
+    if (root.is_zero()) {
+	return nullptr;
+    }
+    auto n = db.num_entries(root);
+    if (symbols_dir_.is_valid(root, n)) {
+	return &symbols_dir_;
+    }
+    // Pending changes of a batch aren't visible when iterating
+    if (db.in_batch(root)) {
+	return nullptr;
+    }
+    // Symbols are stored by index (below this) and by hash of the name
+    static const uint64_t HASHED_KEYS = 1 << 29;
+    symbols_dir_.rebuild(root, n / 2);
+    for (auto it = db.begin(root); !it.at_end(); ++it) {
+	auto &leaf = *it;
+	if (leaf.key() >= HASHED_KEYS) {
+	    break;
+	}
+	auto entry = db_custom_data_to_symbol_entry(leaf.custom_data());
+	symbols_dir_.add(symbol_hash(entry.second));
+    }
+    symbols_dir_.set_num_entries(root, n);
+    return &symbols_dir_;
+}
+
+directory<qname, uint64_t> * global::program_directory() {
+    auto &db = blockchain_.program_db();
+    auto root = blockchain_.program_root();
+    if (root.is_zero()) {
+	return nullptr;
+    }
+    auto n = db.num_entries(root);
+    if (program_dir_.is_valid(root, n)) {
+	return &program_dir_;
+    }
+    if (db.in_batch(root)) {
+	return nullptr;
+    }
+    // Predicates are at 32-bit keys (see below)
+    static const uint64_t PREDICATE_KEYS = static_cast<uint64_t>(1) << 32;
+    program_dir_.rebuild(root, n - db_num_program_chunks());
+    for (auto it = db.begin(root); !it.at_end(); ++it) {
+	auto &leaf = *it;
+	if (leaf.key() >= PREDICATE_KEYS) {
+	    break;
+	}
+	if (leaf.custom_data_size() < 2*sizeof(uint64_t)) {
+	    continue;
+	}
+	auto p = leaf.custom_data();
+	common::untagged_cell qfirst = common::read_uint64(p); p += sizeof(uint64_t);
+	common::untagged_cell qsecond = common::read_uint64(p);
+	qname qn(reinterpret_cast<common::con_cell &>(qfirst),
+		 reinterpret_cast<common::con_cell &>(qsecond));
+	program_dir_.add(predicate_hash(qn));
+    }
+    program_dir_.set_num_entries(root, n);
+    return &program_dir_;
+}
+
+void global::update_directories() {
+    auto symbols_root = blockchain_.symbols_root();
+    symbols_dir_.set_num_entries(symbols_root,
+		 blockchain_.symbols_db().num_entries(symbols_root));
+    auto program_root = blockchain_.program_root();
+    program_dir_.set_num_entries(program_root,
+		 blockchain_.program_db().num_entries(program_root));
+}
+
+void global::rollback_directories() {
+    symbols_dir_.rollback();
+    program_dir_.rollback();
+}
+
+bool global::db_find_predicate(const qname &qn, uint64_t &key,
+			       const db::triedb_leaf *&leaf, bool for_update) {
+    auto *dir = program_directory();
+    if (dir != nullptr) {
+	auto *cached = dir->find(qn);
+	if (cached != nullptr) {
+	    key = *cached;
+	    leaf = blockchain_.program_db().find(blockchain_.program_root(), key);
+	    if (leaf != nullptr) {
+		return true;
+	    }
+	} else if (!for_update && !dir->maybe_contains(predicate_hash(qn))) {
+	    leaf = nullptr;
+	    return true;
+	}
     }
-    
     // Max 10 collisions
-    size_t i;
-    const uint8_t *p = nullptr;
-    size_t custom_data_size = 0;
-    for (i = 0; i < 10; i++) {
+    for (size_t i = 0; i < 10; i++) {
 	common::fast_hash h;
 	h << qn.first.raw_value() << qn.second.raw_value() << i;
-	auto key = h.finalize();
-	auto leaf = blockchain_.program_db().find(
-						  blockchain_.program_root(), key);
+	key = h.finalize();
+	leaf = blockchain_.program_db().find(blockchain_.program_root(), key);
 	if (leaf == nullptr) {
-	    return false;
+	    return true;
+	}
+	auto p = leaf->custom_data();
+	if (leaf->custom_data_size() < 2*sizeof(uint64_t)) {
+	    continue;
 	}
-	p = leaf->custom_data();
-	custom_data_size = leaf->custom_data_size();
 	common::untagged_cell qfirst = common::read_uint64(p); p += sizeof(uint64_t);
 	common::untagged_cell qsecond = common::read_uint64(p); p += sizeof(uint64_t);
 	common::con_cell &qfirst_con = reinterpret_cast<common::con_cell &>(qfirst);
 	common::con_cell &qsecond_con = reinterpret_cast<common::con_cell &>(qsecond);
 	interp::qname qn_entry(qfirst_con, qsecond_con);
 	if (qn == qn_entry) {
-	    break;
+	    if (dir != nullptr) dir->insert(qn, key);
+	    return true;
 	}
     }
-    if (i == 10) {
+    return false;
+}
+
+static bool is_chunked(const db::triedb_leaf *leaf, uint64_t &num_clauses) {
+    if (leaf->custom_data_size() != 4*sizeof(uint64_t)) {
+	return false;
+    }
+    auto p = leaf->custom_data() + 2*sizeof(uint64_t);
+    if (common::read_uint64(p) != CHUNKED) {
 	return false;
     }
-    size_t n_bytes = custom_data_size - 2*sizeof(uint64_t);
+    num_clauses = common::read_uint64(p + sizeof(uint64_t));
+    return true;
+}
+
+uint64_t global::db_num_program_chunks() const {
+    auto leaf = blockchain_.program_db().find(blockchain_.program_root(), CHUNKS_KEY);
+    if (leaf == nullptr) {
+	return 0;
+    }
+    return common::read_uint64(leaf->custom_data());
+}
+
+void global::db_add_program_chunks(int64_t n) {
+    if (n == 0) {
+	return;
+    }
+    // The counter leaf counts itself (and goes with the last chunk)
+    auto num = db_num_program_chunks();
+    num = (num == 0) ? n + 1 : num + n;
+    if (num == 1) {
+	blockchain_.program_db().remove(blockchain_.program_root(), CHUNKS_KEY);
+	return;
+    }
+    uint8_t data[sizeof(uint64_t)];
+    common::write_uint64(data, num);
+    blockchain_.program_db().update(blockchain_.program_root(), CHUNKS_KEY,
+				    data, sizeof(data));
+}
+
+bool global::db_get_predicate_clause(uint64_t key, size_t index,
+				     uint64_t &arg_key, term &clause) const {
+    auto leaf = blockchain_.program_db().find(blockchain_.program_root(),
+					      clause_key(key, index));
+    if (leaf == nullptr || leaf->custom_data_size() != 2*sizeof(uint64_t)) {
+	return false;
+    }
+    auto p = leaf->custom_data();
+    arg_key = common::read_uint64(p); p += sizeof(uint64_t);
+    clause = common::cell(common::read_uint64(p));
+    return true;
+}
+
+void global::db_add_predicate_index(uint64_t key, uint64_t arg_key, size_t index) {
+    auto k = index_key(key, arg_key, index);
+    auto leaf = blockchain_.program_db().find(blockchain_.program_root(), k);
+    std::vector<uint8_t> data;
+    if (leaf != nullptr) {
+	data.assign(leaf->custom_data(), leaf->custom_data() + leaf->custom_data_size());
+    } else {
+	db_add_program_chunks(1);
+    }
+    data.resize(data.size() + 2*sizeof(uint64_t));
+    auto p = &data[data.size() - 2*sizeof(uint64_t)];
+    common::write_uint64(p, key); p += sizeof(uint64_t);
+    common::write_uint64(p, arg_key);
+    blockchain_.program_db().update(blockchain_.program_root(), k,
+				    &data[0], data.size());
+}
+
+void global::db_remove_predicate_index(uint64_t key, uint64_t arg_key, size_t index) {
+    auto k = index_key(key, arg_key, index);
+    auto leaf = blockchain_.program_db().find(blockchain_.program_root(), k);
+    if (leaf == nullptr) {
+	return;
+    }
+    std::vector<uint8_t> data;
+    auto p = leaf->custom_data();
+    auto n = leaf->custom_data_size() / (2*sizeof(uint64_t));
+    for (size_t i = 0; i < n; i++, p += 2*sizeof(uint64_t)) {
+	if (common::read_uint64(p) == key &&
+	    common::read_uint64(p + sizeof(uint64_t)) == arg_key) {
+	    continue;
+	}
+	data.insert(data.end(), p, p + 2*sizeof(uint64_t));
+    }
+    if (data.empty()) {
+	blockchain_.program_db().remove(blockchain_.program_root(), k);
+	db_add_program_chunks(-1);
+	return;
+    }
+    blockchain_.program_db().update(blockchain_.program_root(), k,
+				    &data[0], data.size());
+}
+
+// Remove the clauses (and their index entries) from 'from_index' on
+void global::db_remove_predicate_chunks(uint64_t key, const qname &qn,
+					size_t from_index, size_t num_clauses) {
+    bool indexed = qn.second.arity() > 0;
+    int64_t num_removed = 0;
+    for (size_t i = from_index; i < num_clauses; i++) {
+	uint64_t old_arg_key = 0;
+	term old_clause;
+	if (!db_get_predicate_clause(key, i, old_arg_key, old_clause)) {
+	    continue;
+	}
+	if (indexed) {
+	    db_remove_predicate_index(key, old_arg_key, i);
+	}
+	blockchain_.program_db().remove(blockchain_.program_root(), clause_key(key, i));
+	num_removed++;
+    }
+    db_add_program_chunks(-num_removed);
+}
+
+bool global::db_get_predicate(const qname &qn,
+			      std::vector<term> &clauses) {
+
+    if (blockchain_.program_root().is_zero()) {
+	return false;
+    }
+
+    uint64_t key = 0;
+    const db::triedb_leaf *leaf = nullptr;
+    if (!db_find_predicate(qn, key, leaf, false) || leaf == nullptr) {
+	return false;
+    }
+    uint64_t num_clauses = 0;
+    if (is_chunked(leaf, num_clauses)) {
+	for (size_t i = 0; i < num_clauses; i++) {
+	    uint64_t arg_key = 0;
+	    term clause;
+	    if (!db_get_predicate_clause(key, i, arg_key, clause)) {
+		throw global_db_exception("Missing clause " + boost::lexical_cast<std::string>(i) + " of predicate " + interp().to_string(qn));
+	    }
+	    clauses.push_back(clause);
+	}
+	return true;
+    }
+    auto p = leaf->custom_data() + 2*sizeof(uint64_t);
+    size_t n_bytes = leaf->custom_data_size() - 2*sizeof(uint64_t);
     size_t n_cells = n_bytes / sizeof(common::cell);
-    for (i = 0; i < n_cells; i++) {
+    for (size_t i = 0; i < n_cells; i++) {
 	common::cell c(common::read_uint64(p)); p += sizeof(uint64_t);
 	clauses.push_back(c);
     }
     return true;
 }
-	
-bool global::db_set_predicate(const qname &qn,
-			      const std::vector<term> &clauses) { 
-    static const size_t MAX_CLAUSES = 32;
-    if (clauses.size() > MAX_CLAUSES) {
+
+bool global::db_get_predicate_matching(const qname &qn, term first_arg,
+			       std::vector<std::pair<size_t, term> > &clauses) {
+    if (blockchain_.program_root().is_zero() || qn.second.arity() == 0) {
 	return false;
-    }   
+    }
+    uint64_t key = 0;
+    const db::triedb_leaf *leaf = nullptr;
+    uint64_t num_clauses = 0;
+    if (!db_find_predicate(qn, key, leaf, false) || leaf == nullptr ||
+	!is_chunked(leaf, num_clauses)) {
+	return false;
+    }
+    auto arg_key = predicate_arg_key(interp(), first_arg);
+    if (arg_key == 0) {
+	return false;
+    }
 
-    // Max 10 collisions
-    size_t i;
-    uint64_t key;
-    for (i = 0; i < 10; i++) {
-	common::fast_hash h;
-	h << qn.first.raw_value() << qn.second.raw_value() << i;
-	key = h.finalize();
-	auto leaf = blockchain_.program_db().find(
-						  blockchain_.program_root(), key);
-	if (leaf == nullptr) {
-	    break;
+    // Clauses with the same key and clauses with a variable (in order)
+    auto &pdb = blockchain_.program_db();
+    auto root = blockchain_.program_root();
+    std::vector<size_t> indices;
+    for (auto k : {arg_key, static_cast<uint64_t>(0)}) {
+	auto from = index_key(key, k, 0);
+	auto to = from + MAX_CHUNKED_CLAUSES;
+	for (auto it = pdb.begin(root, from); !it.at_end(); ++it) {
+	    auto &entry = *it;
+	    if (entry.key() >= to) {
+		break;
+	    }
+	    auto index = static_cast<size_t>(entry.key() - from);
+	    if (index >= num_clauses) {
+		continue;
+	    }
+	    auto p = entry.custom_data();
+	    auto n = entry.custom_data_size() / (2*sizeof(uint64_t));
+	    for (size_t i = 0; i < n; i++, p += 2*sizeof(uint64_t)) {
+		if (common::read_uint64(p) == key &&
+		    common::read_uint64(p + sizeof(uint64_t)) == k) {
+		    indices.push_back(index);
+		    break;
+		}
+	    }
 	}
-	auto p = leaf->custom_data();
-	common::untagged_cell qfirst = common::read_uint64(p); p += sizeof(uint64_t);
-	common::untagged_cell qsecond = common::read_uint64(p); p += sizeof(uint64_t);
-	common::con_cell &qfirst_con = reinterpret_cast<common::con_cell &>(qfirst);
-	common::con_cell &qsecond_con = reinterpret_cast<common::con_cell &>(qsecond);
-	interp::qname qn_entry(qfirst_con, qsecond_con);
-	if (qn == qn_entry) {
-	    break;
+    }
+    std::sort(indices.begin(), indices.end());
+
+    for (auto index : indices) {
+	uint64_t clause_arg_key = 0;
+	term clause;
+	if (!db_get_predicate_clause(key, index, clause_arg_key, clause)) {
+	    throw global_db_exception("Missing clause " + boost::lexical_cast<std::string>(index) + " of predicate " + interp().to_string(qn));
 	}
+	clauses.push_back(std::make_pair(index, clause));
     }
-    if (i == 10) {
+    return true;
+}
+
+bool global::db_set_predicate(const qname &qn,
+			      const std::vector<term> &clauses,
+			      const std::vector<term> *stored) {
+    uint64_t key = 0;
+    const db::triedb_leaf *leaf = nullptr;
+    if (!db_find_predicate(qn, key, leaf, true)) {
 	return false;
     }
-    uint8_t custom_data[2*sizeof(uint64_t)+MAX_CLAUSES*sizeof(common::cell)];
+    if (leaf == nullptr) {
+	auto *dir = program_directory();
+	if (dir != nullptr) {
+	    dir->add(predicate_hash(qn));
+	    dir->insert(qn, key);
+	}
+    }
+    if (clauses.size() > MAX_INLINE_CLAUSES) {
+	return db_set_predicate_chunked(key, qn, clauses, stored);
+    }
+    uint64_t num_clauses = 0;
+    if (leaf != nullptr && is_chunked(leaf, num_clauses)) {
+	// Shrunk enough to be inlined again
+	db_remove_predicate_chunks(key, qn, 0, num_clauses);
+    }
+
+    uint8_t custom_data[2*sizeof(uint64_t)+MAX_INLINE_CLAUSES*sizeof(common::cell)];
     uint8_t *p = &custom_data[0];
     common::write_uint64(p, qn.first.raw_value()); p += sizeof(uint64_t);
     common::write_uint64(p, qn.second.raw_value()); p += sizeof(uint64_t);
@@ -147,6 +497,297 @@ bool global::db_set_predicate(const qname &qn,
     return true;
 }
 
+bool global::db_set_predicate_chunked(uint64_t key, const qname &qn,
+				      const std::vector<term> &all_clauses,
+				      const std::vector<term> *stored) {
+    // Erased clauses take no space here
+    std::vector<term> clauses;
+    clauses.reserve(all_clauses.size());
+    for (auto c : all_clauses) {
+	if (c != term()) clauses.push_back(c);
+    }
+    if (clauses.size() > MAX_CHUNKED_CLAUSES) {
+	return false;
+    }
+
+    uint64_t num_old = 0;
+    auto leaf = blockchain_.program_db().find(blockchain_.program_root(), key);
+    if (leaf != nullptr && !is_chunked(leaf, num_old)) {
+	// Switching from inlined clauses
+	num_old = 0;
+    }
+    if (stored != nullptr && stored->size() != num_old) {
+	stored = nullptr;
+    }
+
+    bool indexed = qn.second.arity() > 0;
+    auto &env = interp();
+    int64_t num_new_chunks = 0;
+    size_t n = clauses.size();
+    for (size_t i = 0; i < n; i++) {
+	auto clause = clauses[i];
+	uint64_t old_arg_key = 0;
+	term old_clause;
+	bool has_old = false;
+	if (i < num_old) {
+	    if (stored != nullptr) {
+		old_clause = (*stored)[i];
+		if (old_clause == clause) {
+		    continue;
+		}
+	    }
+	    has_old = db_get_predicate_clause(key, i, old_arg_key, old_clause);
+	    if (has_old && old_clause == clause) {
+		continue;
+	    }
+	} else {
+	    has_old = db_get_predicate_clause(key, i, old_arg_key, old_clause);
+	}
+	if (!has_old) {
+	    num_new_chunks++;
+	}
+	auto arg_key = predicate_arg_key(env, env.clause_first_arg(clause));
+	uint8_t data[2*sizeof(uint64_t)];
+	common::write_uint64(data, arg_key);
+	common::write_uint64(data + sizeof(uint64_t), clause.raw_value());
+	blockchain_.program_db().update(blockchain_.program_root(),
+					clause_key(key, i), data, sizeof(data));
+	if (indexed) {
+	    if (has_old && i < num_old) {
+		if (old_arg_key == arg_key) {
+		    continue;
+		}
+		db_remove_predicate_index(key, old_arg_key, i);
+	    }
+	    db_add_predicate_index(key, arg_key, i);
+	}
+    }
+    db_add_program_chunks(num_new_chunks);
+    if (n < num_old) {
+	db_remove_predicate_chunks(key, qn, n, num_old);
+    }
+
+    uint8_t custom_data[4*sizeof(uint64_t)];
+    uint8_t *p = &custom_data[0];
+    common::write_uint64(p, qn.first.raw_value()); p += sizeof(uint64_t);
+    common::write_uint64(p, qn.second.raw_value()); p += sizeof(uint64_t);
+    common::write_uint64(p, CHUNKED); p += sizeof(uint64_t);
+    common::write_uint64(p, n);
+    blockchain_.program_db().update(blockchain_.program_root(), key,
+				    custom_data, sizeof(custom_data));
+    return true;
+}
+
+//
+// The address index lets a wallet find its closures without scanning
+// all of them. It's node local (a separate DB, see
+// blockchain::index_db) and not part of any root hash, so it can
+// change without affecting consensus:
+//
+//    ADDRESS_SPACE | hash(address) >> 2  => sorted heap addresses
+//    FILTER_SPACE | height               => from addr, to addr, filter
+//
+// The address of a closure is the last of the script arguments of
+// tx/5 (e.g. PubKeyAddr of tx1.) The filter is a golomb_filter of the
+// addresses of the closures frozen in that block, with the range of
+// their heap addresses. Different addresses may share a list (the hash
+// is truncated), so a lookup may return a few closures too many.
+//
+// Each closure root has its own index root (derived from the index
+// root of the previous closure root), so the index follows the tip
+// on a reorg. The first root of the index DB maps closure root ids
+// to index root ids. Closures that came by a state sync (without
+// a previous index root) are not indexed.
+//
+static const uint64_t ADDRESS_SPACE = static_cast<uint64_t>(2) << 62;
+static const uint64_t FILTER_SPACE = static_cast<uint64_t>(3) << 62;
+
+static inline uint64_t address_key(uint64_t address_hash) {
+    return ADDRESS_SPACE | (address_hash >> 2);
+}
+
+static inline uint64_t filter_key(size_t height) {
+    return FILTER_SPACE | height;
+}
+
+bool global::closure_address(term_env &env, term closure, uint64_t &hash) {
+    // ':'('$freeze', F) where F holds the variables of tx/5's freeze
+    static const con_cell COLON(":", 2);
+    static const size_t SCRIPT_ARGS = 5;
+
+    closure = env.deref(closure);
+    if (closure.tag() != tag_t::STR || env.functor(closure) != COLON) {
+	return false;
+    }
+    auto f = env.deref(env.arg(closure, 1));
+    if (f.tag() != tag_t::STR || env.functor(f).arity() <= SCRIPT_ARGS) {
+	return false;
+    }
+    auto args = env.deref(env.arg(f, SCRIPT_ARGS));
+    if (args.tag() != tag_t::STR || env.functor(args).arity() == 0) {
+	return false;
+    }
+    auto address = env.deref(env.arg(args, env.functor(args).arity() - 1));
+    if (address.tag() != tag_t::BIG) {
+	return false;
+    }
+    auto &big = reinterpret_cast<big_cell &>(address);
+    size_t n = env.num_bytes(big);
+    std::vector<uint8_t> bytes(n);
+    env.get_big(big, &bytes[0], n);
+    hash = golomb_filter::hash(&bytes[0], n);
+    return true;
+}
+
+db::root_id global::db_index_root(const db::root_id &closure_root) const {
+    auto &idb = blockchain_.index_db();
+    if (idb.is_empty() || closure_root.is_zero()) {
+	return db::root_id();
+    }
+    auto map_root = *idb.find_roots(0).begin();
+    auto leaf = idb.find(map_root, closure_root.value());
+    if (leaf == nullptr) {
+	return db::root_id();
+    }
+    return db::root_id(common::read_uint64(leaf->custom_data()));
+}
+
+db::root_id global::db_new_index_root() {
+    auto &idb = blockchain_.index_db();
+    if (idb.is_empty()) {
+	idb.new_root(); // The root map
+    }
+    auto closure_root = blockchain_.closure_root();
+    auto index_root = db_index_root(closure_root);
+    if (!index_root.is_zero()) {
+	return index_root;
+    }
+    const db::triedb &closure_db = blockchain_.closure_db();
+    auto parent = db_index_root(closure_db.get_root(closure_root).previous_id());
+    index_root = parent.is_zero() ? idb.new_root() : idb.new_root(parent);
+    uint8_t data[sizeof(uint64_t)];
+    common::write_uint64(data, index_root.value());
+    idb.update(*idb.find_roots(0).begin(), closure_root.value(), data, sizeof(data));
+    return index_root;
+}
+
+void global::db_get_address_closures(uint64_t address_hash,
+				     std::vector<size_t> &addrs) const {
+    auto index_root = db_index_root(blockchain_.closure_root());
+    if (index_root.is_zero()) {
+	return;
+    }
+    auto leaf = blockchain_.index_db().find(index_root, address_key(address_hash));
+    if (leaf == nullptr) {
+	return;
+    }
+    auto n = leaf->custom_data_size() / sizeof(uint64_t);
+    auto p = leaf->custom_data();
+    for (size_t i = 0; i < n; i++, p += sizeof(uint64_t)) {
+	addrs.push_back(common::read_uint64(p));
+    }
+}
+
+void global::db_index_closures(size_t height,
+		const std::vector<std::pair<size_t, uint64_t> > &added,
+		const std::vector<std::pair<size_t, uint64_t> > &removed) {
+    // Also for blocks without closures, so that the next block has a
+    // previous index root.
+    auto index_root = db_new_index_root();
+    auto &idb = blockchain_.index_db();
+
+    // The lists that change, with whether they were there
+    std::map<uint64_t, std::pair<bool, std::vector<size_t> > > lists;
+    auto list_of = [&](uint64_t address_hash) -> std::pair<bool, std::vector<size_t> > & {
+	auto key = address_key(address_hash);
+	auto it = lists.find(key);
+	if (it != lists.end()) {
+	    return it->second;
+	}
+	auto &lst = lists[key];
+	db_get_address_closures(address_hash, lst.second);
+	lst.first = !lst.second.empty();
+	return lst;
+    };
+
+    for (auto &r : removed) {
+	auto &addrs = list_of(r.second).second;
+	auto it = std::lower_bound(addrs.begin(), addrs.end(), r.first);
+	if (it != addrs.end() && *it == r.first) {
+	    addrs.erase(it);
+	}
+    }
+    for (auto &a : added) {
+	auto &addrs = list_of(a.second).second;
+	auto it = std::lower_bound(addrs.begin(), addrs.end(), a.first);
+	if (it == addrs.end() || *it != a.first) {
+	    addrs.insert(it, a.first);
+	}
+    }
+
+    std::vector<uint8_t> data;
+    for (auto &e : lists) {
+	auto existed = e.second.first;
+	auto &addrs = e.second.second;
+	if (addrs.empty()) {
+	    if (existed) {
+		idb.remove(index_root, e.first);
+	    }
+	    continue;
+	}
+	data.resize(addrs.size() * sizeof(uint64_t));
+	auto p = &data[0];
+	for (auto addr : addrs) {
+	    common::write_uint64(p, addr);
+	    p += sizeof(uint64_t);
+	}
+	idb.update(index_root, e.first, &data[0], data.size());
+    }
+
+    if (!added.empty()) {
+	std::vector<uint64_t> hashes;
+	size_t from_addr = added.front().first, to_addr = from_addr;
+	for (auto &a : added) {
+	    hashes.push_back(a.second);
+	    from_addr = std::min(from_addr, a.first);
+	    to_addr = std::max(to_addr, a.first);
+	}
+	golomb_filter filter(hashes);
+	data.resize(2*sizeof(uint64_t));
+	common::write_uint64(&data[0], from_addr);
+	common::write_uint64(&data[sizeof(uint64_t)], to_addr + 1);
+	data.insert(data.end(), filter.bytes().begin(), filter.bytes().end());
+	idb.update(index_root, filter_key(height), &data[0], data.size());
+    }
+}
+
+void global::db_get_closure_filters(size_t height, size_t k,
+				    std::vector<closure_filter> &filters) const {
+    auto index_root = db_index_root(blockchain_.closure_root());
+    if (index_root.is_zero() || k == 0) {
+	return;
+    }
+    // Only blocks that froze closures have a filter, so we go
+    // directly to the next one.
+    auto &idb = blockchain_.index_db();
+    for (auto it = idb.begin(index_root, filter_key(height)); !it.at_end(); ++it) {
+	auto &leaf = *it;
+	if (leaf.custom_data_size() < 2*sizeof(uint64_t)) {
+	    continue;
+	}
+	auto p = leaf.custom_data();
+	closure_filter f;
+	f.height = static_cast<size_t>(leaf.key() - FILTER_SPACE);
+	f.from_addr = common::read_uint64(p);
+	f.to_addr = common::read_uint64(p + sizeof(uint64_t));
+	f.filter.assign(p + 2*sizeof(uint64_t), p + leaf.custom_data_size());
+	filters.push_back(f);
+	if (filters.size() == k) {
+	    break;
+	}
+    }
+}
+
 term global::db_get_block(term_env &dst, const meta_id &root_id, bool raw) {
     auto *e = blockchain_.get_meta_entry(root_id);
     if (e == nullptr) {
@@ -181,6 +822,18 @@ term global::db_get_block(term_env &dst, const meta_entry &e, bool raw) {
 
 void global::db_set_block(size_t height, const term_serializer::buffer_t &buf)
 {
+    if (term_serializer::format_of(buf, buf.size()) != block_format_) {
+	term_env env;
+	term_serializer ser(env);
+	auto goals = ser.read(buf);
+	term_serializer::buffer_t converted;
+	term_serializer conv(env, block_format_);
+	conv.set_compress(true);
+	conv.write(converted, goals);
+	blockchain_.blocks_db().update(blockchain_.blocks_root(), height,
+				       &converted[0], converted.size());
+	return;
+    }
     blockchain_.blocks_db().update(blockchain_.blocks_root(), height,
 				   &buf[0], buf.size());
 }
@@ -398,6 +1051,11 @@ bool global::db_parse_meta(term_env &src, term meta_term, meta_entry &entry)
     return true;
 }
 
+static global_db_exception pow_check_failed(const meta_entry &entry) {
+    std::string short_id = boost::lexical_cast<std::string>(entry.get_height()) + "(" + hex::to_string(entry.get_id().hash(), 2) + ")";
+    return global_db_exception("PoW check failed for " + short_id);
+}
+
 bool global::db_put_meta(term_env &src, term meta_term) {
     meta_entry entry;
     
@@ -406,10 +1064,14 @@ bool global::db_put_meta(term_env &src, term meta_term) {
     }
     
     if (!entry.validate_pow(pow_mode_)) {
-	std::string short_id = boost::lexical_cast<std::string>(entry.get_height()) + "(" + hex::to_string(entry.get_id().hash(), 2) + ")";
-	throw global_db_exception("PoW check failed for " + short_id);
+	throw pow_check_failed(entry);
     }
 
+    db_add_meta(src, entry);
+    return true;
+}
+
+void global::db_add_meta(term_env &src, meta_entry &entry) {
     auto &previd = entry.get_previous_id();
     if (!previd.is_zero() &&
 	blockchain_.get_meta_entry(previd) == nullptr) {
@@ -423,8 +1085,6 @@ bool global::db_put_meta(term_env &src, term meta_term) {
 	    blockchain_.add_meta_entry(entry);
 	}
     }
-
-    return true;
 }
 
 size_t global::db_get_meta_length(const meta_id &root_id, size_t lookahead_n) {
@@ -692,11 +1352,42 @@ term global::db_best_path(term_env &dst, const meta_id &root_id, size_t n)
 
 void global::db_put_metas(term_env &src, term lst)
 {
+    // Parse all entries first, so their proofs can be verified in
+    // parallel. A parse error is raised once the entries before it
+    // have been added (as if they were put one by one.)
+    std::vector<meta_entry> entries;
+    std::exception_ptr parse_error;
     while (src.is_dotted_pair(lst)) {
 	auto meta_term = src.arg(lst, 0);
-	db_put_meta(src, meta_term);
+	meta_entry entry;
+	try {
+	    if (db_parse_meta(src, meta_term, entry)) {
+		entries.push_back(entry);
+	    }
+	} catch (...) {
+	    parse_error = std::current_exception();
+	    break;
+	}
 	lst = src.arg(lst, 1);
     }
+
+    std::vector<const meta_entry *> to_validate;
+    for (auto &entry : entries) {
+	to_validate.push_back(&entry);
+    }
+    std::vector<bool> valid;
+    meta_entry::validate_pows(to_validate, pow_mode_, valid);
+
+    for (size_t i = 0; i < entries.size(); i++) {
+	if (!valid[i]) {
+	    throw pow_check_failed(entries[i]);
+	}
+	db_add_meta(src, entries[i]);
+    }
+
+    if (parse_error) {
+	std::rethrow_exception(parse_error);
+    }
 }
 
 size_t global::current_height() const {
@@ -712,11 +1403,25 @@ void global::increment_height()
     get_blockchain().set_version(commit_version_);
     get_blockchain().set_height(commit_height_);
     get_blockchain().set_time(commit_time_);
-    get_blockchain().advance();
-    interp().commit_heap();
-    interp().commit_closures();
-    interp().commit_symbols();
-    interp().commit_program();
+    auto symbols_root = blockchain_.symbols_root();
+    auto program_root = blockchain_.program_root();
+    symbols_dir_.begin();
+    program_dir_.begin();
+    try {
+	get_blockchain().advance();
+	symbols_dir_.advance(symbols_root, blockchain_.symbols_root());
+	program_dir_.advance(program_root, blockchain_.program_root());
+	interp().commit_heap();
+	interp().commit_closures();
+	interp().commit_symbols();
+	interp().commit_program();
+	update_directories();
+    } catch (...) {
+	rollback_directories();
+	throw;
+    }
+    symbols_dir_.commit();
+    program_dir_.commit();
     db_set_block(current_height(), commit_goals_);
     init_empty_goals();
     get_blockchain().update_tip();
@@ -776,7 +1481,42 @@ void global::setup_commit(const term_serializer::buffer_t &buf) {
     }
 }
 
+//
+// With deferred verification the signature checks succeed while the
+// goal runs and are verified together afterwards. If that fails, or
+// the goal fails having queued signatures, the goal is run again with
+// immediate checks, which decides. (A failed check could have led
+// the goal into another branch.)
+//
 bool global::execute_commit(const term_serializer::buffer_t &buf) {
+    if (deferred_verify_) {
+	auto &ip = interp();
+	std::exception_ptr ex;
+	bool ok = false;
+	ec::builtins::set_deferred_verify(ip, true);
+	try {
+	    ok = execute_goal_silent(buf);
+	} catch (...) {
+	    ex = std::current_exception();
+	}
+	ec::builtins::set_deferred_verify(ip, false);
+	if (ec::builtins::num_deferred(ip) == 0) {
+	    if (ex) {
+		std::rethrow_exception(ex);
+	    }
+	    if (!ok) {
+		discard();
+		return false;
+	    }
+	}
+	if (ok && ec::builtins::verify_deferred(ip)) {
+	    commit_goals_ = buf;
+	    advance();
+	    return true;
+	}
+	discard();
+    }
+
     if (!execute_goal_silent(buf)) {
 	discard();
 	return false;
@@ -11,6 +11,7 @@
 #include "../db/triedb.hpp"
 #include "global_interpreter.hpp"
 #include "blockchain.hpp"
+#include "directory.hpp"
 #include <unordered_map>
 
 namespace epilog { namespace global {
@@ -129,6 +130,20 @@ public:
     void setup_commit(const meta_entry &entry);
     void setup_commit(const buffer_t &buf);
     bool execute_commit(const buffer_t &buf);
+
+    // Serialization format of new blocks. Each block records its own
+    // format, so old blocks remain readable. Note that the format
+    // affects the blocks root.
+    inline common::term_serializer::format_t block_format() const
+    { return block_format_; }
+    inline void set_block_format(common::term_serializer::format_t f)
+    { block_format_ = f; }
+
+    // Check the signatures of a block together (and in parallel) after
+    // its goals have run, instead of one at a time (see execute_commit.)
+    inline bool is_deferred_verify() const { return deferred_verify_; }
+    inline void set_deferred_verify(bool on) { deferred_verify_ = on; }
+
     bool wrap_fees(term_env &src, term &goals, term fee_coin, term to_add);
 
     inline void execute_cut() {
@@ -166,6 +181,7 @@ public:
     void discard() {
 	check_interp();
 	interp_->discard_changes();
+	rollback_directories();
     }
 
     blockchain & get_blockchain() {
@@ -181,6 +197,8 @@ public:
 	auto leaf = blockchain_.heap_db().find( blockchain_.heap_root(),
 						block_index );
 	common::heap_block *block = new common::heap_block(env(), block_index);
+	// Only the changed chunks are stored back (see db_set_heap_block)
+	block->set_track_dirty(true);
 	custom_data_to_heap_block(leaf->custom_data(),
 				  leaf->custom_data_size(), *block);
 	return block;
@@ -190,8 +208,22 @@ public:
 	uint8_t custom_data[common::heap_block::MAX_SIZE*sizeof(common::cell)];
 	size_t custom_data_size = 0;
 	heap_block_to_custom_data(*block, custom_data, custom_data_size);
+	if (!block->is_track_dirty()) {
+	    blockchain_.heap_db().update(blockchain_.heap_root(), block_index,
+					 custom_data, custom_data_size);
+	    return;
+	}
+	// Only the dirty chunks need to be stored as a delta
+	db::leaf_ranges changed;
+	const size_t chunk_bytes = common::heap_block::DIRTY_CHUNK_SIZE
+	                           * sizeof(common::cell);
+	for (size_t i = 0; i < common::heap_block::NUM_DIRTY_CHUNKS; i++) {
+	    if (block->is_dirty_chunk(i)) {
+		changed.push_back(std::make_pair(i*chunk_bytes, chunk_bytes));
+	    }
+	}
 	blockchain_.heap_db().update(blockchain_.heap_root(), block_index,
-				     custom_data, custom_data_size);
+				     custom_data, custom_data_size, changed);
     }  
 
     //
@@ -266,6 +298,16 @@ public:
 	if (blockchain_.symbols_root().is_zero()) {
 	    return 0;
 	}
+	auto *dir = symbols_directory();
+	if (dir != nullptr) {
+	    auto *index = dir->find(name);
+	    if (index != nullptr) {
+		return *index;
+	    }
+	    if (!dir->maybe_contains(symbol_hash(name))) {
+		return 0;
+	    }
+	}
 	// Maximum 10 hash collisions before we give up
 	for (size_t i = 0; i < 10; i++) {
 	    common::fast_hash h;
@@ -280,6 +322,7 @@ public:
 	    std::string symbol_name;
 	    std::tie(symbol_index, symbol_name) = db_custom_data_to_symbol_entry(leaf->custom_data());
 	    if (symbol_name == name) {
+		if (dir != nullptr) dir->insert(name, symbol_index);
 		return symbol_index;
 	    }
 	}
@@ -324,6 +367,11 @@ public:
 		blockchain_.symbols_root(), index,
 		custom_data, custom_data_size);
 
+	auto *dir = symbols_directory();
+	if (dir != nullptr) {
+	    dir->add(symbol_hash(name));
+	    dir->insert(name, index);
+	}
 	return true;
     }
 
@@ -334,7 +382,8 @@ public:
 	if (blockchain_.program_root().is_zero()) {
 	    return 0;
 	}
-	return common::checked_cast<size_t>(blockchain_.program_db().num_entries(blockchain_.program_root()));
+	auto n = blockchain_.program_db().num_entries(blockchain_.program_root());
+	return common::checked_cast<size_t>(n - db_num_program_chunks());
     }
 
     size_t num_predicates() {
@@ -354,11 +403,31 @@ public:
 	return interp().num_frozen_closures();
     }
 
+    //
+    // Predicates with at most MAX_INLINE_CLAUSES clauses are stored
+    // in a single leaf. Larger predicates get one leaf per clause plus
+    // an index on the first argument, so that a call can load only
+    // the clauses that may match (see db_get_predicate_matching.)
+    //
+    static const size_t MAX_INLINE_CLAUSES = 32;
+
+    // Key of the first argument index (0 for variables.)
+    static uint64_t predicate_arg_key(term_env &env, term arg);
+
     bool db_get_predicate(const interp::qname &qn,
 			  std::vector<common::term> &clauses);
 
+    // Clauses (with their position) whose first argument may unify
+    // with 'first_arg'. Returns false if the predicate isn't indexed.
+    bool db_get_predicate_matching(const interp::qname &qn,
+				   common::term first_arg,
+			   std::vector<std::pair<size_t, common::term> > &clauses);
+
+    // 'stored' (if known) is what db_get_predicate returned. Then only
+    // the clauses that differ are written.
     bool db_set_predicate(const interp::qname &qn,
-			  const std::vector<common::term> &clauses);
+			  const std::vector<common::term> &clauses,
+			  const std::vector<common::term> *stored = nullptr);
 
     //
     // Closures
@@ -385,6 +454,37 @@ public:
 					 buffer, sizeof(buffer));
     }
 
+    //
+    // Address index of the closures (see global.cpp.) It's kept in
+    // a node local DB, so it doesn't affect the closure root.
+    //
+
+    // Hash of the address a closure pays to (false if it has none)
+    static bool closure_address(term_env &env, term closure, uint64_t &hash);
+
+    // Index the closures (heap address, address hash) frozen and
+    // removed in the block at 'height'.
+    void db_index_closures(size_t height,
+		   const std::vector<std::pair<size_t, uint64_t> > &added,
+		   const std::vector<std::pair<size_t, uint64_t> > &removed);
+
+    // Sorted heap addresses of the closures paying to this address
+    void db_get_address_closures(uint64_t address_hash,
+				 std::vector<size_t> &addrs) const;
+
+    // The golomb_filter of the addresses frozen in a block and their
+    // heap address range.
+    struct closure_filter {
+	size_t height;
+	size_t from_addr, to_addr;
+	std::vector<uint8_t> filter;
+    };
+
+    // The filters of (at most) the next 'k' blocks from 'height' on
+    // that froze closures.
+    void db_get_closure_filters(size_t height, size_t k,
+				std::vector<closure_filter> &filters) const;
+
     //
     // Goal block (these corresponds to "blocks" in traditional
     // cryptocurrencies.) I renamed them to goals to match the
@@ -408,6 +508,33 @@ public:
     bool db_get_block_hash(common::term_env &src, common::term meta_term, db::node_hash &hash);
 
 private:
+    void db_add_meta(common::term_env &src, meta_entry &entry);
+
+    // Directories of the symbols and the predicates at the current
+    // root (nullptr if it can't be used right now.)
+    static uint64_t symbol_hash(const std::string &name);
+    static uint64_t predicate_hash(const interp::qname &qn);
+    directory<std::string, size_t> * symbols_directory();
+    directory<interp::qname, uint64_t> * program_directory();
+    void rollback_directories();
+    void update_directories();
+
+    bool db_find_predicate(const interp::qname &qn, uint64_t &key,
+			   const db::triedb_leaf *&leaf, bool for_update);
+    uint64_t db_num_program_chunks() const;
+    db::root_id db_index_root(const db::root_id &closure_root) const;
+    db::root_id db_new_index_root();
+    bool db_set_predicate_chunked(uint64_t key, const interp::qname &qn,
+				  const std::vector<common::term> &clauses,
+				  const std::vector<common::term> *stored);
+    bool db_get_predicate_clause(uint64_t key, size_t index,
+				 uint64_t &arg_key, common::term &clause) const;
+    void db_add_predicate_index(uint64_t key, uint64_t arg_key, size_t index);
+    void db_remove_predicate_index(uint64_t key, uint64_t arg_key, size_t index);
+    void db_remove_predicate_chunks(uint64_t key, const interp::qname &qn,
+				    size_t from_index, size_t num_clauses);
+    void db_add_program_chunks(int64_t n);
+
     void custom_data_to_heap_block(const uint8_t *custom_data,
 				   size_t custom_data_size,
 				   common::heap_block &blk) {
@@ -418,9 +545,11 @@ private:
 	    *dst = common::cell(common::read_uint64(src));
 	}
 	blk.trim(n);
+	// Same as what is stored
+	blk.clear_changed();
     }
 
-    void heap_block_to_custom_data(common::heap_block &blk,
+    void heap_block_to_custom_data(const common::heap_block &blk,
 				   uint8_t *custom_data,
 				   size_t &custom_data_size) {
 	auto n = blk.size();
@@ -442,6 +571,13 @@ private:
     uint64_t commit_nonce_;
     common::utime commit_time_;
     buffer_t commit_goals_;
+    common::term_serializer::format_t block_format_;
+    bool deferred_verify_;
+
+    static const size_t SYMBOLS_CACHE_SIZE = 256*1024;
+    static const size_t PROGRAM_CACHE_SIZE = 64*1024;
+    directory<std::string, size_t> symbols_dir_;
+    directory<interp::qname, uint64_t> program_dir_;
 };
 
 }}
@@ -17,7 +17,7 @@ global_interpreter::global_interpreter(global &g)
       current_block_index_(static_cast<size_t>(-2)),
       current_block_(nullptr),
       block_flusher_(),
-      block_cache_(global::BLOCK_CACHE_SIZE / heap_block::MAX_SIZE / sizeof(cell), block_flusher_),
+      block_cache_(global::BLOCK_CACHE_SIZE / sizeof(heap_block), block_flusher_),
       new_predicates_(0),
       new_frozen_closures_(0),
       old_heap_size_(0),
@@ -26,6 +26,7 @@ global_interpreter::global_interpreter(global &g)
       next_predicate_id_(0),
       start_next_predicate_id_(0)
 {
+    block_cache_.set_max_bytes(global::BLOCK_CACHE_SIZE);
     set_auto_wam(true);
 }
 
@@ -77,6 +78,8 @@ void global_interpreter::total_reset()
     modified_blocks_.clear();
     updated_predicates_.clear();
     old_predicates_.clear();
+    partial_predicates_.clear();
+    stored_clauses_.clear();
     modified_closures_.clear();
 
     global::erase_db(get_global().data_dir());
@@ -85,12 +88,20 @@ void global_interpreter::total_reset()
 }
 
 void global_interpreter::load_predicate(const interp::qname &qn) {
+    auto *pred = internal_get_predicate(qn);
+    if (pred->is_partial()) {
+	pred->clear();
+	pred->set_partial(false);
+	partial_predicates_.erase(qn);
+    }
     std::vector<term> clauses;
     if (get_global().db_get_predicate(qn, clauses)) {
-	auto *pred = internal_get_predicate(qn);
 	for (auto clause : clauses) {
 	    pred->add_clause(*this, clause);
 	}
+	if (clauses.size() > global::MAX_INLINE_CLAUSES) {
+	    stored_clauses_[qn] = clauses;
+	}
     } else {
 	// The predicate was not found, but maybe there's an inherited
 	// system predicate available? Of course, the global interpreter
@@ -105,7 +116,6 @@ void global_interpreter::load_predicate(const interp::qname &qn) {
 	static const con_cell SYSTEM("system",0);
 	interp::qname imported_qn(SYSTEM, qn.second);
 	if (get_global().db_get_predicate(imported_qn, clauses)) {
-	    auto *pred = internal_get_predicate(qn);
 	    for (auto clause : clauses) {
 		pred->add_clause(*this, clause);
 	    }
@@ -114,6 +124,66 @@ void global_interpreter::load_predicate(const interp::qname &qn) {
     }
 }
 
+bool global_interpreter::load_predicate_matching(const interp::qname &qn,
+						 term first_arg) {
+    auto *pred = internal_get_predicate(qn);
+    if (!pred->is_partial() && !pred->empty()) {
+	return true;
+    }
+    auto arg_key = global::predicate_arg_key(*this, first_arg);
+    if (arg_key == 0) {
+	return false;
+    }
+    auto found = partial_predicates_.find(qn);
+    if (found != partial_predicates_.end() &&
+	found->second.keys.count(arg_key)) {
+	return true;
+    }
+    std::vector<std::pair<size_t, term> > clauses;
+    if (!get_global().db_get_predicate_matching(qn, first_arg, clauses)) {
+	return false;
+    }
+
+    bool is_new = found == partial_predicates_.end();
+    auto &partial = is_new ? partial_predicates_[qn] : found->second;
+    if (is_new) {
+	partial.last_var_clause = 0;
+    }
+    partial.keys.insert(arg_key);
+
+    // Clauses with other keys never match this call, so new clauses can
+    // be appended as long as they come after the clauses with variables
+    // (which are loaded with the first key.)
+    bool append = true;
+    std::vector<term> added;
+    for (auto &c : clauses) {
+	if (!partial.clauses.insert(c).second) {
+	    continue;
+	}
+	added.push_back(c.second);
+	if (is_new) {
+	    auto key = global::predicate_arg_key(*this, clause_first_arg(c.second));
+	    if (key == 0) {
+		partial.last_var_clause = c.first;
+	    }
+	} else if (c.first < partial.last_var_clause) {
+	    append = false;
+	}
+    }
+    if (!append) {
+	pred->clear();
+	for (auto &c : partial.clauses) {
+	    pred->add_clause(*this, c.second);
+	}
+    } else {
+	for (auto clause : added) {
+	    pred->add_clause(*this, clause);
+	}
+    }
+    pred->set_partial(true);
+    return true;
+}
+
 size_t global_interpreter::unique_predicate_id(const common::con_cell /*module*/) {
     size_t predicate_id = next_predicate_id_;
     next_predicate_id_++;
@@ -536,7 +606,7 @@ void global_interpreter::load_atom_index(const std::string &name)
 
 heap_block * global_interpreter::db_get_heap_block(size_t block_index) {
     common::heap_block *block = get_global().db_get_heap_block(block_index);
-    block_cache_.insert(block_index, block);
+    block_cache_.insert(block_index, block, sizeof(heap_block));
     current_block_ = block;
     return block;
 }
@@ -689,11 +759,15 @@ void global_interpreter::commit_symbols()
 	 return;
     }
     
+    auto &sdb = get_global().get_blockchain().symbols_db();
+    auto root = get_global().get_blockchain().symbols_root();
+    db::triedb_batch batch(sdb, root);
     for (auto &a : new_atoms_) {
 	size_t symbol_index = a.first;
         const std::string &symbol_name = a.second;
 	get_global().db_set_symbol_index(symbol_index, symbol_name);
     }
+    batch.commit();
 
     new_atoms_.clear();
     new_atom_indices_.clear();
@@ -702,13 +776,26 @@ void global_interpreter::commit_symbols()
 void global_interpreter::commit_closures()
 {
     const auto none = term();
+    auto &g = get_global();
+    std::vector<std::pair<size_t, uint64_t> > added, removed;
+    uint64_t address_hash = 0;
     for (auto &cl : modified_closures_) {
+	// The replaced closure is still on the heap
+	auto old = g.db_get_closure(cl.first);
+	if (old != common::heap::EMPTY_LIST &&
+	    global::closure_address(*this, old, address_hash)) {
+	    removed.push_back(std::make_pair(cl.first, address_hash));
+	}
 	if (cl.second == none) {
-	    get_global().db_remove_closure(cl.first);
+	    g.db_remove_closure(cl.first);
 	} else {
-	    get_global().db_set_closure(cl.first, cl.second);
+	    g.db_set_closure(cl.first, cl.second);
+	    if (global::closure_address(*this, cl.second, address_hash)) {
+		added.push_back(std::make_pair(cl.first, address_hash));
+	    }
 	}
     }
+    g.db_index_closures(g.current_height(), added, removed);
     modified_closures_.clear();
     new_frozen_closures_ = 0;
 }
@@ -734,11 +821,15 @@ void global_interpreter::commit_heap()
     }
     std::sort(blocks.begin(), blocks.end(),
 	   [](heap_block *a, heap_block *b) { return a->index() < b->index();});
+    auto &hdb = get_global().get_blockchain().heap_db();
+    auto root = get_global().get_blockchain().heap_root();
+    db::triedb_batch batch(hdb, root);
     for (auto *block : blocks) {
 	get_global().db_set_heap_block(block->index(), block);
 	block->clear_changed();
-	block_cache_.insert(block->index(), block);
+	block_cache_.insert(block->index(), block, sizeof(heap_block));
     }
+    batch.commit();
     modified_blocks_.clear();
     old_heap_size_ = heap_size();
 }
@@ -796,6 +887,9 @@ void global_interpreter::commit_program()
 	 return;
     }
 
+    auto &pdb = get_global().get_blockchain().program_db();
+    auto root = get_global().get_blockchain().program_root();
+    db::triedb_batch batch(pdb, root);
     for (auto &qn : updated_predicates_) {
         auto &pred = get_predicate(qn);
 	auto &mclauses = pred.get_clauses();
@@ -803,8 +897,20 @@ void global_interpreter::commit_program()
 	for (auto &mc : mclauses) {
 	    clauses.push_back(mc.clause());
 	}
-	get_global().db_set_predicate(qn, clauses);
+	auto stored = stored_clauses_.find(qn);
+	bool has_stored = stored != stored_clauses_.end();
+	get_global().db_set_predicate(qn, clauses,
+				      has_stored ? &stored->second : nullptr);
+	if (has_stored || clauses.size() > global::MAX_INLINE_CLAUSES) {
+	    // Large predicates are stored without erased clauses
+	    auto &s = stored_clauses_[qn];
+	    s.clear();
+	    for (auto c : clauses) {
+		if (c != term()) s.push_back(c);
+	    }
+	}
     }
+    batch.commit();
 
     updated_predicates_.clear();
     old_predicates_.clear();
@@ -102,6 +102,8 @@ public:
     }
 
     virtual void load_predicate(const interp::qname &qn) override;
+    virtual bool load_predicate_matching(const interp::qname &qn,
+					 common::term first_arg) override;
     virtual size_t unique_predicate_id(const common::con_cell module) override;
   
     inline void set_current_block(common::heap_block *b, size_t block_index) {
@@ -235,6 +237,7 @@ private:
 	        new_block_index = num_blocks();
 	    }
   	    auto *new_block = new common::heap_block(*this, new_block_index);
+	    new_block->set_track_dirty(true);
 	    modified_blocks_.insert(std::make_pair(new_block_index, new_block));
 	    set_head_block(new_block);
 	    current_block_ = new_block;
@@ -268,7 +271,7 @@ private:
     size_t current_block_index_;
     common::heap_block *current_block_;
 
-    struct block_flusher {
+    struct block_flusher : public common::lru_cache_callback_nop<size_t, common::heap_block *> {
         void evicted(size_t, common::heap_block *block) {
 	    if (!block->has_changed() && !block->is_head_block()) {
 	        delete block;
@@ -282,6 +285,19 @@ private:
  
     std::vector<interp::qname> updated_predicates_;
     std::vector<interp::predicate> old_predicates_;
+
+    // Large predicates that are partially loaded; the first argument
+    // keys that have been loaded and the clauses (by position.)
+    struct partial_predicate {
+	std::unordered_set<uint64_t> keys;
+	std::map<size_t, common::term> clauses;
+	size_t last_var_clause;
+    };
+    std::unordered_map<interp::qname, partial_predicate> partial_predicates_;
+
+    // Clauses of large predicates as stored in the program DB, so
+    // that commit_program only writes the clauses that changed.
+    std::unordered_map<interp::qname, std::vector<common::term> > stored_clauses_;
     int new_predicates_;
     int new_frozen_closures_;
 
@@ -38,6 +38,20 @@ bool meta_entry::validate_pow(pow_mode_t mode) const {
     }
 }
 
+void meta_entry::validate_pows(const std::vector<const meta_entry *> &entries, pow_mode_t mode, std::vector<bool> &valid) {
+    if (mode == POW_NONE) {
+	valid.assign(entries.size(), true);
+	return;
+    }
+    std::vector<pow_batch_entry> batch;
+    batch.reserve(entries.size());
+    for (auto *e : entries) {
+	siphash_keys key(reinterpret_cast<const char *>(e->get_id().hash()), e->get_id().hash_size());
+	batch.push_back(pow_batch_entry(key, e->get_pow_difficulty(), e->get_pow_proof()));
+    }
+    verify_pow_batch(DEFAULT_SUPER_DIFFICULTY, batch, valid, mode == POW_SIMPLE);
+}
+
 }}
 
 
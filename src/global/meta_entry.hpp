@@ -182,6 +182,10 @@ public:
 
     bool validate_pow(pow_mode_t mode) const;
 
+    // Validate the PoW of many entries in parallel; valid[i] is the
+    // result of entries[i].
+    static void validate_pows(const std::vector<const meta_entry *> &entries, pow_mode_t mode, std::vector<bool> &valid);
+
     bool is_partial() const {
 	return get_root_id_heap().is_zero() ||
 	       get_root_id_closure().is_zero() ||
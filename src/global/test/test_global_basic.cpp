@@ -218,6 +218,240 @@ static void test_global_frozen_closures()
     recheck_frozen_closures(all_frozen_closures);
 }
 
+static size_t count_items(global &g, const std::string &goal)
+{
+    auto cmd = g.interp().parse(goal);
+    g.interp().execute(cmd, false);
+    auto n = g.interp().get_result_term("N");
+    assert(n.tag() == tag_t::INT);
+    return checked_cast<size_t>(reinterpret_cast<int_cell &>(n).value());
+}
+
+static void test_global_large_predicate()
+{
+    header("test_global_large_predicate");
+
+    static const size_t NUM_ITEMS = 1000;
+
+    global::erase_db(test_dir);
+
+    {
+	global g(test_dir);
+	for (size_t i = 0; i < NUM_ITEMS; i++) {
+	    auto s = boost::lexical_cast<std::string>(i);
+	    auto cmd = g.interp().parse("assertz(item(" + s + ", v(" + s + "))).");
+	    g.interp().execute(cmd, false);
+	}
+	g.advance();
+
+	// Only the changed clauses are written
+	auto cmd = g.interp().parse("retract(item(500, _)), assertz(item(other, w)).");
+	g.interp().execute(cmd, false);
+	g.advance();
+    }
+
+    global g(test_dir);
+    std::cout << "Predicates in DB: " << g.db_num_predicates() << std::endl;
+
+    // A call with a bound first argument only loads what may match
+    qname qn(con_cell("user",0), con_cell("item",2));
+    assert(count_items(g, "findall(X, item(499, X), L), length(L, N).") == 1);
+    auto *pred = g.interp().internal_get_predicate(qn);
+    assert(pred != nullptr && pred->is_partial());
+    std::cout << "Loaded clauses: " << pred->num_clauses() << std::endl;
+    assert(pred->num_clauses() == 1);
+
+    assert(count_items(g, "findall(X, item(500, X), L), length(L, N).") == 0);
+    assert(count_items(g, "findall(X, item(other, X), L), length(L, N).") == 1);
+
+    // Unbound first argument loads everything
+    assert(count_items(g, "findall(X, item(_, X), L), length(L, N).") == NUM_ITEMS);
+    pred = g.interp().internal_get_predicate(qn);
+    assert(!pred->is_partial() && pred->num_clauses() == NUM_ITEMS);
+}
+
+//
+// The program DB after writing item/2 with the clauses [from, to) of
+// each range in turn.
+//
+static std::vector<uint8_t> program_hash_after(
+	    const std::vector<std::pair<size_t, size_t> > &ranges,
+	    size_t &num_predicates)
+{
+    static const size_t NUM_CLAUSES = 1000;
+
+    global::erase_db(test_dir);
+    global g(test_dir);
+    g.advance();
+
+    // The same clauses (at the same heap addresses) every time
+    auto &ip = g.interp();
+    std::vector<term> clauses;
+    for (size_t i = 0; i < NUM_CLAUSES; i++) {
+	clauses.push_back(ip.new_term(con_cell("item",2),
+			  {int_cell(static_cast<int64_t>(i % 100)),
+			   int_cell(static_cast<int64_t>(i))}));
+    }
+
+    qname qn(con_cell("user",0), con_cell("item",2));
+    auto &pdb = g.get_blockchain().program_db();
+    for (auto &r : ranges) {
+	epilog::db::triedb_batch batch(pdb, g.get_blockchain().program_root());
+	std::vector<term> part(clauses.begin() + r.first, clauses.begin() + r.second);
+	bool ok = g.db_set_predicate(qn, part, nullptr);
+	assert(ok);
+	batch.commit();
+    }
+
+    num_predicates = g.db_num_predicates();
+    auto &h = pdb.get_root_hash(g.get_blockchain().program_root());
+    return std::vector<uint8_t>(h.hash(), h.hash() + h.hash_size());
+}
+
+static void test_global_redefine_predicate()
+{
+    header("test_global_redefine_predicate");
+
+    typedef std::vector<std::pair<size_t, size_t> > ranges_t;
+    std::vector<std::pair<ranges_t, ranges_t> > cases = {
+	// Fewer clauses
+	{ {{0, 1000}, {0, 300}}, {{0, 300}} },
+	// Other and fewer clauses
+	{ {{0, 1000}, {500, 800}}, {{500, 800}} },
+	// Small enough to be inlined again
+	{ {{0, 1000}, {0, 300}, {0, 10}}, {{0, 10}} },
+	{ {{0, 10}, {0, 1000}, {990, 1000}}, {{990, 1000}} }
+    };
+    for (auto &c : cases) {
+	size_t num_redefined = 0, num_fresh = 0;
+	auto redefined = program_hash_after(c.first, num_redefined);
+	auto fresh = program_hash_after(c.second, num_fresh);
+	std::cout << "Redefined to " << (c.second[0].second - c.second[0].first)
+		  << " clauses: " << (redefined == fresh ? "same root" : "other root")
+		  << std::endl;
+	assert(redefined == fresh);
+	assert(num_redefined == num_fresh);
+    }
+}
+
+//
+// A block of n signature checks: ec:validate(PubKey, d(I), Signature),
+// where signature 'bad' (if < n) is for another message.
+//
+static void test_global_directory_rollback()
+{
+    header("test_global_directory_rollback");
+
+    directory<std::string, size_t> dir(16);
+    epilog::db::root_id r1(1), r2(2);
+    dir.rebuild(r1, 1);
+    dir.add(1);
+    dir.insert("foo", 1);
+    dir.set_num_entries(r1, 1);
+
+    // Discarded commit: back at r1 without the new name
+    dir.begin();
+    dir.advance(r1, r2);
+    dir.add(2);
+    dir.insert("bar", 2);
+    dir.set_num_entries(r2, 2);
+    assert(dir.is_valid(r2, 2));
+    dir.rollback();
+    assert(dir.is_valid(r1, 1));
+    assert(dir.find("bar") == nullptr);
+    assert(dir.find("foo") != nullptr && *dir.find("foo") == 1);
+    assert(dir.num_rebuilds() == 1);
+
+    // Committed
+    dir.begin();
+    dir.advance(r1, r2);
+    dir.insert("bar", 2);
+    dir.set_num_entries(r2, 2);
+    dir.commit();
+    dir.rollback();
+    assert(dir.is_valid(r2, 2));
+    assert(dir.find("bar") != nullptr);
+
+    // Rebuilt for another root during the commit
+    dir.begin();
+    dir.rebuild(r1, 1);
+    dir.set_num_entries(r1, 1);
+    dir.rollback();
+    assert(!dir.is_valid(r1, 1));
+}
+
+static term_serializer::buffer_t signature_block(interpreter &ip, size_t n, size_t bad)
+{
+    term goal;
+    for (size_t i = 0; i < n; i++) {
+	auto signed_data = boost::lexical_cast<std::string>(i == bad ? -1 : static_cast<int64_t>(i));
+	auto query = ip.parse("ec:privkey(K), ec:pubkey(K, P), ec:sign(K, d(" + signed_data + "), S).");
+	bool r = ip.execute(query, false);
+	assert(r);
+	auto data = ip.new_term(con_cell("d",1), {int_cell(static_cast<int64_t>(i))});
+	auto validate = ip.new_term(ip.functor("validate",3),
+			    {ip.get_result_term("P"), data, ip.get_result_term("S")});
+	auto call = ip.new_term(con_cell(":",2), {con_cell("ec",0), validate});
+	goal = (i == 0) ? call : ip.new_term(con_cell(",",2), {call, goal});
+    }
+    term_serializer::buffer_t buf;
+    term_serializer ser(ip);
+    ser.write(buf, goal);
+    return buf;
+}
+
+// Run the deferred verification benchmark at full size (--bench);
+// by default only small blocks are checked.
+static bool full_benchmarks = false;
+
+static void test_global_deferred_verify()
+{
+    header("test_global_deferred_verify");
+
+    global::erase_db(test_dir);
+    global g(test_dir);
+    epilog::ec::builtins::load(g.interp());
+
+    interpreter ip("test");
+    ip.set_retain_state_between_queries(true);
+    epilog::ec::builtins::load(ip);
+
+    // Invalid signatures are rejected with both
+    for (bool deferred : {false, true}) {
+	g.set_deferred_verify(deferred);
+	auto bad = signature_block(ip, 100, 42);
+	g.setup_commit();
+	assert(!g.execute_commit(bad));
+    }
+
+    // A failed check that only selects a branch is not an error
+    g.setup_commit();
+    auto branch = ip.parse("(ec:privkey(K), ec:pubkey(K, P), ec:sign(K, a, S), (ec:validate(P, b, S) -> fail ; true)).");
+    term_serializer::buffer_t buf;
+    term_serializer ser(ip);
+    ser.write(buf, branch);
+    assert(g.execute_commit(buf));
+
+    std::cout << std::setw(8) << "Txs" << std::setw(14) << "Immediate" << std::setw(14) << "Deferred" << std::endl;
+    std::vector<size_t> sizes = {10, 100};
+    if (full_benchmarks) {
+	sizes.insert(sizes.end(), {1000, 4000});
+    }
+    for (size_t n : sizes) {
+	auto block = signature_block(ip, n, n);
+	uint64_t t[2];
+	for (bool deferred : {false, true}) {
+	    g.set_deferred_verify(deferred);
+	    g.setup_commit();
+	    auto start = utime::now();
+	    bool r = g.execute_commit(block);
+	    t[deferred] = (utime::now() - start).in_us();
+	    assert(r);
+	}
+	std::cout << std::setw(8) << n << std::setw(11) << t[0] << " us" << std::setw(11) << t[1] << " us" << std::endl;
+    }
+}
+
 int main(int argc, char *argv[])
 {
     home_dir = find_home_dir(argv[0]);
@@ -225,8 +459,14 @@ int main(int argc, char *argv[])
     test_dir = (boost::filesystem::path(test_dir) / "bin" / "test" / "global" / "triedb").string();
 
     random::set_for_testing(true);
+
+    full_benchmarks = argc == 2 && strcmp(argv[1], "--bench") == 0;
   
     test_global_basic();
     test_global_frozen_closures();
+    test_global_large_predicate();
+    test_global_redefine_predicate();
+    test_global_directory_rollback();
+    test_global_deferred_verify();
     return 0;
 }
@@ -142,9 +142,71 @@ namespace epilog { namespace interp {
 	args_.clear();
     }
 
+    arithmetics::int_fn arithmetics::lookup_int(con_cell f)
+    {
+	static const con_cell PLUS("+", 2);
+	static const con_cell MINUS("-", 2);
+	static const con_cell TIMES("*", 2);
+	static const con_cell MOD("mod", 2);
+	static const con_cell REM("rem", 2);
+	static const con_cell DIV("div", 2);
+	static const con_cell DIV0("//", 2);
+	static const con_cell MAX("max", 2);
+	static const con_cell MIN("min", 2);
+
+	if (f == PLUS) return &arithmetics_fn::plus_2;
+	if (f == MINUS) return &arithmetics_fn::minus_2;
+	if (f == TIMES) return &arithmetics_fn::times_2;
+	if (f == MOD) return &arithmetics_fn::mod_2;
+	if (f == REM) return &arithmetics_fn::rem_2;
+	if (f == DIV) return &arithmetics_fn::div_2;
+	if (f == DIV0) return &arithmetics_fn::div0_2;
+	if (f == MAX) return &arithmetics_fn::max_2;
+	if (f == MIN) return &arithmetics_fn::min_2;
+	return nullptr;
+    }
+
+    bool arithmetics::eval_int(term expr, term &result, size_t depth)
+    {
+	// Without cost, like eval() (arg() is dereferenced the same way)
+	expr = interp_.term_env::deref(expr);
+	switch (expr.tag()) {
+	case tag_t::INT:
+	    result = expr;
+	    return true;
+	case tag_t::STR: {
+	    if (depth == MAX_INT_DEPTH) {
+		return false;
+	    }
+	    auto fn = lookup_int(interp_.functor(expr));
+	    if (fn == nullptr) {
+		return false;
+	    }
+	    // Same (post) order as eval(), so a function that throws
+	    // does so where eval() would have.
+	    term args[2];
+	    if (!eval_int(interp_.arg(expr, 0), args[0], depth+1) ||
+		!eval_int(interp_.arg(expr, 1), args[1], depth+1)) {
+		return false;
+	    }
+	    result = fn(interp_, args);
+	    return true;
+	}
+	default:
+	    return false;
+	}
+    }
+
     term arithmetics::eval(term &expr,
 			   const std::string &context)
     {
+	if (!is_debug() && int_shortcut_) {
+	    term result;
+	    if (eval_int(expr, result)) {
+		return result;
+	    }
+	}
+
 	load_fns();
 
 	term result = expr;
@@ -45,17 +45,36 @@ public:
 				            common::term *args)> fn;
 
     public:
-        arithmetics(interpreter_base &interp) : interp_(interp), debug_(false)
+	typedef common::term (*int_fn)(interpreter_base &interp,
+				       common::term *args);
+
+        arithmetics(interpreter_base &interp) : interp_(interp), debug_(false), int_shortcut_(true)
  	   { }
 
 	void total_reset();
 
 	inline void set_debug(bool dbg) { debug_ = dbg; }
 
+	// eval() tries eval_int() first unless this is off (only the
+	// generic evaluation is used then; for comparisons.)
+	inline void set_int_shortcut(bool enabled) { int_shortcut_ = enabled; }
+
 	void unload();
 
 	common::term eval(common::term &expr, const std::string &context);
 
+	// Evaluate integer expressions built from the functions above
+	// without the generic machinery of eval(). Returns false if
+	// 'expr' is anything else (nothing has happened then, so the
+	// caller can go to eval() for the proper result or error.)
+	bool eval_int(common::term expr, common::term &result,
+		      size_t depth = 0);
+
+	static const size_t MAX_INT_DEPTH = 64;
+
+	// The function for 'f' in eval_int() (or nullptr.)
+	static int_fn lookup_int(common::con_cell f);
+
     private:
 	void load_fn(const std::string &name, size_t arity, fn f);
 	void load_fns();
@@ -75,6 +94,7 @@ public:
 	inline bool is_debug() const { return debug_; }
 
 	bool debug_;
+	bool int_shortcut_;
 
     };
 
@@ -23,6 +23,83 @@ bool builtins::profile_0(interpreter_base &interp, size_t arity, common::term ar
     return true;
 }
 
+//
+// profile(on), profile(off) and profile(reset)
+//
+bool builtins::profile_1(interpreter_base &interp, size_t arity, common::term args[])
+{
+    static const con_cell ON("on", 0);
+    static const con_cell OFF("off", 0);
+    static const con_cell RESET("reset", 0);
+
+    auto cmd = args[0];
+    if (cmd == ON) {
+	interp.set_profiling(true);
+    } else if (cmd == OFF) {
+	interp.set_profiling(false);
+    } else if (cmd == RESET) {
+	interp.reset_profiling();
+    } else {
+	interp.abort(interpreter_exception_wrong_arg_type(
+		"profile/1: Argument must be 'on', 'off' or 'reset'; was: "
+		+ interp.to_string(cmd)));
+    }
+    return true;
+}
+
+std::string builtins::profile_export(interpreter_base &interp, common::term format, const std::string &from)
+{
+    return profile_export(interp, format, from, interp);
+}
+
+std::string builtins::profile_export(interpreter_base &interp, common::term format, const std::string &from, const interpreter_base &profiled)
+{
+    static const con_cell FLAME("flame", 0);
+    static const con_cell FLAME_1("flame", 1);
+    static const con_cell JSON("json", 0);
+
+    profiler::metric metric = profiler::TIME;
+    bool is_json = format == JSON;
+    bool ok = is_json || format == FLAME;
+    if (format.tag() == tag_t::STR && interp.functor(format) == FLAME_1) {
+	auto m = interp.arg(format, 0);
+	ok = interp.is_atom(m) && profiler::parse_metric(interp.atom_name(m), metric);
+    }
+    if (!ok) {
+	interp.abort(interpreter_exception_wrong_arg_type(
+		from + ": Format must be 'flame', 'flame(Metric)' or 'json'; was: "
+		+ interp.to_string(format)));
+    }
+
+    static const profiler none{std::vector<std::string>()};
+    auto *prof = profiled.get_profiler();
+    if (prof == nullptr) {
+	prof = &none;
+    }
+    std::stringstream ss;
+    if (is_json) {
+	prof->write_json(ss, profiled);
+    } else {
+	prof->write_collapsed(ss, profiled, metric);
+    }
+    return ss.str();
+}
+
+//
+// profile(Format, Text) unifies Text with the profile as a string.
+// (With file I/O enabled it's written to the file if it's an atom.)
+//
+bool builtins::profile_2(interpreter_base &interp, size_t arity, common::term args[])
+{
+    if (!args[1].tag().is_ref()) {
+	interp.abort(interpreter_exception_wrong_arg_type(
+		"profile/2: Second argument must be unbound; was: "
+		+ interp.to_string(args[1])));
+    }
+    auto text = profile_export(interp, args[0], "profile/2");
+    return interp.unify(args[1], interp.string_to_list(text));
+}
+
 //
 // debug_on/0
 //
@@ -1612,6 +1689,23 @@ bool builtins::garbage_collect_0(interpreter_base &interp, size_t arity, common:
     return true;
 }
 
+// garbage_collect(young) only collects what has been allocated since
+// the last choice point. garbage_collect(full) is garbage_collect/0
+// and collects everything allocated by the current query.
+bool builtins::garbage_collect_1(interpreter_base &interp, size_t arity, common::term args[]) {
+    static const con_cell YOUNG("young", 0);
+    static const con_cell FULL("full", 0);
+
+    auto kind = interp.deref(args[0]);
+    if (kind != YOUNG && kind != FULL) {
+	throw interpreter_exception_wrong_arg_type(
+	      "garbage_collect/1: Argument must be 'young' or 'full'; was "
+	      + interp.to_string(kind));
+    }
+    interp.garbage_collect(kind == YOUNG);
+    return true;
+}
+
 bool builtins::asserta_1(interpreter_base &interp, size_t arity, common::term args[] ) {
 
     term clause = interp.copy(args[0]);
@@ -1800,8 +1894,21 @@ bool builtins::current_predicate_1(interpreter_base &interp, size_t arity, commo
     return exists;
 }
 
+//
+// status_predicate(P, N) unifies N with the performance count of P.
+// status_predicate(P, indexes(L)) unifies L with a list of
+// index(Arg, NumKeys, NumLookups), one for each JIT index of P.
+// status_predicate(P, tier(T, Calls, Compilations)) unifies T with
+// compiled or interpreted, Calls with the number of interpreted calls
+// since its clauses last changed and Compilations with the number of
+// times it was compiled (see wam_interpreter::auto_compile.)
+//
 bool builtins::status_predicate_2(interpreter_base &interp, size_t arity, common::term args[])
 {
+    static const con_cell INDEXES("indexes", 1);
+    static const con_cell INDEX("index", 3);
+    static const con_cell TIER("tier", 3);
+
     qname qn = check_predicate(interp, "status_predicate/2", args[0]);
 
     auto &cp = interp.get_code(qn);
@@ -1816,6 +1923,25 @@ bool builtins::status_predicate_2(interpreter_base &interp, size_t arity, common
     if (exists) {
         const predicate &p = interp.get_predicate(qn);
 	if (p.empty()) return false;
+	auto status = interp.deref(args[1]);
+	if (interp.is_functor(status, INDEXES)) {
+	    auto stats = p.index_stats();
+	    term lst = interp.EMPTY_LIST;
+	    for (auto it = stats.rbegin(); it != stats.rend(); ++it) {
+		auto arg = int_cell(checked_cast<int64_t>(it->arg + 1));
+		auto num_keys = int_cell(checked_cast<int64_t>(it->num_keys));
+		auto num_lookups = int_cell(checked_cast<int64_t>(it->num_lookups));
+		lst = interp.new_dotted_pair(
+		      interp.new_term(INDEX, {arg, num_keys, num_lookups}), lst);
+	    }
+	    return interp.unify(interp.arg(status, 0), lst);
+	}
+	if (interp.is_functor(status, TIER)) {
+	    auto tier = interp.functor(cp.has_wam_code() ? "compiled" : "interpreted", 0);
+	    auto calls = int_cell(checked_cast<int64_t>(p.num_interpreted_calls()));
+	    auto compilations = int_cell(checked_cast<int64_t>(p.num_compilations()));
+	    return interp.unify(status, interp.new_term(TIER, {tier, calls, compilations}));
+	}
 	return interp.unify(args[1],int_cell(static_cast<int64_t>(p.performance_count())));
     }
 
@@ -1831,6 +1957,8 @@ void builtins::load(interpreter_base &interp) {
     
     // Profiling
     i.load_builtin(con_cell("profile", 0), &builtins::profile_0);
+    i.load_builtin(con_cell("profile", 1), &builtins::profile_1);
+    i.load_builtin(con_cell("profile", 2), &builtins::profile_2);
     i.load_builtin(i.functor("debug_on", 0), &builtins::debug_on_0);
     i.load_builtin(i.functor("debug_off", 0), &builtins::debug_off_0);
 
@@ -1926,6 +2054,7 @@ void builtins::load(interpreter_base &interp) {
     i.load_builtin(i.functor("dump_stack",0), builtin(&builtins::dump_stack_0));
     i.load_builtin(i.functor("dump_choice_points",0), builtin(&builtins::dump_choice_points_0));
     i.load_builtin(i.functor("garbage_collect",0), builtin(&builtins::garbage_collect_0));
+    i.load_builtin(i.functor("garbage_collect",1), builtin(&builtins::garbage_collect_1));
 
     // Program database
     i.load_builtin(con_cell("show",0), builtin(&builtins::show_0));
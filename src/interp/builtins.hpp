@@ -60,6 +60,12 @@ typedef std::pair<common::con_cell, common::con_cell> qname;
 	//
 
         static bool profile_0(interpreter_base &interp, size_t arity, common::term args []);
+        static bool profile_1(interpreter_base &interp, size_t arity, common::term args []);
+        static bool profile_2(interpreter_base &interp, size_t arity, common::term args []);
+	// The profile in the given format (flame, flame(Metric) or json)
+	static std::string profile_export(interpreter_base &interp, common::term format, const std::string &from);
+	// Same for another interpreter (the format is a term of 'interp')
+	static std::string profile_export(interpreter_base &interp, common::term format, const std::string &from, const interpreter_base &profiled);
 
 	static bool debug_on_0(interpreter_base &interp, size_t arity, common::term args []);
 
@@ -223,6 +229,7 @@ typedef std::pair<common::con_cell, common::con_cell> qname;
         static bool dump_stack_0(interpreter_base &interp, size_t arity, common::term args[]);
         static bool dump_choice_points_0(interpreter_base &interp, size_t arity, common::term args[]);
         static bool garbage_collect_0(interpreter_base &interp, size_t arity, common::term args[]);
+        static bool garbage_collect_1(interpreter_base &interp, size_t arity, common::term args[]);
         //
         // Program database
         //
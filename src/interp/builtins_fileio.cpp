@@ -776,4 +776,30 @@ namespace epilog { namespace interp {
 	return ok;
     }
 	
+    //
+    // profile(Format, File) writes the profile to a file. With an
+    // unbound second argument it's the profile as a string.
+    //
+    bool builtins_fileio::profile_2(interpreter_base &interp, size_t arity, common::term args[])
+    {
+	term filename0 = args[1];
+	if (filename0.tag().is_ref()) {
+	    return builtins::profile_2(interp, arity, args);
+	}
+	if (!interp.is_atom(filename0)) {
+	    interp.abort(interpreter_exception_wrong_arg_type(
+		      "profile/2: Filename must be an atom; was: "
+		      + interp.to_string(filename0)));
+	}
+	auto text = builtins::profile_export(interp, args[0], "profile/2");
+	std::string full_path = interp.get_full_path(interp.atom_name(filename0));
+	std::ofstream out(full_path);
+	out << text;
+	if (!out.good()) {
+	    interp.abort(interpreter_exception_file_not_found(
+		      "profile/2: Could not write '" + full_path + "'"));
+	}
+	return true;
+    }
+
 }}
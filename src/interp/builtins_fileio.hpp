@@ -21,6 +21,7 @@ namespace epilog { namespace interp {
 	static bool told_0(interpreter_base &interp, size_t arity, common::term args[]);
 	static bool format_2(interpreter_base &interp, size_t arity, common::term args[]);
 	static bool sformat_3(interpreter_base &interp, size_t arity, common::term args[]);
+	static bool profile_2(interpreter_base &interp, size_t arity, common::term args[]);
 
     private:
         static size_t get_stream_id(interpreter_base &interp, common::term &stream,
@@ -12,6 +12,7 @@ interpreter::interpreter(const std::string &name) : wam_interpreter(name)
     wam_enabled_ = true;
     query_vars_ = nullptr;
     num_instances_ = 0;
+    set_gc_roots_fn( &gc_roots );
 }
 
 void interpreter::reset()
@@ -31,6 +32,7 @@ void interpreter::total_reset()
     wam_enabled_ = true;
     query_vars_ = nullptr;
     num_instances_ = 0;
+    set_gc_roots_fn( &gc_roots );
 }
 
 interpreter::~interpreter()
@@ -156,6 +158,31 @@ struct new_instance_context : public meta_context {
     common::term old_ai[interpreter_base::MAX_ARGS];
 };
 
+// Query variables are roots too (also the ones of outer instances.)
+void interpreter::gc_roots(std::vector<common::ptr_cell *> &roots,
+			   interpreter_base *interp0)
+{
+    wam_interpreter::gc_roots(roots, interp0);
+
+    auto &interp = reinterpret_cast<interpreter &>(*interp0);
+    auto add_query_vars = [&](std::vector<binding> *qv) {
+	if (qv == nullptr) return;
+	for (auto &b : *qv) {
+	    add_root(roots, &b.value_);
+	}
+    };
+    add_query_vars(interp.query_vars_ptr());
+    for (auto *m = interp.m(); m != nullptr; m = m->old_m) {
+	if (m->fn == &interpreter::new_instance_meta) {
+	    auto *context = reinterpret_cast<new_instance_context *>(m);
+	    add_query_vars(context->old_query_vars);
+	    for (size_t i = 0; i < context->old_num_of_args; i++) {
+		add_root(roots, &context->old_ai[i]);
+	    }
+	}
+    }
+}
+
 void interpreter::new_instance()
 {
     new_meta_context<new_instance_context>(interpreter::new_instance_meta);
@@ -282,6 +309,10 @@ void interpreter::stop()
 
 bool interpreter::cont()
 {
+    if (is_profiling()) {
+	profile_resume();
+    }
+
     try {
         set_complete(false);
 	while (!is_complete()) {
@@ -305,6 +336,9 @@ bool interpreter::cont()
 		}
 	    }
 	}
+	if (is_profiling()) {
+	    profile_sample(false);
+	}
 	set_register_hb(b());
 	tidy_trail();
     } catch (std::runtime_error &) {
@@ -434,6 +468,10 @@ void interpreter::fail()
 	    }
 	}
     }
+
+    if (is_profiling()) {
+	profile_sample(false);
+    }
 }
 
 bool interpreter::unify_args(term head, const code_point &p)
@@ -572,9 +610,16 @@ void interpreter::dispatch()
 
     con_cell f = functor(qr());
 
+    if (is_profiling()) {
+	profile_count_goal();
+    }
+
     if (f == interpreter_base::EMPTY_LIST) {
         // Return
 	deallocate_and_proceed();
+	if (is_profiling()) {
+	    profile_sample(false);
+	}
 	if (is_debug()) {
 	    std::cout << "interpreter::dispatch(): pop: e=" << e0() << std::endl;
 	}
@@ -655,7 +700,14 @@ void interpreter::dispatch()
     // Is instruction already a built-in (can happen for native backtracking)
     
     if (p().is_builtin()) {
-	if (!(p().bn())(*this, arity, args())) {
+	if (is_profiling()) {
+	    profile_builtin(f);
+	}
+	bool ok = (p().bn())(*this, arity, args());
+	if (is_profiling()) {
+	    profile_sample(false);
+	}
+	if (!ok) {
 	    fail();
 	    return;
 	}
@@ -674,7 +726,15 @@ void interpreter::dispatch()
 	    // P becomes CP.
 	    set_cp(code_point(interpreter_base::EMPTY_LIST));
 	}
-	if (!(code.bn())(*this, arity, args())) {
+	// Control constructs (like ',') are not frames of their own
+	if (is_profiling() && !code.is_builtin_recursive()) {
+	    profile_builtin(f);
+	}
+	bool ok = (code.bn())(*this, arity, args());
+	if (is_profiling()) {
+	    profile_sample(false);
+	}
+	if (!ok) {
 	    fail();
 	}
 	check_frozen();
@@ -689,21 +749,29 @@ void interpreter::dispatch()
 
     bool is_updated = has_updated_predicates() && is_updated_predicate(qn);
 
+    term first_arg = arity > 0 ? a(0) : term();
+
     if (is_wam_enabled()) {
 	if (!code.has_wam_code() && is_auto_wam()) {
-	    auto_compile(qn);
+	    // Partially loaded predicates are never compiled
+	    if (!get_predicate_matching(qn, first_arg).is_partial()) {
+		auto_compile(qn, true);
+	    }
 	} else if (is_updated) {
    	    recompile_if_needed(qn);
         }
 	if (code.has_wam_code()) {
 	    dispatch_wam(code.wam_code());
+	    if (is_profiling()) {
+		profile_sample(true);
+	    }
 	    return;
 	}
     }
 
-    const predicate &pred = get_predicate(module, f);
+    const predicate &pred = get_predicate_matching(qn, first_arg);
 
-    if (pred.empty()) {
+    if (pred.empty() && !pred.is_partial()) {
         std::stringstream msg;
 	msg << "Undefined predicate ";
 	if (module != USER_MODULE) {
@@ -745,6 +813,8 @@ void interpreter::dispatch()
 
     if (!select_clause(code_point(qr()), pred_id, num_choices, choices, 0)) {
 	fail();
+    } else if (is_profiling()) {
+	profile_sample(true);
     }
 }
 
@@ -862,9 +932,12 @@ void interpreter::load_file(const std::string &filename)
 	    }
 	    interpreter &interp_;
 	};
-	load_program<pre_action>(infile);
-	compile();
+	// Read it as a whole, so a program cache can be used
+	std::string text((std::istreambuf_iterator<char>(infile)),
+			 std::istreambuf_iterator<char>());
 	infile.close();
+	load_program<pre_action>(text);
+	compile();
     } catch (const syntax_exception &ex) {
 	throw ex;
     } catch (const interpreter_exception &ex) {
@@ -335,6 +335,8 @@ public:
 	inline const common::term value() const { return value_; }
 
     private:
+	friend class interpreter;
+
 	std::string name_;
 	common::term value_;
     };
@@ -451,6 +453,9 @@ private:
     inline void set_query_vars(std::vector<binding> *qv)
         { query_vars_ = qv; }
 
+    static void gc_roots(std::vector<common::ptr_cell *> &roots,
+			 interpreter_base *interp);
+
     bool wam_enabled_;
     std::vector<binding> *query_vars_;
     size_t num_instances_;
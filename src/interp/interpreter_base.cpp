@@ -30,6 +30,7 @@ void managed_clauses::add_clause(const managed_clause &mclause, clause_position
 	size_t i = clauses_.size();
 	clauses_.push_back(mclause);
 	add_index(i);
+	add_arg_index(i);
     }
     num_clauses_++;
 }
@@ -195,6 +196,112 @@ void managed_clauses::do_index() const
     }
     is_indexed_ = true;
 }
+
+//
+// Pick the most selective bound argument for this call. Each argument
+// position gets its own hash index (built on demand), and we use the
+// one with the smallest bucket for this goal (or the first argument
+// index if that is already best.)
+//
+const std::vector<size_t> & managed_clauses::get_jit_indexed(common::term goal, const std::vector<size_t> &first) const
+{
+    const std::vector<size_t> *best = &first;
+    arg_index *best_index = nullptr;
+
+    // Don't let get_arg_index move the indexes we point into
+    if (arg_index_.size() < JIT_INDEX_MAX_ARGS) {
+	arg_index_.resize(JIT_INDEX_MAX_ARGS);
+    }
+
+    // The first argument index is exact unless there are clauses
+    // with a variable as first argument.
+    size_t start = has_vars_ ? 0 : 1;
+    for (size_t arg_pos = start; arg_pos < JIT_INDEX_MAX_ARGS; arg_pos++) {
+	auto arg = interp_->get_arg(goal, arg_pos);
+	if (arg == common::term()) {
+	    break;
+	}
+	if (arg.tag().is_ref()) {
+	    continue;
+	}
+	auto &index = get_arg_index(arg_pos);
+	auto key = index_key(arg, interp_->simple_hash(arg));
+	auto it = index.map.find(key);
+	auto &indexed = (it == index.map.end()) ? index.var_based : it->second;
+	if (indexed.size() < best->size()) {
+	    best = &indexed;
+	    best_index = &index;
+	    if (best->size() <= 1) {
+		break;
+	    }
+	}
+    }
+    if (best_index != nullptr) {
+	best_index->num_lookups++;
+    }
+    return *best;
+}
+
+managed_clauses::arg_index & managed_clauses::get_arg_index(size_t arg_pos) const
+{
+    if (arg_pos >= arg_index_.size()) {
+	arg_index_.resize(arg_pos + 1);
+    }
+    auto &index = arg_index_[arg_pos];
+    if (index.built) {
+	return index;
+    }
+    auto n = clauses_.size();
+    for (size_t i = 0; i < n; i++) {
+	if (clauses_[i].is_erased()) continue;
+	add_to_arg_index(index, arg_pos, i);
+    }
+    index.built = true;
+    return index;
+}
+
+void managed_clauses::add_to_arg_index(arg_index &index, size_t arg_pos, size_t i) const
+{
+    increment_performance_count();
+    auto arg = interp_->clause_arg(clauses_[i].clause(), arg_pos);
+    if (arg == common::term() || arg.tag().is_ref()) {
+	// Matches everything, so it goes into every bucket
+	index.var_based.push_back(i);
+	for (auto &p : index.map) {
+	    p.second.push_back(i);
+	}
+	return;
+    }
+    auto key = index_key(arg, interp_->simple_hash(arg));
+    auto it = index.map.find(key);
+    if (it == index.map.end()) {
+	it = index.map.insert(std::make_pair(key, index.var_based)).first;
+    }
+    it->second.push_back(i);
+}
+
+void managed_clauses::add_arg_index(size_t i)
+{
+    for (size_t arg_pos = 0; arg_pos < arg_index_.size(); arg_pos++) {
+	auto &index = arg_index_[arg_pos];
+	if (index.built) {
+	    add_to_arg_index(index, arg_pos, i);
+	}
+    }
+}
+
+std::vector<managed_clauses::index_stat> managed_clauses::index_stats() const
+{
+    std::vector<index_stat> stats;
+    for (size_t arg_pos = 0; arg_pos < arg_index_.size(); arg_pos++) {
+	auto &index = arg_index_[arg_pos];
+	if (index.built) {
+	    stats.push_back(index_stat{arg_pos, index.map.size(),
+				       index.num_lookups});
+	}
+    }
+    return stats;
+}
 	
 meta_context::meta_context(interpreter_base &i, meta_fn mfn)
 {
@@ -212,7 +319,7 @@ meta_context::meta_context(interpreter_base &i, meta_fn mfn)
     old_hb = i.get_register_hb();
 }
 
-interpreter_base::interpreter_base(const std::string &name) : retain_state_between_queries_(false), arith_(*this), locale_(*this), name_(name)
+interpreter_base::interpreter_base(const std::string &name) : retain_state_between_queries_(false), program_cache_(nullptr), arith_(*this), profiler_enabled_(false), profiler_(nullptr), num_choice_points_(0), locale_(*this), name_(name)
 {
     init();
 }
@@ -292,6 +399,7 @@ void interpreter_base::init()
 
 interpreter_base::~interpreter_base()
 {
+    delete profiler_;
     for (auto &p : managed_data_) {
         auto md = p.second;
 	delete md;
@@ -918,6 +1026,7 @@ void interpreter_base::load_builtins_file_io()
     load_builtin(con_cell("told",0), &builtins_fileio::told_0);
     load_builtin(con_cell("format",2), builtin(&builtins_fileio::format_2,true));
     load_builtin(con_cell("sformat",3), builtin(&builtins_fileio::sformat_3,true));
+    load_builtin(con_cell("profile",2), &builtins_fileio::profile_2);
     set_current_module(old_module);
 }
 
@@ -1128,9 +1237,133 @@ void interpreter_base::print_profile(std::ostream &out) const
     for (auto p : all) {
 	auto f = p.f;
 	auto t = p.t;
-	std::cout << to_string(f) << ": " << t << "\n";
+	out << to_string(f) << ": " << t << "\n";
     }
 
+    // Tiers of the auto compiled predicates, most called first
+    std::vector<const predicate *> tiered;
+    for (auto &qn : program_predicates_) {
+	auto it = program_db_.find(qn);
+	if (it == program_db_.end()) {
+	    continue;
+	}
+	auto &pred = it->second;
+	if (pred.num_interpreted_calls() > 0 || pred.num_compilations() > 0) {
+	    tiered.push_back(&pred);
+	}
+    }
+    std::stable_sort(tiered.begin(), tiered.end(),
+		     [](const predicate *a, const predicate *b) {
+			 return a->num_interpreted_calls() > b->num_interpreted_calls();
+		     });
+    for (auto *pred : tiered) {
+	auto &qn = pred->qualified_name();
+	auto it = code_db_.find(qn);
+	bool compiled = it != code_db_.end() && it->second.has_wam_code();
+	out << to_string(qn) << "/" << qn.second.arity() << ": "
+	    << (compiled ? "compiled" : "interpreted")
+	    << " calls=" << pred->num_interpreted_calls()
+	    << " compilations=" << pred->num_compilations() << "\n";
+    }
+
+    if (profiler_ != nullptr && !profiler_->empty()) {
+	profiler_->write_summary(out, *this, 20);
+    }
+}
+
+void interpreter_base::set_profiling(bool on)
+{
+    if (on == profiler_enabled_) {
+	return;
+    }
+    if (on) {
+	if (profiler_ == nullptr) {
+	    profiler_ = new profiler(profile_instruction_names());
+	}
+	profiler_enabled_ = true;
+	profile_resume();
+    } else {
+	profile_sample(false);
+	profiler_enabled_ = false;
+    }
+}
+
+void interpreter_base::reset_profiling()
+{
+    if (profiler_ != nullptr) {
+	profiler_->reset();
+	if (profiler_enabled_) {
+	    profile_resume();
+	}
+    }
+}
+
+void interpreter_base::profile_resume()
+{
+    profiler_->resume(accumulated_cost_, heap_size(), num_choice_points_);
+}
+
+void interpreter_base::profile_sample(bool is_call)
+{
+    profiler_->charge(accumulated_cost_, heap_size(), num_choice_points_);
+    profile_stack_.clear();
+    profile_stack(profile_stack_);
+    std::reverse(profile_stack_.begin(), profile_stack_.end());
+    profiler_->enter(profile_stack_, is_call);
+}
+
+void interpreter_base::profile_builtin(con_cell f)
+{
+    profiler_->charge(accumulated_cost_, heap_size(), num_choice_points_);
+    profile_stack_.clear();
+    profile_stack(profile_stack_);
+    if (profile_stack_.size() == profiler::MAX_DEPTH) {
+	profile_stack_.pop_back();
+    }
+    std::reverse(profile_stack_.begin(), profile_stack_.end());
+    profile_stack_.push_back(qname(EMPTY_LIST, f));
+    profiler_->enter(profile_stack_, true);
+}
+
+void interpreter_base::profile_stack(profiler::stack_t &stack)
+{
+    auto k = e_kind();
+    auto *e = e0();
+    while (e != nullptr && stack.size() < profiler::MAX_DEPTH) {
+	if (k != ENV_WAM) {
+	    profile_naive_env(reinterpret_cast<environment_naive_t *>(e), stack);
+	}
+	k = e->ce.kind();
+	e = e->ce.ce0();
+    }
+}
+
+//
+// Only the environment of a clause body is a frame. Control
+// constructs (like ',') allocate environments with the same
+// predicate, but then the saved goal isn't a call to it.
+//
+void interpreter_base::profile_naive_env(environment_naive_t *ee, profiler::stack_t &stack)
+{
+    static const con_cell FREEZE("$freeze",0);
+
+    auto &qn = ee->pr;
+    if (qn.first == FREEZE || qn.second == EMPTY_LIST) {
+	return;
+    }
+    term goal = ee->qr;
+    if (goal.tag() == tag_t::STR && functor(goal) == COLON) {
+	goal = arg(goal, 1);
+    }
+    if ((goal.tag() == tag_t::STR || goal.tag() == tag_t::CON) &&
+	functor(goal) == qn.second) {
+	stack.push_back(qn);
+    }
+}
+
+std::vector<std::string> interpreter_base::profile_instruction_names() const
+{
+    return std::vector<std::string>();
 }
 
 void interpreter_base::abort(const interpreter_exception &ex)
@@ -1387,59 +1620,94 @@ void interpreter_base::get_meta_roots(std::vector<common::ptr_cell *> &roots) {
   meta_context *current_meta = get_current_meta_context();
   while (current_meta != nullptr) {
     add_root(roots, &current_meta->old_qr);
+    add_root(roots, &current_meta->old_p.term_code_);
+    add_root(roots, &current_meta->old_cp.term_code_);
     current_meta = current_meta->old_m;
   }
 }
 
 void interpreter_base::get_stack_roots(std::vector<common::ptr_cell *> &roots) {
+  add_root(roots, &register_qr_);
+  add_root(roots, &register_p_.term_code_);
+  add_root(roots, &register_cp_.term_code_);
+
+  // Choice points: saved query, alternatives and argument registers.
+  for (auto cp = b(); cp != nullptr; cp = cp->b) {
+    add_root(roots, &cp->qr);
+    add_root(roots, &cp->cp.term_code_);
+    add_root(roots, &cp->bp.term_code_);
+    for (size_t i = 0; i < cp->num_extra(); i++) {
+      add_root(roots, &cp->zi[i]);
+    }
+  }
+
   auto older_e = e0();
-  auto cur_cp = b();
   auto kind = e_kind();
+  auto cur_cp = b();
+  auto cur_m = m();
   environment_base_t *newer_e = nullptr;
-  while(older_e != nullptr || newer_e != nullptr) {
-    if(kind == ENV_NAIVE) {
+  while (older_e != nullptr) {
+    add_root(roots, &older_e->cp.term_code_);
+    if (kind == ENV_NAIVE) {
+      add_root(roots, &reinterpret_cast<environment_naive_t *>(older_e)->qr);
     } else if (kind == ENV_WAM) {
-      if (newer_e != nullptr) {
-        // If we have interleaved choice point(s?) on the stack
-        // make sure those are subtracted from the current environment
-        // calculation.
-        int choice_points_size = 0;
-        while (base(cur_cp) < base(newer_e) && base(cur_cp) > base(older_e)) {
-          choice_points_size += words<choice_point_t>();
-          choice_points_size += words<term>()*cur_cp->arity;
-	  // Process choice point.
-	  // Assumption: there will always be an environment below
-	  // the last choice point.
-	  add_root(roots, &(cur_cp->qr));
-	  for (size_t i = 0; i < cur_cp->arity; i++) {
-	      add_root(roots, &cur_cp->ai(i));
+      size_t num_y = 0;
+      if (newer_e == nullptr) {
+	// Top frame. It belongs to the executing predicate or (if that
+	// one hasn't allocated a frame) to its caller. Take the larger
+	// but don't go beyond whatever is on the stack above it.
+	num_y = std::max(num_y_fn()(this, false), num_y_fn()(this, true));
+	word_t *above = nullptr;
+	for (auto cp = b(); cp != nullptr && base(cp) > base(older_e); cp = cp->b) {
+	  above = base(cp);
+	}
+	for (auto mc = m(); mc != nullptr && base(mc) > base(older_e); mc = mc->old_m) {
+	  if (above == nullptr || base(mc) < above) {
+	    above = base(mc);
 	  }
-          cur_cp = cur_cp->b;
-        }
-	auto newer_e_w  = base(newer_e);
-	auto older_e_w = base(older_e);
-        auto base_size_w = words<environment_t>();
-        auto term_size_w = words<term>();
-        auto num_y = ((newer_e_w - older_e_w) - base_size_w - choice_points_size)/term_size_w;
-
-        auto wamenv = reinterpret_cast<environment_t*>(older_e);
-	for(size_t i = 0; i < num_y; i++) {
-	  add_root(roots, &wamenv->yn[i]);
 	}
+	if (above != nullptr) {
+	  size_t max_y = (above - base(older_e) - words<environment_base_t>())/words<term>();
+	  num_y = std::min(num_y, max_y);
+	}
+      } else {
+	// The Y variables are what's between this frame and the
+	// newer one, except for interleaved choice points and meta
+	// contexts.
+	size_t other_w = 0;
+	while (cur_cp != nullptr && base(cur_cp) > base(newer_e)) {
+	  cur_cp = cur_cp->b;
+	}
+	while (cur_cp != nullptr && base(cur_cp) > base(older_e)) {
+	  other_w += words<choice_point_t>() + words<term>()*cur_cp->num_extra();
+	  cur_cp = cur_cp->b;
+	}
+	while (cur_m != nullptr && base(cur_m) > base(newer_e)) {
+	  cur_m = cur_m->old_m;
+	}
+	while (cur_m != nullptr && base(cur_m) > base(older_e)) {
+	  other_w += cur_m->size_in_words;
+	  cur_m = cur_m->old_m;
+	}
+	auto frame_w = base(newer_e) - base(older_e);
+	num_y = (frame_w - words<environment_base_t>() - other_w)/words<term>();
+      }
+      auto wamenv = reinterpret_cast<environment_t *>(older_e);
+      for (size_t i = 0; i < num_y; i++) {
+	add_root(roots, &wamenv->yn[i]);
       }
     } else { // FROZEN
-      auto frozen_env = reinterpret_cast<environment_frozen_t*>(older_e);
+      auto frozen_env = reinterpret_cast<environment_frozen_t *>(older_e);
+      add_root(roots, &frozen_env->qr);
       auto num_extra = frozen_env->num_extra;
-      for(size_t i = 0; i < num_extra; i++) {
+      for (size_t i = 0; i < num_extra; i++) {
 	add_root(roots, &frozen_env->extra[i]);
       }
     }
 
     newer_e = older_e;
-    if(older_e != nullptr) {
-      kind = older_e->ce.kind();
-      older_e = older_e->ce.ce0();
-    }
+    kind = older_e->ce.kind();
+    older_e = older_e->ce.ce0();
   }
 }
 
@@ -1578,10 +1846,24 @@ void interpreter_base::dump_choice_points() {
   std::cout << "---- Choicepoint End ---\n";
 }
 
-void interpreter_base::garbage_collect() {
+size_t interpreter_base::garbage_collect(bool young) {
   std::vector<common::ptr_cell *> roots = get_gc_roots();
   common::garbage_collector collector(get_heap());
-  collector.do_collection(roots);
+  // Terms older than the running query may be held by C++ code
+  // (e.g. the query itself) so they are never moved.
+  collector.set_young_start(young ? get_register_hb() : top_hb());
+  collector.add_trail(get_trail());
+  for (auto *cp = b(); cp != nullptr; cp = cp->b) {
+    collector.add_boundary(&cp->h);
+  }
+  for (auto *mc = m(); mc != nullptr; mc = mc->old_m) {
+    collector.add_boundary(&mc->old_hb);
+  }
+  size_t hb = get_register_hb();
+  collector.add_boundary(&hb);
+  size_t collected = collector.do_collection(roots);
+  set_register_hb(hb);
+  return collected;
 }
 
 }}
@@ -20,6 +20,8 @@
 #include "arithmetics.hpp"
 #include "locale.hpp"
 #include "source_element.hpp"
+#include "program_cache.hpp"
+#include "profiler.hpp"
 #include "interpreter_exception.hpp"
 
 extern "C" void frotz();
@@ -95,6 +97,7 @@ public:
 	is_indexed_ = true;
 	for (size_t i = 0; i < NUM_TAGS; i++) index_[i].clear();
 	all_.clear();
+	arg_index_.clear();
 	performance_count_ = 0;
     }
     void add_clause(const managed_clause &mclause, clause_position pos);
@@ -141,11 +144,47 @@ public:
 	performance_count_++;
     }
 
+    // Statistics for a JIT index (see get_jit_indexed)
+    struct index_stat {
+	size_t arg;         // Argument position (0 = first argument)
+	size_t num_keys;    // Number of distinct keys
+	size_t num_lookups; // Number of lookups that selected this index
+    };
+
+    std::vector<index_stat> index_stats() const;
+
+    // Predicates with fewer clauses only use the first argument index
+    static const size_t JIT_INDEX_MIN_CLAUSES = 8;
+    static const size_t JIT_INDEX_MAX_ARGS = 8;
+
 private:
+    // Demand driven (JIT) index on one argument position. It is built
+    // the first time a call has that argument bound. Clauses with a
+    // variable at this position are merged (in clause order) into every
+    // bucket. Erased clauses are filtered by the callers, so retract
+    // keeps the index; assertz extends it and asserta drops it.
+    struct arg_index {
+	arg_index() : built(false), num_lookups(0) { }
+	bool built;
+	size_t num_lookups;
+	std::unordered_map<size_t, std::vector<size_t> > map;
+	std::vector<size_t> var_based;
+    };
+
+    static inline size_t index_key(common::term arg, size_t h) {
+	return h * NUM_TAGS + static_cast<size_t>(arg.tag());
+    }
+
+    const std::vector<size_t> & get_jit_indexed(common::term goal, const std::vector<size_t> &first) const;
+    arg_index & get_arg_index(size_t arg_pos) const;
+    void add_to_arg_index(arg_index &index, size_t arg_pos, size_t i) const;
+    void add_arg_index(size_t i);
+
     void add_index(size_t i);
     void remove_index(size_t i);
     void clear_index() {
 	for (size_t i = 0; i < NUM_TAGS; i++) index_[i].clear();
+	arg_index_.clear();
 	is_indexed_ = false;
     }
     void do_index() const;
@@ -160,13 +199,14 @@ private:
     mutable std::unordered_map<size_t, std::vector<size_t> > index_[NUM_TAGS];
     mutable std::vector<size_t> all_;
     mutable size_t performance_count_;
+    mutable std::vector<arg_index> arg_index_;
 };
 	
 class predicate {
 public:
   inline predicate() = default;
   inline predicate(const predicate &other) = default;
-  inline predicate(interpreter_base &interp, const qname &qn) : qname_(qn), id_(0), clauses_(interp), was_compiled_(false),ok_to_compile_(true) { }
+  inline predicate(interpreter_base &interp, const qname &qn) : qname_(qn), id_(0), clauses_(interp), was_compiled_(false),ok_to_compile_(true), partial_(false), changed_(false), num_interpreted_calls_(0), num_compilations_(0) { }
   inline const qname & qualified_name() const { return qname_; }
 
   inline const managed_clauses & clauses() const {
@@ -208,6 +248,45 @@ public:
       ok_to_compile_ = on;
   }
 
+  // Only some of the clauses are loaded (see load_predicate_matching)
+  inline bool is_partial() const {
+      return partial_;
+  }
+
+  inline void set_partial(bool on) {
+      partial_ = on;
+  }
+
+  // Tiered compilation (see wam_interpreter::auto_compile.) Calls
+  // are only counted while the predicate is interpreted and the
+  // count starts over when its clauses change.
+  inline bool is_changed() const {
+      return changed_;
+  }
+
+  inline void set_changed(bool on) {
+      changed_ = on;
+      if (on) {
+	  num_interpreted_calls_ = 0;
+      }
+  }
+
+  inline size_t num_interpreted_calls() const {
+      return num_interpreted_calls_;
+  }
+
+  inline void count_interpreted_call() {
+      num_interpreted_calls_++;
+  }
+
+  inline size_t num_compilations() const {
+      return num_compilations_;
+  }
+
+  inline void count_compilation() {
+      num_compilations_++;
+  }
+
   size_t num_matched(common::term pattern, bool on_head) const {
       return clauses_.num_matched(pattern, on_head);
   }
@@ -241,6 +320,10 @@ public:
 
   size_t performance_count() const { return clauses_.performance_count(); }
 
+  std::vector<managed_clauses::index_stat> index_stats() const {
+      return clauses_.index_stats();
+  }
+
 private:
     friend class interpreter_base;
   
@@ -253,6 +336,10 @@ private:
 
     bool was_compiled_;
     bool ok_to_compile_;
+    bool partial_;
+    bool changed_;
+    size_t num_interpreted_calls_;
+    size_t num_compilations_;
 };
 
 class module_meta {
@@ -671,6 +758,15 @@ public:
 	return retain_state_between_queries_;
     }
     
+    inline program_cache * get_program_cache() {
+	return program_cache_;
+    }
+
+    // Parsed program text is looked up in (and added to) this cache.
+    inline void set_program_cache(program_cache *cache) {
+	program_cache_ = cache;
+    }
+
     inline void set_retain_state_between_queries(bool b) {
         retain_state_between_queries_ = b;
     }
@@ -776,6 +872,26 @@ public:
 	return arg(head, 0);
     }
 
+    term clause_arg(term clause, size_t i)
+    {
+        term head = clause_head(clause);
+	if (!is_functor(head)) {
+	    return term();
+	}
+	auto f = functor(head);
+	if (f == COLON) {
+	     head = arg(head, 1);
+	     if (!is_functor(head)) {
+	         return term();
+	     }
+	     f = functor(head);
+	}
+	if (i >= f.arity()) {
+	    return term();
+	}
+	return deref(arg(head, i));
+    }
+
     term arg_index(term arg)
     {
         switch (arg.tag()) {
@@ -801,11 +917,30 @@ public:
       
     template<typename F = none> void load_program(const std::string &str, F f = F())
     {
-	std::stringstream ss(str);
-	load_program<F>(ss, f);
+	std::vector<source_element> source_list;
+	term clause_list;
+	auto *cache = program_cache_;
+	if (cache == nullptr || !cache->lookup(*this, current_module(), str,
+					       clause_list, source_list)) {
+	    std::stringstream ss(str);
+	    clause_list = parse_program(ss, source_list);
+	    if (cache != nullptr) {
+		cache->store(*this, current_module(), str, clause_list,
+			     source_list);
+	    }
+	}
+	load_parsed_program<F>(clause_list, source_list, f);
     }
 
     template<typename F = none> void load_program(std::istream &in, F f = F())
+    {
+	std::vector<source_element> source_list;
+	term clause_list = parse_program(in, source_list);
+	load_parsed_program<F>(clause_list, source_list, f);
+    }
+
+    term parse_program(std::istream &in,
+		       std::vector<source_element> &source_list)
     {
 	using namespace epilog::common;
 
@@ -814,8 +949,6 @@ public:
     
 	std::vector<term> clauses;
 
-	std::vector<source_element> source_list;
-
 	std::unordered_set<con_cell> seen_predicates;
 
 	while (!parser.is_eof()) {
@@ -870,7 +1003,13 @@ public:
 	for (auto clause : boost::adaptors::reverse(clauses)) {
 	    clause_list = new_dotted_pair(clause, clause_list);
 	}
+	return clause_list;
+    }
 
+    template<typename F> void load_parsed_program(term clause_list,
+			      const std::vector<source_element> &source_list,
+			      F f)
+    {
 	con_cell primary_module = current_module();
 	load_program<F>(clause_list, f, primary_module);
 
@@ -975,7 +1114,7 @@ public:
 	    auto it = program_db_.find(qn);
 	    if (it != program_db_.end()) {
 		auto &pred = it->second;
-		if (pred.empty()) {
+		if (pred.empty() || pred.is_partial()) {
 		    load_predicate(qn);
 		}
 		return it->second;
@@ -994,6 +1133,34 @@ public:
 	    return pred;
 	}
 
+    // Same as above, but for a call with 'first_arg'. Then it's
+    // enough to have the clauses that may match (the predicate is
+    // partial if that's all we have.)
+    inline predicate & get_predicate_matching(const qname &qn,
+					      common::term first_arg)
+        {
+	    auto it = program_db_.find(qn);
+	    if (it == program_db_.end()) {
+		size_t id = program_predicates_.size() + 1;
+		program_predicates_.push_back(qn);
+		predicate &pred = program_db_[qn];
+		pred = predicate(*this, qn);
+		pred.set_id(id);
+		if (!load_predicate_matching(qn, first_arg)) {
+		    load_predicate(qn);
+		}
+		return pred;
+	    }
+	    auto &pred = it->second;
+	    if (pred.is_partial() || pred.empty()) {
+		if (!load_predicate_matching(qn, first_arg) &&
+		    (pred.is_partial() || pred.empty())) {
+		    load_predicate(qn);
+		}
+	    }
+	    return pred;
+	}
+
     virtual void update_pr();
     
     virtual size_t num_predicates() const
@@ -1046,6 +1213,12 @@ public:
     virtual void updated_predicate_pre(const qname &qn) { }
     virtual void updated_predicate_post(const qname &qn) { }
     virtual void load_predicate(const qname &qn) { }
+    // Load the clauses that may match a call with 'first_arg' (and
+    // mark the predicate as partial.) Return false to load all.
+    virtual bool load_predicate_matching(const qname &qn,
+					 common::term first_arg) {
+	return false;
+    }
     virtual size_t unique_predicate_id(const con_cell module) {
 	return program_predicates_.size() + 1;
     }
@@ -1086,6 +1259,15 @@ public:
     void print_profile() const;
     void print_profile(std::ostream &out) const;
 
+    // The profiler (see profiler.hpp) can be switched on and off at
+    // any time. Its data is kept until reset_profiling().
+    void set_profiling(bool on);
+    inline bool is_profiling() const { return profiler_enabled_; }
+    inline const profiler * get_profiler() const { return profiler_; }
+    void reset_profiling();
+
+    inline uint64_t num_choice_points() const { return num_choice_points_; }
+
     class list_iterator : public common::term_iterator {
     public:
 	list_iterator(term_env &env, const common::term t)
@@ -1274,11 +1456,30 @@ public:
     void dump_roots();
     void dump_stack();
     void dump_choice_points();
-    void garbage_collect();
+    // Compact what the running query has allocated on the heap. A
+    // young collection only looks at the cells above HB (allocated
+    // after the last choice point.)
+    size_t garbage_collect(bool young = false);
   
 protected:
     friend class wam_interpreter;
     friend class gc_visitor;
+
+    // Charge the profiler and find out where we are now. Only to be
+    // called if is_profiling().
+    void profile_sample(bool is_call);
+    // A built-in is about to be called (it becomes a frame of its
+    // own.) Built-ins are known by name only; WAM code doesn't keep
+    // their module.
+    void profile_builtin(common::con_cell f);
+    void profile_resume();
+    // The current stack of predicates (innermost first, at most
+    // profiler::MAX_DEPTH.) This only understands naive environments.
+    virtual void profile_stack(profiler::stack_t &stack);
+    void profile_naive_env(environment_naive_t *ee, profiler::stack_t &stack);
+    virtual std::vector<std::string> profile_instruction_names() const;
+    inline void profile_count_instruction(size_t type) { profiler_->count_instruction(type); }
+    inline void profile_count_goal() { profiler_->count_goal(); }
   
     template<typename T> inline size_t words() const
     { return sizeof(T)/sizeof(word_t); }
@@ -1789,6 +1990,7 @@ protected:
 	new_b->pr = register_pr_;
 	register_b_ = new_b;
 	set_register_hb(heap_size());
+	num_choice_points_++;
 
 	// std::cout << "allocate_choice_point(): b=" << new_b << " trail_size=" << trail_size() << "\n";
 
@@ -1897,6 +2099,33 @@ protected:
 	return arg(goal, 0);
     }
 
+    // Like get_first_arg(goal), but for argument i (dereferenced.)
+    // Returns term() if there is no such argument.
+    term get_arg(term goal, size_t i) const
+    {
+	if (goal.tag() == common::tag_t::CON) {
+	    auto c = reinterpret_cast<con_cell &>(goal);
+	    if (c.arity() > 0) {
+		return i < c.arity() ? deref(a(i)) : term();
+	    }
+	}
+        if (!is_functor(goal)) {
+	    return term();
+        }
+	auto f = functor(goal);
+	if (f == COLON) {
+	    goal = arg(goal, 1);
+	    if (!is_functor(goal)) {
+	        return term();
+	    }
+	    f = functor(goal);
+	}
+	if (i >= f.arity()) {
+	    return term();
+	}
+	return deref(arg(goal, i));
+    }
+
     void abort(const interpreter_exception &ex);
     bool definitely_inequal(const term a, const term b);
 
@@ -2060,6 +2289,7 @@ public:
 
 private:
     bool retain_state_between_queries_;
+    program_cache *program_cache_;
 
     std::string current_dir_; // Current directory
 
@@ -2072,6 +2302,11 @@ private:
 
     std::unordered_map<common::con_cell, uint64_t> profiling_;
 
+    bool profiler_enabled_;
+    profiler *profiler_;
+    profiler::stack_t profile_stack_;
+    uint64_t num_choice_points_;
+
     std::function<void ()> debug_check_fn_;
 
     // Keep track of accumulated cost while interpreter is executing
@@ -2611,7 +2846,11 @@ inline void managed_clauses::get_matched_first_arg(common::term first_arg, std::
 
 inline const std::vector<size_t> & managed_clauses::get_indexed(common::term goal) const {
     auto first_arg = interp_->get_first_arg(goal);
-    return get_indexed_first_arg(first_arg);
+    auto &indexed = get_indexed_first_arg(first_arg);
+    if (indexed.size() <= 1 || num_clauses_ < JIT_INDEX_MIN_CLAUSES) {
+	return indexed;
+    }
+    return get_jit_indexed(goal, indexed);
 }
 
 inline const std::vector<size_t> & managed_clauses::get_indexed_first_arg(common::term first_arg) const {
@@ -0,0 +1,327 @@
+#include <chrono>
+#include <map>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <boost/functional/hash.hpp>
+#include "profiler.hpp"
+#include "interpreter_base.hpp"
+
+namespace epilog { namespace interp {
+
+using namespace epilog::common;
+
+static const char * METRIC_NAMES[profiler::NUM_METRICS] = {
+    "calls", "time", "instructions", "cost", "heap", "choicepoints"
+};
+
+profiler::profiler(const std::vector<std::string> &instruction_names)
+    : instruction_names_(instruction_names)
+{
+    // The last one counts the goals of the naive interpreter
+    instruction_names_.push_back("goal");
+    reset();
+}
+
+const char * profiler::metric_name(metric m)
+{
+    return METRIC_NAMES[m];
+}
+
+bool profiler::parse_metric(const std::string &name, metric &m)
+{
+    for (size_t i = 0; i < NUM_METRICS; i++) {
+	if (name == METRIC_NAMES[i]) {
+	    m = static_cast<metric>(i);
+	    return true;
+	}
+    }
+    return false;
+}
+
+void profiler::reset()
+{
+    current_.clear();
+    current_pred_ = nullptr;
+    current_edge_ = nullptr;
+    current_stack_ = nullptr;
+    num_instructions_ = 0;
+    predicates_.clear();
+    edges_.clear();
+    stacks_.clear();
+    instructions_.assign(instruction_names_.size(), 0);
+    resume(0, 0, 0);
+}
+
+uint64_t profiler::now_ns()
+{
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+void profiler::resume(uint64_t cost, size_t heap, uint64_t num_choice_points)
+{
+    last_time_ = now_ns();
+    last_instructions_ = num_instructions_;
+    last_cost_ = cost;
+    last_heap_ = heap;
+    last_choice_points_ = num_choice_points;
+}
+
+void profiler::charge(uint64_t cost, size_t heap, uint64_t num_choice_points)
+{
+    counters delta;
+    delta[TIME] = now_ns() - last_time_;
+    delta[INSTRUCTIONS] = num_instructions_ - last_instructions_;
+    // Cost is reset between queries and the heap shrinks on
+    // backtracking; only growth counts.
+    delta[COST] = cost > last_cost_ ? cost - last_cost_ : 0;
+    delta[HEAP] = heap > last_heap_ ? heap - last_heap_ : 0;
+    delta[CHOICE_POINTS] = num_choice_points - last_choice_points_;
+    resume(cost, heap, num_choice_points);
+
+    if (current_stack_ == nullptr) {
+	return;
+    }
+    current_pred_->add(delta);
+    if (current_edge_) current_edge_->add(delta);
+    current_stack_->add(delta);
+}
+
+void profiler::enter(stack_t &stack, bool is_call)
+{
+    if (current_stack_ == nullptr || stack != current_) {
+	current_.swap(stack);
+	if (current_.empty()) {
+	    current_pred_ = nullptr;
+	    current_edge_ = nullptr;
+	    current_stack_ = nullptr;
+	    return;
+	}
+	// (Pointers to elements of an unordered_map survive rehashing)
+	size_t n = current_.size();
+	current_pred_ = &predicates_[current_[n-1]];
+	current_edge_ = n > 1 ? &edges_[edge_t(current_[n-2], current_[n-1])] : nullptr;
+	current_stack_ = &stacks_[current_];
+    }
+    if (is_call && current_stack_ != nullptr) {
+	current_pred_->value[CALLS]++;
+	if (current_edge_) current_edge_->value[CALLS]++;
+	current_stack_->value[CALLS]++;
+    }
+}
+
+const profiler::counters & profiler::get(const qname &qn) const
+{
+    static const counters none;
+    auto it = predicates_.find(qn);
+    return it == predicates_.end() ? none : it->second;
+}
+
+const profiler::counters & profiler::get(const qname &caller, const qname &callee) const
+{
+    static const counters none;
+    auto it = edges_.find(edge_t(caller, callee));
+    return it == edges_.end() ? none : it->second;
+}
+
+profiler::counters profiler::total() const
+{
+    counters sum;
+    for (auto &p : predicates_) {
+	sum.add(p.second);
+    }
+    return sum;
+}
+
+size_t profiler::hash::operator () (const qname &qn) const
+{
+    size_t h = 0;
+    boost::hash_combine(h, qn.first.raw_value());
+    boost::hash_combine(h, qn.second.raw_value());
+    return h;
+}
+
+size_t profiler::hash::operator () (const edge_t &e) const
+{
+    size_t h = (*this)(e.first);
+    boost::hash_combine(h, (*this)(e.second));
+    return h;
+}
+
+size_t profiler::hash::operator () (const stack_t &s) const
+{
+    size_t h = s.size();
+    for (auto &qn : s) {
+	boost::hash_combine(h, (*this)(qn));
+    }
+    return h;
+}
+
+std::string profiler::name_of(const interpreter_base &interp, const qname &qn) const
+{
+    static const con_cell SYSTEM("system", 0);
+
+    std::string name;
+    if (qn.first != interpreter_base::USER_MODULE && qn.first != SYSTEM &&
+	qn.first != interpreter_base::EMPTY_LIST && qn.first != con_cell()) {
+	name = interp.atom_name(qn.first) + ":";
+    }
+    name += interp.atom_name(qn.second) + "/" + std::to_string(qn.second.arity());
+    return name;
+}
+
+static std::string collapsed_frame(std::string name)
+{
+    // ';' separates frames and the count follows the first blank
+    for (auto &ch : name) {
+	if (ch == ';' || ch == ' ' || ch == '\t' || ch == '\n') ch = '_';
+    }
+    return name;
+}
+
+static std::string json_string(const std::string &str)
+{
+    std::stringstream ss;
+    ss << '"';
+    for (unsigned char ch : str) {
+	switch (ch) {
+	case '"': ss << "\\\""; break;
+	case '\\': ss << "\\\\"; break;
+	case '\n': ss << "\\n"; break;
+	case '\t': ss << "\\t"; break;
+	default:
+	    if (ch < 0x20) {
+		ss << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(ch) << std::dec;
+	    } else {
+		ss << ch;
+	    }
+	    break;
+	}
+    }
+    ss << '"';
+    return ss.str();
+}
+
+static void json_counters(std::ostream &out, const profiler::counters &c)
+{
+    for (size_t i = 0; i < profiler::NUM_METRICS; i++) {
+	auto m = static_cast<profiler::metric>(i);
+	out << (i == 0 ? "" : ", ") << "\"" << profiler::metric_name(m) << "\": " << c[m];
+    }
+}
+
+void profiler::write_collapsed(std::ostream &out, const interpreter_base &interp, metric m) const
+{
+    // Sorted (and merged, in case two stacks get the same names)
+    std::map<std::string, uint64_t> lines;
+    for (auto &s : stacks_) {
+	auto value = s.second[m];
+	if (value == 0) {
+	    continue;
+	}
+	std::string line;
+	for (auto &qn : s.first) {
+	    if (!line.empty()) line += ";";
+	    line += collapsed_frame(name_of(interp, qn));
+	}
+	lines[line] += value;
+    }
+    for (auto &line : lines) {
+	out << line.first << " " << line.second << "\n";
+    }
+}
+
+void profiler::write_json(std::ostream &out, const interpreter_base &interp) const
+{
+    // Most expensive (in time) first
+    auto by_time = [](const counters &a, const counters &b) {
+	return a[TIME] > b[TIME];
+    };
+
+    out << "{\n  \"total\": {";
+    json_counters(out, total());
+    out << "},\n";
+
+    std::vector<std::pair<std::string, counters> > preds;
+    for (auto &p : predicates_) {
+	preds.push_back(std::make_pair(name_of(interp, p.first), p.second));
+    }
+    std::sort(preds.begin(), preds.end(), [&](const std::pair<std::string, counters> &a, const std::pair<std::string, counters> &b) { return by_time(a.second, b.second) || (!by_time(b.second, a.second) && a.first < b.first); });
+    out << "  \"predicates\": [";
+    bool first = true;
+    for (auto &p : preds) {
+	out << (first ? "\n" : ",\n") << "    {\"name\": " << json_string(p.first) << ", ";
+	json_counters(out, p.second);
+	out << "}";
+	first = false;
+    }
+    out << "\n  ],\n";
+
+    std::vector<std::pair<edge_t, counters> > edges(edges_.begin(), edges_.end());
+    std::stable_sort(edges.begin(), edges.end(), [&](const std::pair<edge_t, counters> &a, const std::pair<edge_t, counters> &b) { return by_time(a.second, b.second); });
+    out << "  \"edges\": [";
+    first = true;
+    for (auto &e : edges) {
+	out << (first ? "\n" : ",\n") << "    {\"caller\": "
+	    << json_string(name_of(interp, e.first.first)) << ", \"callee\": "
+	    << json_string(name_of(interp, e.first.second)) << ", ";
+	json_counters(out, e.second);
+	out << "}";
+	first = false;
+    }
+    out << "\n  ],\n";
+
+    std::vector<std::pair<stack_t, counters> > stacks(stacks_.begin(), stacks_.end());
+    std::stable_sort(stacks.begin(), stacks.end(), [&](const std::pair<stack_t, counters> &a, const std::pair<stack_t, counters> &b) { return by_time(a.second, b.second); });
+    out << "  \"stacks\": [";
+    first = true;
+    for (auto &s : stacks) {
+	out << (first ? "\n" : ",\n") << "    {\"stack\": [";
+	for (size_t i = 0; i < s.first.size(); i++) {
+	    out << (i == 0 ? "" : ", ") << json_string(name_of(interp, s.first[i]));
+	}
+	out << "], ";
+	json_counters(out, s.second);
+	out << "}";
+	first = false;
+    }
+    out << "\n  ],\n";
+
+    out << "  \"instructions\": {";
+    first = true;
+    for (size_t i = 0; i < instructions_.size(); i++) {
+	if (instructions_[i] == 0) {
+	    continue;
+	}
+	out << (first ? "" : ", ") << json_string(instruction_names_[i]) << ": " << instructions_[i];
+	first = false;
+    }
+    out << "}\n}\n";
+}
+
+void profiler::write_summary(std::ostream &out, const interpreter_base &interp, size_t max_lines) const
+{
+    std::vector<std::pair<qname, counters> > preds(predicates_.begin(), predicates_.end());
+    std::stable_sort(preds.begin(), preds.end(), [](const std::pair<qname, counters> &a, const std::pair<qname, counters> &b) { return a.second[TIME] > b.second[TIME]; });
+    if (preds.size() > max_lines) {
+	preds.resize(max_lines);
+    }
+
+    out << std::left << std::setw(32) << "predicate" << std::right;
+    for (size_t i = 0; i < NUM_METRICS; i++) {
+	auto m = static_cast<metric>(i);
+	out << " " << std::setw(12) << (m == TIME ? "time(us)" : metric_name(m));
+    }
+    out << "\n";
+    for (auto &p : preds) {
+	out << std::left << std::setw(32) << name_of(interp, p.first) << std::right;
+	for (size_t i = 0; i < NUM_METRICS; i++) {
+	    auto m = static_cast<metric>(i);
+	    out << " " << std::setw(12) << (m == TIME ? p.second[m] / 1000 : p.second[m]);
+	}
+	out << "\n";
+    }
+}
+
+}}
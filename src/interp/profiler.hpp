@@ -0,0 +1,136 @@
+#pragma once
+
+#ifndef _interp_profiler_hpp
+#define _interp_profiler_hpp
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include <unordered_map>
+#include "builtins.hpp"
+
+namespace epilog { namespace interp {
+
+class interpreter_base;
+
+//
+// Instrumented profiler. The interpreter takes a sample whenever
+// control is transferred (call, execute, proceed, backtracking, a
+// built-in) and everything that happened since the previous sample is
+// charged to the stack (of predicates) that was current at that time,
+// i.e. these are "self" numbers. The stack is recovered from the
+// environment chain, so last call optimization removes frames the same
+// way it does in the actual execution.
+//
+// Heap cells are the growth of the heap between two samples, so heap
+// reclaimed on backtracking is not counted twice.
+//
+class profiler {
+public:
+    enum metric {
+	CALLS = 0,
+	TIME = 1,          // wall time in nanoseconds
+	INSTRUCTIONS = 2,  // WAM instructions + dispatches of naive goals
+	COST = 3,
+	HEAP = 4,
+	CHOICE_POINTS = 5,
+	NUM_METRICS = 6
+    };
+
+    struct counters {
+	inline counters() : value{} { }
+
+	inline uint64_t operator [] (metric m) const { return value[m]; }
+	inline uint64_t & operator [] (metric m) { return value[m]; }
+
+	inline void add(const counters &c) {
+	    for (size_t i = 0; i < NUM_METRICS; i++) value[i] += c.value[i];
+	}
+
+	uint64_t value[NUM_METRICS];
+    };
+
+    // Root first, the last element is the current predicate
+    typedef std::vector<qname> stack_t;
+
+    // Deeper stacks keep their innermost frames only
+    static const size_t MAX_DEPTH = 64;
+
+    profiler(const std::vector<std::string> &instruction_names);
+
+    static const char * metric_name(metric m);
+    static bool parse_metric(const std::string &name, metric &m);
+
+    void reset();
+
+    // Totals at this point, without charging anything
+    void resume(uint64_t cost, size_t heap, uint64_t num_choice_points);
+
+    // Charge everything since the last sample to the current stack
+    void charge(uint64_t cost, size_t heap, uint64_t num_choice_points);
+
+    // Make 'stack' the current one; 'is_call' if we just entered it
+    void enter(stack_t &stack, bool is_call);
+
+    inline void count_instruction(size_t type) {
+	num_instructions_++;
+	instructions_[type]++;
+    }
+
+    // A goal dispatched by the naive interpreter counts as one
+    inline void count_goal() {
+	num_instructions_++;
+	instructions_.back()++;
+    }
+
+    inline bool empty() const { return predicates_.empty(); }
+
+    inline const stack_t & current() const { return current_; }
+
+    const counters & get(const qname &qn) const;
+    const counters & get(const qname &caller, const qname &callee) const;
+    counters total() const;
+
+    // Collapsed stacks ("a;b;c N" per line) for flamegraph.pl and
+    // friends, weighted by the given metric.
+    void write_collapsed(std::ostream &out, const interpreter_base &interp, metric m) const;
+
+    void write_json(std::ostream &out, const interpreter_base &interp) const;
+
+    // Top predicates (by time) as a table
+    void write_summary(std::ostream &out, const interpreter_base &interp, size_t max_lines) const;
+
+private:
+    typedef std::pair<qname, qname> edge_t;
+
+    // (std::hash<qname> is only defined later in interpreter_base.hpp)
+    struct hash {
+	size_t operator () (const qname &qn) const;
+	size_t operator () (const edge_t &e) const;
+	size_t operator () (const stack_t &s) const;
+    };
+
+    static uint64_t now_ns();
+    std::string name_of(const interpreter_base &interp, const qname &qn) const;
+
+    stack_t current_;
+    counters *current_pred_;
+    counters *current_edge_;
+    counters *current_stack_;
+    uint64_t last_time_;
+    uint64_t last_instructions_;
+    uint64_t last_cost_;
+    size_t last_heap_;
+    uint64_t last_choice_points_;
+    uint64_t num_instructions_;
+
+    std::unordered_map<qname, counters, hash> predicates_;
+    std::unordered_map<edge_t, counters, hash> edges_;
+    std::unordered_map<stack_t, counters, hash> stacks_;
+    std::vector<std::string> instruction_names_;
+    std::vector<uint64_t> instructions_;
+};
+
+}}
+
+#endif
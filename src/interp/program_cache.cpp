@@ -0,0 +1,328 @@
+#include <algorithm>
+#include <ctime>
+#include <fstream>
+#include <boost/filesystem.hpp>
+#include <boost/range/adaptor/reversed.hpp>
+#include "../common/blake2.hpp"
+#include "../common/hex.hpp"
+#include "program_cache.hpp"
+
+namespace epilog { namespace interp {
+
+using namespace epilog::common;
+
+// The last byte is the image version; bump it when the layout changes.
+const char program_cache::MAGIC[8] = { 'e','p','i','l','o','g','i', 1 };
+
+static const con_cell PROGRAM("program", 2);
+static const con_cell PRED("pred", 2);
+static const con_cell ACTION("action", 1);
+static const con_cell COMMENT("comment", 1);
+
+static void write_u32(std::ostream &out, uint32_t v)
+{
+    uint8_t b[4] = { static_cast<uint8_t>(v), static_cast<uint8_t>(v >> 8),
+		     static_cast<uint8_t>(v >> 16), static_cast<uint8_t>(v >> 24) };
+    out.write(reinterpret_cast<const char *>(b), sizeof(b));
+}
+
+static bool read_u32(std::istream &in, uint32_t &v)
+{
+    uint8_t b[4];
+    if (!in.read(reinterpret_cast<char *>(b), sizeof(b))) {
+	return false;
+    }
+    v = static_cast<uint32_t>(b[0]) | (static_cast<uint32_t>(b[1]) << 8) |
+	(static_cast<uint32_t>(b[2]) << 16) | (static_cast<uint32_t>(b[3]) << 24);
+    return true;
+}
+
+static bool read_bytes(std::istream &in, char *bytes, uint32_t n)
+{
+    return n == 0 || static_cast<bool>(in.read(bytes, n));
+}
+
+program_cache::program_cache(const std::string &dir,
+			     size_t max_memory_bytes, size_t max_disk_bytes)
+    : dir_(dir), images_(DEFAULT_MAX_IMAGES), max_disk_bytes_(max_disk_bytes),
+      hits_(0), misses_(0)
+{
+    images_.set_max_bytes(max_memory_bytes);
+}
+
+void program_cache::set_max_memory_bytes(size_t max_bytes)
+{
+    boost::lock_guard<boost::mutex> guard(lock_);
+    images_.set_max_bytes(max_bytes);
+}
+
+size_t program_cache::memory_bytes()
+{
+    boost::lock_guard<boost::mutex> guard(lock_);
+    return images_.num_bytes();
+}
+
+std::string program_cache::key_of(term_env &env, con_cell module,
+				  const std::string &source)
+{
+    // Hash module, a separator and the source text
+    std::string mod = env.atom_name(module);
+    uint8_t h[32];
+    blake2b_state s;
+    blake2b_init(&s, sizeof(h));
+    blake2b_update(&s, mod.c_str(), mod.size() + 1);
+    blake2b_update(&s, source.c_str(), source.size());
+    blake2b_final(&s, h, sizeof(h));
+    return hex::to_string(h, sizeof(h));
+}
+
+std::string program_cache::file_of(const std::string &key) const
+{
+    return (boost::filesystem::path(dir_) / (key + ".img")).string();
+}
+
+std::shared_ptr<const program_cache::image> program_cache::read_image(const std::string &key)
+{
+    {
+	boost::lock_guard<boost::mutex> guard(lock_);
+	auto *img = images_.find(key);
+	if (img != nullptr) {
+	    return *img;
+	}
+    }
+
+    auto file = file_of(key);
+    std::ifstream ifs(file, std::ios::binary);
+    if (!ifs.good()) {
+	return nullptr;
+    }
+    char magic[sizeof(MAGIC)];
+    if (!ifs.read(magic, sizeof(magic)) ||
+	!std::equal(magic, magic + sizeof(magic), MAGIC)) {
+	return nullptr;
+    }
+
+    auto img = std::make_shared<image>();
+    uint32_t n = 0;
+    if (!read_u32(ifs, n)) {
+	return nullptr;
+    }
+    img->term.resize(n);
+    if (!read_bytes(ifs, reinterpret_cast<char *>(&img->term[0]), n) ||
+	!read_u32(ifs, n)) {
+	return nullptr;
+    }
+    img->comments.resize(n);
+    for (auto &comment : img->comments) {
+	uint32_t len = 0;
+	if (!read_u32(ifs, len)) {
+	    return nullptr;
+	}
+	comment.resize(len);
+	if (!read_bytes(ifs, &comment[0], len)) {
+	    return nullptr;
+	}
+    }
+    ifs.close();
+
+    // In use, so it's the last to be removed by trim_disk()
+    boost::system::error_code ec;
+    boost::filesystem::last_write_time(file, std::time(nullptr), ec);
+
+    remember(key, img);
+    return img;
+}
+
+void program_cache::remember(const std::string &key,
+			     const std::shared_ptr<const image> &img)
+{
+    size_t num_bytes = sizeof(image) + img->term.size();
+    for (auto &comment : img->comments) {
+	num_bytes += sizeof(comment) + comment.size();
+    }
+    boost::lock_guard<boost::mutex> guard(lock_);
+    images_.insert(key, img, num_bytes);
+}
+
+void program_cache::write_image(const std::string &key, const image &img)
+{
+    // Write to a temporary file first, so a concurrent reader never
+    // sees half an image.
+    try {
+	boost::filesystem::create_directories(dir_);
+	auto tmp = boost::filesystem::unique_path(file_of(key) + ".%%%%%%%%");
+	{
+	    std::ofstream ofs(tmp.string(), std::ios::binary);
+	    ofs.write(MAGIC, sizeof(MAGIC));
+	    write_u32(ofs, static_cast<uint32_t>(img.term.size()));
+	    ofs.write(reinterpret_cast<const char *>(&img.term[0]),
+		      img.term.size());
+	    write_u32(ofs, static_cast<uint32_t>(img.comments.size()));
+	    for (auto &comment : img.comments) {
+		write_u32(ofs, static_cast<uint32_t>(comment.size()));
+		ofs.write(comment.c_str(), comment.size());
+	    }
+	}
+	boost::filesystem::rename(tmp, file_of(key));
+    } catch (const boost::filesystem::filesystem_error &) {
+	// Not being able to persist the image is not an error;
+	// we'll just parse the source again next time.
+    }
+    trim_disk(file_of(key));
+}
+
+void program_cache::trim_disk(const std::string &keep)
+{
+    size_t max_bytes = max_disk_bytes_;
+    if (max_bytes == 0) {
+	return;
+    }
+
+    struct file_info {
+	std::time_t time;
+	size_t size;
+	boost::filesystem::path path;
+    };
+    std::vector<file_info> files;
+    size_t total = 0;
+    boost::system::error_code ec;
+    for (boost::filesystem::directory_iterator it(dir_, ec), end;
+	 !ec && it != end; it.increment(ec)) {
+	auto &path = it->path();
+	if (path.extension() != ".img") {
+	    continue;
+	}
+	boost::system::error_code ec1;
+	size_t size = boost::filesystem::file_size(path, ec1);
+	std::time_t time = boost::filesystem::last_write_time(path, ec1);
+	if (ec1) {
+	    continue;
+	}
+	total += size;
+	if (path.string() != keep) {
+	    files.push_back(file_info{time, size, path});
+	}
+    }
+    if (total <= max_bytes) {
+	return;
+    }
+
+    // Oldest first (another thread may be removing them too, so
+    // errors are ignored.)
+    std::sort(files.begin(), files.end(),
+	      [](const file_info &a, const file_info &b) {
+		  return a.time < b.time; });
+    for (auto &f : files) {
+	if (total <= max_bytes) {
+	    break;
+	}
+	boost::filesystem::remove(f.path, ec);
+	total -= f.size;
+    }
+}
+
+bool program_cache::lookup(term_env &env, con_cell module,
+			   const std::string &source, term &clauses,
+			   std::vector<source_element> &elements)
+{
+    auto key = key_of(env, module, source);
+    auto img = read_image(key);
+
+    bool ok = img != nullptr;
+    if (ok) {
+	size_t heap_size = env.heap_size();
+	try {
+	    term_serializer ser(env);
+	    term t = ser.read(img->term);
+	    ok = t.tag() == tag_t::STR && env.functor(t) == PROGRAM;
+	    if (ok) {
+		clauses = env.arg(t, 0);
+		for (term lst = env.arg(t, 1); ok && env.is_dotted_pair(lst);
+		     lst = env.arg(lst, 1)) {
+		    auto e = env.arg(lst, 0);
+		    auto f = env.functor(e);
+		    if (f == PRED) {
+			auto name = env.arg(e, 0);
+			auto arity = env.arg(e, 1);
+			auto n = reinterpret_cast<int_cell &>(arity).value();
+			elements.push_back(source_element(
+			     env.functor(env.atom_name(name), n)));
+		    } else if (f == ACTION) {
+			elements.push_back(source_element(env.arg(e, 0)));
+		    } else if (f == COMMENT) {
+			auto index = env.arg(e, 0);
+			auto i = reinterpret_cast<int_cell &>(index).value();
+			ok = i >= 0 && static_cast<size_t>(i) < img->comments.size();
+			if (ok) {
+			    term_tokenizer::token comment;
+			    comment.set_lexeme(img->comments[i]);
+			    elements.push_back(source_element(comment));
+			}
+		    }
+		}
+	    }
+	} catch (const serializer_exception &) {
+	    ok = false;
+	}
+	if (!ok) {
+	    env.trim_heap(heap_size);
+	    elements.clear();
+	}
+    }
+
+    if (ok) hits_++; else misses_++;
+    return ok;
+}
+
+void program_cache::store(term_env &env, con_cell module,
+			  const std::string &source, term clauses,
+			  const std::vector<source_element> &elements)
+{
+    auto key = key_of(env, module, source);
+    auto img = std::make_shared<image>();
+
+    for (auto &e : elements) {
+	if (e.type() == source_element::SOURCE_COMMENT) {
+	    img->comments.push_back(e.comment().lexeme());
+	}
+    }
+
+    // The image term is only needed for the serialization
+    size_t heap_size = env.heap_size();
+    size_t comment_index = img->comments.size();
+    term elems = env.EMPTY_LIST;
+    for (auto &e : boost::adaptors::reverse(elements)) {
+	term t;
+	switch (e.type()) {
+	case source_element::SOURCE_PREDICATE:
+	    t = env.new_term(PRED, {env.functor(env.atom_name(e.predicate()),0),
+			            int_cell(e.predicate().arity())});
+	    break;
+	case source_element::SOURCE_ACTION:
+	    t = env.new_term(ACTION, {e.action()});
+	    break;
+	case source_element::SOURCE_COMMENT:
+	    t = env.new_term(COMMENT, {int_cell(--comment_index)});
+	    break;
+	default:
+	    continue;
+	}
+	elems = env.new_dotted_pair(t, elems);
+    }
+    term t = env.new_term(PROGRAM, {clauses, elems});
+
+    term_serializer ser(env, term_serializer::FORMAT_COMPACT);
+    ser.write(img->term, t);
+    env.trim_heap(heap_size);
+
+    remember(key, img);
+    write_image(key, *img);
+}
+
+void program_cache::clear_memory()
+{
+    boost::lock_guard<boost::mutex> guard(lock_);
+    images_.clear();
+}
+
+}}
@@ -0,0 +1,97 @@
+#pragma once
+
+#ifndef _interp_program_cache_hpp
+#define _interp_program_cache_hpp
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <memory>
+#include <boost/thread.hpp>
+#include "../common/lru_cache.hpp"
+#include "../common/term_env.hpp"
+#include "../common/term_serializer.hpp"
+#include "source_element.hpp"
+
+namespace epilog { namespace interp {
+
+//
+// Binary images of parsed programs, so the same Prolog text doesn't
+// need to be tokenized and parsed again on every start. An image
+// holds the clauses and the source elements (predicate order and
+// comments) of one load_program() call and is keyed by a hash of the
+// module and the source text. Images are stored as files in a
+// directory and kept in memory once read, so several interpreters
+// can share one cache (it is thread safe.)
+//
+// Both are bounded: the images in memory by an LRU with a byte budget,
+// and the files by removing the least recently used ones (by
+// modification time, which is touched when an image is read from disk)
+// once the directory has grown past its budget. The image just written
+// is never removed.
+//
+// The budgets are the defaults below unless given; 0 means no limit.
+//
+class program_cache {
+public:
+    typedef common::term_serializer::buffer_t buffer_t;
+
+    static const size_t DEFAULT_MAX_IMAGES = 1024;
+    static const size_t DEFAULT_MAX_MEMORY_BYTES = 32*1024*1024;
+    static const size_t DEFAULT_MAX_DISK_BYTES = 256*1024*1024;
+
+    // Comments are kept as plain strings, the term (the clauses,
+    // predicate order and actions) refers to them by index.
+    struct image {
+	buffer_t term;
+	std::vector<std::string> comments;
+    };
+
+    program_cache(const std::string &dir,
+		  size_t max_memory_bytes = DEFAULT_MAX_MEMORY_BYTES,
+		  size_t max_disk_bytes = DEFAULT_MAX_DISK_BYTES);
+
+    inline const std::string & directory() const { return dir_; }
+
+    void set_max_memory_bytes(size_t max_bytes);
+    inline void set_max_disk_bytes(size_t max_bytes) { max_disk_bytes_ = max_bytes; }
+    inline size_t max_disk_bytes() const { return max_disk_bytes_; }
+    size_t memory_bytes();
+
+    // Returns false if there's no (valid) image for this source.
+    bool lookup(common::term_env &env, common::con_cell module,
+		const std::string &source, common::term &clauses,
+		std::vector<source_element> &elements);
+
+    void store(common::term_env &env, common::con_cell module,
+	       const std::string &source, common::term clauses,
+	       const std::vector<source_element> &elements);
+
+    // Forget the images read so far (they remain on disk.)
+    void clear_memory();
+
+    inline size_t num_hits() const { return hits_.load(); }
+    inline size_t num_misses() const { return misses_.load(); }
+
+private:
+    static const char MAGIC[8];
+
+    std::string key_of(common::term_env &env, common::con_cell module,
+		       const std::string &source);
+    std::string file_of(const std::string &key) const;
+    std::shared_ptr<const image> read_image(const std::string &key);
+    void write_image(const std::string &key, const image &img);
+    void trim_disk(const std::string &keep);
+    void remember(const std::string &key, const std::shared_ptr<const image> &img);
+
+    std::string dir_;
+    boost::mutex lock_;
+    common::lru_cache<std::string, std::shared_ptr<const image> > images_;
+    std::atomic<size_t> max_disk_bytes_;
+    std::atomic<size_t> hits_;
+    std::atomic<size_t> misses_;
+};
+
+}}
+
+#endif
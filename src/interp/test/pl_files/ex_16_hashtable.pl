@@ -27,9 +27,40 @@ check0(P) :- status_predicate(foo:bar/1, P0), lookup(100), status_predicate(foo:
 ?- assert(foo:bar(X) :- X = default).
 % Expect: true
 
-% Now let's see how the lookup works now (it should be a lot worse.)
+% Now let's see how the lookup works now. The first argument index
+% gives up, but the JIT index on the first argument merges the
+% variable clause into every bucket (building it costs 101.)
 check1(P) :- status_predicate(foo:bar/1, P0), lookup(100), status_predicate(foo:bar/1, P1), P is P1 - P0.
 
 ?- check1(P).
-% Expect: P = 40400
+% Expect: P = 701
 
+% Tables looked up on other arguments than the first one get a JIT
+% index on the most selective bound argument.
+fill_addr(0) :- !.
+fill_addr(N) :-
+    K is N mod 10,
+    V is N * 7,
+    assert(foo:addr(K, N, V)),
+    N1 is N - 1,
+    fill_addr(N1).
+
+?- fill_addr(100).
+% Expect: true
+
+lookup_addr(0) :- !.
+lookup_addr(N) :-
+    K is N mod 10,
+    foo:addr(K, N, V),
+    foo:addr(_, N1, V),
+    N1 == N,
+    N2 is N - 1,
+    lookup_addr(N2).
+
+check2(P) :- status_predicate(foo:addr/3, P0), lookup_addr(100), status_predicate(foo:addr/3, P1), P is P1 - P0.
+
+?- check2(P).
+% Expect: P = 600
+
+?- status_predicate(foo:addr/3, indexes(L)).
+% Expect: L = [index(2, 100, 200),index(3, 100, 200)]
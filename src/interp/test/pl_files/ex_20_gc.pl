@@ -0,0 +1,40 @@
+% Meta: WAM-only
+
+%
+% Testing garbage collection while running
+%
+
+garbage(0) :- !.
+garbage(N) :- _ = foo(N, [a,b,c], bar(N)), N1 is N - 1, garbage(N1).
+
+build(0, []) :- !.
+build(N, [f(N)|Xs]) :- N1 is N - 1, build(N1, Xs).
+
+sum([], 0).
+sum([f(X)|Xs], S) :- sum(Xs, S0), S is S0 + X.
+
+% Live data in environments
+run1(S) :- garbage(1000), build(100, L), garbage(1000), garbage_collect, sum(L, S).
+
+?- run1(S).
+% Expect: S = 5050
+
+% Live data in query variables
+?- garbage(1000), build(5, L), garbage(1000), garbage_collect, sum(L, S).
+% Expect: L = [f(5),f(4),f(3),f(2),f(1)], S = 15
+
+% A young collection keeps everything older than the last choice
+% point and bindings made to old variables after it.
+pick(a).
+pick(b).
+pick(c).
+
+?- T = t(V), pick(X), garbage(1000), V = young(X), garbage_collect(young), garbage(100), T = t(young(c)).
+% Expect: T = t(young(c)), V = young(c), X = c
+
+% Backtracking into choice points after a collection
+?- pick(X), build(3, L), garbage(500), garbage_collect(full), X = c.
+% Expect: X = c, L = [f(3),f(2),f(1)]
+
+?- garbage_collect(middle).
+% Expect: garbage_collect/1: Argument must be 'young' or 'full'; was middle
@@ -0,0 +1,167 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <boost/lexical_cast.hpp>
+#include "../../common/utime.hpp"
+#include "../interpreter.hpp"
+
+using namespace epilog::common;
+using namespace epilog::interp;
+
+static void header( const std::string &str )
+{
+    std::cout << "\n";
+    std::cout << "--- [" + str + "] " + std::string(60 - str.length(), '-') << "\n";
+    std::cout << "\n";
+}
+
+static const std::string PROG = R"PROG(
+    app([], L, L).
+    app([X|Xs], L, [X|Ys]) :- app(Xs, L, Ys).
+
+    nrev([], []).
+    nrev([X|Xs], R) :- nrev(Xs, R0), app(R0, [X], R).
+
+    mem(X, [X|_]).
+    mem(X, [_|Xs]) :- mem(X, Xs).
+
+    third(L, X) :- mem(X, L), X >= 3, !.
+
+    run(L) :- nrev(L, _), third(L, _).
+
+    repeat_n(N) :- N > 0.
+    repeat_n(N) :- N > 1, N1 is N - 1, repeat_n(N1).
+
+    bench(N, L) :- repeat_n(N), nrev(L, _), fail.
+    bench(_, _).
+)PROG";
+
+static const std::string LIST = "[1,2,3,4,5,6,7,8,9,10]";
+
+static bool run(interpreter &interp, const std::string &query)
+{
+    return interp.execute(interp.parse(query + "."), false);
+}
+
+static qname user(interpreter &interp, const std::string &name, size_t arity)
+{
+    return qname(interp.functor("user", 0), interp.functor(name, arity));
+}
+
+static void check_profile(interpreter &interp)
+{
+    auto *prof = interp.get_profiler();
+    assert(prof != nullptr);
+
+    auto run_1 = user(interp, "run", 1);
+    auto nrev_2 = user(interp, "nrev", 2);
+    auto app_3 = user(interp, "app", 3);
+    auto mem_2 = user(interp, "mem", 2);
+    auto third_2 = user(interp, "third", 2);
+
+    std::stringstream flame;
+    prof->write_collapsed(flame, interp, profiler::CALLS);
+    std::cout << flame.str() << std::flush;
+
+    // A list of 10: nrev is called 11 times and app 1+2+...+10 times.
+    assert(prof->get(run_1)[profiler::CALLS] == 1);
+    assert(prof->get(nrev_2)[profiler::CALLS] == 11);
+    assert(prof->get(app_3)[profiler::CALLS] == 55);
+    assert(prof->get(mem_2)[profiler::CALLS] == 3);
+
+    assert(prof->get(run_1, nrev_2)[profiler::CALLS] == 1);
+    assert(prof->get(nrev_2, nrev_2)[profiler::CALLS] == 10);
+    assert(prof->get(third_2, mem_2)[profiler::CALLS] >= 1);
+    // With last call optimization (compiled) the frame of the caller
+    // is gone, so the edge is from the one before it.
+    assert(prof->get(run_1, app_3)[profiler::CALLS] +
+	   prof->get(nrev_2, app_3)[profiler::CALLS] +
+	   prof->get(app_3, app_3)[profiler::CALLS] == 55);
+
+    assert(prof->get(app_3)[profiler::INSTRUCTIONS] > 0);
+    assert(prof->get(app_3)[profiler::HEAP] > 0);
+    assert(prof->get(mem_2)[profiler::CHOICE_POINTS] > 0);
+    assert(prof->total()[profiler::TIME] > 0);
+
+    assert(flame.str().find("run/1;nrev/2;nrev/2 1\n") != std::string::npos);
+    assert(flame.str().find("third/2;mem/2") != std::string::npos);
+
+    std::stringstream json;
+    prof->write_json(json, interp);
+    assert(json.str().find("{\"name\": \"app/3\", \"calls\": 55, ") != std::string::npos);
+    assert(json.str().find("{\"caller\": \"run/1\", \"callee\": \"nrev/2\", \"calls\": 1, ") != std::string::npos);
+}
+
+static void test_profiler(bool wam)
+{
+    header(std::string("test_profiler ") + (wam ? "(compiled)" : "(naive)"));
+
+    interpreter interp("test");
+    interp.setup_standard_lib();
+    interp.set_wam_enabled(wam);
+    interp.load_program(PROG);
+    if (wam) {
+	interp.compile();
+    }
+
+    // Nothing is counted when it's off
+    assert(run(interp, "run(" + LIST + ")"));
+    assert(interp.get_profiler() == nullptr);
+
+    assert(run(interp, "profile(on)"));
+    assert(run(interp, "run(" + LIST + ")"));
+    assert(run(interp, "profile(off)"));
+    check_profile(interp);
+
+    assert(run(interp, "run(" + LIST + ")"));
+    check_profile(interp);
+
+    interp.print_profile(std::cout);
+
+    // The exports are available as strings too
+    assert(run(interp, "profile(flame(heap), X), X \\= []"));
+    assert(run(interp, "profile(json, X), X = [0'{|_]"));
+
+    assert(run(interp, "profile(reset)"));
+    assert(interp.get_profiler()->empty());
+}
+
+static void test_profiler_overhead()
+{
+    header("test_profiler_overhead");
+
+    const size_t n = 500;
+    const std::string query = "bench(" + boost::lexical_cast<std::string>(n)
+	+ ", [1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,"
+	"21,22,23,24,25,26,27,28,29,30])";
+
+    uint64_t t[2];
+    for (size_t i = 0; i < 2; i++) {
+	interpreter interp("test");
+	interp.setup_standard_lib();
+	interp.set_wam_enabled(true);
+	interp.load_program(PROG);
+	interp.compile();
+	interp.set_profiling(i == 1);
+	auto start = utime::now();
+	assert(run(interp, query));
+	t[i] = (utime::now() - start).in_us();
+	if (i == 1) {
+	    auto calls = interp.get_profiler()->get(user(interp, "app", 3))[profiler::CALLS];
+	    assert(calls == 465 * n);
+	    interp.get_profiler()->write_summary(std::cout, interp, 5);
+	}
+    }
+
+    std::cout << "Profiling off: " << std::setw(8) << t[0] / 1000 << " ms" << std::endl;
+    std::cout << "Profiling on:  " << std::setw(8) << t[1] / 1000 << " ms" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    test_profiler(false);
+    test_profiler(true);
+    test_profiler_overhead();
+
+    return 0;
+}
@@ -0,0 +1,155 @@
+#include <iostream>
+#include <fstream>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+#include "../../common/test/test_home_dir.hpp"
+#include "../../common/utime.hpp"
+#include "../interpreter.hpp"
+#include "../program_cache.hpp"
+
+using namespace epilog::common;
+using namespace epilog::interp;
+
+static void header( const std::string &str )
+{
+    std::cout << "\n";
+    std::cout << "--- [" + str + "] " + std::string(60 - str.length(), '-') << "\n";
+    std::cout << "\n";
+}
+
+static std::vector<std::string> sources;
+
+static void read_sources()
+{
+    const std::string &home_dir = find_home_dir();
+    auto dir = boost::filesystem::path(home_dir) / "src" / "interp" / "test" / "pl_files";
+    for (auto name : {"lr_gen.pl", "sorting.pl", "term_grammar.pl", "std.pl"}) {
+	std::ifstream ifs((dir / name).string());
+	assert(ifs.good());
+	sources.push_back(std::string((std::istreambuf_iterator<char>(ifs)),
+				      std::istreambuf_iterator<char>()));
+    }
+}
+
+//
+// Start an interpreter (standard library and the test sources),
+// returns the elapsed time in microseconds and the saved program.
+//
+static uint64_t startup(program_cache *cache, std::string &saved)
+{
+    auto start = utime::now();
+    interpreter interp("test");
+    interp.set_program_cache(cache);
+    interp.setup_standard_lib();
+    for (auto &src : sources) {
+	interp.load_program(src);
+    }
+    interp.compile();
+    auto end = utime::now();
+
+    std::stringstream ss;
+    interp.save_program(interp.current_module(), ss);
+    saved = ss.str();
+
+    return (end - start).in_us();
+}
+
+static void test_program_cache()
+{
+    header("test_program_cache");
+
+    const std::string &home_dir = find_home_dir();
+    auto dir = (boost::filesystem::path(home_dir) / "bin" / "test" / "interp" / "program_cache").string();
+    boost::filesystem::remove_all(dir);
+
+    const size_t N = 10;
+
+    std::string expect, saved;
+    uint64_t t_none = 0, t_disk = 0, t_mem = 0;
+    for (size_t i = 0; i < N; i++) {
+	t_none += startup(nullptr, expect);
+    }
+
+    // First one parses and stores the images
+    program_cache first(dir);
+    auto t_store = startup(&first, saved);
+    assert(saved == expect);
+    assert(first.num_hits() == 0);
+
+    for (size_t i = 0; i < N; i++) {
+	program_cache cache(dir);
+	t_disk += startup(&cache, saved);
+	assert(saved == expect);
+	assert(cache.num_misses() == 0);
+    }
+
+    for (size_t i = 0; i < N; i++) {
+	t_mem += startup(&first, saved);
+	assert(saved == expect);
+    }
+
+    // Changed source, changed key
+    sources.back() += "\nextra_clause.\n";
+    program_cache cache(dir);
+    startup(&cache, saved);
+    assert(cache.num_misses() == 1);
+
+    std::cout << "No cache:   " << std::setw(8) << t_none / N << " us" << std::endl;
+    std::cout << "Storing:    " << std::setw(8) << t_store << " us" << std::endl;
+    std::cout << "From disk:  " << std::setw(8) << t_disk / N << " us" << std::endl;
+    std::cout << "In memory:  " << std::setw(8) << t_mem / N << " us" << std::endl;
+}
+
+static size_t disk_bytes(const std::string &dir)
+{
+    size_t total = 0;
+    for (boost::filesystem::directory_iterator it(dir), end; it != end; ++it) {
+	if (it->path().extension() == ".img") {
+	    total += boost::filesystem::file_size(it->path());
+	}
+    }
+    return total;
+}
+
+static void test_program_cache_limits()
+{
+    header("test_program_cache_limits");
+
+    const std::string &home_dir = find_home_dir();
+    auto dir = (boost::filesystem::path(home_dir) / "bin" / "test" / "interp" / "program_cache_limits").string();
+    boost::filesystem::remove_all(dir);
+
+    const size_t MAX_MEMORY = 4096, MAX_DISK = 8192;
+    program_cache cache(dir, MAX_MEMORY, MAX_DISK);
+
+    // Many different programs (like files loaded by sessions)
+    const size_t N = 100;
+    for (size_t i = 0; i < N; i++) {
+	interpreter interp("test");
+	interp.set_program_cache(&cache);
+	std::string src;
+	for (size_t j = 0; j < 10; j++) {
+	    src += "p" + boost::lexical_cast<std::string>(i) + "(" +
+		boost::lexical_cast<std::string>(j) + ", foo(bar, baz)).\n";
+	}
+	interp.load_program(src);
+	assert(cache.memory_bytes() <= MAX_MEMORY);
+	assert(disk_bytes(dir) <= MAX_DISK);
+    }
+    assert(cache.num_misses() == N);
+
+    std::cout << "Programs:   " << std::setw(8) << N << std::endl;
+    std::cout << "In memory:  " << std::setw(8) << cache.memory_bytes() << " bytes" << std::endl;
+    std::cout << "On disk:    " << std::setw(8) << disk_bytes(dir) << " bytes" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    find_home_dir(argv[0]);
+
+    read_sources();
+    test_program_cache();
+    test_program_cache_limits();
+
+    return 0;
+}
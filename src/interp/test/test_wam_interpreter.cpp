@@ -1,5 +1,6 @@
 #include <boost/algorithm/string.hpp>
 #include "../../common/term_tools.hpp"
+#include "../../common/utime.hpp"
 #include "../interpreter.hpp"
 #include "../wam_interpreter.hpp"
 #include "../wam_compiler.hpp"
@@ -470,8 +471,250 @@ static void test_unsafe_set_unify()
     test.test_unsafe_set_unify();
 }
 
+// Run the benchmarks at full size (--bench); by default they're only
+// small functional checks.
+static bool full_benchmarks = false;
+
+//
+// Naive reverse of a 30 element list is 496 logical inferences.
+// Run it with both dispatch loops (function pointers and threaded);
+// they must agree on the cost. With --bench report LIPS.
+//
+static uint64_t run_nrev(bool threaded, size_t n, uint64_t &cost)
+{
+    interpreter interp("test");
+    interp.set_wam_enabled(true);
+    interp.set_threaded_dispatch(threaded);
+
+    const std::string prog = R"PROG(
+       app([], L, L).
+       app([X|Xs], L, [X|Ys]) :- app(Xs, L, Ys).
+
+       nrev([], []).
+       nrev([X|Xs], R) :- nrev(Xs, R0), app(R0, [X], R).
+
+       range(N, N, [N]) :- !.
+       range(I, N, [I|Is]) :- I1 is I + 1, range(I1, N, Is).
+
+       repeat_n(N) :- N > 0.
+       repeat_n(N) :- N > 1, N1 is N - 1, repeat_n(N1).
+
+       bench(N, L) :- repeat_n(N), nrev(L, _), fail.
+       bench(_, _).
+
+       rev([], R, R).
+       rev([X|Xs], Acc, R) :- rev(Xs, [X|Acc], R).
+
+       check :- range(1, 30, L), nrev(L, R), rev(L, [], R).
+    )PROG";
+
+    interp.load_program(prog);
+    interp.compile();
+
+    std::string query = "check, bench("
+	+ boost::lexical_cast<std::string>(n) + ", [1,2,3,4,5,6,7,8,9,10,"
+	"11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,26,27,28,29,30]).";
+    term qr = interp.parse(query);
+
+    auto start = utime::now();
+    bool ok = interp.execute(qr, false);
+    auto end = utime::now();
+
+    assert(ok);
+    cost = interp.accumulated_cost();
+
+    return (end - start).in_us();
+}
+
+static void test_nrev_benchmark()
+{
+    header("test_nrev_benchmark");
+
+    const size_t n = full_benchmarks ? 2000 : 20;
+    const uint64_t li = 496 * n;
+
+    uint64_t c_fn = 0, c_threaded = 0;
+    uint64_t t_fn = run_nrev(false, n, c_fn);
+    uint64_t t_threaded = run_nrev(true, n, c_threaded);
+
+    std::cout << "Function pointers: " << t_fn / 1000 << " ms ("
+	      << li * 1000000 / std::max(t_fn, uint64_t(1)) << " LIPS)"
+	      << std::endl;
+    std::cout << "Threaded:          " << t_threaded / 1000 << " ms ("
+	      << li * 1000000 / std::max(t_threaded, uint64_t(1)) << " LIPS)"
+	      << std::endl;
+
+    assert(c_fn == c_threaded);
+}
+
+//
+// Arithmetic in a tight loop, with and without the ARITH instruction
+// and with only the generic evaluation of is/2 (as before either.)
+// The results and the accumulated cost must be the same.
+//
+static uint64_t run_arith(bool inlined, bool int_shortcut, size_t n,
+			  std::string &result, uint64_t &cost)
+{
+    interpreter interp("test");
+    interp.set_wam_enabled(true);
+    interp.set_inline_arithmetic(inlined);
+    interp.arith().set_int_shortcut(int_shortcut);
+
+    const std::string prog = R"PROG(
+       loop(N, N, S, S) :- !.
+       loop(I, N, S0, S) :-
+           I < N, I >= 0,
+           S1 is (S0 + I * 3 - I // 2) mod 1000003,
+           I1 is I + 1,
+           loop(I1, N, S1, S).
+    )PROG";
+
+    interp.load_program(prog);
+    interp.compile();
+
+    std::string query = "loop(0, "
+	+ boost::lexical_cast<std::string>(n) + ", 0, S), S > 0, "
+	"T is S * 2.";
+    term qr = interp.parse(query);
+
+    auto start = utime::now();
+    uint64_t cost0 = interp.accumulated_cost();
+    bool ok = interp.execute(qr, false);
+    cost = interp.accumulated_cost() - cost0;
+    auto end = utime::now();
+
+    assert(ok);
+    result = interp.to_string(qr);
+
+    return (end - start).in_us();
+}
+
+static void test_arith_benchmark()
+{
+    header("test_arith_benchmark");
+
+    const size_t n = full_benchmarks ? 100000 : 1000;
+    const uint64_t EXPECTED_COST = full_benchmarks ? 7099939 : 70939;
+
+    std::string r_generic, r_builtin, r_inline;
+    uint64_t c_generic = 0, c_builtin = 0, c_inline = 0;
+    uint64_t t_generic = run_arith(false, false, n, r_generic, c_generic);
+    uint64_t t_builtin = run_arith(false, true, n, r_builtin, c_builtin);
+    uint64_t t_inline = run_arith(true, true, n, r_inline, c_inline);
+
+    std::cout << "Result: " << r_inline << std::endl;
+    std::cout << "Generic: " << t_generic / 1000 << " ms (cost "
+	      << c_generic << ")" << std::endl;
+    std::cout << "Builtin: " << t_builtin / 1000 << " ms (cost "
+	      << c_builtin << ")" << std::endl;
+    std::cout << "Inline:  " << t_inline / 1000 << " ms (cost "
+	      << c_inline << ")" << std::endl;
+
+    assert(r_generic == r_builtin);
+    assert(r_generic == r_inline);
+    assert(c_generic == EXPECTED_COST);
+    assert(c_builtin == EXPECTED_COST);
+    assert(c_inline == EXPECTED_COST);
+}
+
+//
+// A large fact table is interpreted until it is hot, then compiled
+// (and dropped back to the interpreter when it changes.)
+//
+static std::string query_tier(interpreter &interp, const std::string &pred)
+{
+    term q = interp.parse("status_predicate(" + pred + ", tier(T, C, M)).");
+    bool ok = interp.execute(q, false);
+    assert(ok);
+    return interp.to_string(interp.arg(q, 1));
+}
+
+static uint64_t run_lookups(interpreter &interp, size_t n)
+{
+    term q = interp.parse("lookups(" + boost::lexical_cast<std::string>(n) + ", 0, S).");
+    auto start = utime::now();
+    bool ok = interp.execute(q, false);
+    auto end = utime::now();
+    assert(ok);
+    return (end - start).in_us();
+}
+
+static void new_table_interp(interpreter &interp, size_t hot_threshold,
+			     bool tiered = true)
+{
+    const size_t num_facts = 500;
+
+    std::string prog;
+    for (size_t i = 0; i < num_facts; i++) {
+	auto s = boost::lexical_cast<std::string>(i);
+	prog += "color(" + s + ", c" + s + ", " + s + ").\n";
+    }
+    prog += R"PROG(
+       lookups(0, S, S) :- !.
+       lookups(N, S0, S) :-
+           K is N mod 500,
+           color(K, _, V),
+           S1 is S0 + V,
+           N1 is N - 1,
+           lookups(N1, S1, S).
+    )PROG";
+
+    interp.set_wam_enabled(true);
+    interp.set_auto_wam(true);
+    interp.set_tiered_compilation(tiered);
+    interp.set_hot_threshold(hot_threshold);
+    interp.load_program(prog);
+}
+
+static void test_tiered_compilation()
+{
+    header("test_tiered_compilation");
+
+    interpreter interp("test");
+    new_table_interp(interp, 100);
+
+    run_lookups(interp, 50);
+    std::cout << "After 50 calls:  " << query_tier(interp, "color/3") << std::endl;
+    assert(query_tier(interp, "color/3") == "tier(interpreted, 50, 0)");
+    assert(query_tier(interp, "lookups/3") == "tier(compiled, 1, 1)");
+
+    run_lookups(interp, 100);
+    std::cout << "After 150 calls: " << query_tier(interp, "color/3") << std::endl;
+    assert(query_tier(interp, "color/3") == "tier(compiled, 100, 1)");
+
+    // A change drops it back to the interpreter until it is hot again
+    interp.execute(interp.parse("assert(color(500, c500, 500))."), false);
+    run_lookups(interp, 10);
+    std::cout << "After change:    " << query_tier(interp, "color/3") << std::endl;
+    assert(query_tier(interp, "color/3") == "tier(interpreted, 10, 1)");
+    run_lookups(interp, 100);
+    assert(query_tier(interp, "color/3") == "tier(compiled, 100, 2)");
+
+    // Timing only (the statuses are checked either way)
+    const size_t n = full_benchmarks ? 100000 : 1000;
+    interpreter never("test");
+    new_table_interp(never, std::numeric_limits<size_t>::max());
+    uint64_t t_interpreted = run_lookups(never, n);
+    uint64_t t_tiered = run_lookups(interp, n);
+    assert(query_tier(never, "color/3") == "tier(interpreted, " + boost::lexical_cast<std::string>(n) + ", 0)");
+
+    std::cout << "Lookups:     " << n << std::endl;
+    std::cout << "Interpreted: " << t_interpreted / 1000 << " ms" << std::endl;
+    std::cout << "Tiered:      " << t_tiered / 1000 << " ms" << std::endl;
+
+    // Without tiering (the default) how it runs doesn't depend on how
+    // often it was called before: the table is never compiled.
+    interpreter plain("test");
+    new_table_interp(plain, 100, false);
+    run_lookups(plain, 1000);
+    assert(query_tier(plain, "color/3") == "tier(interpreted, 0, 0)");
+    assert(query_tier(plain, "lookups/3") == "tier(compiled, 0, 1)");
+}
+
 int main( int argc, char *argv[] )
 {
+    full_benchmarks = argc == 2 && strcmp(argv[1], "--bench") == 0;
+
     test_flatten();
     test_flatten2();    
     test_instruction_sequence();
@@ -480,6 +723,9 @@ int main( int argc, char *argv[] )
     test_compile2();
     test_varset();
     test_unsafe_set_unify();
+    test_nrev_benchmark();
+    test_arith_benchmark();
+    test_tiered_compilation();
 
     return 0;
 }
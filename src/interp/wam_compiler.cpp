@@ -1316,6 +1316,54 @@ void wam_compiler::compile_builtin(common::con_cell module,
     }
 }
 
+bool wam_compiler::is_arith_goal(common::con_cell module,
+				 common::con_cell f, const term goal,
+				 arith_op &op)
+{
+    static const common::con_cell colon(":", 2);
+
+    if (!interp_.is_inline_arithmetic()) {
+	return false;
+    }
+    auto fn = get_builtin(qname(module, f)).fn();
+    if (fn == builtins::is_2) op = ARITH_IS;
+    else if (fn == builtins::less_than_2) op = ARITH_LT;
+    else if (fn == builtins::less_than_equals_2) op = ARITH_LE;
+    else if (fn == builtins::greater_than_2) op = ARITH_GT;
+    else if (fn == builtins::greater_than_equals_2) op = ARITH_GE;
+    else return false;
+
+    term g = goal;
+    if (env_.functor(g) == colon) {
+	g = env_.arg(g, 1);
+    }
+    if (op == ARITH_IS) {
+	return is_int_expr(env_.arg(g, 1));
+    } else {
+	return is_int_expr(env_.arg(g, 0)) && is_int_expr(env_.arg(g, 1));
+    }
+}
+
+// Variables, integers and the functions of arithmetics::eval_int().
+bool wam_compiler::is_int_expr(const term t0, size_t depth)
+{
+    term t = env_.deref(t0);
+    switch (t.tag()) {
+    case common::tag_t::REF:
+    case common::tag_t::INT:
+	return true;
+    case common::tag_t::STR:
+	if (depth == arithmetics::MAX_INT_DEPTH ||
+	    arithmetics::lookup_int(env_.functor(t)) == nullptr) {
+	    return false;
+	}
+	return is_int_expr(env_.arg(t, 0), depth+1) &&
+	       is_int_expr(env_.arg(t, 1), depth+1);
+    default:
+	return false;
+    }
+}
+
 bool wam_compiler::is_if_then_else(const term goal)
 {
     static const common::con_cell bn_impl = common::con_cell("->",2);
@@ -1513,8 +1561,14 @@ void wam_compiler::compile_goal(const term goal, bool first_goal,
     }
     qname qn(module, f);
     bool isbn = is_builtin(qn);
+    // Check the shape before the goal gets flattened
+    arith_op op = ARITH_IS;
+    bool isarith = isbn && is_arith_goal(module, f, goal, op);
     compile_query_or_program(goal, COMPILE_QUERY, seq);
-    if (isbn) {
+    if (isarith) {
+	auto &bn = get_builtin(qn);
+	seq.push_back(wam_instruction<ARITH>(module, f, bn.fn(), op));
+    } else if (isbn) {
 	compile_builtin(module, f, first_goal, seq);
     } else {
         auto instr = wam_instruction<CALL>(module, f, 0);
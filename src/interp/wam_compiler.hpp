@@ -460,6 +460,9 @@ private:
 			 common::con_cell f,
 			 bool first_goal,
 			 wam_interim_code &seq);
+    bool is_arith_goal(common::con_cell module, common::con_cell f,
+		       const term goal, arith_op &op);
+    bool is_int_expr(const term t, size_t depth = 0);
 
 
     void compile_query_or_program(term t, compile_type c,
@@ -1,3 +1,4 @@
+#include <boost/algorithm/string.hpp>
 #include "wam_interpreter.hpp"
 #include "wam_compiler.hpp"
 
@@ -97,7 +98,7 @@ void wam_code::print_code(std::ostream &out, size_t from, size_t to)
     }
 }
 
-wam_interpreter::wam_interpreter(const std::string &name) : interpreter_base(name), wam_code(*this), auto_wam_(false), compiler_(nullptr)
+wam_interpreter::wam_interpreter(const std::string &name) : interpreter_base(name), wam_code(*this), auto_wam_(false), tiered_compilation_(false), hot_threshold_(DEFAULT_HOT_THRESHOLD), threaded_dispatch_(true), inline_arithmetic_(true), compiler_(nullptr)
 {
     total_reset();
 }
@@ -215,18 +216,7 @@ void wam_interpreter::total_reset()
 bool wam_interpreter::cont_wam()
 {
     fail_ = false;
-    while (p().has_wam_code() && !is_top_fail()) {
-	if (auto instr = p().wam_code()) {
-	    if (is_debug()) {
-		std::stringstream ss;
-		ss << "[WAM debug]: tr=" << trail_size() << " [" << std::setw(5)
-		   << instr << " " << to_code_addr(instr) << "]: e=" << e0() << " ";
-		instr->print(ss, *this);
-		std::cout << ss.str() << "\n";
-	    }
-	    instr->invoke(*this);
-	}
-    }
+    run_wam();
     if (is_debug()) {
 	if (fail_) {
 	    std::cout << "[WAM debug]: fail\n";
@@ -237,6 +227,286 @@ bool wam_interpreter::cont_wam()
     return !fail_;
 }
 
+//
+// The loop is chosen once, here, so the loops themselves don't check
+// for debugging or profiling on every instruction. (Turning either on
+// from a built-in is noticed by the threaded loop after the next
+// control instruction, by the function pointer loop when the WAM is
+// entered again.)
+//
+void wam_interpreter::run_wam()
+{
+    if (is_debug()) {
+	run_wam_debug();
+    } else if (is_profiling()) {
+	run_wam_profile();
+    } else if (threaded_dispatch_) {
+	run_wam_threaded();
+    } else {
+	run_wam_loop();
+    }
+}
+
+// Trace every instruction
+void wam_interpreter::run_wam_debug()
+{
+    while (p().has_wam_code() && !is_top_fail()) {
+	if (!is_debug()) {
+	    run_wam();
+	    return;
+	}
+	if (auto instr = p().wam_code()) {
+	    std::stringstream ss;
+	    ss << "[WAM debug]: tr=" << trail_size() << " [" << std::setw(5)
+	       << instr << " " << to_code_addr(instr) << "]: e=" << e0() << " ";
+	    instr->print(ss, *this);
+	    std::cout << ss.str() << "\n";
+	    if (is_profiling()) {
+		profile_instruction(instr);
+	    } else {
+		instr->invoke(*this);
+	    }
+	}
+    }
+}
+
+// Count and time every instruction
+void wam_interpreter::run_wam_profile()
+{
+    while (p().has_wam_code() && !is_top_fail()) {
+	if (!is_profiling() || is_debug()) {
+	    run_wam();
+	    return;
+	}
+	if (auto instr = p().wam_code()) {
+	    profile_instruction(instr);
+	}
+    }
+}
+
+//
+// The reference loop: an indirect call through the instruction's
+// function pointer. Used if threaded dispatch is disabled.
+//
+void wam_interpreter::run_wam_loop()
+{
+    while (p().has_wam_code() && !is_top_fail()) {
+	if (auto instr = p().wam_code()) {
+	    instr->invoke(*this);
+	}
+    }
+}
+
+//
+// We only need to find out where we are when control can go to
+// another predicate: calls, returns and backtracking (retry and trust
+// are only reached by backtracking.)
+//
+void wam_interpreter::profile_instruction(wam_instruction_base *instr)
+{
+    auto type = instr->type();
+    profile_count_instruction(type);
+    switch (type) {
+    case BUILTIN:
+    case BUILTIN_R: {
+	auto bn = reinterpret_cast<wam_instruction_code_point *>(instr);
+	profile_builtin(bn->cp().name());
+	instr->invoke(*this);
+	profile_sample(false);
+	break;
+    }
+    case CALL:
+    case EXECUTE:
+	instr->invoke(*this);
+	// Calls to the naive interpreter are counted when it dispatches
+	profile_sample(p().has_wam_code());
+	break;
+    case PROCEED:
+    case RETRY_ME_ELSE:
+    case TRUST_ME:
+    case RETRY:
+    case TRUST:
+	instr->invoke(*this);
+	profile_sample(false);
+	break;
+    default:
+	instr->invoke(*this);
+	break;
+    }
+}
+
+//
+// The predicate at P, then the one CP returns to (unless we've
+// already returned there, then CP points at or before P in the same
+// predicate) and then those the environments return to. Naive
+// environments know their predicate.
+//
+void wam_interpreter::profile_stack(profiler::stack_t &stack)
+{
+    static const con_cell FREEZE("$freeze",0);
+
+    auto add = [&](const qname &qn) {
+	if (qn.first != FREEZE && qn.second != EMPTY_LIST) {
+	    stack.push_back(qn);
+	}
+    };
+
+    if (p().has_wam_code()) {
+	size_t p_addr = to_code_addr(p().wam_code());
+	auto &leaf = get_wam_predicate(p_addr);
+	add(leaf);
+	if (cp().has_wam_code()) {
+	    size_t cp_addr = to_code_addr(cp().wam_code());
+	    auto &caller = get_wam_predicate(cp_addr);
+	    if (caller != leaf || cp_addr > p_addr) {
+		add(caller);
+	    }
+	}
+    }
+
+    auto k = e_kind();
+    auto *e = e0();
+    while (e != nullptr && stack.size() < profiler::MAX_DEPTH) {
+	if (e->cp.has_wam_code()) {
+	    // A WAM environment, or a naive one for a call from WAM
+	    add(get_wam_predicate(to_code_addr(e->cp.wam_code())));
+	} else if (k != ENV_WAM) {
+	    profile_naive_env(reinterpret_cast<environment_naive_t *>(e), stack);
+	}
+	k = e->ce.kind();
+	e = e->ce.ce0();
+    }
+    if (stack.size() > profiler::MAX_DEPTH) {
+	stack.resize(profiler::MAX_DEPTH);
+    }
+}
+
+// Instructions that continue with the next instruction in sequence
+// (unless they fail.)
+#define WAM_SEQUENTIAL_INSTRUCTIONS(X) \
+    X(PUT_VARIABLE_X) X(PUT_VARIABLE_Y) X(PUT_VALUE_X) X(PUT_VALUE_Y) \
+    X(PUT_UNSAFE_VALUE_Y) X(PUT_STRUCTURE_A) X(PUT_STRUCTURE_X) \
+    X(PUT_STRUCTURE_Y) X(PUT_LIST_A) X(PUT_LIST_X) X(PUT_LIST_Y) \
+    X(PUT_CONSTANT) \
+    X(GET_VARIABLE_X) X(GET_VARIABLE_Y) X(GET_VALUE_X) X(GET_VALUE_Y) \
+    X(GET_STRUCTURE_A) X(GET_STRUCTURE_X) X(GET_STRUCTURE_Y) \
+    X(GET_LIST_A) X(GET_LIST_X) X(GET_LIST_Y) X(GET_CONSTANT) \
+    X(SET_VARIABLE_A) X(SET_VARIABLE_X) X(SET_VARIABLE_Y) \
+    X(SET_VALUE_A) X(SET_VALUE_X) X(SET_VALUE_Y) \
+    X(SET_LOCAL_VALUE_X) X(SET_LOCAL_VALUE_Y) X(SET_CONSTANT) X(SET_VOID) \
+    X(UNIFY_VARIABLE_A) X(UNIFY_VARIABLE_X) X(UNIFY_VARIABLE_Y) \
+    X(UNIFY_VALUE_A) X(UNIFY_VALUE_X) X(UNIFY_VALUE_Y) \
+    X(UNIFY_LOCAL_VALUE_X) X(UNIFY_LOCAL_VALUE_Y) X(UNIFY_CONSTANT) \
+    X(UNIFY_VOID) \
+    X(ALLOCATE) X(DEALLOCATE)
+
+// Instructions that may transfer control elsewhere (or, through a
+// built-in, turn on debugging or profiling.)
+#define WAM_CONTROL_INSTRUCTIONS(X) \
+    X(CALL) X(EXECUTE) X(PROCEED) X(BUILTIN) X(BUILTIN_R) \
+    X(TRY_ME_ELSE) X(RETRY_ME_ELSE) X(TRUST_ME) X(TRY) X(RETRY) X(TRUST) \
+    X(SWITCH_ON_TERM) X(SWITCH_ON_CONSTANT) X(SWITCH_ON_STRUCTURE) \
+    X(NECK_CUT) X(GET_LEVEL) X(CUT) X(GOTO) X(RESET_LEVEL) X(COST) X(ARITH)
+
+#define WAM_COUNT(I) + 1
+static_assert(0 WAM_SEQUENTIAL_INSTRUCTIONS(WAM_COUNT)
+	        WAM_CONTROL_INSTRUCTIONS(WAM_COUNT) == LAST,
+	      "Every WAM instruction must be listed exactly once");
+#undef WAM_COUNT
+
+#if defined(__GNUC__) && !defined(EPILOG_NO_COMPUTED_GOTO)
+#define WAM_COMPUTED_GOTO
+#endif
+
+//
+// Threaded dispatch. Each instruction type gets its own label (and
+// its own indirect jump to the next one, which is much easier for the
+// branch predictor than a single shared call site) and the invoke
+// functions are called directly so they can be inlined. For compilers
+// without computed goto (labels as values) we use a switch instead.
+//
+// After a sequential instruction we check if p simply advanced to the
+// next instruction and then jump there directly without going through
+// the loop checks. Thus a head sequence like get_structure followed by
+// unify_variable/unify_value runs as one (dynamic) superinstruction.
+// Debugging and profiling are only rechecked after control
+// instructions; the only way to turn them on is through a built-in.
+//
+void wam_interpreter::run_wam_threaded()
+{
+    wam_instruction_base *instr = nullptr;
+    wam_instruction_base *next = nullptr;
+
+#ifdef WAM_COMPUTED_GOTO
+    void *labels[LAST];
+#define WAM_LABEL(I) labels[I] = &&L_##I;
+    WAM_SEQUENTIAL_INSTRUCTIONS(WAM_LABEL)
+    WAM_CONTROL_INSTRUCTIONS(WAM_LABEL)
+#undef WAM_LABEL
+#define WAM_CASE(I) L_##I:
+#define WAM_DISPATCH() goto *labels[instr->type()]
+#else
+#define WAM_CASE(I) case I:
+#define WAM_DISPATCH() goto dispatch
+#endif
+
+#define WAM_NEXT() \
+    if (!p().has_wam_code() || is_top_fail()) return; \
+    instr = p().wam_code(); \
+    WAM_DISPATCH();
+
+#define WAM_SEQUENTIAL(I) \
+    WAM_CASE(I) \
+	next = next_instruction(instr); \
+	wam_instruction<I>::invoke(*this, instr); \
+	if (p().wam_code() == next && p().has_wam_code()) { \
+	    instr = next; \
+	    WAM_DISPATCH(); \
+	} \
+	WAM_NEXT();
+
+#define WAM_CONTROL(I) \
+    WAM_CASE(I) \
+	wam_instruction<I>::invoke(*this, instr); \
+	if (is_debug() || is_profiling()) { \
+	    run_wam(); \
+	    return; \
+	} \
+	WAM_NEXT();
+
+    WAM_NEXT();
+
+#ifdef WAM_COMPUTED_GOTO
+    WAM_SEQUENTIAL_INSTRUCTIONS(WAM_SEQUENTIAL)
+    WAM_CONTROL_INSTRUCTIONS(WAM_CONTROL)
+#else
+ dispatch:
+    switch (instr->type()) {
+    WAM_SEQUENTIAL_INSTRUCTIONS(WAM_SEQUENTIAL)
+    WAM_CONTROL_INSTRUCTIONS(WAM_CONTROL)
+    default:
+	instr->invoke(*this);
+	WAM_NEXT();
+    }
+#endif
+
+#undef WAM_CONTROL
+#undef WAM_SEQUENTIAL
+#undef WAM_NEXT
+#undef WAM_DISPATCH
+#undef WAM_CASE
+}
+
+std::vector<std::string> wam_interpreter::profile_instruction_names() const
+{
+    std::vector<std::string> names(LAST);
+#define WAM_NAME(I) names[I] = boost::algorithm::to_lower_copy(std::string(#I));
+    WAM_SEQUENTIAL_INSTRUCTIONS(WAM_NAME)
+    WAM_CONTROL_INSTRUCTIONS(WAM_NAME)
+#undef WAM_NAME
+    return names;
+}
+
 bool wam_interpreter::compile(const qname &qn)
 {
     size_t heap_sz = heap_size();
@@ -261,7 +531,9 @@ bool wam_interpreter::compile(const qname &qn)
 
     trim_heap_safe(heap_sz);
 
-    get_predicate(qn).set_was_compiled(true);
+    auto &pred = get_predicate(qn);
+    pred.set_was_compiled(true);
+    pred.count_compilation();
 
     return true;
 }
@@ -316,21 +588,38 @@ void wam_interpreter::recompile_if_needed(const qname &qn)
     }
 }
 
-void wam_interpreter::auto_compile(const qname &qn)
+void wam_interpreter::auto_compile(const qname &qn, bool interpreted)
 {
     auto &pred = get_predicate(qn);
-    bool failed = false;
-    if (pred.ok_to_compile()) {
-	auto num_clauses = pred.num_clauses();
-	if (num_clauses > 0 && num_clauses <= 10) {
-	    if (!compile(qn)) {
-		failed = true;
-	    }
-	} else {
-	    failed = true;
+    if (!pred.ok_to_compile()) {
+	return;
+    }
+    auto num_clauses = pred.num_clauses();
+    if (!tiered_compilation_) {
+	if (num_clauses == 0 || num_clauses > EAGER_MAX_CLAUSES ||
+	    !compile(qn)) {
+	    pred.set_ok_to_compile(false);
+	    remove_compiled(qn);
+	    clear_updated_predicate(qn);
 	}
+	return;
+    }
+    if (num_clauses == 0) {
+	// Nothing to compile (yet)
+	return;
     }
-    if (failed) {
+    if (interpreted) {
+	pred.count_interpreted_call();
+    }
+    bool eager = num_clauses <= EAGER_MAX_CLAUSES && !pred.is_changed();
+    bool hot = pred.num_interpreted_calls() >= hot_threshold_;
+    if (!eager && !hot) {
+	return;
+    }
+    if (compile(qn)) {
+	pred.set_changed(false);
+	clear_updated_predicate(qn);
+    } else {
 	pred.set_ok_to_compile(false);
 	remove_compiled(qn);
 	clear_updated_predicate(qn);
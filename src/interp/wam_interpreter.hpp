@@ -97,6 +97,8 @@ enum wam_instruction_type {
 
   COST, // Non-standard WAM; for accumulated cost
 
+  ARITH, // Non-standard WAM; is/2 and arithmetic comparisons
+
   LAST
 };
 
@@ -295,6 +297,10 @@ public:
 	term_ = t;
     }
 
+    inline common::term * term_ptr() {
+	return &term_;
+    }
+
 private:
     common::term term_;
 };
@@ -672,6 +678,38 @@ private:
 };
 
 
+// Non-standard WAM: is/2 and the arithmetic comparisons. The
+// arguments are put in A0 and A1 just as for the builtin (so the heap
+// and the cost stay the same), but small integer expressions are
+// evaluated directly. Anything else is left to the builtin.
+enum arith_op { ARITH_IS, ARITH_LT, ARITH_LE, ARITH_GT, ARITH_GE };
+
+template<> class wam_instruction<ARITH> : public wam_instruction_code_point_reg {
+public:
+    inline wam_instruction(common::con_cell module, common::con_cell name,
+			   builtin_fn b, arith_op op) :
+       wam_instruction_code_point_reg(&invoke, sizeof(*this), ARITH,
+				      code_point(name,b,false), op) {
+       init();
+    }
+
+    inline static void init() {
+	static bool init_ = [] {
+	    register_printer(&invoke, &print);
+	    return true; } ();
+	static_cast<void>(init_);
+    }
+
+    inline common::con_cell f() const { return cp().name(); }
+    inline builtin_fn bn() { return cp().bn(); }
+    inline size_t arity() const { return f().arity(); }
+    inline arith_op op() const { return static_cast<arith_op>(reg()); }
+
+    static void invoke(wam_interpreter &interp, wam_instruction_base *self);
+
+    static void print(std::ostream &out, wam_interpreter &interp, wam_instruction_base *self);
+};
+
 class wam_interpreter : public interpreter_base, public wam_code
 {
 public:
@@ -696,6 +734,11 @@ public:
     virtual void updated_predicate_post(const qname &qn) override {
 	interpreter_base::updated_predicate_post(qn);
 	remove_compiled(qn);
+	// Only a change after it has been in use counts (not loading it.)
+	auto &pred = get_predicate(qn);
+	if (pred.was_compiled() || pred.num_interpreted_calls() > 0) {
+	    pred.set_changed(true);
+	}
     }
     
     inline void remove_compiled(const qname &qn)
@@ -733,7 +776,9 @@ public:
     bool compile(common::con_cell name);
     void recompile();
     void recompile_if_needed(const qname &qn);
-    void auto_compile(const qname &qn);
+    // 'interpreted' is true when called from the interpreter (which
+    // is where the calls of an interpreted predicate are counted.)
+    void auto_compile(const qname &qn, bool interpreted = false);
     void print_code(std::ostream &out);
     void print_code(std::ostream &out, size_t from, size_t to);    
     void print_code(std::ostream &out, const qname &qn);
@@ -745,6 +790,52 @@ public:
     inline void set_auto_wam(bool enabled)
     { auto_wam_ = enabled; }
 
+    // Auto compilation compiles predicates with at most
+    // EAGER_MAX_CLAUSES clauses on their first call and never compiles
+    // larger ones.
+    //
+    // With tiered compilation larger ones are compiled once they have
+    // been called hot_threshold() times while interpreted. A predicate
+    // whose clauses change drops back to the interpreter and is
+    // compiled again when it is hot, so a predicate that is updated
+    // between calls isn't recompiled on every call. As the cost of a
+    // call depends on whether it is compiled, this makes the cost
+    // depend on what the interpreter has run before, so it is off by
+    // default and must stay off where the cost is part of consensus.
+    static const size_t EAGER_MAX_CLAUSES = 10;
+    static const size_t DEFAULT_HOT_THRESHOLD = 100;
+
+    inline bool is_tiered_compilation() const
+    { return tiered_compilation_; }
+
+    inline void set_tiered_compilation(bool enabled)
+    { tiered_compilation_ = enabled; }
+
+    inline size_t hot_threshold() const
+    { return hot_threshold_; }
+
+    inline void set_hot_threshold(size_t n)
+    { hot_threshold_ = n; }
+
+    inline bool is_threaded_dispatch() const
+    { return threaded_dispatch_; }
+
+    // Use the threaded dispatch loop (see run_wam_threaded) when not
+    // debugging or profiling. If disabled we always go through the
+    // function pointers.
+    inline void set_threaded_dispatch(bool enabled)
+    { threaded_dispatch_ = enabled; }
+
+    inline bool is_inline_arithmetic() const
+    { return inline_arithmetic_; }
+
+    // Evaluate is/2 and the arithmetic comparisons inline with ARITH
+    // instructions instead of calling the builtins (takes effect for
+    // predicates compiled after this.) The expression is still built
+    // on the heap; only the call and the generic evaluation are saved.
+    inline void set_inline_arithmetic(bool enabled)
+    { inline_arithmetic_ = enabled; }
+
 protected:
     void load_code(wam_interim_code &code);
 
@@ -766,8 +857,22 @@ protected:
 	return interpreter_base::code_db();
     }
 
+    virtual void profile_stack(profiler::stack_t &stack) override;
+    virtual std::vector<std::string> profile_instruction_names() const override;
+
 private:
+    void run_wam();
+    void run_wam_debug();
+    void run_wam_profile();
+    void run_wam_loop();
+    void run_wam_threaded();
+    void profile_instruction(wam_instruction_base *instr);
+
     bool auto_wam_;
+    bool tiered_compilation_;
+    size_t hot_threshold_;
+    bool threaded_dispatch_;
+    bool inline_arithmetic_;
     bool fail_;
     wam_compiler *compiler_;
 
@@ -906,9 +1011,34 @@ private:
   static inline void gc_roots(std::vector<common::ptr_cell *> &roots,
                               interpreter_base *interp) {
     auto wami = reinterpret_cast<wam_interpreter *>(interp);
+    get_code_roots(roots, wami);
+    if (!wami->p().has_wam_code()) {
+      return;
+    }
     get_register_roots(roots, wami);
   }
 
+  // Constants in compiled code may live on the heap (e.g. big nums)
+  static inline void get_code_roots(std::vector<common::ptr_cell *> &roots,
+				    wam_interpreter *wami) {
+    size_t end = wami->next_offset();
+    for (size_t addr = 0; addr < end;) {
+      auto instr = wami->to_code(addr);
+      switch (instr->type()) {
+      case PUT_CONSTANT:
+      case GET_CONSTANT:
+      case SET_CONSTANT:
+      case UNIFY_CONSTANT:
+      case COST:
+	add_root(roots, reinterpret_cast<wam_instruction_term *>(instr)->term_ptr());
+	break;
+      default:
+	break;
+      }
+      addr = wami->to_code_addr(wami->next_instruction(instr));
+    }
+  }
+
   static inline void get_a_roots(std::vector<common::ptr_cell *> &roots,
                                  wam_interpreter *wami) {
     auto na = num_a(wami);
@@ -1692,13 +1822,16 @@ private:
 	size_t num_args = bn->arity();
 	set_num_of_args(num_args);
 	goto_next_instruction();
+	return invoke_builtin(bn->bn(), num_args);
+    }
 
+    inline bool invoke_builtin(builtin_fn fn, size_t num_args)
+    {
 	common::term args[builtins::MAX_ARGS];
 	for (size_t i = 0; i < num_args; i++) {
 	    args[i] = deref(a(i));
 	}
-	epilog::interp::builtin_fn fn = bn->bn();
-	bool r = fn(*this, bn->arity(), args);
+	bool r = fn(*this, num_args, args);
 	if (!r) {
 	    backtrack();
 	} else {
@@ -1709,6 +1842,44 @@ private:
 	return r;
     }
 
+    inline bool arithmetic(wam_instruction_base *p0)
+    {
+        auto ai = reinterpret_cast<wam_instruction<ARITH> *>(p0);
+	set_num_of_args(2);
+	goto_next_instruction();
+	if (is_debug()) {
+	    return invoke_builtin(ai->bn(), 2);
+	}
+	common::term lhs = deref(a(0));
+	common::term rhs = deref(a(1));
+	common::term v0, v1;
+	bool r;
+	if (ai->op() == ARITH_IS) {
+	    if (!arith().eval_int(rhs, v1)) {
+		return invoke_builtin(ai->bn(), 2);
+	    }
+	    r = unify(lhs, v1);
+	} else {
+	    if (!arith().eval_int(lhs, v0) || !arith().eval_int(rhs, v1)) {
+		return invoke_builtin(ai->bn(), 2);
+	    }
+	    int cmp = standard_order(v0, v1);
+	    switch (ai->op()) {
+	    case ARITH_LT: r = cmp < 0; break;
+	    case ARITH_LE: r = cmp <= 0; break;
+	    case ARITH_GT: r = cmp > 0; break;
+	    case ARITH_GE: r = cmp >= 0; break;
+	    default: r = false; break;
+	    }
+	}
+	if (!r) {
+	    backtrack();
+	} else {
+	    check_frozen();
+	}
+	return r;
+    }
+
     void retry_choice_point(code_point &p_else)
     {
         size_t n = b()->arity;
@@ -1900,6 +2071,7 @@ private:
     friend class wam_code;
 
     friend class test_wam_interpreter;
+    friend class interpreter;
 };
 
 template<> class wam_instruction<PUT_VARIABLE_X> : public wam_instruction_binary_reg {
@@ -3371,6 +3543,17 @@ inline void wam_instruction<BUILTIN_R>::print(std::ostream &out, wam_interpreter
     out << "builtin_r " << interp.to_string(self1->f()) << "/" << self1->arity() << ", " << self1->num_y();
 }
 
+inline void wam_instruction<ARITH>::invoke(wam_interpreter &interp, wam_instruction_base *self)
+{
+    interp.arithmetic(self);
+}
+
+inline void wam_instruction<ARITH>::print(std::ostream &out, wam_interpreter &interp, wam_instruction_base *self)
+{
+    auto self1 = reinterpret_cast<wam_instruction<ARITH> *>(self);
+    out << "arith " << interp.to_string(self1->f()) << "/" << self1->arity();
+}
+
 template<> class wam_instruction<TRY_ME_ELSE> : public wam_instruction_code_point {
 public:
     inline wam_instruction(code_point p) :
@@ -4,6 +4,7 @@
 #include "interactive_prompt.hpp"
 #include "../common/readline.hpp"
 #include "../wallet/wallet.hpp"
+#include "../pow/pow_mining.hpp"
 #include "meta_interpreter.hpp"
 
 using namespace epilog::common;
@@ -31,6 +32,10 @@ static void help()
     std::cout << "  --port <number> (start service on this port, default is " << self_node::DEFAULT_PORT << ")" << std::endl;
     std::cout << "  --name <string> (set friendly name on node, default is noname)" << std::endl;
     std::cout << "  --dir <dir> (location of data directory)" << std::endl;
+    std::cout << "  --mining_threads <number> (threads used for proof-of-work, default is" << std::endl;
+    std::cout << "                             one per hardware thread)" << std::endl;
+    std::cout << "  --mining_galaxies <number> (populated galaxies kept between searches," << std::endl;
+    std::cout << "                              default is " << epilog::pow::observatory_cache::DEFAULT_MAX_OBSERVATORIES << ")" << std::endl;
 
     std::cout << std::endl;
     std::cout << "Example: " << program_name << " --interactive --port 8700" << std::endl;
@@ -202,6 +207,26 @@ int main(int argc, char *argv[])
 	return 1;
     }
 
+    std::string mining_threads_opt = get_option(args, "--mining_threads");
+    if (!mining_threads_opt.empty()) {
+	try {
+	    epilog::pow::set_mining_threads(boost::lexical_cast<size_t>(mining_threads_opt));
+	} catch (boost::exception &ex) {
+	    std::cout << std::endl << program_name << ": erroneous mining_threads: " << mining_threads_opt << std::endl << std::endl;
+	    return 1;
+	}
+    }
+
+    std::string mining_galaxies_opt = get_option(args, "--mining_galaxies");
+    if (!mining_galaxies_opt.empty()) {
+	try {
+	    epilog::pow::set_mining_galaxies(boost::lexical_cast<size_t>(mining_galaxies_opt));
+	} catch (boost::exception &ex) {
+	    std::cout << std::endl << program_name << ": erroneous mining_galaxies: " << mining_galaxies_opt << std::endl << std::endl;
+	    return 1;
+	}
+    }
+
     start();
 
     return 0;
@@ -31,7 +31,10 @@ connection::connection(self_node &self,
       sent_bytes_(0),
       send_length_(0),
       auto_send_(false),
-      stopped_(false)
+      stopped_(false),
+      encoding_(term_serializer::FORMAT_VER1),
+      framed_(false),
+      writing_(false)
 {
 }
 
@@ -89,7 +92,8 @@ void connection::send_ok(const term t)
 
 void connection::send(const term t)
 {
-    term_serializer ser(env_);
+    term_serializer ser(env_, encoding_);
+    ser.set_compress(true);
     buffer_.clear();
     ser.write(buffer_, t);
     buffer_len_.resize(sizeof(cell));
@@ -101,10 +105,21 @@ void connection::send(const term t)
 
 bool connection::received_length()
 {
-    auto &e = env_;
-
     cell c = term_serializer::read_cell(buffer_len_, 0,
 	"node::connection::received_length");
+    if (!check_length(c)) {
+	return false;
+    }
+    state_ = STATE_RECEIVE;
+    received_bytes_ = 0;
+    buffer_.resize(receive_length_);
+    return true;
+}
+
+bool connection::check_length(const cell c)
+{
+    auto &e = env_;
+
     if (c.tag() != tag_t::INT) {
 	if (auto_send()) {
 	    send_error(e.functor("error_query_length_was_not_integer",0));
@@ -131,9 +146,6 @@ bool connection::received_length()
 	    return false;
 	} else {
 	    receive_length_ = ic.value();
-	    state_ = STATE_RECEIVE;
-	    received_bytes_ = 0;
-	    buffer_.resize(receive_length_);
 	    return true;
 	}
     }
@@ -271,6 +283,7 @@ void connection::run()
 	close();
 	break;
     case STATE_IDLE:
+    case STATE_FRAMED:
 	timer_.expires_from_now(boost::posix_time::microseconds(
 			self().get_fast_timer_interval_microseconds()));
 	timer_.async_wait(
@@ -302,9 +315,127 @@ void connection::trigger_now()
 			    self().get_fast_timer_interval_microseconds()));
 }
 
+void connection::start_framed()
+{
+    framed_ = true;
+    // Replies need the id of their request, so the subclass sends
+    // them (see in_connection::reply_error.)
+    set_auto_send(false);
+    set_state(STATE_FRAMED);
+    read_frame();
+}
+
+void connection::send_frame(uint64_t id, const term t)
+{
+    term_serializer ser(env_, encoding_);
+    ser.set_compress(true);
+    std::vector<uint8_t> body;
+    ser.write(body, t);
+
+    write_queue_.push_back(std::vector<uint8_t>(FRAME_HEADER_SIZE));
+    auto &frame = write_queue_.back();
+    ser.write_cell(frame, 0, int_cell(body.size()));
+    ser.write_cell(frame, sizeof(cell), int_cell(static_cast<int64_t>(id)));
+    frame.insert(frame.end(), body.begin(), body.end());
+
+    if (!writing_) {
+	write_frame();
+    }
+}
+
+void connection::write_frame()
+{
+    using namespace boost::asio;
+    using namespace boost::system;
+
+    writing_ = true;
+    async_write(get_socket(), buffer(write_queue_.front()),
+	strand_.wrap(
+	     [this](const error_code &ec, size_t n) {
+		 if (ec) {
+		     writing_ = false;
+		     frame_error("While sending frame", n, ec);
+		     return;
+		 }
+		 write_queue_.pop_front();
+		 if (write_queue_.empty()) {
+		     writing_ = false;
+		 } else {
+		     write_frame();
+		 }
+	     }));
+}
+
+void connection::read_frame()
+{
+    using namespace boost::asio;
+    using namespace boost::system;
+
+    frame_header_.resize(FRAME_HEADER_SIZE);
+    async_read(get_socket(), buffer(frame_header_),
+	strand_.wrap(
+	     [this](const error_code &ec, size_t n) {
+		 if (ec) {
+		     frame_error("While receiving frame header", n, ec);
+		     return;
+		 }
+		 cell c = term_serializer::read_cell(frame_header_, 0,
+			       "node::connection::read_frame");
+		 cell id = term_serializer::read_cell(frame_header_,
+			       sizeof(cell), "node::connection::read_frame");
+		 if (!check_length(c) || id.tag() != tag_t::INT) {
+		     set_state_error("Erroneous frame header");
+		     dispatch();
+		     close();
+		     return;
+		 }
+		 auto &id_cell = reinterpret_cast<const int_cell &>(id);
+		 read_frame_body(static_cast<uint64_t>(id_cell.value()));
+	     }));
+}
+
+void connection::read_frame_body(uint64_t id)
+{
+    using namespace boost::asio;
+    using namespace boost::system;
+
+    buffer_.resize(receive_length_);
+    async_read(get_socket(), buffer(buffer_),
+	strand_.wrap(
+	     [this,id](const error_code &ec, size_t n) {
+		 if (ec) {
+		     frame_error("While receiving frame", n, ec);
+		     return;
+		 }
+		 if (get_state() != STATE_FRAMED) {
+		     return;
+		 }
+		 on_frame(id);
+		 if (get_state() == STATE_FRAMED) {
+		     read_frame();
+		 }
+	     }));
+}
+
+void connection::frame_error(const std::string &what, size_t n,
+			     const boost::system::error_code &ec)
+{
+    // Reading and writing both run, so only the first one to fail
+    // closes the connection.
+    if (get_state() != STATE_FRAMED) {
+	return;
+    }
+    std::stringstream msg;
+    msg << what << ": n=" << n << "; error: " << ec.message();
+    set_state_error(msg.str());
+    dispatch();
+    close();
+}
+
 in_connection::in_connection(self_node &self)
     : connection(self, CONNECTION_IN, env_),
-      session_(nullptr)
+      session_(nullptr),
+      switch_to_framed_(false)
 {
     setup_commands();
     prepare_receive();
@@ -321,43 +452,70 @@ in_connection::~in_connection()
 
 void in_connection::setup_commands()
 {
-    commands_[con_cell("new",0)] = [this](const term cmd){ command_new(cmd); };
-    commands_[con_cell("connect",1)] = [this](const term cmd){ command_connect(cmd); };
-    commands_[con_cell("kill",1)] = [this](const term cmd){ command_kill(cmd); };
-    commands_[con_cell("next",0)] = [this](const term cmd){ command_next(cmd); };
-    commands_[con_cell("delinst",0)] = [this](const term cmd){ command_delete_instance(cmd); };
-    commands_[con_cell("reset",0)] = [this](const term cmd){ command_reset(cmd); };
-    commands_[con_cell("lreset",0)] = [this](const term cmd){ command_local_reset(cmd); };
-    commands_[con_cell("name",1)] = [this](const term cmd){ command_name(cmd); };
+    commands_[con_cell("new",0)] = [this](uint64_t req_id, const term cmd){ command_new(req_id, cmd); };
+    commands_[con_cell("connect",1)] = [this](uint64_t req_id, const term cmd){ command_connect(req_id, cmd); };
+    commands_[con_cell("kill",1)] = [this](uint64_t req_id, const term cmd){ command_kill(req_id, cmd); };
+    commands_[con_cell("next",0)] = [this](uint64_t req_id, const term cmd){ command_next(req_id, cmd); };
+    commands_[con_cell("delinst",0)] = [this](uint64_t req_id, const term cmd){ command_delete_instance(req_id, cmd); };
+    commands_[con_cell("reset",0)] = [this](uint64_t req_id, const term cmd){ command_reset(req_id, cmd); };
+    commands_[con_cell("lreset",0)] = [this](uint64_t req_id, const term cmd){ command_local_reset(req_id, cmd); };
+    commands_[con_cell("name",1)] = [this](uint64_t req_id, const term cmd){ command_name(req_id, cmd); };
+    commands_[con_cell("framed",1)] = [this](uint64_t req_id, const term cmd){ command_framed(req_id, cmd); };
+    commands_[con_cell("encoding",1)] = [this](uint64_t req_id, const term cmd){ command_encoding(req_id, cmd); };
 }
 
 void in_connection::on_state()
 {
     switch (get_state()) {
-    case STATE_RECEIVED: process_query(); break;
-    case STATE_SENT: prepare_receive(); break;
+    case STATE_RECEIVED: process_query(0); break;
+    case STATE_SENT:
+	if (switch_to_framed_) {
+	    // The acknowledgement is out, so the peer will only send
+	    // frames from now on.
+	    switch_to_framed_ = false;
+	    start_framed();
+	} else {
+	    prepare_receive();
+	}
+	break;
     default: break;
     }
 }
 
-void in_connection::reply_ok(const term t)
+void in_connection::on_frame(uint64_t req_id)
 {
-    send_ok(t);
+    // Requests are processed in the order they arrive, but every reply
+    // carries the id of its own request so the peer doesn't depend on
+    // that.
+    process_query(req_id);
 }
 
-void in_connection::reply_error(const term t)
+void in_connection::reply_ok(uint64_t req_id, const term t)
 {
-    send_error(t);
+    if (is_framed()) {
+	send_frame(req_id, env_.new_term(env_.functor("ok",1),{t}));
+    } else {
+	send_ok(t);
+    }
 }
 
-void in_connection::reply_exception(const std::string &msg)
+void in_connection::reply_error(uint64_t req_id, const term t)
+{
+    if (is_framed()) {
+	send_frame(req_id, env_.new_term(env_.functor("error",1),{t}));
+    } else {
+	send_error(t);
+    }
+}
+
+void in_connection::reply_exception(uint64_t req_id, const std::string &msg)
 {
     auto &e = env_;
-    reply_error(e.new_term(e.functor("remote_exception",1),
+    reply_error(req_id, e.new_term(e.functor("remote_exception",1),
     			   {e.string_to_list(msg)}));
 }
 
-void in_connection::command_new(const term)
+void in_connection::command_new(uint64_t req_id, const term)
 {
     // Check if this is a local IP address (if yes, then allow root access)
     bool do_root = false;
@@ -366,23 +524,23 @@ void in_connection::command_new(const term)
     if (ip.is_local() && self().is_grant_root_for_local()) {
         do_root = true;
     }
-    auto *ss = self().new_in_session(this, do_root);
-    reply_ok(env_.new_term(con_cell("session",2),
+    auto *ss = self().new_warm_in_session(this, do_root);
+    reply_ok(req_id, env_.new_term(con_cell("session",2),
 			   {env_.functor(ss->id(),0),
 			    env_.functor(self().name(),0)}));
 }
 
-in_session_state * in_connection::get_session(const term id_term)
+in_session_state * in_connection::get_session(uint64_t req_id, const term id_term)
 {
     auto &e = env_;
     if (!e.is_atom(id_term)) {
-	reply_error(e.new_term(e.functor("erroneous_session_id",1),{id_term}));
+	reply_error(req_id, e.new_term(e.functor("erroneous_session_id",1),{id_term}));
 	return nullptr;
     }
     std::string id = e.atom_name(id_term);
     auto *s = self().find_in_session(id);
     if (s == nullptr) {
-	reply_error(e.new_term(e.functor("session_not_found",1),{id_term}));
+	reply_error(req_id, e.new_term(e.functor("session_not_found",1),{id_term}));
 	return nullptr;
     }
     return s;
@@ -401,55 +559,55 @@ con_cell in_connection::get_state_atom()
     }
 }
 
-void in_connection::command_connect(const term cmd)
+void in_connection::command_connect(uint64_t req_id, const term cmd)
 {
     auto &e = env_;
     term id_term = e.arg(cmd,0);
 
-    auto *s = get_session(id_term);
+    auto *s = get_session(req_id, id_term);
     if (s == nullptr) {
 	return;
     }
     self().in_session_connect(s, this);
     session_ = s;
-    reply_ok(e.new_term(e.functor("session_resumed",2),
+    reply_ok(req_id, e.new_term(e.functor("session_resumed",2),
 			{id_term, get_state_atom()}));
 }
 
-void in_connection::command_name(const term cmd)
+void in_connection::command_name(uint64_t req_id, const term cmd)
 {
     auto &e = env_;
     term name_term = e.arg(cmd, 0);
     if (!e.is_atom(name_term)) {
-	reply_error(e.new_term(e.functor("erroneous_name",1),{name_term}));
+	reply_error(req_id, e.new_term(e.functor("erroneous_name",1),{name_term}));
 	return;
     }
     name_ = e.atom_name(name_term);
 }
 
-void in_connection::command_kill(const term cmd)
+void in_connection::command_kill(uint64_t req_id, const term cmd)
 {
     auto &e = env_;
     term id_term = e.arg(cmd,0);
 
-    auto *s = get_session(id_term);
+    auto *s = get_session(req_id, id_term);
     if (s == nullptr) {
 	return;
     }
     self().kill_in_session(s);
     session_ = nullptr;
-    reply_ok(e.new_term(e.functor("session_killed",1),{id_term}));
+    reply_ok(req_id, e.new_term(e.functor("session_killed",1),{id_term}));
 }
 
-void in_connection::command_delete_instance(const term cmd)
+void in_connection::command_delete_instance(uint64_t req_id, const term cmd)
 {
     auto &e = env_;
     if (session_ == nullptr) {
-	reply_error(e.functor("no_running_session",0));
+	reply_error(req_id, e.functor("no_running_session",0));
     } else {
 	try {
 	    session_->delete_instance();
-	    reply_ok(e.new_term(e.functor("result",5),
+	    reply_ok(req_id, e.new_term(e.functor("result",5),
 				{e.EMPTY_LIST,
 				 e.EMPTY_LIST,
 			 	 e.EMPTY_LIST,
@@ -457,20 +615,20 @@ void in_connection::command_delete_instance(const term cmd)
 	 			 e.EMPTY_LIST
 					} ));
 	} catch (std::exception &ex) {
-	    reply_exception(ex.what());
+	    reply_exception(req_id, ex.what());
 	}
     }
 }
 
-void in_connection::command_reset(const term cmd)
+void in_connection::command_reset(uint64_t req_id, const term cmd)
 {
     auto &e = env_;
     if (session_ == nullptr) {
-	reply_error(e.functor("no_running_session",0));
+	reply_error(req_id, e.functor("no_running_session",0));
     } else {
 	try {
 	    session_->reset();
-	    reply_ok(e.new_term(e.functor("result",5),
+	    reply_ok(req_id, e.new_term(e.functor("result",5),
 				{e.EMPTY_LIST,
 				 e.EMPTY_LIST,
 			 	 e.EMPTY_LIST,
@@ -478,20 +636,20 @@ void in_connection::command_reset(const term cmd)
 			 	 e.EMPTY_LIST
 					} ));
 	} catch (std::exception &ex) {
-	    reply_exception(ex.what());
+	    reply_exception(req_id, ex.what());
 	}
     }
 }
 
-void in_connection::command_local_reset(const term cmd)
+void in_connection::command_local_reset(uint64_t req_id, const term cmd)
 {
     auto &e = env_;
     if (session_ == nullptr) {
-	reply_error(e.functor("no_running_session",0));
+	reply_error(req_id, e.functor("no_running_session",0));
     } else {
 	try {
 	    session_->local_reset();
-	    reply_ok(e.new_term(e.functor("result",5),
+	    reply_ok(req_id, e.new_term(e.functor("result",5),
 				{e.EMPTY_LIST,
 				 e.EMPTY_LIST,
 			 	 e.EMPTY_LIST,
@@ -499,58 +657,94 @@ void in_connection::command_local_reset(const term cmd)
 			 	 e.EMPTY_LIST
 					} ));
 	} catch (std::exception &ex) {
-	    reply_exception(ex.what());
+	    reply_exception(req_id, ex.what());
 	}
     }
 }
 
-void in_connection::command_next(const term cmd)
+void in_connection::command_framed(uint64_t req_id, const term cmd)
 {
-    process_execution(cmd, true, false);
+    auto &e = env_;
+    term version = e.arg(cmd, 0);
+    if (version.tag() != tag_t::INT ||
+	reinterpret_cast<const int_cell &>(version).value()
+	  != FRAMED_PROTOCOL_VERSION) {
+	reply_error(req_id, e.new_term(e.functor("unsupported_version",1),{version}));
+	return;
+    }
+    if (!is_framed()) {
+	switch_to_framed_ = true;
+    }
+    reply_ok(req_id, e.new_term(e.functor("framed",1),{version}));
 }
 
-void in_connection::process_command(const term cmd)
+void in_connection::command_encoding(uint64_t req_id, const term cmd)
+{
+    auto &e = env_;
+    term name = e.arg(cmd, 0);
+    if (name == con_cell("compact",0)) {
+	reply_ok(req_id, e.new_term(e.functor("encoding",1),{name}));
+	// The reply above is still ver1, the peer reads both anyway.
+	set_encoding(term_serializer::FORMAT_COMPACT);
+    } else if (name == con_cell("ver1",0)) {
+	reply_ok(req_id, e.new_term(e.functor("encoding",1),{name}));
+	set_encoding(term_serializer::FORMAT_VER1);
+    } else {
+	reply_error(req_id, e.new_term(e.functor("unsupported_encoding",1),{name}));
+    }
+}
+
+void in_connection::command_next(uint64_t req_id, const term cmd)
+{
+    process_execution(req_id, cmd, true, false);
+}
+
+void in_connection::process_command(uint64_t req_id, const term cmd)
 {
     auto &e = env_;
 
     auto it = commands_.find(e.functor(cmd));
     if (it == commands_.end()) {
-	reply_error(e.new_term(e.functor("unrecognized_commmand",1),{cmd}));
+	reply_error(req_id, e.new_term(e.functor("unrecognized_commmand",1),{cmd}));
 	return;
     }
-    (it->second)(cmd);
+    (it->second)(req_id, cmd);
 }
 
-void in_connection::process_query()
+void in_connection::process_query(uint64_t req_id)
 {
     auto &e = env_;
     auto t = received();
     if (t == term()) {
+	if (is_framed()) {
+	    reply_error(req_id, e.new_term(e.functor("serializer_exception",1),
+				       {e.functor("erroneous_frame",0)}));
+	}
 	return;
     }
     if (t.tag() != tag_t::STR) {
-	reply_error(e.new_term(e.functor("unrecognized_command",1),{t}));
+	reply_error(req_id, e.new_term(e.functor("unrecognized_command",1),{t}));
 	return;
     }
     auto f = e.functor(t);
     if (f == con_cell("command",1)) {
-	process_command(e.arg(t,0));
+	process_command(req_id, e.arg(t,0));
     } else if (f == con_cell("query",2)) {
 	if (session_ == nullptr) {
-	    reply_error(e.functor("no_running_session",0));
+	    reply_error(req_id, e.functor("no_running_session",0));
 	} else {
 	    term qr;
 	    try {
 		bool silent = e.arg(t,1) == con_cell("true",0);
 		uint64_t cost = 0;
 		qr = session_->env().copy(e.arg(t,0), e, cost);
-		process_execution(qr, false, silent);
+		process_execution(req_id, qr, false, silent);
 	    } catch (std::exception &ex) {
-		reply_exception(ex.what());
+		reply_exception(req_id, ex.what());
 	    }
 	}
     } else {
-	reply_error(e.new_term(e.functor("unrecognized_command",1),{t}));
+	reply_error(req_id, e.new_term(e.functor("unrecognized_command",1),{t}));
     }
 }
 
@@ -573,18 +767,18 @@ std::string in_connection::to_error_message(const term_parse_exception &ex)
     return to_error_message(env_.to_error_messages(ex));
 }
 
-void in_connection::process_execution(const term cmd, bool in_query, bool silent)
+void in_connection::process_execution(uint64_t req_id, const term cmd, bool in_query, bool silent)
 {
     auto &e = env_;
     try {
 	if (session_ == nullptr) {
-	    reply_error(e.functor("no_running_session",0));
+	    reply_error(req_id, e.functor("no_running_session",0));
 	} else {
 	    uint64_t cost = 0;
 	    if (in_query) {
 		if (cmd != con_cell("next",0)) {
 		    uint64_t cost = 0;
-		    reply_error(e.new_term(e.functor("unrecognized_command",1)
+		    reply_error(req_id, e.new_term(e.functor("unrecognized_command",1)
 				   ,{e.copy(cmd, session_->env(),cost)}));
 		    return;
 		}
@@ -599,7 +793,7 @@ void in_connection::process_execution(const term cmd, bool in_query, bool silent
 	    }
 	    auto last_cost = static_cast<int64_t>(session_->last_cost());
 	    if (!r) {
-		reply_ok(e.new_term(e.functor("result",5),
+		reply_ok(req_id, e.new_term(e.functor("result",5),
 				    {e.functor("false",0),
 				     e.EMPTY_LIST,
 		 		     get_state_atom(),
@@ -631,15 +825,15 @@ void in_connection::process_execution(const term cmd, bool in_query, bool silent
 					 int_cell(last_cost) } );
 		}
 	       
-		reply_ok(result);
+		reply_ok(req_id, result);
 	    }
 	}
     } catch (const token_exception &ex) {
-	reply_exception(to_error_message(ex));
+	reply_exception(req_id, to_error_message(ex));
     } catch (const term_parse_exception &ex) {
-	reply_exception(to_error_message(ex));
+	reply_exception(req_id, to_error_message(ex));
     } catch (const std::exception &ex) {
-	reply_exception(ex.what());
+	reply_exception(req_id, ex.what());
     }
 }
 
@@ -648,7 +842,7 @@ void in_connection::process_execution(const term cmd, bool in_query, bool silent
 //
 
 out_connection::out_connection(self_node &self, out_connection::out_type_t t, const ip_service &ip)
-    :  connection(self, CONNECTION_OUT, env_), out_type_(t), ip_(ip), init_in_progress_(false), use_heartbeat_(true), connected_(false), sent_my_name_(false), work_( &out_task::comparator ), busy_count_(0), pending_queries_(0)
+    :  connection(self, CONNECTION_OUT, env_), out_type_(t), ip_(ip), init_in_progress_(false), use_heartbeat_(true), connected_(false), sent_my_name_(false), work_( &out_task::comparator ), busy_count_(0), pending_queries_(0), use_framed_(self.is_framed_protocol()), framed_accepted_(false), use_compact_(self.is_compact_encoding()), max_in_flight_(DEFAULT_MAX_IN_FLIGHT), frame_timeout_microseconds_(utime::ss(DEFAULT_FRAME_TIMEOUT_SECONDS)), next_frame_id_(0)
 {
     using namespace boost::system;
 
@@ -688,6 +882,10 @@ void out_connection::delete_tasks()
         delete t;
 	work_.pop();
     }
+    for (auto &p : in_flight_) {
+	delete p.second.task;
+    }
+    in_flight_.clear();
 }
 
 out_task * out_connection::create_heartbeat_task()
@@ -735,7 +933,8 @@ void out_connection::reschedule(out_task *task, utime t)
     // If task issues a reschedule on SEND, which normally it doesn't
     // as it doesn't pop the work queue, then we'll pop the work queue
     // to remove it first.
-    if (task->get_state() == out_task::SEND) {
+    if (task->get_state() == out_task::SEND &&
+	!work_.empty() && work_.top() == task) {
 	work_.pop();
     }
 
@@ -861,25 +1060,104 @@ void out_connection::send_next_task()
     }
 }
 
+void out_connection::fill_window()
+{
+    // Unlike send_next_task() the task is popped as soon as it's sent,
+    // as its reply is matched through in_flight_.
+    expire_in_flight();
+    while (in_flight_.size() < max_in_flight_ && !work_.empty()) {
+	auto next_task = work_.top();
+	if (!next_task->expiring()) {
+	    return;
+	}
+	if (next_task->get_state() == out_task::KILLED) {
+	    delete next_task;
+	    work_.pop();
+	    continue;
+	}
+	next_task->set_state(out_task::SEND);
+	next_task->set_term(term());
+	next_task->process();
+	if (next_task->get_term() == term()) {
+	    // Nothing to send (the task may have rescheduled itself.)
+	    // Try again on the next tick.
+	    return;
+	}
+	work_.pop();
+	auto id = next_frame_id_++;
+	in_flight_[id] = in_flight_entry{next_task,
+			   utime::now() + utime::us(frame_timeout_microseconds_)};
+	send_frame(id, next_task->get_term());
+    }
+}
+
+void out_connection::expire_in_flight()
+{
+    // Fail the requests whose reply is overdue, which frees their
+    // slots in the window. (There are at most max_in_flight_ of them.)
+    auto now = utime::now();
+    for (auto it = in_flight_.begin(); it != in_flight_.end();) {
+	if (now < it->second.deadline) {
+	    ++it;
+	    continue;
+	}
+	auto task = it->second.task;
+	it = in_flight_.erase(it);
+	auto &e = task->env();
+	process_received(task, e.new_term(e.functor("error",1),
+					  {e.functor("frame_timeout",0)}));
+    }
+}
+
+void out_connection::process_received(out_task *task, const term r)
+{
+    task->set_state(out_task::RECEIVED);
+    task->set_term(r);
+    task->process();
+    if (task->get_state() == out_task::WAIT) {
+	self().add_waiting(task);
+    } else if (task->get_state() == out_task::KILLED) {
+	delete task;
+    }
+}
+
+void out_connection::on_frame(uint64_t id)
+{
+    boost::lock_guard<boost::recursive_mutex> guard(work_lock_);
+
+    auto it = in_flight_.find(id);
+    if (it == in_flight_.end()) {
+	return;
+    }
+    auto task = it->second.task;
+    in_flight_.erase(it);
+    process_received(task, received(task->env()));
+    if (!is_stopped()) {
+	fill_window();
+    }
+}
+
 void out_connection::on_state()
 {
     boost::lock_guard<boost::recursive_mutex> guard(work_lock_);
 
     switch (get_state()) {
     case STATE_IDLE: if (!is_stopped()) send_next_task(); break;
+    case STATE_FRAMED: if (!is_stopped()) fill_window(); break;
     case STATE_RECEIVED: {
 	auto task = work_.top();
 	work_.pop();
-	auto r = received(task->env());
-	task->set_state(out_task::RECEIVED);
-	task->set_term(r);
-	task->process();
-	if (task->get_state() == out_task::WAIT) {
-	    self().add_waiting(task);
-	} else if (task->get_state() == out_task::KILLED) {
-	    delete task;
+	process_received(task, received(task->env()));
+	if (is_stopped()) {
+	    break;
 	}
-	if (!is_stopped()) {
+	if (framed_accepted_) {
+	    // The peer has acknowledged command(framed(...)) so we
+	    // switch protocol before sending anything else.
+	    framed_accepted_ = false;
+	    start_framed();
+	    fill_window();
+	} else {
 	    send_next_task();
 	}
 	break;
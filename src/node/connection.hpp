@@ -6,15 +6,19 @@
 #include "asio_win32_check.hpp"
 
 #include <queue>
+#include <deque>
+#include <map>
 #include <boost/thread.hpp>
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/strand.hpp>
+#include <boost/asio/read.hpp>
 #include <boost/asio/write.hpp>
 #include <boost/asio/buffer.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/deadline_timer.hpp>
 #include "../common/term.hpp"
 #include "../common/term_env.hpp"
+#include "../common/term_serializer.hpp"
 #include "../common/utime.hpp"
 #include "../common/spinlock.hpp"
 #include "ip_address.hpp"
@@ -74,6 +78,11 @@ protected:
 public:
     enum connection_type { CONNECTION_IN, CONNECTION_OUT };
 
+    // Version of the framed (multiplexed) protocol. Negotiated with
+    // command(framed(Version)) once the session is established; peers
+    // that don't recognize it keep the single-shot protocol.
+    static const int FRAMED_PROTOCOL_VERSION = 1;
+
     connection(self_node &self, connection_type type, term_env &env);
     virtual ~connection();
 
@@ -103,6 +112,15 @@ public:
     inline void set_dispatcher( std::function<void ()> dispatcher )
     { dispatcher_ = dispatcher; }
 
+    inline bool is_framed() const { return framed_; }
+
+    // Serialization format of what we send. Anything we receive is
+    // read in the format it was written (it's recorded in the data.)
+    inline common::term_serializer::format_t encoding() const
+    { return encoding_; }
+    inline void set_encoding(common::term_serializer::format_t f)
+    { encoding_ = f; }
+
     inline bool auto_send() const
     { return auto_send_; }
     inline void set_auto_send(bool auto_send)
@@ -119,7 +137,8 @@ protected:
 	STATE_SENT,
 	STATE_ERROR,
 	STATE_KILLED,
-	STATE_CLOSED
+	STATE_CLOSED,
+	STATE_FRAMED
     };
 
     inline state get_state() const { return state_; }
@@ -140,8 +159,27 @@ protected:
 
     const std::string & last_error() const { return last_error_; }
 
+    //
+    // Framed mode. Every message is preceded by its length and a
+    // request id (two cells.) Reading and writing run independently
+    // of each other, so any number of requests can be in flight and
+    // replies are matched by their id. The state stays at STATE_FRAMED
+    // and the timer keeps dispatching as in STATE_IDLE.
+    //
+    static const size_t FRAME_HEADER_SIZE = 2*sizeof(common::cell);
+
+    void start_framed();
+    void send_frame(uint64_t id, const term t);
+    virtual void on_frame(uint64_t id) = 0;
+
 private:
+    bool check_length(const common::cell c);
     bool received_length();
+    void read_frame();
+    void read_frame_body(uint64_t id);
+    void write_frame();
+    void frame_error(const std::string &what, size_t n,
+		     const boost::system::error_code &ec);
 
     self_node &self_node_;
     connection_type type_;
@@ -163,6 +201,12 @@ private:
     bool auto_send_;
     bool stopped_;
     std::string last_error_;
+
+    common::term_serializer::format_t encoding_;
+    bool framed_;
+    std::vector<uint8_t> frame_header_;
+    std::deque<std::vector<uint8_t> > write_queue_;
+    bool writing_;
 };
 
 class in_connection : public connection {
@@ -181,36 +225,42 @@ private:
 
     common::con_cell get_state_atom();
     void setup_commands();
-    in_session_state * get_session(const term id_term);
+    // Commands and replies carry the id of the request they answer
+    // (framed mode only, 0 otherwise.)
+    in_session_state * get_session(uint64_t req_id, const term id_term);
     inline in_session_state * get_session() { return session_; }
 
     void on_state();
-
-    void command_new(const term cmd);
-    void command_connect(const term cmd);
-    void command_name(const term cmd);
-    void command_kill(const term cmd);
-    void command_next(const term cmd);
-    void command_delete_instance(const term cmd);
-    void command_reset(const term cmd);
-    void command_local_reset(const term cmd);
-    void process_command(const term cmd);
-    void process_query();
+    void on_frame(uint64_t req_id) override;
+
+    void command_new(uint64_t req_id, const term cmd);
+    void command_connect(uint64_t req_id, const term cmd);
+    void command_name(uint64_t req_id, const term cmd);
+    void command_kill(uint64_t req_id, const term cmd);
+    void command_next(uint64_t req_id, const term cmd);
+    void command_delete_instance(uint64_t req_id, const term cmd);
+    void command_reset(uint64_t req_id, const term cmd);
+    void command_local_reset(uint64_t req_id, const term cmd);
+    void command_framed(uint64_t req_id, const term cmd);
+    void command_encoding(uint64_t req_id, const term cmd);
+    void process_command(uint64_t req_id, const term cmd);
+    void process_query(uint64_t req_id);
     void process_query_reply();
-    void process_execution(const term cmd, bool in_query, bool silent);
+    void process_execution(uint64_t req_id, const term cmd, bool in_query, bool silent);
 
-    void reply_exception(const std::string &msg);
-    void reply_error(const common::term t);
-    void reply_ok(const common::term t);
+    void reply_exception(uint64_t req_id, const std::string &msg);
+    void reply_error(uint64_t req_id, const common::term t);
+    void reply_ok(uint64_t req_id, const common::term t);
 
     friend class self_node;
 
     std::unordered_map<epilog::common::con_cell,
-		       std::function<void(common::term cmd)> > commands_;
+		       std::function<void(uint64_t req_id, common::term cmd)> > commands_;
     in_session_state *session_;
     term_env env_;
     std::string name_;
     bool silent_;
+    bool switch_to_framed_;
 };
 
 //
@@ -225,6 +275,9 @@ public:
     using utime = epilog::common::utime;
     enum out_type_t { STANDARD, VERIFIER };
 
+    static const size_t DEFAULT_MAX_IN_FLIGHT = 32;
+    static const uint64_t DEFAULT_FRAME_TIMEOUT_SECONDS = 30;
+
     out_connection(self_node &self, out_type_t t, const ip_service &ip);
     virtual ~out_connection();
     
@@ -241,7 +294,33 @@ public:
     inline bool sent_my_name() const { return sent_my_name_; }
     inline void set_sent_my_name() { sent_my_name_ = true; }
 
-    inline bool is_ready() const { return pending_queries_ == 0; }
+    // In framed mode queries are multiplexed, so the connection is
+    // ready as long as there's room in the window.
+    inline bool is_ready() const {
+	return is_framed() ? pending_queries_ < max_in_flight_
+	                   : pending_queries_ == 0;
+    }
+
+    // Try to switch to the framed protocol after the handshake.
+    inline bool use_framed() const { return use_framed_; }
+    inline void set_use_framed(bool b) { use_framed_ = b; }
+    inline void set_framed_accepted() { framed_accepted_ = true; }
+
+    // Ask the peer to accept compact encoding after the handshake.
+    inline bool use_compact() const { return use_compact_; }
+    inline void set_use_compact(bool b) { use_compact_ = b; }
+
+    // Maximum number of requests in flight (framed mode only.)
+    inline size_t max_in_flight() const { return max_in_flight_; }
+    inline void set_max_in_flight(size_t n) { max_in_flight_ = n == 0 ? 1 : n; }
+    inline size_t num_in_flight() const { return in_flight_.size(); }
+
+    // A request in flight that isn't answered in time fails with
+    // error(frame_timeout) (and a late reply is ignored.)
+    inline uint64_t frame_timeout_microseconds() const
+    { return frame_timeout_microseconds_; }
+    template<uint64_t C> inline void set_frame_timeout(utime::dt<C> t)
+    { frame_timeout_microseconds_ = t; }
 
     void increment_pending_queries();
     void decrement_pending_queries();
@@ -315,7 +394,11 @@ private:
     static void handle_init_connection_task_fn(out_task &task);
 
     void send_next_task();
+    void fill_window();
+    void expire_in_flight();
     void on_state();
+    void on_frame(uint64_t id) override;
+    void process_received(out_task *task, const term r);
 
     void reply_error(const common::term t);
     void reply_ok(const common::term t);
@@ -339,6 +422,18 @@ private:
     size_t busy_count_;
     common::spinlock busy_count_lock_;
     size_t pending_queries_;
+
+    bool use_framed_;
+    bool framed_accepted_;
+    bool use_compact_;
+    size_t max_in_flight_;
+    uint64_t frame_timeout_microseconds_;
+    uint64_t next_frame_id_;
+    struct in_flight_entry {
+	out_task *task;
+	utime deadline;
+    };
+    std::map<uint64_t, in_flight_entry> in_flight_;
 };
 
 }}
@@ -11,6 +11,7 @@
 #include "../pow/pow_mining.hpp"
 #include "node_locker.hpp"
 #include "sync.hpp"
+#include <fstream>
 
 namespace epilog { namespace node {
 
@@ -568,6 +569,46 @@ bool me_builtins::gstat_1(interpreter_base &interp0, size_t arity, term args[])
     }
 }
 
+bool me_builtins::gprofile_1(interpreter_base &interp0, size_t arity, term args[]) {
+    auto &interp = to_local(interp0);
+    auto locked = interp.lock_node();
+    auto &g = interp.self().global();
+    term arg = args[0];
+    if (arg == con_cell("on",0)) {
+	g.interp().set_profiling(true);
+    } else if (arg == con_cell("off",0)) {
+	g.interp().set_profiling(false);
+    } else if (arg == con_cell("reset",0)) {
+	g.interp().reset_profiling();
+    } else {
+	throw interpreter_exception_wrong_arg_type("gprofile/1: Argument must be 'on', 'off' or 'reset'; was " + interp.to_string(arg));
+    }
+    return true;
+}
+
+bool me_builtins::gprofile_2(interpreter_base &interp0, size_t arity, term args[]) {
+    auto &interp = to_local(interp0);
+    auto locked = interp.lock_node();
+    auto &g = interp.self().global();
+
+    // Predicate names are atoms of the global interpreter
+    auto text = interp::builtins::profile_export(interp, args[0], "gprofile/2", g.interp());
+    term out = args[1];
+    if (out.tag().is_ref()) {
+	return interp.unify(out, interp.string_to_list(text));
+    }
+    if (!interp.is_atom(out)) {
+	throw interpreter_exception_wrong_arg_type("gprofile/2: Filename must be an atom; was " + interp.to_string(out));
+    }
+    std::string full_path = interp.get_full_path(interp.atom_name(out));
+    std::ofstream file(full_path);
+    file << text;
+    if (!file.good()) {
+	throw interpreter_exception_file_not_found("gprofile/2: Could not write '" + full_path + "'");
+    }
+    return true;
+}
+
 static size_t min_prefix(const global::meta_id &a, const global::meta_id &b) {
     size_t n = a.hash_size();
     auto ha = a.hash();
@@ -1711,7 +1752,7 @@ bool me_builtins::pow_mode_1(interpreter_base &interp0, size_t arity, term args[
 
 term me_builtins::build_leaf_term(interpreter_base &interp0, const merkle_leaf *lf, size_t pos)
 {
-    auto &interp = to_local(interp0);
+    auto &interp = interp0;
 
     auto key = lf->key();
 
@@ -1735,7 +1776,7 @@ term me_builtins::build_leaf_term(interpreter_base &interp0, const merkle_leaf *
 
 term me_builtins::build_tree_term(interpreter_base &interp0, const merkle_branch *br, size_t pos)
 {
-    auto &interp = to_local(interp0);    
+    auto &interp = interp0;
     
     term tail = interp.EMPTY_LIST;
     term lst = tail;
@@ -1772,12 +1813,32 @@ term me_builtins::build_tree_term(interpreter_base &interp0, const merkle_branch
     return interp.new_term(con_cell("branch", 4), {hash_term,depth,pos1,lst});
 }
 
+term me_builtins::build_tree_blob(interpreter_base &interp0, const merkle_root &mtree)
+{
+    std::vector<uint8_t> bytes;
+    mtree.write(bytes);
+    return interp0.new_big(&bytes[0], bytes.size());
+}
+
+bool me_builtins::get_merkle_tree(interpreter_base &interp0, term t, merkle_root &mr)
+{
+    if (t.tag() == tag_t::BIG) {
+	auto &big = reinterpret_cast<big_cell &>(t);
+	size_t n = interp0.num_bytes(big);
+	std::vector<uint8_t> bytes(n);
+	interp0.get_big(big, &bytes[0], n);
+	return mr.read(&bytes[0], n);
+    }
+    size_t pos = 0;
+    return build_merkle_tree(interp0, t, mr, pos);
+}
+
 //
 //         <id>    <type> <from key> <to key>
 // db_get(<root id>, heap, 10,         2000,                 X)
 //  X will become a tree of data.
 //
-term me_builtins::db_get(interpreter_base &interp0, const std::string &name, size_t arity, term args[], bool compute_size_only) {
+term me_builtins::db_get(interpreter_base &interp0, const std::string &name, size_t arity, term args[], bool compute_size_only, bool binary) {
     auto &interp = to_local(interp0);
     auto locked = interp.lock_node();
 
@@ -1827,6 +1888,8 @@ term me_builtins::db_get(interpreter_base &interp0, const std::string &name, siz
 
     if (compute_size_only) {
 	result = int_cell(static_cast<int64_t>(mtree.total_size()));
+    } else if (binary) {
+	result = build_tree_blob(interp, mtree);
     } else {
 	result = build_tree_term(interp, &mtree, 0);
     }
@@ -1844,6 +1907,44 @@ bool me_builtins::db_get_5(interpreter_base &interp0, size_t arity, term args[])
     return interp.unify(result, args[4]);
 }
 
+//
+// db_get_bin(<root id>, <type>, <from key>, <to key>, X)
+//  Same as db_get/5, but X becomes the tree in its binary form (a
+//  bignum, see merkle_root::write.) db_put/5, db_keys/4, db_end/2,
+//  db_num/4 and db_hash/2 take either form.
+//
+bool me_builtins::db_get_bin_5(interpreter_base &interp0, size_t arity, term args[]) {
+    auto &interp = to_local(interp0);
+    term result = db_get(interp0, "db_get_bin/5", arity, args, false, true);
+    return interp.unify(result, args[4]);
+}
+
+//
+// db_hash(Tree, Hash)
+//  Hash is the root hash of the tree.
+//
+bool me_builtins::db_hash_2(interpreter_base &interp0, size_t arity, term args[]) {
+    merkle_root mtree;
+    if (!get_merkle_tree(interp0, args[0], mtree) || mtree.hash_size() == 0) {
+	return false;
+    }
+    auto &h = static_cast<const merkle_root &>(mtree);
+    auto hash_term = interp0.new_big(h.hash(), h.hash_size());
+    return interp0.unify(args[1], hash_term);
+}
+
+//
+// db_tree(Tree, Term)
+//  Term is the tree in its term form (for debugging the binary form.)
+//
+bool me_builtins::db_tree_2(interpreter_base &interp0, size_t arity, term args[]) {
+    merkle_root mtree;
+    if (!get_merkle_tree(interp0, args[0], mtree)) {
+	return false;
+    }
+    return interp0.unify(args[1], build_tree_term(interp0, &mtree, 0));
+}
+
 static size_t merkle_leaf_count(interpreter_base &interp0, term mtree_term, uint64_t from_key, uint64_t to_key)
 {
     if (mtree_term.tag() != tag_t::STR) {
@@ -1921,7 +2022,16 @@ bool me_builtins::db_num_4(interpreter_base &interp0, size_t arity, term args[])
     auto from_key_val = reinterpret_cast<int_cell &>(from_key).value();
     auto to_key_val = reinterpret_cast<int_cell &>(to_key).value();
 
-    auto n = merkle_leaf_count(interp0, mtree_term, from_key_val, to_key_val);
+    size_t n = 0;
+    if (mtree_term.tag() == tag_t::BIG) {
+	merkle_root mr;
+	if (!get_merkle_tree(interp0, mtree_term, mr)) {
+	    return false;
+	}
+	n = mr.num_leaves(from_key_val, to_key_val);
+    } else {
+	n = merkle_leaf_count(interp0, mtree_term, from_key_val, to_key_val);
+    }
 
     return interp.unify(args[3], int_cell(static_cast<int64_t>(n)));
 }
@@ -1933,6 +2043,11 @@ bool me_builtins::db_size_5(interpreter_base &interp0, size_t arity, term args[]
 }
 
 std::pair<triedb *, root_id> me_builtins::get_db_root(interpreter_base &interp0, term db_name, const global::meta_id &id) {
+    auto &interp = to_local(interp0);
+    return get_db_root(interp.self().global().get_blockchain(), db_name, id);
+}
+
+std::pair<triedb *, root_id> me_builtins::get_db_root(global::blockchain &chain, term db_name, const global::meta_id &id) {
     db::triedb *db = nullptr;
     db::root_id rid;
 
@@ -1941,8 +2056,6 @@ std::pair<triedb *, root_id> me_builtins::get_db_root(interpreter_base &interp0,
     static con_cell CLOSURE("closure",0);
     static con_cell SYMBOLS("symbols",0);
     static con_cell PROGRAM("program",0);
-    auto &interp = to_local(interp0);
-    auto &chain = interp.self().global().get_blockchain();
 
     auto e = chain.get_meta_entry(id);    
 
@@ -1967,13 +2080,16 @@ std::pair<triedb *, root_id> me_builtins::get_db_root(interpreter_base &interp0,
 }
 
 void me_builtins::set_db_root(interpreter_base &interp0, term db_name, const global::meta_id &id, const db::root_id &new_root_id) {
+    auto &interp = to_local(interp0);
+    set_db_root(interp.self().global().get_blockchain(), db_name, id, new_root_id);
+}
+
+void me_builtins::set_db_root(global::blockchain &chain, term db_name, const global::meta_id &id, const db::root_id &new_root_id) {
     static con_cell BLOCK("block",0);
     static con_cell HEAP("heap", 0);
     static con_cell CLOSURE("closure",0);
     static con_cell SYMBOLS("symbols",0);
     static con_cell PROGRAM("program",0);
-    auto &interp = to_local(interp0);
-    auto &chain = interp.self().global().get_blockchain();
 
     auto ep = chain.get_meta_entry(id);
     if (ep == nullptr) {
@@ -2084,8 +2200,7 @@ bool me_builtins::db_keys_4(interpreter_base &interp0, size_t arity, term args[]
     auto &interp = to_local(interp0);
 
     merkle_root mtree;
-    size_t pos = 0;
-    if (!build_merkle_tree(interp0, args[0], mtree, pos)) {
+    if (!get_merkle_tree(interp0, args[0], mtree)) {
 	return false;
     }
 
@@ -2133,8 +2248,7 @@ bool me_builtins::db_end_2(interpreter_base &interp0, size_t arity, term args[])
     static const std::string name = "db_end/2";
 
     merkle_root mtree;
-    size_t pos = 0;
-    if (!build_merkle_tree(interp0, args[0], mtree, pos)) {
+    if (!get_merkle_tree(interp0, args[0], mtree)) {
 	return false;
     }
 
@@ -2337,8 +2451,7 @@ bool me_builtins::db_put_5(interpreter_base &interp0, size_t arity, term args[])
     term merkle_term = args[4];
 
     merkle_root mr;
-    size_t pos = 0;
-    if (!build_merkle_tree(interp0, merkle_term, mr, pos)) {
+    if (!get_merkle_tree(interp0, merkle_term, mr)) {
 	return false;
     }
 
@@ -2463,6 +2576,79 @@ bool me_builtins::db_put_3(interpreter_base &interp0, size_t arity, term args[])
     return true;
 }
 
+/*
+ * db_pipeline(Root, DB, Params, NewLow, Done)
+ *
+ * Run one step of the native sync of DB (see sync_pipeline.) Params
+ * is a list of num(N), hash(H), low(L), step(S), timeout(T) and
+ * optionally threads(N) and window(W). Done is true when all the
+ * entries are in the database.
+ */
+bool me_builtins::db_pipeline_5(interpreter_base &interp0, size_t arity, term args[]) {
+    static const std::string name = "db_pipeline/5";
+
+    auto &interp = to_local(interp0);
+    interp.root_check("db_pipeline", arity);
+
+    if (!interp.self().has_syncer()) {
+	throw interpreter_exception_wrong_arg_type(name + ": Node is not syncing.");
+    }
+
+    auto id = get_meta_id(interp, name, args[0]);
+
+    if (args[1].tag() != tag_t::CON) {
+	throw interpreter_exception_wrong_arg_type(name + ": Second argument must be an atom.");
+    }
+    auto db_name = reinterpret_cast<con_cell &>(args[1]);
+
+    auto &pipeline = interp.self().syncer().pipeline();
+
+    sync_pipeline::params p;
+    merkle_root expected;
+    term lst = args[2];
+    while (interp.is_dotted_pair(lst)) {
+	term param = interp.arg(lst, 0);
+	lst = interp.arg(lst, 1);
+	if (param.tag() != tag_t::STR || interp.functor(param).arity() != 1) {
+	    throw interpreter_exception_wrong_arg_type(name + ": Unexpected parameter; was " + interp.to_string(param));
+	}
+	auto f = interp.functor(param);
+	auto val = interp.arg(param, 0);
+	if (f == interp.functor("hash", 1)) {
+	    if (!interp.is_empty_list(val) && !set_hash(interp0, val, expected)) {
+		throw interpreter_exception_wrong_arg_type(name + ": Hash must be a bignum; was " + interp.to_string(val));
+	    }
+	    continue;
+	}
+	if (val.tag() != tag_t::INT || reinterpret_cast<int_cell &>(val).value() < 0) {
+	    throw interpreter_exception_wrong_arg_type(name + ": Parameter value must be a non-negative integer; was " + interp.to_string(param));
+	}
+	auto v = static_cast<uint64_t>(reinterpret_cast<int_cell &>(val).value());
+	if (f == interp.functor("num", 1)) {
+	    p.num_entries = v;
+	} else if (f == interp.functor("low", 1)) {
+	    p.low = v;
+	} else if (f == interp.functor("step", 1)) {
+	    p.step = v;
+	} else if (f == interp.functor("timeout", 1)) {
+	    p.timeout_millis = v;
+	} else if (f == interp.functor("threads", 1)) {
+	    pipeline.set_num_threads(static_cast<size_t>(v));
+	} else if (f == interp.functor("window", 1)) {
+	    pipeline.set_window(static_cast<size_t>(v));
+	} else {
+	    throw interpreter_exception_wrong_arg_type(name + ": Unexpected parameter; was " + interp.to_string(param));
+	}
+    }
+    p.expected = expected;
+
+    bool done = pipeline.run(interp, db_name, id, p);
+
+    auto new_low = int_cell(static_cast<int64_t>(pipeline.low()));
+    auto done_term = done ? interp.functor("true", 0) : interp.functor("false", 0);
+    return interp.unify(args[3], new_low) && interp.unify(args[4], done_term);
+}
+
 bool me_builtins::ptask_0(interpreter_base &interp0, size_t arity, term args[]) {
     static const std::string name = "ptask/0";
     auto &interp = to_local(interp0);
@@ -2617,7 +2803,7 @@ bool me_builtins::new_blk_2(interpreter_base &interp0, size_t arity, term args[]
 }
 
 local_interpreter::local_interpreter(in_session_state &session)
-    : interp::interpreter("node"), session_(session), initialized_(false), ignore_text_(false)
+    : interp::interpreter("node"), session_(session), initialized_(false), startup_loaded_(false), ignore_text_(false)
 {
     // Redirect standard output (standard std::cout) to an internal
     // stringstream.
@@ -2651,12 +2837,25 @@ void local_interpreter::root_check(const std::string &name, size_t arity)
 }
 
 void local_interpreter::ensure_initialized()
+{
+    ensure_libraries_initialized();
+    if (!startup_loaded_) {
+	startup_loaded_ = true;
+	// Load startup file
+	if (load_startup_file_) startup_file();
+    }
+}
+
+void local_interpreter::ensure_libraries_initialized()
 {
     if (!initialized_) {
 	initialized_ = true;
 	// TODO: Only do this for authorized clients.
 	enable_file_io();
 
+	// Reuse parsed programs (standard library, startup file, ...)
+	set_program_cache(&self().get_program_cache());
+
 	setup_standard_lib();
 
 	ec::builtins::load(*this);
@@ -2675,9 +2874,6 @@ void local_interpreter::ensure_initialized()
 	// Retain state between queries (enables frozen closures in
 	// "background" processes between queries)
 	set_retain_state_between_queries(true);
-
-	// Load startup file
-	if (load_startup_file_) startup_file();
     }
 }
 
@@ -2731,6 +2927,9 @@ void local_interpreter::setup_local_builtins()
     // gstat/0/1: Status of global interpreter
     load_builtin(ME, con_cell("gstat", 0), &me_builtins::gstat_1);
     load_builtin(ME, con_cell("gstat", 1), &me_builtins::gstat_1);
+    // gprofile/1/2: Profile global interpreter (see profile/1/2)
+    load_builtin(ME, functor("gprofile", 1), &me_builtins::gprofile_1);
+    load_builtin(ME, functor("gprofile", 2), &me_builtins::gprofile_2);
     // chain/0: View chain
     load_builtin(ME, con_cell("chain", 0), &me_builtins::chain_0);
     load_builtin(ME, con_cell("chain", 2), &me_builtins::chain_3);
@@ -2797,6 +2996,9 @@ void local_interpreter::setup_local_builtins()
     load_builtin(ME, functor("sync_progress", 1), &me_builtins::sync_progress_1);
     load_builtin(ME, functor("pow_mode", 1), &me_builtins::pow_mode_1);
     load_builtin(ME, con_cell("db_get", 5), &me_builtins::db_get_5);
+    load_builtin(ME, functor("db_get_bin", 5), &me_builtins::db_get_bin_5);
+    load_builtin(ME, con_cell("db_hash", 2), &me_builtins::db_hash_2);
+    load_builtin(ME, con_cell("db_tree", 2), &me_builtins::db_tree_2);
     load_builtin(ME, con_cell("db_num", 3), &me_builtins::db_num_3);    
     load_builtin(ME, con_cell("db_num", 4), &me_builtins::db_num_4);
     load_builtin(ME, con_cell("db_size", 5), &me_builtins::db_size_5);
@@ -2806,6 +3008,7 @@ void local_interpreter::setup_local_builtins()
     load_builtin(ME, con_cell("db_put", 5), &me_builtins::db_put_5);
     load_builtin(ME, con_cell("db_put", 4), &me_builtins::db_put_4);
     load_builtin(ME, con_cell("db_put", 3), &me_builtins::db_put_3);
+    load_builtin(ME, functor("db_pipeline", 5), &me_builtins::db_pipeline_5);
     load_builtin(ME, con_cell("ptask", 0), &me_builtins::ptask_0);
     load_builtin(ME, con_cell("new_tx", 1), &me_builtins::new_tx_1);
     load_builtin(ME, con_cell("pow",0), &me_builtins::pow_0);
@@ -72,6 +72,8 @@ public:
     static global::meta_id get_meta_id(interpreter_base &interp, const std::string &name, term prefix_id);
     static bool drop_global_0(interpreter_base &interp, size_t arity, term args[]);
     static bool gstat_1(interpreter_base &interp, size_t arity, term args[]);
+    static bool gprofile_1(interpreter_base &interp, size_t arity, term args[]);
+    static bool gprofile_2(interpreter_base &interp, size_t arity, term args[]);
     static bool chain_0(interpreter_base &interp, size_t arity, term args[]);
     static bool chain_2(interpreter_base &interp, size_t arity, term args[]);
     static bool chain_3(interpreter_base &interp, size_t arity, term args[]);
@@ -123,9 +125,14 @@ public:
 
     static term build_leaf_term(interpreter_base &interp0, const db::merkle_leaf *lf, size_t pos);
     static term build_tree_term(interpreter_base &interp0, const db::merkle_branch *br, size_t pos);
+    static term build_tree_blob(interpreter_base &interp0, const db::merkle_root &mtree);
     static term db_get(interpreter_base &interp, const std::string &name,
-		       size_t arity, term args[], bool compute_size_only);
+		       size_t arity, term args[], bool compute_size_only,
+		       bool binary = false);
     static bool db_get_5(interpreter_base &interp, size_t arity, term args[]);
+    static bool db_get_bin_5(interpreter_base &interp, size_t arity, term args[]);
+    static bool db_hash_2(interpreter_base &interp, size_t arity, term args[]);
+    static bool db_tree_2(interpreter_base &interp, size_t arity, term args[]);
     static bool db_size_5(interpreter_base &interp, size_t arity, term args[]);
     static bool db_num_3(interpreter_base &interp, size_t arity, term args[]);
     static bool db_num_4(interpreter_base &interp, size_t arity, term args[]);
@@ -136,14 +143,19 @@ public:
 
     static std::pair<db::triedb *, db::root_id> get_db_root(interpreter_base &interp, term name, const global::meta_id &id);
     static void set_db_root(interpreter_base &interp, term name, const global::meta_id &id, const db::root_id &new_root_id);
+    static std::pair<db::triedb *, db::root_id> get_db_root(global::blockchain &chain, term name, const global::meta_id &id);
+    static void set_db_root(global::blockchain &chain, term name, const global::meta_id &id, const db::root_id &new_root_id);
     static bool set_hash(interpreter_base &interp0, term hash_term, db::merkle_node &mnode);
     static bool set_depth(interpreter_base &interp0, term hash_term, db::merkle_branch &mbr);    
     static bool check_position(interpreter_base &interp0, term t);
     static bool build_merkle_tree(interpreter_base &interp0, term t, db::merkle_branch &br, size_t &pos);
     static bool build_merkle_tree(interpreter_base &interp0, term t, db::merkle_leaf &lf, size_t &pos);
+    // From either the term form or the binary form (a bignum)
+    static bool get_merkle_tree(interpreter_base &interp0, term t, db::merkle_root &mr);
     static bool db_put_5(interpreter_base &interp, size_t arity, term args[]);
     static bool db_put_4(interpreter_base &interp, size_t arity, term args[]);
     static bool db_put_3(interpreter_base &interp, size_t arity, term args[]);    
+    static bool db_pipeline_5(interpreter_base &interp, size_t arity, term args[]);
     static bool ptask_0(interpreter_base &interp, size_t arity, term args[]);
 
     // Put a new transaction in mempool (if not already present)
@@ -201,6 +213,9 @@ public:
     local_interpreter(in_session_state &session);
 
     void ensure_initialized();
+    // Everything but the startup file (which is loaded by the thread
+    // of the first query, as for a new session.)
+    void ensure_libraries_initialized();
 
     node_locker lock_node();
 
@@ -249,6 +264,7 @@ private:
 
     in_session_state &session_;
     bool initialized_;
+    bool startup_loaded_;
     std::string text_out_;
     bool ignore_text_;
     std::stringstream standard_output_;
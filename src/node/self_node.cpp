@@ -7,6 +7,7 @@
 #include "../common/random.hpp"
 #include "self_node.hpp"
 #include "session.hpp"
+#include "session_pool.hpp"
 #include "address_verifier.hpp"
 #include "address_downloader.hpp"
 #include "task_execute_query.hpp"
@@ -38,12 +39,16 @@ self_node::self_node(const std::string &data_dir, unsigned short port)
       num_verifier_connections_(0),
       num_download_addresses_(DEFAULT_NUM_DOWNLOAD_ADDRESSES),
       testing_mode_(false),
+      framed_protocol_(false),
+      compact_encoding_(false),
       initial_funds_(DEFAULT_INITIAL_FUNDS),
       maximum_funds_(DEFAULT_MAXIMUM_FUNDS),
       new_funds_per_second_(DEFAULT_NEW_FUNDS_PER_SECOND),
       grant_root_for_local_(true),
+      session_pool_size_(session_pool::DEFAULT_SIZE),
       data_dir_(data_dir),
-      global_(data_dir_)
+      global_(data_dir_),
+      program_cache_((boost::filesystem::path(data_dir_) / "programs").string())
 {
     set_timer_interval(utime::ms(DEFAULT_TIMER_INTERVAL_MILLISECONDS));
     set_time_to_live(utime::ss(DEFAULT_TTL_SECONDS));
@@ -52,6 +57,7 @@ self_node::self_node(const std::string &data_dir, unsigned short port)
 
 self_node::~self_node()
 {
+    delete session_pool_;
     delete sync_;
 }
 
@@ -72,10 +78,14 @@ void self_node::start()
     thread_ = boost::thread([&](){ run(); });
 
     sync_ = new sync(this);
+
+    session_pool_ = new session_pool(this, session_pool_size_);
+    session_pool_->start();
 }
 
 void self_node::stop()
 {
+    if (session_pool_) session_pool_->stop();
     stop_all_connections();
     stop_sync();
 }
@@ -349,6 +359,24 @@ in_session_state * self_node::new_in_session(in_connection *conn, bool is_root)
     return ss;
 }
 
+in_session_state * self_node::new_warm_in_session(in_connection *conn, bool is_root)
+{
+    auto *ss = session_pool_ ? session_pool_->take(is_root) : nullptr;
+    if (ss == nullptr) {
+	return new_in_session(conn, is_root);
+    }
+    ss->set_connection(conn);
+    ss->set_available_funds( get_initial_funds() );
+    boost::lock_guard<boost::recursive_mutex> guard(lock_);
+    in_states_[ss->id()] = ss;
+    return ss;
+}
+
+size_t self_node::num_warm_sessions(bool is_root)
+{
+    return session_pool_ ? session_pool_->num_ready(is_root) : 0;
+}
+
 in_session_state * self_node::find_in_session(const std::string &id)
 {
     boost::lock_guard<boost::recursive_mutex> guard(lock_);
@@ -635,6 +663,7 @@ void self_node::join()
     using namespace boost::system;
 
     if (sync_) sync_->join();
+    if (session_pool_) session_pool_->join();
     
     stop_all_connections();
     for (size_t i = 0; i < 100 && !all_connections_closed(); i++) {
@@ -28,6 +28,7 @@ namespace epilog { namespace node {
 class out_task;
 class task_execute_query;
 class sync;
+class session_pool;
 
 class self_node_exception : public std::runtime_error {
 public:
@@ -101,6 +102,12 @@ public:
     inline bool is_grant_root_for_local() const { return grant_root_for_local_; }
     inline void set_grant_root_for_local(bool b) { grant_root_for_local_ = b; }
 
+    // Number of warm sessions (of each kind, root and non-root) to
+    // keep ready for new in connections. Takes effect at start().
+    inline size_t session_pool_size() const { return session_pool_size_; }
+    inline void set_session_pool_size(size_t n) { session_pool_size_ = n; }
+    size_t num_warm_sessions(bool is_root);
+
     inline const std::string & id() const { return id_; }
 
     inline boost::asio::ip::address address() { return endpoint_.address(); }
@@ -111,6 +118,9 @@ public:
 
     inline const std::string & data_directory() const { return data_dir_; }
 
+    // Parsed programs shared by all local interpreters
+    inline interp::program_cache & get_program_cache() { return program_cache_; }
+
     // Must be a Prolog term
     void set_comment(const std::string &str);
     inline term get_comment() const { return comment_; }
@@ -165,6 +175,25 @@ public:
 	testing_mode_ = b;
     }
 
+    // New out connections negotiate the framed (multiplexed)
+    // protocol. Off by default (always the single-shot protocol) until
+    // the negotiation is proven against older peers.
+    inline bool is_framed_protocol() const {
+	return framed_protocol_;
+    }
+    inline void set_framed_protocol(bool b) {
+	framed_protocol_ = b;
+    }
+
+    // New out connections ask for compact term encoding. Off by
+    // default, like the framed protocol.
+    inline bool is_compact_encoding() const {
+	return compact_encoding_;
+    }
+    inline void set_compact_encoding(bool b) {
+	compact_encoding_ = b;
+    }
+
     template<uint64_t C> inline void set_timer_interval(utime::dt<C> t)
     {
 	timer_interval_microseconds_ = t;
@@ -222,6 +251,9 @@ public:
 					size_t timeout);
 
     in_session_state * new_in_session(in_connection *conn, bool is_root);
+    // Same as above, but takes an initialized session from the pool
+    // if there is one.
+    in_session_state * new_warm_in_session(in_connection *conn, bool is_root);
     in_session_state * find_in_session(const std::string &id);
     void kill_in_session(in_session_state *sess);
     void in_session_connect(in_session_state *sess, in_connection *conn);
@@ -361,24 +393,30 @@ private:
     std::map<std::string, std::queue<std::string> > mailbox_;
 
     bool testing_mode_;
+    bool framed_protocol_;
+    bool compact_encoding_;
 
     uint64_t initial_funds_;
     uint64_t maximum_funds_;
     uint64_t new_funds_per_second_;
 
     bool grant_root_for_local_;
+    size_t session_pool_size_;
 
     std::string data_dir_;
   
     // This is where the consensus is stored
     global::global global_;
 
+    interp::program_cache program_cache_;
+
     // Tracking outgoing parallel tasks
     std::vector<task_execute_query *> parallel_;
     boost::mutex parallel_changed_lock_;
     boost::condition_variable parallel_changed_;
 
     sync *sync_{nullptr};
+    session_pool *session_pool_{nullptr};
 
     class mempool mempool_;
 };
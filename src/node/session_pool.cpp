@@ -0,0 +1,112 @@
+#include "session_pool.hpp"
+#include "session.hpp"
+#include "self_node.hpp"
+
+namespace epilog { namespace node {
+
+using namespace epilog::common;
+
+session_pool::session_pool(self_node *self, size_t size)
+    : self_(self), size_(size), started_(false), stop_(false)
+{
+}
+
+session_pool::~session_pool()
+{
+    join();
+    for (auto &ready : ready_) {
+	for (auto *ss : ready) {
+	    delete ss;
+	}
+	ready.clear();
+    }
+}
+
+void session_pool::start()
+{
+    if (!started_ && size_ > 0) {
+	started_ = true;
+	thread_ = boost::thread([this](){ run(); });
+    }
+}
+
+void session_pool::stop()
+{
+    boost::lock_guard<boost::mutex> guard(lock_);
+    stop_ = true;
+    changed_.notify_all();
+}
+
+void session_pool::join()
+{
+    stop();
+    if (started_) {
+	thread_.join();
+	started_ = false;
+    }
+}
+
+in_session_state * session_pool::take(bool is_root)
+{
+    boost::lock_guard<boost::mutex> guard(lock_);
+    auto &ready = ready_[is_root];
+    if (ready.empty()) {
+	return nullptr;
+    }
+    auto *ss = ready.back();
+    ready.pop_back();
+    changed_.notify_all();
+    return ss;
+}
+
+size_t session_pool::num_ready(bool is_root)
+{
+    boost::lock_guard<boost::mutex> guard(lock_);
+    return ready_[is_root].size();
+}
+
+bool session_pool::wants(bool is_root) const
+{
+    // Only local connections get root sessions
+    if (is_root && !self_->is_grant_root_for_local()) {
+	return false;
+    }
+    return ready_[is_root].size() < size_;
+}
+
+void session_pool::run()
+{
+    boost::unique_lock<boost::mutex> lock(lock_);
+    while (!stop_) {
+	bool is_root;
+	if (wants(false)) {
+	    is_root = false;
+	} else if (wants(true)) {
+	    is_root = true;
+	} else {
+	    changed_.wait(lock);
+	    continue;
+	}
+
+	lock.unlock();
+	auto *ss = new in_session_state(self_, nullptr, is_root);
+	try {
+	    ss->interp().ensure_libraries_initialized();
+	} catch (const std::exception &) {
+	    // Leave it to the lazy initialization of new_in_session
+	    delete ss;
+	    ss = nullptr;
+	}
+	lock.lock();
+
+	if (ss == nullptr) {
+	    changed_.wait_for(lock, boost::chrono::seconds(1));
+	} else if (stop_) {
+	    delete ss;
+	} else {
+	    ready_[is_root].push_back(ss);
+	}
+    }
+}
+
+}}
@@ -0,0 +1,53 @@
+#pragma once
+
+#ifndef _node_session_pool_hpp
+#define _node_session_pool_hpp
+
+#include <vector>
+#include <boost/thread.hpp>
+
+namespace epilog { namespace node {
+
+class self_node;
+class in_session_state;
+
+//
+// Keeps a few in sessions with initialized interpreters (the standard
+// library, builtins and modules) ready, so a new session doesn't have
+// to wait for them. A background thread tops up the pool whenever one
+// is taken. The startup file of root sessions runs with the first
+// query, like it does for a new session.
+//
+class session_pool {
+public:
+    static const size_t DEFAULT_SIZE = 2;
+
+    session_pool(self_node *self, size_t size);
+    ~session_pool();
+
+    void start();
+    void stop();
+    void join();
+
+    // Returns nullptr if there is no warm session available.
+    in_session_state * take(bool is_root);
+
+    size_t num_ready(bool is_root);
+
+private:
+    void run();
+    bool wants(bool is_root) const;
+
+    self_node *self_;
+    size_t size_;
+    bool started_;
+    bool stop_;
+    boost::thread thread_;
+    boost::mutex lock_;
+    boost::condition_variable changed_;
+    std::vector<in_session_state *> ready_[2];
+};
+
+}}
+
+#endif
@@ -13,7 +13,8 @@ sync::sync(self_node *self)
     : self_(self),
       sync_file_("sync.pl"),
       session_(self->new_in_session(nullptr, true)),
-      interp_(session_->interp()) {
+      interp_(session_->interp()),
+      pipeline_(self) {
     interp_.dont_load_startup_file();
     interp_.set_current_directory(self->data_directory()),
     interp_.set_debug_enabled();
@@ -33,6 +34,7 @@ void sync::join()
 {
     stop_ = true;
     thread_.join();
+    pipeline_.stop();
 }
 
 void sync::load()
@@ -206,6 +208,7 @@ sync_setup :-
     (\+ current_predicate(sync:'timeout'/1) -> assert(sync:'timeout'(100000)) ; true),
     (\+ current_predicate(sync:lookahead/1) -> assert(sync:lookahead(10)) ; true),
     (\+ current_predicate(sync:low/1) -> assert(sync:low(0)) ; true),
+    (\+ current_predicate(sync:pipeline/1) -> assert(sync:pipeline(true)) ; true),
     (current_predicate(sync:low_db/2), sync:low_db(symbols,_) -> true ; assert(sync:low_db(symbols,0))),
     (current_predicate(sync:low_db/2), sync:low_db(program,_) -> true ; assert(sync:low_db(program,0))),
     (current_predicate(sync:low_db/2), sync:low_db(closure,_) -> true ; assert(sync:low_db(closure,0))),
@@ -342,6 +345,35 @@ sync_run(catchup) :-
         retract(sync:mode(_)),
         assert(sync:mode(done))).
 
+%
+% Native pipelined sync (see sync_pipeline.cpp.) Set sync:pipeline(false)
+% to use the Prolog version below.
+%
+sync_run(DB) :-
+    current_predicate(sync:rootid/1),
+    sync:pipeline(true),
+    !,
+    db_update_progress,
+    sync:rootid(Root),
+    (current_predicate(tmp:end/2), tmp:end(DB,Root) ->
+      retract(tmp:end(DB,Root)),
+      (current_predicate(sync:get/4) -> retractall(sync:get(_,Root,DB,_)) ; true),
+      db_next_mode(DB)
+    ; sync:db(DB, Num, ExpectedDBRoot),
+      sync:low_db(DB, Low),
+      sync:step(Step),
+      sync:'timeout'(Timeout),
+      db_pipeline(Root, DB, [num(Num), hash(ExpectedDBRoot), low(Low),
+                             step(Step), timeout(Timeout)], NewLow, Done),
+      (NewLow \== Low ->
+          % --Debug>>>
+          debug((write('Low '), write(NewLow), write(' '), write('DB='), write(DB), write_short_root(Root), nl)),
+          % --Debug<<<
+          retract(sync:low_db(DB, _)),
+          assert(sync:low_db(DB, NewLow))
+      ; true),
+      (Done == true -> assert(tmp:end(DB,Root)) ; true)).
+
 sync_run(DB) :-
     current_predicate(sync:rootid/1),
     db_update_progress,
@@ -349,12 +381,7 @@ sync_run(DB) :-
     (\+ current_predicate(sync:get/4),
       current_predicate(tmp:end/2), tmp:end(DB,Root),
       retract(tmp:end(DB,Root)),
-      db_done(DB, NextDB),
-      retract(sync:mode(DB)),
-      assert(sync:mode(NextDB)),
-      retract(sync:step(_)),
-      db_default_step(NextDB, Step),
-      assert(sync:step(Step))
+      db_next_mode(DB)
     ; (db_schedule_scan, ! ; true),
       % Do not attempt to schedule new downloads until scan
       % is complete
@@ -377,6 +404,14 @@ db_progress([DB|Rest], Root, Acc0, Tot0, Acc, Tot) :-
     Tot1 is Tot0 + Num,
     db_progress(Rest, Root, Acc1, Tot1, Acc, Tot).
 
+db_next_mode(DB) :-
+    db_done(DB, NextDB),
+    retract(sync:mode(DB)),
+    assert(sync:mode(NextDB)),
+    retract(sync:step(_)),
+    db_default_step(NextDB, Step),
+    assert(sync:step(Step)).
+
 db_done(block, symbols).
 db_done(symbols, program).
 db_done(program, closure).
@@ -727,16 +762,20 @@ db_process_one_get(DB,Root,UsedConn,Connection) :-
    % --Debug<<<
    assert(tmp:run(get(Key,Root,DB))),
    sync:'timeout'(Timeout),
-   (db_get(Root,DB,Key,KeyEnd,Result) @= (Connection else
+   (current_predicate(tmp:nobin/1), tmp:nobin(Connection) ->
+       Get = db_get(Root,DB,Key,KeyEnd,Result)
+     ; Get = db_get_bin(Root,DB,Key,KeyEnd,Result)),
+   (Get @= (Connection else
       (Result = fail) timeout Timeout)),
    %
    % Note that we can process out of order responses - doesn't affect
    % end result.
    %
    freeze(Result, critical_section((retract(tmp:run(get(Key,Root,DB))),
+                   db_check_bin(Get, Result, Connection),
                    Result \= fail,
                    sync:db(DB, _, ExpectedDBRoot),
-                   Result = branch(ActualDBRoot, _, _, _),
+                   db_hash(Result, ActualDBRoot),
                    ActualDBRoot == ExpectedDBRoot,
                    (db_put(Root, DB, Key, KeyEnd, Result) ->
                       db_num(Result, Key, KeyEnd, NumKeys),
@@ -755,6 +794,18 @@ db_process_one_get(DB,Root,UsedConn,Connection) :-
                       db_update_low(DB, Root, Key, KeyEnd)
                     ; db_get_fail(DB,Root,Key,Span))))).
 
+%
+% db_check_bin(Get, Result, Connection)
+%
+% Peers older than db_get_bin/5 fail it. If so, ask Connection with
+% db_get/5 from now on (the failed get is retried.)
+%
+
+db_check_bin(db_get_bin(_,_,_,_,_), fail, Connection) :- !,
+    (current_predicate(tmp:nobin/1), tmp:nobin(Connection) -> true
+    ; assert(tmp:nobin(Connection))).
+db_check_bin(_, _, _).
+
 %
 % db_update_low(DB, Root, Key, KeyEnd)
 %
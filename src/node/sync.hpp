@@ -7,6 +7,7 @@
 #include "../common/utime.hpp"
 #include "ip_service.hpp"
 #include "local_interpreter.hpp"
+#include "sync_pipeline.hpp"
 
 namespace epilog { namespace node {
 
@@ -77,6 +78,10 @@ public:
     void set_progress(size_t p) {
 	syncing_progress_ = p;
     }
+
+    sync_pipeline & pipeline() {
+	return pipeline_;
+    }
     
 private:
     void setup_sync_impl();
@@ -99,6 +104,7 @@ private:
     std::string sync_mode_;
     size_t syncing_meta_block_{0};
     size_t syncing_progress_{0};
+    sync_pipeline pipeline_;
 };
 
 }}
@@ -0,0 +1,600 @@
+#include <algorithm>
+#include "self_node.hpp"
+#include "local_interpreter.hpp"
+#include "task_execute_query.hpp"
+#include "sync_pipeline.hpp"
+
+using namespace epilog::common;
+using namespace epilog::db;
+
+namespace epilog { namespace node {
+
+//
+// node_sync_transport
+//
+
+void node_sync_transport::get_peers(std::vector<peer_t> &peers)
+{
+    connections_.clear();
+    self_->for_each_standard_out_connection(
+	[&](out_connection *conn) { connections_.push_back(conn); });
+    peers.assign(connections_.begin(), connections_.end());
+
+    // Abandoned tasks are consumed when they're done, so that the
+    // connection can delete them.
+    for (auto it = abandoned_.begin(); it != abandoned_.end();) {
+	if (!is_alive(it->second)) {
+	    it = abandoned_.erase(it);
+	} else if (it->first->is_result_ready()) {
+	    it->first->consume_result();
+	    it = abandoned_.erase(it);
+	} else {
+	    ++it;
+	}
+    }
+}
+
+//
+// Tasks are deleted along with their connection. So before touching
+// a task we check that its connection is still around.
+//
+bool node_sync_transport::is_alive(out_connection *conn) const
+{
+    return std::find(connections_.begin(), connections_.end(), conn)
+	!= connections_.end();
+}
+
+bool node_sync_transport::is_connected(peer_t peer)
+{
+    return static_cast<out_connection *>(peer)->is_connected();
+}
+
+sync_transport::request_t node_sync_transport::send(peer_t peer, interpreter_base &interp, term query)
+{
+    auto *conn = static_cast<out_connection *>(peer);
+    auto where = conn->name();
+    if (!self_->is_unique_connection_name(where)) {
+	where = conn->ip().str();
+    }
+    return self_->schedule_execute_query(query, nullptr, interp, where,
+					 interp::MODE_NORMAL);
+}
+
+bool node_sync_transport::is_ready(request_t req)
+{
+    return static_cast<task_execute_query *>(req)->is_result_ready();
+}
+
+term node_sync_transport::take_result(request_t req, interpreter_base &interp)
+{
+    auto *task = static_cast<task_execute_query *>(req);
+    if (task->failed()) {
+	task->consume_result();
+	return term();
+    }
+    uint64_t cost = 0;
+    term_env &dst = interp;
+    term result = dst.copy(task->get_result(), task->env(), cost);
+    task->consume_result();
+    return result;
+}
+
+void node_sync_transport::abandon(peer_t peer, request_t req)
+{
+    abandoned_.push_back(std::make_pair(static_cast<task_execute_query *>(req),
+					static_cast<out_connection *>(peer)));
+}
+
+const triedb * node_sync_transport::get_db(con_cell db_name, const global::meta_id &root)
+{
+    node_locker locked(*self_);
+    auto &chain = self_->global().get_blockchain();
+    if (chain.get_meta_entry(root) == nullptr) {
+	return nullptr;
+    }
+    return me_builtins::get_db_root(chain, db_name, root).first;
+}
+
+uint64_t node_sync_transport::num_entries(con_cell db_name, const global::meta_id &root)
+{
+    node_locker locked(*self_);
+    auto &chain = self_->global().get_blockchain();
+    if (chain.get_meta_entry(root) == nullptr) {
+	return 0;
+    }
+    triedb *db = nullptr;
+    root_id rid;
+    std::tie(db, rid) = me_builtins::get_db_root(chain, db_name, root);
+    return rid.is_zero() ? 0 : db->num_entries(rid);
+}
+
+void node_sync_transport::apply(con_cell db_name, const global::meta_id &root, const merkle_root &part)
+{
+    node_locker locked(*self_);
+    auto &chain = self_->global().get_blockchain();
+    triedb *db = nullptr;
+    root_id rid;
+    std::tie(db, rid) = me_builtins::get_db_root(chain, db_name, root);
+    bool new_root = rid.is_zero();
+    if (new_root) {
+	rid = db->new_root();
+    }
+    db->update(rid, part);
+    if (new_root) {
+	me_builtins::set_db_root(chain, db_name, root, rid);
+    }
+}
+
+//
+// sync_pipeline
+//
+
+sync_pipeline::sync_pipeline(self_node *self)
+    : sync_pipeline(new node_sync_transport(self))
+{
+}
+
+sync_pipeline::sync_pipeline(sync_transport *transport)
+    : transport_(transport),
+      num_threads_(std::max(2u, boost::thread::hardware_concurrency())),
+      window_(64),
+      per_connection_(4),
+      db_(nullptr),
+      generation_(0),
+      low_(0),
+      next_(0),
+      at_end_(false),
+      need_scan_(false),
+      scan_task_(nullptr),
+      scan_conn_(nullptr),
+      scan_from_(0),
+      threads_started_(false),
+      stop_threads_(false)
+{
+}
+
+sync_pipeline::~sync_pipeline()
+{
+    stop();
+}
+
+void sync_pipeline::stop()
+{
+    {
+	boost::lock_guard<boost::mutex> guard(verify_lock_);
+	stop_threads_ = true;
+	verify_cv_.notify_all();
+    }
+    threads_.join_all();
+}
+
+void sync_pipeline::start_threads()
+{
+    if (threads_started_) {
+	return;
+    }
+    threads_started_ = true;
+    for (size_t i = 0; i < num_threads_; i++) {
+	threads_.create_thread([this](){ verify_worker(); });
+    }
+}
+
+void sync_pipeline::verify_worker()
+{
+    for (;;) {
+	range_ptr r;
+	{
+	    boost::unique_lock<boost::mutex> lockit(verify_lock_);
+	    while (!stop_threads_ && verify_queue_.empty()) {
+		verify_cv_.wait(lockit);
+	    }
+	    if (stop_threads_) {
+		return;
+	    }
+	    r = verify_queue_.front();
+	    verify_queue_.pop_front();
+	}
+
+	// This is where the time goes (hashing all leaves and branches)
+	bool ok = r->tree->validate(r->db, r->from, r->to);
+	size_t num_keys = 0;
+	if (ok) {
+	    std::vector<uint64_t> keys;
+	    r->tree->get_keys(r->from, std::numeric_limits<size_t>::max(), keys);
+	    for (auto k : keys) {
+		if (k <= r->to) num_keys++;
+	    }
+	}
+
+	boost::lock_guard<boost::mutex> guard(verify_lock_);
+	r->ok = ok;
+	r->num_keys = num_keys;
+	verified_.push_back(r);
+    }
+}
+
+void sync_pipeline::reset(con_cell db_name,
+			  const global::meta_id &root, const params &p)
+{
+    for (auto &e : ranges_) {
+	auto &r = *e.second;
+	if (r.state == ISSUED) {
+	    abandon(r.task, r.conn);
+	}
+    }
+    ranges_.clear();
+    if (scan_task_ != nullptr) {
+	abandon(scan_task_, scan_conn_);
+	scan_task_ = nullptr;
+    }
+
+    generation_++;
+    db_name_ = db_name;
+    root_ = root;
+    params_ = p;
+    if (params_.step == 0) params_.step = 1;
+    low_ = next_ = p.low;
+    at_end_ = false;
+    need_scan_ = false;
+    db_ = transport_->get_db(db_name, root);
+}
+
+bool sync_pipeline::run(interpreter_base &interp, con_cell db_name,
+			const global::meta_id &root, const params &p)
+{
+    if (db_name != db_name_ || root != root_ || db_ == nullptr) {
+	reset(db_name, root, p);
+    }
+    if (db_ == nullptr) {
+	return false;
+    }
+    params_.step = p.step == 0 ? 1 : p.step;
+    params_.timeout_millis = p.timeout_millis;
+
+    start_threads();
+    update_connections();
+
+    collect_results(interp);
+    collect_scan(interp);
+    collect_verified();
+    if (apply()) {
+	return true;
+    }
+    if (need_scan_) {
+	issue_scan(interp);
+    }
+    fill_window();
+    issue(interp);
+    return false;
+}
+
+void sync_pipeline::update_connections()
+{
+    connections_.clear();
+    transport_->get_peers(connections_);
+}
+
+bool sync_pipeline::is_alive(peer_t conn) const
+{
+    return std::find(connections_.begin(), connections_.end(), conn)
+	!= connections_.end();
+}
+
+void sync_pipeline::abandon(request_t task, peer_t conn)
+{
+    done_with(conn);
+    transport_->abandon(conn, task);
+}
+
+void sync_pipeline::done_with(peer_t conn)
+{
+    auto it = in_flight_.find(conn);
+    if (it != in_flight_.end() && it->second > 0) {
+	it->second--;
+    }
+}
+
+void sync_pipeline::fail(range &r)
+{
+    if (r.conn != nullptr) {
+	failures_[r.conn]++;
+    }
+    r.fails++;
+    r.failed_conn = r.conn;
+    r.task = nullptr;
+    r.conn = nullptr;
+    r.tree.reset();
+    r.state = WAITING;
+}
+
+term sync_pipeline::tree_of(interpreter_base &interp, request_t task)
+{
+    term result = transport_->take_result(task, interp);
+    if (result.tag() != tag_t::STR || interp.functor(result).arity() != 5) {
+	return term();
+    }
+    return interp.arg(result, 4);
+}
+
+void sync_pipeline::collect_results(interpreter_base &interp)
+{
+    auto now = utime::now();
+    for (auto &e : ranges_) {
+	auto &r = *e.second;
+	if (r.state != ISSUED) {
+	    continue;
+	}
+	if (!is_alive(r.conn)) {
+	    in_flight_.erase(r.conn);
+	    failures_.erase(r.conn);
+	    no_bin_.erase(r.conn);
+	    fail(r);
+	    continue;
+	}
+	if (!transport_->is_ready(r.task)) {
+	    if ((now - r.issued).in_ms() > params_.timeout_millis) {
+		abandon(r.task, r.conn);
+		fail(r);
+	    }
+	    continue;
+	}
+	done_with(r.conn);
+	term tree = tree_of(interp, r.task);
+	if (tree == term() && r.bin) {
+	    no_bin_.insert(r.conn);
+	}
+	r.tree.reset(new merkle_root());
+	if (tree == term() ||
+	    !me_builtins::get_merkle_tree(interp, tree, *r.tree) ||
+	    !r.tree->equal_hash(params_.expected)) {
+	    fail(r);
+	    continue;
+	}
+	r.state = VERIFYING;
+	r.task = nullptr;
+	boost::lock_guard<boost::mutex> guard(verify_lock_);
+	verify_queue_.push_back(e.second);
+	verify_cv_.notify_one();
+    }
+}
+
+void sync_pipeline::collect_verified()
+{
+    std::vector<range_ptr> verified;
+    {
+	boost::lock_guard<boost::mutex> guard(verify_lock_);
+	std::swap(verified, verified_);
+    }
+    for (auto &r : verified) {
+	if (r->generation != generation_) {
+	    continue;
+	}
+	if (r->ok) {
+	    r->state = VERIFIED;
+	} else {
+	    fail(*r);
+	}
+    }
+}
+
+//
+// Apply verified ranges in key order, starting at the low watermark.
+//
+bool sync_pipeline::apply()
+{
+    while (!ranges_.empty()) {
+	auto it = ranges_.begin();
+	auto &r = *it->second;
+	if (r.from > low_ || r.state != VERIFIED) {
+	    break;
+	}
+	transport_->apply(db_name_, root_, *r.tree);
+	if (r.to > low_) {
+	    low_ = r.to;
+	}
+	// An empty range: look for the next key instead of requesting
+	// the (possibly huge) gap range by range.
+	need_scan_ = r.num_keys == 0;
+	ranges_.erase(it);
+    }
+    return is_complete();
+}
+
+bool sync_pipeline::is_complete()
+{
+    if (at_end_) {
+	return true;
+    }
+    auto n = transport_->num_entries(db_name_, root_);
+    return n > 0 && n >= params_.num_entries;
+}
+
+void sync_pipeline::fill_window()
+{
+    while (!at_end_ && ranges_.size() < window_) {
+	uint64_t to = next_ + params_.step;
+	if (to < next_) {
+	    break; // Wrapped around
+	}
+	auto r = std::make_shared<range>();
+	r->from = next_;
+	r->to = to;
+	r->state = WAITING;
+	r->generation = generation_;
+	r->task = nullptr;
+	r->conn = nullptr;
+	r->failed_conn = nullptr;
+	r->bin = true;
+	r->fails = 0;
+	r->db = db_;
+	r->ok = false;
+	r->num_keys = 0;
+	ranges_[r->from] = r;
+	next_ = to;
+    }
+}
+
+sync_pipeline::peer_t sync_pipeline::pick_connection(peer_t avoid)
+{
+    peer_t best = nullptr;
+    size_t best_n = 0, best_fails = 0;
+    for (auto conn : connections_) {
+	if (!transport_->is_connected(conn)) {
+	    continue;
+	}
+	size_t n = in_flight_[conn];
+	if (n >= per_connection_ || (conn == avoid && connections_.size() > 1)) {
+	    continue;
+	}
+	// Peers that fail fast would otherwise always look the least
+	// busy, and get the lowest ranges again and again.
+	size_t fails = failures_[conn];
+	if (best == nullptr || fails < best_fails ||
+	    (fails == best_fails && n < best_n)) {
+	    best = conn;
+	    best_n = n;
+	    best_fails = fails;
+	}
+    }
+    return best;
+}
+
+sync_pipeline::request_t sync_pipeline::schedule(interpreter_base &interp,
+						peer_t conn, term query)
+{
+    auto task = transport_->send(conn, interp, query);
+    if (task != nullptr) {
+	in_flight_[conn]++;
+    }
+    return task;
+}
+
+// Lowest keys first, as those hold back the low watermark
+void sync_pipeline::issue(interpreter_base &interp)
+{
+    for (auto &e : ranges_) {
+	auto &r = *e.second;
+	if (r.state != WAITING) {
+	    continue;
+	}
+	auto conn = pick_connection(r.failed_conn);
+	if (conn == nullptr) {
+	    return;
+	}
+	// Peers that failed db_get_bin/5 get db_get/5 (same result as
+	// a term.)
+	bool bin = no_bin_.count(conn) == 0;
+	auto query = interp.new_term(interp.functor(bin ? "db_get_bin" : "db_get", 5),
+				     { root_.to_term(interp), db_name_,
+				       int_cell(static_cast<int64_t>(r.from)),
+				       int_cell(static_cast<int64_t>(r.to)),
+				       interp.new_ref() });
+	auto task = schedule(interp, conn, query);
+	if (task == nullptr) {
+	    return;
+	}
+	r.task = task;
+	r.conn = conn;
+	r.bin = bin;
+	r.issued = utime::now();
+	r.state = ISSUED;
+    }
+}
+
+void sync_pipeline::issue_scan(interpreter_base &interp)
+{
+    if (scan_task_ != nullptr) {
+	return;
+    }
+    auto conn = pick_connection(nullptr);
+    if (conn == nullptr) {
+	return;
+    }
+    auto query = interp.new_term(interp.functor("db_keys", 5),
+				 { root_.to_term(interp), db_name_,
+				   int_cell(static_cast<int64_t>(low_)),
+				   int_cell(1),
+				   interp.new_ref() });
+    scan_task_ = schedule(interp, conn, query);
+    if (scan_task_ != nullptr) {
+	scan_conn_ = conn;
+	scan_from_ = low_;
+	scan_issued_ = utime::now();
+	need_scan_ = false;
+    }
+}
+
+//
+// Next key after a gap. Everything below it is empty, so skip the
+// ranges there. No key means that we're at the end.
+//
+void sync_pipeline::collect_scan(interpreter_base &interp)
+{
+    if (scan_task_ == nullptr) {
+	return;
+    }
+    if (!is_alive(scan_conn_)) {
+	in_flight_.erase(scan_conn_);
+	failures_.erase(scan_conn_);
+	scan_task_ = nullptr;
+	need_scan_ = true;
+	return;
+    }
+    if (!transport_->is_ready(scan_task_)) {
+	if ((utime::now() - scan_issued_).in_ms() > params_.timeout_millis) {
+	    abandon(scan_task_, scan_conn_);
+	    failures_[scan_conn_]++;
+	    scan_task_ = nullptr;
+	    need_scan_ = true;
+	}
+	return;
+    }
+    done_with(scan_conn_);
+    auto task = scan_task_;
+    scan_task_ = nullptr;
+
+    term tree = tree_of(interp, task);
+    merkle_root mtree;
+    size_t pos = 0;
+    if (tree == term() || !me_builtins::build_merkle_tree(interp, tree, mtree, pos)) {
+	failures_[scan_conn_]++;
+	need_scan_ = true;
+	return;
+    }
+    std::vector<uint64_t> keys;
+    mtree.get_keys(scan_from_, 1, keys);
+    if (keys.empty()) {
+	if (mtree.validate_end(nullptr, scan_from_)) {
+	    at_end_ = true;
+	} else {
+	    need_scan_ = true;
+	}
+	return;
+    }
+    if (!mtree.validate(nullptr, keys[0], keys[0])) {
+	need_scan_ = true;
+	return;
+    }
+
+    uint64_t next_key = keys[0];
+    if (next_key <= low_) {
+	return;
+    }
+    low_ = next_key;
+    // If no range covers the next key, then start over from it.
+    auto first = ranges_.lower_bound(next_key);
+    bool covered = first != ranges_.begin() && std::prev(first)->second->to >= next_key;
+    auto last = covered ? std::prev(first) : ranges_.end();
+    for (auto it = ranges_.begin(); it != last;) {
+	auto &r = *it->second;
+	if (r.state == ISSUED) {
+	    abandon(r.task, r.conn);
+	}
+	it = ranges_.erase(it);
+    }
+    if (!covered) {
+	next_ = next_key;
+    }
+}
+
+}}
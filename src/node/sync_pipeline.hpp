@@ -0,0 +1,217 @@
+#pragma once
+
+#ifndef _node_sync_pipeline_hpp
+#define _node_sync_pipeline_hpp
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <set>
+#include <vector>
+#include <boost/thread.hpp>
+#include "../common/term_env.hpp"
+#include "../common/utime.hpp"
+#include "../db/triedb.hpp"
+#include "../global/meta_entry.hpp"
+#include "../interp/interpreter_base.hpp"
+
+namespace epilog { namespace node {
+
+class self_node;
+class out_connection;
+class task_execute_query;
+
+//
+// What the pipeline needs from the node: peers to send queries to and
+// the local databases. node_sync_transport (below) uses the standard
+// out connections and the blockchain of the node.
+//
+// Peers and requests are opaque. A request is valid until its result
+// is taken or it is abandoned, or until its peer is no longer among
+// the peers.
+//
+class sync_transport {
+public:
+    using term = common::term;
+    using con_cell = common::con_cell;
+    using interpreter_base = interp::interpreter_base;
+    typedef void * peer_t;
+    typedef void * request_t;
+
+    virtual ~sync_transport() { }
+
+    // Called once per tick
+    virtual void get_peers(std::vector<peer_t> &peers) = 0;
+    virtual bool is_connected(peer_t peer) = 0;
+
+    // nullptr if it cannot be sent now
+    virtual request_t send(peer_t peer, interpreter_base &interp, term query) = 0;
+    virtual bool is_ready(request_t req) = 0;
+    // The answered query copied to 'interp' (term() if it failed)
+    virtual term take_result(request_t req, interpreter_base &interp) = 0;
+    // We're no longer interested in the result
+    virtual void abandon(peer_t peer, request_t req) = 0;
+
+    // Local databases
+    virtual const db::triedb * get_db(con_cell db_name, const global::meta_id &root) = 0;
+    virtual uint64_t num_entries(con_cell db_name, const global::meta_id &root) = 0;
+    virtual void apply(con_cell db_name, const global::meta_id &root, const db::merkle_root &part) = 0;
+};
+
+class node_sync_transport : public sync_transport {
+public:
+    node_sync_transport(self_node *self) : self_(self) { }
+
+    virtual void get_peers(std::vector<peer_t> &peers) override;
+    virtual bool is_connected(peer_t peer) override;
+    virtual request_t send(peer_t peer, interpreter_base &interp, term query) override;
+    virtual bool is_ready(request_t req) override;
+    virtual term take_result(request_t req, interpreter_base &interp) override;
+    virtual void abandon(peer_t peer, request_t req) override;
+
+    virtual const db::triedb * get_db(con_cell db_name, const global::meta_id &root) override;
+    virtual uint64_t num_entries(con_cell db_name, const global::meta_id &root) override;
+    virtual void apply(con_cell db_name, const global::meta_id &root, const db::merkle_root &part) override;
+
+private:
+    bool is_alive(out_connection *conn) const;
+
+    self_node *self_;
+    std::vector<out_connection *> connections_;
+    std::vector<std::pair<task_execute_query *, out_connection *> > abandoned_;
+};
+
+//
+// Native state sync of the symbols, program, closure and heap
+// databases (driven by db_pipeline/5 in sync_impl.)
+//
+// The key space is split into ranges of 'step' keys. Up to 'window'
+// ranges are requested at once, spread over all peers. Received
+// merkle parts are verified on a pool of threads and applied in key
+// order, so the low watermark only passes ranges that are in the
+// database (and a restart can resume from it.)
+//
+// run() never blocks; it's called once per sync tick.
+//
+class sync_pipeline {
+public:
+    using term = common::term;
+    using utime = common::utime;
+    using interpreter_base = interp::interpreter_base;
+    typedef sync_transport::peer_t peer_t;
+    typedef sync_transport::request_t request_t;
+
+    struct params {
+	params() : num_entries(0), low(0), step(1), timeout_millis(100000) { }
+	uint64_t num_entries;     // Number of entries in the remote DB
+	db::node_hash expected;   // Expected DB root hash
+	uint64_t low;             // Low watermark
+	uint64_t step;            // Keys per request
+	uint64_t timeout_millis;
+    };
+
+    sync_pipeline(self_node *self);
+    // Takes ownership of the transport
+    sync_pipeline(sync_transport *transport);
+    ~sync_pipeline();
+
+    inline void set_num_threads(size_t n) { num_threads_ = n == 0 ? 1 : n; }
+    inline size_t num_threads() const { return num_threads_; }
+    inline void set_window(size_t n) { window_ = n == 0 ? 1 : n; }
+    inline size_t window() const { return window_; }
+    inline void set_per_connection(size_t n) { per_connection_ = n == 0 ? 1 : n; }
+
+    // Returns true when the database is complete. 'interp' holds the
+    // queries and the results.
+    bool run(interpreter_base &interp, common::con_cell db_name,
+	     const global::meta_id &root, const params &p);
+
+    inline uint64_t low() const { return low_; }
+
+    void stop();
+
+private:
+    enum range_state { WAITING, ISSUED, VERIFYING, VERIFIED };
+
+    struct range {
+	uint64_t from, to;
+	range_state state;
+	size_t generation;
+	request_t task;
+	peer_t conn;
+	peer_t failed_conn;
+	bool bin;
+	utime issued;
+	size_t fails;
+	const db::triedb *db;
+	std::unique_ptr<db::merkle_root> tree;
+	bool ok;
+	size_t num_keys;
+    };
+    typedef std::shared_ptr<range> range_ptr;
+
+    void reset(common::con_cell db_name,
+	       const global::meta_id &root, const params &p);
+    void start_threads();
+    void verify_worker();
+
+    bool is_alive(peer_t conn) const;
+    void update_connections();
+    void abandon(request_t task, peer_t conn);
+    void fail(range &r);
+    void done_with(peer_t conn);
+
+    void collect_results(interpreter_base &interp);
+    void collect_scan(interpreter_base &interp);
+    void collect_verified();
+    bool apply();
+    bool is_complete();
+    void fill_window();
+    void issue(interpreter_base &interp);
+    void issue_scan(interpreter_base &interp);
+    peer_t pick_connection(peer_t avoid);
+    request_t schedule(interpreter_base &interp, peer_t conn, term query);
+    term tree_of(interpreter_base &interp, request_t task);
+
+    std::unique_ptr<sync_transport> transport_;
+    size_t num_threads_;
+    size_t window_;
+    size_t per_connection_;
+
+    // Current job
+    common::con_cell db_name_;
+    global::meta_id root_;
+    params params_;
+    const db::triedb *db_;
+    size_t generation_;
+    uint64_t low_;
+    uint64_t next_;
+    bool at_end_;
+    bool need_scan_;
+    std::map<uint64_t, range_ptr> ranges_;
+
+    // Scan for the next key after an empty range
+    request_t scan_task_;
+    peer_t scan_conn_;
+    uint64_t scan_from_;
+    utime scan_issued_;
+
+    std::vector<peer_t> connections_;
+    std::map<peer_t, size_t> in_flight_;
+    std::map<peer_t, size_t> failures_;
+    // Peers that don't have db_get_bin/5 (older versions)
+    std::set<peer_t> no_bin_;
+
+    // Verification
+    boost::thread_group threads_;
+    bool threads_started_;
+    bool stop_threads_;
+    boost::mutex verify_lock_;
+    boost::condition_variable verify_cv_;
+    std::deque<range_ptr> verify_queue_;
+    std::vector<range_ptr> verified_;
+};
+
+}}
+
+#endif
@@ -6,9 +6,37 @@ using namespace epilog::common;
 
 namespace epilog { namespace node {
 
-task_init_connection::task_init_connection(out_connection *out) : out_task("init", out_task::TYPE_INIT_CONNECTION, out)
+task_init_connection::task_init_connection(out_connection *out) : out_task("init", out_task::TYPE_INIT_CONNECTION, out), negotiating_(NEGOTIATE_NONE)
 { }
 
+void task_init_connection::connected()
+{
+    connection().set_connected(true);
+    self().successful_connection(ip());
+    if (connection().use_heartbeat()) {
+	auto infotask = connection().create_info_task();
+	connection().schedule(infotask);
+	auto hbtask = connection().create_heartbeat_task();
+	connection().schedule(hbtask);
+	auto pubtask = connection().create_publish_task();
+	connection().schedule(pubtask);
+    }
+}
+
+void task_init_connection::negotiate()
+{
+    if (negotiating_ < NEGOTIATE_FRAMED && connection().use_framed()) {
+	negotiating_ = NEGOTIATE_FRAMED;
+    } else if (negotiating_ < NEGOTIATE_ENCODING && connection().use_compact()) {
+	negotiating_ = NEGOTIATE_ENCODING;
+    } else {
+	negotiating_ = NEGOTIATE_DONE;
+	connected();
+	return;
+    }
+    connection().schedule(this);
+}
+
 void task_init_connection::process()
 {
     static const con_cell ok("ok", 1);
@@ -21,6 +49,19 @@ void task_init_connection::process()
 	break;
     case RECEIVED: {
 	term t = get_term();
+	if (negotiating_ != NEGOTIATE_NONE) {
+	    // Old nodes don't recognize the commands and reply with an
+	    // error, in which case we stay with what we have.
+	    if (t.tag() == tag_t::STR && e.functor(t) == ok) {
+		if (negotiating_ == NEGOTIATE_FRAMED) {
+		    connection().set_framed_accepted();
+		} else if (negotiating_ == NEGOTIATE_ENCODING) {
+		    connection().set_encoding(term_serializer::FORMAT_COMPACT);
+		}
+	    }
+	    negotiate();
+	    break;
+	}
 	if (t.tag() != tag_t::STR) {
 	    error(reason_t::ERROR_FAIL_CONNECT,
 		 "Unexpected response for init connection: "
@@ -60,21 +101,22 @@ void task_init_connection::process()
 	    connection().set_name(e.atom_name(name_term));
 	    connection().schedule(this);
 	} else {
-	    connection().set_connected(true);
-	    self().successful_connection(ip());
-	    if (connection().use_heartbeat()) {
-		auto infotask = connection().create_info_task();
-		connection().schedule(infotask);
-		auto hbtask = connection().create_heartbeat_task();
-		connection().schedule(hbtask);
-		auto pubtask = connection().create_publish_task();
-		connection().schedule(pubtask);
-	    }
+	    negotiate();
 	}
 	break;
         }
     case SEND:
-	if (connection().id().empty()) {
+	if (negotiating_ == NEGOTIATE_FRAMED) {
+	    set_term(
+		  e.new_term(con_cell("command",1),
+			{e.new_term(con_cell("framed",1),
+			    {int_cell(connection::FRAMED_PROTOCOL_VERSION)})}));
+	} else if (negotiating_ == NEGOTIATE_ENCODING) {
+	    set_term(
+		  e.new_term(con_cell("command",1),
+			{e.new_term(con_cell("encoding",1),
+				    {con_cell("compact",0)})}));
+	} else if (connection().id().empty()) {
 	    set_term(
 		  e.new_term(con_cell("command",1), {con_cell("new",0)}));
 	} else if (!connection().is_connected()) {
@@ -14,6 +14,13 @@ public:
 
 private:
     virtual void process() override;
+    void connected();
+    void negotiate();
+
+    // Optional protocol features asked for after the handshake
+    enum negotiate_t { NEGOTIATE_NONE, NEGOTIATE_FRAMED,
+		       NEGOTIATE_ENCODING, NEGOTIATE_DONE };
+    negotiate_t negotiating_;
 };
 
 }}
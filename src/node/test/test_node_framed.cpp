@@ -0,0 +1,111 @@
+#include <common/test/test_home_dir.hpp>
+#include <common/term_tools.hpp>
+#include <node/self_node.hpp>
+#include <node/session.hpp>
+#include <node/task_execute_query.hpp>
+
+using namespace epilog::common;
+using namespace epilog::node;
+using namespace epilog::global;
+
+static void header( const std::string &str )
+{
+    std::cout << "\n";
+    std::cout << "--- [" + str + "] " + std::string(60 - str.length(), '-') << "\n";
+    std::cout << "\n";
+}
+
+static std::string test_dir;
+
+static out_connection * wait_for_connection(out_connection *out, bool framed)
+{
+    for (size_t i = 0; i < 100; i++) {
+	if (out->is_connected() && out->is_framed() == framed) {
+	    return out;
+	}
+	utime::sleep(utime::ms(100));
+    }
+    return nullptr;
+}
+
+//
+// Issue 'n' queries X = i on a loop-back connection without waiting
+// in between, then check every result against its query. Returns
+// the number of round-trips per second.
+//
+static uint64_t run_round_trips(bool framed, size_t n)
+{
+    global::erase_db(test_dir);
+
+    self_node self(test_dir);
+    self.set_framed_protocol(framed);
+    self.set_timer_interval(utime::ss(1));
+    self.start();
+
+    auto *out = self.new_standard_out_connection(
+			 ip_service("127.0.0.1", self_node::DEFAULT_PORT));
+    out->set_use_heartbeat(false);
+    out = wait_for_connection(out, framed);
+    assert(out != nullptr);
+
+    term_env env;
+    auto where = out->ip().str();
+    std::vector<task_execute_query *> tasks;
+
+    auto start = utime::now();
+    for (size_t i = 0; i < n; i++) {
+	auto query = env.new_term(con_cell("=",2),
+				  {env.new_ref(), int_cell(static_cast<int64_t>(i))});
+	auto *task = self.schedule_execute_query(query, nullptr, env, where,
+						 epilog::interp::MODE_NORMAL);
+	assert(task != nullptr);
+	tasks.push_back(task);
+    }
+    for (size_t i = 0; i < n; i++) {
+	auto *task = tasks[i];
+	task->wait_for_result();
+	assert(!task->failed());
+	uint64_t cost = 0;
+	auto result = env.copy(task->get_result(), task->env(), cost);
+	task->consume_result();
+	auto expect = std::to_string(i) + " = " + std::to_string(i);
+	if (env.to_string(result) != expect) {
+	    std::cout << "ACTUAL: " << env.to_string(result) << std::endl;
+	    std::cout << "EXPECT: " << expect << std::endl;
+	    assert(env.to_string(result) == expect);
+	}
+    }
+    auto end = utime::now();
+
+    self.stop();
+    self.join();
+
+    auto us = (end - start).in_us();
+    return us == 0 ? 0 : n * 1000000 / us;
+}
+
+static void test_node_framed()
+{
+    header("test_node_framed()");
+
+    // Both modes must produce the same results; the framed one
+    // keeps up to out_connection::DEFAULT_MAX_IN_FLIGHT queries
+    // on the socket.
+    const size_t N = 2000;
+    auto legacy = run_round_trips(false, N);
+    auto framed = run_round_trips(true, N);
+
+    std::cout << "Queries: " << N << std::endl;
+    std::cout << "Single-shot: " << std::setw(8) << legacy << " round-trips/s" << std::endl;
+    std::cout << "Framed:      " << std::setw(8) << framed << " round-trips/s" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    std::string home_dir = find_home_dir(argv[0]);
+    test_dir = (boost::filesystem::path(home_dir) / "bin" / "test" / "node" / "triedb").string();
+
+    test_node_framed();
+
+    return 0;
+}
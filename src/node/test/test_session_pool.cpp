@@ -0,0 +1,145 @@
+#include <fstream>
+#include <common/test/test_home_dir.hpp>
+#include <common/term_tools.hpp>
+#include <node/self_node.hpp>
+#include <node/session.hpp>
+
+using namespace epilog::common;
+using namespace epilog::node;
+using namespace epilog::global;
+
+static void header( const std::string &str )
+{
+    std::cout << "\n";
+    std::cout << "--- [" + str + "] " + std::string(60 - str.length(), '-') << "\n";
+    std::cout << "\n";
+}
+
+static std::string test_dir;
+
+// Create a session and run a first query on it, returns the elapsed
+// time in microseconds.
+static uint64_t first_query(self_node &self, bool warm)
+{
+    auto start = utime::now();
+    auto *ss = warm ? self.new_warm_in_session(nullptr, false)
+	            : self.new_in_session(nullptr, false);
+    auto &e = ss->env();
+    auto query = e.new_term(con_cell("=",2), {e.new_ref(), int_cell(42)});
+    bool r = ss->execute(query, true);
+    auto end = utime::now();
+    assert(r);
+    assert(e.to_string(query) == "42 = 42");
+    self.kill_in_session(ss);
+    return (end - start).in_us();
+}
+
+static void wait_for_warm_sessions(self_node &self, size_t n)
+{
+    for (size_t i = 0; i < 100 && self.num_warm_sessions(false) < n; i++) {
+	utime::sleep(utime::ms(100));
+    }
+    assert(self.num_warm_sessions(false) == n);
+}
+
+// Run 'query' on a new session and return the answer (or "error")
+static std::string answer(self_node &self, bool warm, bool is_root,
+			  const std::string &query)
+{
+    auto *ss = warm ? self.new_warm_in_session(nullptr, is_root)
+	            : self.new_in_session(nullptr, is_root);
+    auto &e = ss->env();
+    std::string result;
+    try {
+	auto t = e.parse(query);
+	result = ss->execute(t, true) ? e.to_string(t) : "false";
+    } catch (const std::exception &) {
+	result = "error";
+    }
+    assert(ss->id().size() > 1 && ss->id()[0] == 's');
+    self.kill_in_session(ss);
+    return result;
+}
+
+static void test_session_pool_same()
+{
+    header("test_session_pool_same()");
+
+    global::erase_db(test_dir);
+
+    self_node self(test_dir);
+    // Root sessions load the startup file
+    {
+	boost::filesystem::create_directories(test_dir);
+	std::ofstream startup((boost::filesystem::path(test_dir) / "startup.pl").string());
+	startup << "hello(world)." << std::endl;
+    }
+    self.set_grant_root_for_local(true);
+    self.set_session_pool_size(2);
+    self.set_timer_interval(utime::ss(1));
+    self.start();
+
+    const std::vector<std::string> queries = {
+	"hello(X).",
+	"append([1,2],[3],X).",
+	"X = 42."
+    };
+    for (bool is_root : {false, true}) {
+	for (auto &q : queries) {
+	    auto fresh = answer(self, false, is_root, q);
+	    for (size_t i = 0; i < 100 && self.num_warm_sessions(is_root) == 0; i++) {
+		utime::sleep(utime::ms(100));
+	    }
+	    assert(self.num_warm_sessions(is_root) > 0);
+	    auto warm = answer(self, true, is_root, q);
+	    std::cout << (is_root ? "root: " : "user: ") << q << " "
+		      << fresh << " / " << warm << std::endl;
+	    assert(fresh == warm);
+	}
+    }
+    assert(answer(self, true, true, "hello(X).") == "hello(world)");
+
+    self.stop();
+    self.join();
+
+    boost::filesystem::remove(boost::filesystem::path(test_dir) / "startup.pl");
+}
+
+static void test_session_pool()
+{
+    header("test_session_pool()");
+
+    global::erase_db(test_dir);
+
+    const size_t N = 10;
+
+    self_node self(test_dir);
+    self.set_session_pool_size(2);
+    self.set_timer_interval(utime::ss(1));
+    self.start();
+
+    uint64_t cold = 0, warm = 0;
+    for (size_t i = 0; i < N; i++) {
+	cold += first_query(self, false);
+	wait_for_warm_sessions(self, 2);
+	warm += first_query(self, true);
+    }
+
+    self.stop();
+    self.join();
+
+    std::cout << "Sessions: " << N << std::endl;
+    std::cout << "Cold: " << std::setw(8) << cold / N << " us to first result" << std::endl;
+    std::cout << "Warm: " << std::setw(8) << warm / N << " us to first result" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    std::string home_dir = find_home_dir(argv[0]);
+    test_dir = (boost::filesystem::path(home_dir) / "bin" / "test" / "node" / "triedb").string();
+
+    test_session_pool();
+    test_session_pool_same();
+
+    return 0;
+}
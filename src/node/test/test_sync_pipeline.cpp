@@ -0,0 +1,422 @@
+#include <common/test/test_home_dir.hpp>
+#include <common/utime.hpp>
+#include <common/random.hpp>
+#include <set>
+#include <boost/filesystem.hpp>
+#include <interp/interpreter.hpp>
+#include <node/sync_pipeline.hpp>
+#include <node/local_interpreter.hpp>
+
+using namespace epilog::common;
+using namespace epilog::db;
+using namespace epilog::node;
+using epilog::interp::interpreter;
+
+static void header( const std::string &str )
+{
+    std::cout << "\n";
+    std::cout << "--- [" + str + "] " + std::string(60 - str.length(), '-') << "\n";
+    std::cout << "\n";
+}
+
+static std::string test_dir;
+
+struct custom_data_leaf {
+    uint8_t data[16];
+};
+
+//
+// A stub transport. The peers answer db_get_bin/5, db_get/5 and
+// db_keys/5 from a "remote" triedb (like the real peers do) and the
+// pipeline fills a local triedb. Peers can be slow, fail, send
+// garbage, disconnect, never answer or lack db_get_bin/5.
+//
+class stub_transport : public sync_transport {
+public:
+    struct peer {
+	peer() : delay(0), fails(false), corrupt(false), silent(false),
+		 old(false), disconnect_after(0), connected(true),
+		 num_sent(0) { }
+	size_t delay;            // Ticks before the answer is ready
+	bool fails;
+	bool corrupt;
+	bool silent;
+	bool old;                // No db_get_bin/5
+	size_t disconnect_after; // Disconnect after this many queries
+	bool connected;
+	size_t num_sent;
+    };
+
+    struct request {
+	peer *p;
+	bool scan;
+	bool bin;
+	uint64_t from, to;
+	size_t ready_at;
+	bool taken;
+	bool abandoned;
+    };
+
+    stub_transport(triedb &remote, const root_id &remote_root, triedb &local)
+	: remote_(remote), remote_root_(remote_root), local_(local),
+	  tick_(0), num_get_(0), num_get_term_(0), num_retries_(0),
+	  num_scan_(0), num_abandoned_(0),
+	  last_applied_(0) { }
+
+    peer & add_peer() {
+	peers_.push_back(std::unique_ptr<peer>(new peer()));
+	return *peers_.back();
+    }
+
+    const root_id & local_root() const { return local_root_; }
+    size_t num_get() const { return num_get_; }
+    size_t num_get_term() const { return num_get_term_; }
+    size_t num_retries() const { return num_retries_; }
+    size_t num_scan() const { return num_scan_; }
+    size_t num_abandoned() const { return num_abandoned_; }
+    size_t num_applied() const { return applied_.size(); }
+
+    virtual void get_peers(std::vector<peer_t> &peers) override {
+	tick_++;
+	for (auto &p : peers_) {
+	    if (p->connected) peers.push_back(p.get());
+	}
+    }
+
+    virtual bool is_connected(peer_t p) override {
+	return static_cast<peer *>(p)->connected;
+    }
+
+    virtual request_t send(peer_t p0, interpreter_base &interp, term query) override {
+	auto *p = static_cast<peer *>(p0);
+	assert(p->connected);
+	std::unique_ptr<request> req(new request());
+	req->p = p;
+	req->scan = interp.functor(query) == interp.functor("db_keys", 5);
+	req->bin = interp.functor(query) == interp.functor("db_get_bin", 5);
+	assert(req->scan || req->bin || interp.functor(query) == interp.functor("db_get", 5));
+	auto from = interp.arg(query, 2), to = interp.arg(query, 3);
+	req->from = reinterpret_cast<int_cell &>(from).value();
+	req->to = reinterpret_cast<int_cell &>(to).value();
+	req->ready_at = tick_ + p->delay;
+	req->taken = false;
+	req->abandoned = false;
+	if (req->scan) {
+	    num_scan_++;
+	} else if (!req->bin) {
+	    num_get_++;
+	    num_get_term_++;
+	} else {
+	    num_get_++;
+	    if (!requested_.insert(req->from).second) num_retries_++;
+	}
+	if (p->disconnect_after != 0 && ++p->num_sent == p->disconnect_after) {
+	    p->connected = false;
+	}
+	requests_.push_back(std::move(req));
+	return requests_.back().get();
+    }
+
+    virtual bool is_ready(request_t req0) override {
+	auto *req = static_cast<request *>(req0);
+	assert(req->p->connected && !req->taken && !req->abandoned);
+	return !req->p->silent && tick_ >= req->ready_at;
+    }
+
+    virtual term take_result(request_t req0, interpreter_base &interp) override {
+	auto *req = static_cast<request *>(req0);
+	assert(!req->taken && !req->abandoned);
+	req->taken = true;
+	if (req->p->fails || (req->p->old && req->bin)) {
+	    return term();
+	}
+
+	merkle_root mtree;
+	term tree;
+	if (req->scan || !req->bin) {
+	    if (req->scan) mtree.set_num_keys(req->to);
+	    remote_.get(remote_root_, req->from,
+			req->scan ? std::numeric_limits<uint64_t>::max() : req->to,
+			true, mtree);
+	    tree = me_builtins::build_tree_term(interp, &mtree, 0);
+	} else {
+	    remote_.get(remote_root_, req->from, req->to, true, mtree);
+	    std::vector<uint8_t> bytes;
+	    mtree.write(bytes);
+	    if (req->p->corrupt) {
+		bytes[bytes.size() / 2] ^= 0xff;
+	    }
+	    tree = interp.new_big(&bytes[0], bytes.size());
+	}
+	auto name = req->scan ? interp.functor("db_keys", 5)
+	    : req->bin ? interp.functor("db_get_bin", 5)
+	               : interp.functor("db_get", 5);
+	return interp.new_term(name, { interp.EMPTY_LIST, interp.EMPTY_LIST,
+		    int_cell(static_cast<int64_t>(req->from)),
+		    int_cell(static_cast<int64_t>(req->to)), tree });
+    }
+
+    virtual void abandon(peer_t, request_t req0) override {
+	auto *req = static_cast<request *>(req0);
+	assert(!req->taken && !req->abandoned);
+	req->abandoned = true;
+	num_abandoned_++;
+    }
+
+    virtual const triedb * get_db(con_cell, const epilog::global::meta_id &) override {
+	return &local_;
+    }
+
+    virtual uint64_t num_entries(con_cell, const epilog::global::meta_id &) override {
+	return local_root_.is_zero() ? 0 : local_.num_entries(local_root_);
+    }
+
+    // Parts must arrive in key order. A part may hold more leaves
+    // than its range, but its lowest key never goes down.
+    virtual void apply(con_cell, const epilog::global::meta_id &, const merkle_root &part) override {
+	std::vector<uint64_t> keys;
+	part.get_keys(0, std::numeric_limits<size_t>::max(), keys);
+	if (!keys.empty()) {
+	    auto lowest = *std::min_element(keys.begin(), keys.end());
+	    assert(lowest >= last_applied_);
+	    last_applied_ = lowest;
+	}
+	applied_.insert(keys.begin(), keys.end());
+	if (local_root_.is_zero()) {
+	    local_root_ = local_.new_root();
+	}
+	local_.update(local_root_, part);
+    }
+
+private:
+    triedb &remote_;
+    root_id remote_root_;
+    triedb &local_;
+    root_id local_root_;
+    size_t tick_;
+    std::vector<std::unique_ptr<peer> > peers_;
+    std::vector<std::unique_ptr<request> > requests_;
+    size_t num_get_, num_get_term_, num_retries_, num_scan_, num_abandoned_;
+    std::set<uint64_t> requested_;
+    uint64_t last_applied_;
+    std::set<uint64_t> applied_;
+};
+
+static root_id build_remote(triedb &remote, const std::vector<uint64_t> &keys)
+{
+    auto at_root = remote.new_root();
+    for (size_t i = 0; i < keys.size(); i++) {
+	custom_data_leaf data;
+	for (size_t j = 0; j < sizeof(data.data); j++) {
+	    data.data[j] = static_cast<uint8_t>(i + j);
+	}
+	remote.insert(at_root, keys[i], reinterpret_cast<uint8_t *>(&data), sizeof(data));
+    }
+    return at_root;
+}
+
+static std::vector<uint64_t> dense_keys(size_t n)
+{
+    std::vector<uint64_t> keys;
+    for (size_t i = 0; i < n; i++) {
+	keys.push_back(i);
+    }
+    return keys;
+}
+
+//
+// Run the pipeline until it's done (or give up.) The low watermark may
+// never move backwards.
+//
+static void run_to_end(sync_pipeline &pipeline, triedb &remote, const root_id &remote_root,
+		       uint64_t step, uint64_t timeout_millis = 100000)
+{
+    sync_pipeline::params p;
+    p.num_entries = remote.num_entries(remote_root);
+    p.expected = remote.get_root_hash(remote_root);
+    p.step = step;
+    p.timeout_millis = timeout_millis;
+
+    epilog::global::meta_id root;
+    con_cell db_name("heap", 0);
+
+    // Each tick is a query on the node, so nothing on the heap outlives
+    // it. Here nothing reclaims the heap; start over now and then.
+    std::unique_ptr<interpreter> interp;
+    uint64_t low = 0;
+    bool done = false;
+    for (size_t i = 0; i < 20000 && !done; i++) {
+	if (i % 100 == 0) {
+	    interp.reset(new interpreter("test"));
+	}
+	done = pipeline.run(*interp, db_name, root, p);
+	assert(pipeline.low() >= low);
+	low = pipeline.low();
+	if (!done) {
+	    utime::sleep(utime::ms(1));
+	}
+    }
+    assert(done);
+}
+
+static void check_same(stub_transport &transport, triedb &local, triedb &remote, const root_id &remote_root)
+{
+    auto &local_root = transport.local_root();
+    std::cout << "Entries: local=" << local.num_entries(local_root)
+	      << " remote=" << remote.num_entries(remote_root) << std::endl;
+    assert(local.num_entries(local_root) == remote.num_entries(remote_root));
+    assert(local.get_root_hash(local_root) == remote.get_root_hash(remote_root));
+}
+
+static void test_in_order()
+{
+    header("test_in_order");
+
+    triedb::erase_all(test_dir + "/remote");
+    triedb::erase_all(test_dir + "/local");
+    triedb remote(test_dir + "/remote");
+    triedb local(test_dir + "/local");
+    auto remote_root = build_remote(remote, dense_keys(1000));
+
+    auto *transport = new stub_transport(remote, remote_root, local);
+    transport->add_peer();
+    transport->add_peer();
+
+    sync_pipeline pipeline(transport);
+    pipeline.set_num_threads(2);
+    run_to_end(pipeline, remote, remote_root, 50);
+
+    std::cout << "Requests: " << transport->num_get() << std::endl;
+    assert(transport->num_get() >= 1000 / 50);
+    assert(transport->num_retries() == 0);
+    assert(transport->num_applied() == 1000);
+    check_same(*transport, local, remote, remote_root);
+}
+
+static void test_reorder()
+{
+    header("test_reorder");
+
+    triedb::erase_all(test_dir + "/remote");
+    triedb::erase_all(test_dir + "/local");
+    triedb remote(test_dir + "/remote");
+    triedb local(test_dir + "/local");
+    auto remote_root = build_remote(remote, dense_keys(1000));
+
+    auto *transport = new stub_transport(remote, remote_root, local);
+    // The slow peer gets the lowest keys, so later ranges complete
+    // first and have to wait.
+    transport->add_peer().delay = 20;
+    transport->add_peer().delay = 0;
+
+    sync_pipeline pipeline(transport);
+    pipeline.set_num_threads(4);
+    pipeline.set_window(8);
+    run_to_end(pipeline, remote, remote_root, 25);
+
+    assert(transport->num_applied() == 1000);
+    check_same(*transport, local, remote, remote_root);
+}
+
+static void test_failures()
+{
+    header("test_failures");
+
+    triedb::erase_all(test_dir + "/remote");
+    triedb::erase_all(test_dir + "/local");
+    triedb remote(test_dir + "/remote");
+    triedb local(test_dir + "/local");
+    auto remote_root = build_remote(remote, dense_keys(1000));
+
+    auto *transport = new stub_transport(remote, remote_root, local);
+    transport->add_peer().fails = true;
+    transport->add_peer().corrupt = true;
+    transport->add_peer().silent = true;
+    transport->add_peer().disconnect_after = 3;
+    transport->add_peer().delay = 2;
+
+    sync_pipeline pipeline(transport);
+    pipeline.set_num_threads(2);
+    run_to_end(pipeline, remote, remote_root, 50, 20);
+
+    std::cout << "Requests: " << transport->num_get()
+	      << " abandoned: " << transport->num_abandoned() << std::endl;
+    // Every failure is retried elsewhere
+    assert(transport->num_retries() > 0);
+    // The silent peer times out
+    assert(transport->num_abandoned() > 0);
+    assert(transport->num_applied() == 1000);
+    check_same(*transport, local, remote, remote_root);
+}
+
+static void test_gap_scan()
+{
+    header("test_gap_scan");
+
+    triedb::erase_all(test_dir + "/remote");
+    triedb::erase_all(test_dir + "/local");
+    triedb remote(test_dir + "/remote");
+    triedb local(test_dir + "/local");
+    auto keys = dense_keys(200);
+    for (uint64_t k = 0; k < 50; k++) {
+	keys.push_back(1000000000 + k);
+    }
+    auto remote_root = build_remote(remote, keys);
+
+    auto *transport = new stub_transport(remote, remote_root, local);
+    transport->add_peer();
+    transport->add_peer().delay = 1;
+
+    sync_pipeline pipeline(transport);
+    pipeline.set_window(4);
+    run_to_end(pipeline, remote, remote_root, 16);
+
+    std::cout << "Requests: " << transport->num_get()
+	      << " scans: " << transport->num_scan() << std::endl;
+    // The gap is skipped, not requested range by range
+    assert(transport->num_scan() > 0);
+    assert(transport->num_get() < 100);
+    assert(transport->num_applied() == keys.size());
+    check_same(*transport, local, remote, remote_root);
+}
+
+static void test_old_peer()
+{
+    header("test_old_peer");
+
+    triedb::erase_all(test_dir + "/remote");
+    triedb::erase_all(test_dir + "/local");
+    triedb remote(test_dir + "/remote");
+    triedb local(test_dir + "/local");
+    auto remote_root = build_remote(remote, dense_keys(1000));
+
+    auto *transport = new stub_transport(remote, remote_root, local);
+    transport->add_peer().old = true;
+    transport->add_peer();
+
+    sync_pipeline pipeline(transport);
+    run_to_end(pipeline, remote, remote_root, 50);
+
+    std::cout << "Requests: " << transport->num_get()
+	      << " db_get: " << transport->num_get_term() << std::endl;
+    // The old peer is asked with db_get/5 after its first failure
+    assert(transport->num_get_term() > 0);
+    assert(transport->num_applied() == 1000);
+    check_same(*transport, local, remote, remote_root);
+}
+
+int main(int argc, char *argv[])
+{
+    auto home_dir = find_home_dir(argv[0]);
+    test_dir = (boost::filesystem::path(home_dir) / "bin" / "test" / "node" / "sync_pipeline").string();
+
+    random::set_for_testing(true);
+
+    test_in_order();
+    test_reorder();
+    test_failures();
+    test_gap_scan();
+    test_old_peer();
+
+    return 0;
+}
@@ -88,6 +88,10 @@ public:
     void init(size_t num_stars = 1 << (3*NumBits+3));
     void check();
     void memory() const;
+
+    inline size_t memory_size() const {
+	return stars_ != nullptr ? stars_->memory() : 0;
+    }
     void status() const;
 
     inline T step_vector_length() const {
@@ -162,7 +166,10 @@ template<size_t NumBits, typename T> void galaxy<NumBits,T>::init(size_t num_sta
     uint64_t chunk[3*N];
 
     num_stars_ = num_stars;
-    stars_ = new buckets_type();
+    // Reuse the buckets (they are cleared by set_keys())
+    if (stars_ == nullptr) {
+	stars_ = new buckets_type();
+    }
 
     for (size_t i = 0; i < num_stars; i += N) {
 	size_t nn = std::min(N, num_stars-i);
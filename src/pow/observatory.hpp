@@ -8,6 +8,8 @@
 #include "dipper_detector.hpp"
 #include "checked_cast.hpp"
 #include <boost/thread.hpp>
+#include <atomic>
+#include <limits>
 #include <fstream>
 #include <math.h>
 
@@ -17,7 +19,10 @@ namespace epilog { namespace pow {
 
 template<size_t N, typename T> class observatory {
 public:
-    inline observatory(const siphash_keys &keys) : keys_(keys), galaxy_(keys_) { init(); }
+    inline observatory(const siphash_keys &keys) : keys_(keys), galaxy_(keys_), num_workers_(0) { init(); }
+
+    // Only populate num_stars stars (as for init(num_stars).)
+    inline observatory(const siphash_keys &keys, size_t num_stars) : keys_(keys), galaxy_(keys_), num_workers_(0) { init(num_stars); }
 
     void init(size_t num_stars = 0);
 
@@ -37,6 +42,19 @@ public:
 
     size_t new_camera();
 
+    inline size_t num_cameras() const {
+	return cameras_.size();
+    }
+
+    // Number of threads scan() uses, 0 = one per hardware thread.
+    inline void set_num_workers(size_t n) {
+	num_workers_ = n;
+    }
+
+    inline size_t num_workers() const {
+	return num_workers_;
+    }
+
     inline star get_star(uint32_t id) const {
 	uint64_t out[3];
 	siphash(keys_, checked_cast<uint64_t>(3*id),
@@ -51,6 +69,10 @@ public:
     void status() const; 
     void memory() const; 
 
+    inline size_t memory_size() const {
+	return galaxy_.memory_size();
+    }
+
     size_t num_buckets() const;
     T step_vector_length() const;
 
@@ -74,6 +96,7 @@ private:
     siphash_keys keys_;
     galaxy<N, T> galaxy_;
     std::vector<camera<N, T> > cameras_;
+    size_t num_workers_;
 };
 
 template<size_t N, typename T> void observatory<N,T>::init(size_t num_stars)
@@ -133,54 +156,23 @@ template<size_t N, typename T> void observatory<N,T>::take_picture(std::vector<p
 
 template<size_t N, typename T> class worker_pool;
 
+//
+// A worker claims ranges of nonces from the pool and scans them with
+// its own camera until no range can hold a nonce smaller than the
+// smallest one found so far.
+//
 template<size_t N, typename T> class worker {
 public:
-    worker(worker_pool<N,T> &workers);
+    worker(worker_pool<N,T> &workers, size_t cam_id);
 
     worker(const worker &other) = delete;
     void operator = (const worker &other) = delete;
 
-    inline void join() {
-	
-    }
-
-    inline void kill() {
-	killed_ = true;
-	set_idle(false);
-    }
-
-    inline void wait_idle() const {
-    }
-
-    inline void set_idle(bool r) {
-	boost::unique_lock<boost::mutex> lockit(idle_lock_);
-	idle_ = r;
-	idle_cv_.notify_one();
-    }
-
     inline bool is_done() const {
 	return found_done_;
     }
-    
-    inline void set_nonce_range(size_t nonce_offset, size_t nonce_start, size_t nonce_end) {
-	nonce_offset_ = nonce_offset;
-	nonce_ = nonce_start;
-	nonce_start_ = nonce_start;
-	nonce_end_ = nonce_end;
-	found_done_ = false;
-	has_first_visible_ = false;
-	first_visible_.clear();
-    }
 
-    inline size_t nonce_start() const {
-        return nonce_start_;
-    }
-
-    inline size_t nonce_end() const {
-        return nonce_end_;
-    }
-  
-    inline size_t nonce() const {
+    inline uint32_t nonce() const {
 	return nonce_;
     }
 
@@ -192,15 +184,19 @@ public:
         return has_first_visible_;
     }
 
-    void set_target(uint64_t nonce_offset, uint32_t nonce);
-    void take_picture();
-    void run();
+    inline uint64_t num_pictures() const {
+	return num_pictures_;
+    }
 
     inline const std::vector<projected_star> & get_found() const {
 	return found_;
     }
 
+    void run();
+
 private:
+    bool scan_range(uint64_t nonce_start, uint64_t nonce_end);
+
     worker_pool<N,T> &workers_;
     std::vector<projected_star> stars_;
     std::vector<projected_star> found_;
@@ -208,202 +204,168 @@ private:
     bool has_first_visible_;
     dipper_detector detector_;
     size_t cam_id_;
-    bool idle_;
-    bool killed_;
-    boost::mutex idle_lock_;
-    boost::condition_variable idle_cv_;
-    size_t nonce_offset_, nonce_, nonce_start_, nonce_end_;
+    uint32_t nonce_;
     bool found_done_;
+    uint64_t num_pictures_;
 };
 
+//
+// Nonces are handed out in ranges of NONCE_RANGE by bumping an atomic
+// counter and the smallest nonce found is kept as an atomic minimum,
+// so the workers never wait on each other (or on a lock) while
+// scanning.
+//
 template<size_t N, typename T> class worker_pool {
 public:
-    static const size_t DEFAULT_NUM_WORKERS = 16;
-
-    worker_pool(observatory<N,T> &obs, size_t num_workers = DEFAULT_NUM_WORKERS) : observatory_(obs), num_workers_(num_workers), busy_count_(0) {
-	smallest_nonce_ = std::numeric_limits<size_t>::max();
-	for (size_t i = 0; i < num_workers_; i++) {
-	    auto *w = new worker<N,T>(*this);
-	    all_workers_.push_back(w);
-	    ready_workers_.push_back(w);
+    static const uint32_t NONCE_RANGE = 100;
+
+    // 0 workers means one per hardware thread.
+    worker_pool(observatory<N,T> &obs, size_t num_workers = 0) : observatory_(obs) {
+	if (num_workers == 0) {
+	    num_workers = default_num_workers();
 	}
-	for (auto *w : ready_workers_) {
-	    threads_.create_thread( [=]{w->run();} );
+	// All cameras are created up front; the workers only read them.
+	for (size_t i = 0; i < num_workers; i++) {
+	    auto cam_id = i + 1;
+	    while (observatory_.num_cameras() <= cam_id) {
+		observatory_.new_camera();
+	    }
+	    workers_.push_back(new worker<N,T>(*this, cam_id));
 	}
     }
 
-    void kill_all_workers() {
-	std::vector<worker<N,T> *> all_workers;
-	{
-	    boost::unique_lock<boost::mutex> lockit(workers_lock_);
-	    for (auto *w : all_workers_) {
-		all_workers.push_back(w);
-	    }
-	}
-	for (auto *w : all_workers) {
-	    w->kill();
+    ~worker_pool() {
+	for (auto *w : workers_) {
+	    delete w;
 	}
     }
 
-    size_t smallest_nonce() {
-	boost::unique_lock<boost::mutex> lockit(workers_lock_);
-	return smallest_nonce_;
+    static inline size_t default_num_workers() {
+	size_t n = boost::thread::hardware_concurrency();
+	return n == 0 ? 1 : n;
     }
 
-    void found_nonce(size_t nonce) {
-	boost::unique_lock<boost::mutex> lockit(workers_lock_);
-	if (nonce < smallest_nonce_) {
-	    smallest_nonce_ = nonce;
-	}
-    }
-    
-    worker<N,T> & find_ready_worker() {
-	boost::unique_lock<boost::mutex> lockit(workers_lock_);
-	while (busy_count_ == num_workers_) {
-	    workers_cv_.wait(lockit);
-	}
-	worker<N,T> *w = ready_workers_.back();
-	ready_workers_.pop_back();
-	busy_count_++;
-	return *w;
+    inline size_t num_workers() const {
+	return workers_.size();
     }
 
-    void wait_until_no_more_busy_workers() {
-	{
-	    boost::unique_lock<boost::mutex> lockit(workers_lock_);
-	    while (busy_count_ != 0) {
-		workers_cv_.wait(lockit);
+    // Scan nonces [0, nonce_end) and return the smallest nonce with a
+    // dipper (and the stars of it.)
+    bool search(uint64_t nonce_offset, uint64_t nonce_end, projected_star &first_visible, std::vector<projected_star> &found, uint32_t &nonce_out) {
+	nonce_offset_ = nonce_offset;
+	nonce_end_ = nonce_end;
+	next_nonce_ = 0;
+	smallest_nonce_ = std::numeric_limits<uint64_t>::max();
+
+	if (workers_.size() == 1) {
+	    workers_[0]->run();
+	} else {
+	    boost::thread_group threads;
+	    for (auto *w : workers_) {
+		threads.create_thread( [=]{w->run();} );
 	    }
+	    threads.join_all();
 	}
-	threads_.join_all();
-    }
 
-    worker<N,T> * find_successful_worker() {
-	worker<N,T> *best_worker = nullptr;
-	for (auto *worker : all_workers_) {
-	    if (worker->is_done()) {
-		if (best_worker == nullptr || worker->nonce() < best_worker->nonce()) {
-		    best_worker = worker;
-		}
+	first_visible.clear();
+	bool first_visible_found = false;
+	worker<N,T> *best = nullptr;
+	for (auto *w : workers_) {
+	    if (w->has_first_visible()) {
+		first_visible_found = true;
+		first_visible = w->first_visible();
+	    }
+	    if (w->is_done() && w->nonce() == smallest_nonce_) {
+		best = w;
 	    }
 	}
-	return best_worker;
+	if (best) {
+	    found = best->get_found();
+	    nonce_out = best->nonce();
+	}
+	return best != nullptr && first_visible_found;
     }
 
-    worker<N,T> * find_first_nonce_worker() {
-	for (auto *worker : all_workers_) {
-	    if (worker->has_first_visible()) {
-	        return worker;
-	    }
+    // Number of nonces looked at by the last search.
+    uint64_t num_pictures() const {
+	uint64_t n = 0;
+	for (auto *w : workers_) {
+	    n += w->num_pictures();
 	}
-	return nullptr;
+	return n;
     }
 
-    void add_ready_worker(worker<N,T> *w) {
-	boost::unique_lock<boost::mutex> lockit(workers_lock_);
-	busy_count_--;
-	ready_workers_.push_back(w);
-	workers_cv_.notify_all();
+private:
+    inline uint64_t claim_range() {
+	return next_nonce_.fetch_add(NONCE_RANGE);
+    }
+
+    inline uint64_t smallest_nonce() const {
+	return smallest_nonce_.load();
+    }
+
+    void found_nonce(uint64_t nonce) {
+	uint64_t current = smallest_nonce_.load();
+	while (nonce < current && !smallest_nonce_.compare_exchange_weak(current, nonce)) {
+	}
     }
 
-private:
     observatory<N,T> &observatory_;
-    size_t num_workers_;
-    std::vector<worker<N,T> *> all_workers_;
-    std::vector<worker<N,T> *> ready_workers_;
-    boost::mutex workers_lock_;
-    boost::condition_variable workers_cv_;
-    size_t busy_count_;
-    boost::thread_group threads_;
-    size_t smallest_nonce_;
+    std::vector<worker<N,T> *> workers_;
+    uint64_t nonce_offset_;
+    uint64_t nonce_end_;
+    std::atomic<uint64_t> next_nonce_;
+    std::atomic<uint64_t> smallest_nonce_;
 
     friend class worker<N,T>;
 };
 
-template<size_t N, typename T> worker<N,T>::worker(worker_pool<N,T> &workers) 
-    : workers_(workers), has_first_visible_(false), detector_(stars_), idle_(true), killed_(false), nonce_offset_(0), nonce_(0), nonce_end_(0), found_done_(false) {
-    cam_id_ = workers_.observatory_.new_camera();
-}
-
-template<size_t N, typename T> void worker<N,T>::set_target(uint64_t nonce_offset, uint32_t nonce) {
-    workers_.observatory_.set_target(nonce_offset, nonce, cam_id_);
-}
-
-template<size_t N, typename T> void worker<N,T>::take_picture() {
-    workers_.observatory_.take_picture(stars_, cam_id_);
+template<size_t N, typename T> worker<N,T>::worker(worker_pool<N,T> &workers, size_t cam_id)
+    : workers_(workers), has_first_visible_(false), detector_(stars_), cam_id_(cam_id), nonce_(0), found_done_(false), num_pictures_(0) {
 }
 
 template<size_t N, typename T> void worker<N,T>::run() {
+    has_first_visible_ = false;
+    first_visible_.clear();
+    found_done_ = false;
+    num_pictures_ = 0;
     for (;;) {
-	boost::unique_lock<boost::mutex> lockit(idle_lock_);
-	while (idle_ && !killed_) {
-	    idle_cv_.wait(lockit);
-	}
-	if (killed_) {
+	uint64_t nonce_start = workers_.claim_range();
+	if (nonce_start >= workers_.nonce_end_ || nonce_start >= workers_.smallest_nonce()) {
 	    break;
 	}
-	for (; nonce_ != nonce_end_ && nonce_ < workers_.smallest_nonce(); nonce_++) {
-	    set_target(nonce_offset_, nonce_);
-	    take_picture();
-	    if (nonce_ == 0 && stars_.size() >= 1) {
-	        has_first_visible_ = true;
-	        first_visible_ = stars_[0];
-	    }
-	    if (detector_.search(found_)) {
-	         workers_.found_nonce(nonce_);
-	         found_done_ = true;
-	         break;
-	    }
+	uint64_t nonce_end = std::min(nonce_start + worker_pool<N,T>::NONCE_RANGE, workers_.nonce_end_);
+	if (scan_range(nonce_start, nonce_end)) {
+	    // Any range claimed after this one starts at a larger nonce
+	    break;
 	}
-	idle_ = true;
-	workers_.add_ready_worker(this);
     }
 }
 
-template<size_t N, typename T> bool observatory<N,T>::scan(uint64_t nonce_offset, projected_star &first_visible, std::vector<projected_star> &found, uint32_t &nonce_out)
-{
-    worker_pool<N,T> workers(*this);
-
-    uint32_t nonce = 0, nonce_delta = 100;
-    bool first_visible_found = false;
-
-    first_visible.clear();
-
-    for (;;) {
-	auto &worker = workers.find_ready_worker();
-	if (worker.nonce_start() == 0) {
-	    if (worker.has_first_visible()) {
-	        first_visible_found = true;
-	        first_visible = worker.first_visible();
-	    }
-	}
-	if (worker.is_done()) {
-	    workers.add_ready_worker(&worker);
-	    break;
+template<size_t N, typename T> bool worker<N,T>::scan_range(uint64_t nonce_start, uint64_t nonce_end) {
+    auto &obs = workers_.observatory_;
+    for (uint64_t nonce = nonce_start; nonce < nonce_end && nonce < workers_.smallest_nonce(); nonce++) {
+	obs.set_target(workers_.nonce_offset_, static_cast<uint32_t>(nonce), cam_id_);
+	obs.take_picture(stars_, cam_id_);
+	num_pictures_++;
+	if (nonce == 0 && stars_.size() >= 1) {
+	    has_first_visible_ = true;
+	    first_visible_ = stars_[0];
 	}
-	worker.set_nonce_range(nonce_offset, nonce, nonce + nonce_delta);
-	nonce += nonce_delta;
-	worker.set_idle(false);
-    }
-    workers.kill_all_workers();
-    workers.wait_until_no_more_busy_workers();
-
-    if (!first_visible_found) {
-        if (auto *wn = workers.find_first_nonce_worker()) {
-	    if (wn->has_first_visible()) {
-	        first_visible_found = true;
-		first_visible = wn->first_visible();
-	    }
+	if (detector_.search(found_)) {
+	    nonce_ = static_cast<uint32_t>(nonce);
+	    found_done_ = true;
+	    workers_.found_nonce(nonce);
+	    return true;
 	}
     }
-    
-    auto *w = workers.find_successful_worker();
-    if (w) {
-	found = w->get_found();
-	nonce_out = w->nonce();
-    }
+    return false;
+}
 
-    return w != nullptr && first_visible_found;
+template<size_t N, typename T> bool observatory<N,T>::scan(uint64_t nonce_offset, projected_star &first_visible, std::vector<projected_star> &found, uint32_t &nonce_out)
+{
+    worker_pool<N,T> workers(*this, num_workers_);
+    return workers.search(nonce_offset, static_cast<uint64_t>(1) << 32, first_visible, found, nonce_out);
 }    
 
 #ifndef DIPPER_DONT_USE_NAMESPACE
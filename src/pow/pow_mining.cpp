@@ -6,6 +6,27 @@
 namespace epilog { namespace pow {
 #endif
 
+static std::atomic<size_t> mining_threads_(0);
+
+void set_mining_threads(size_t n) {
+    mining_threads_ = n;
+}
+
+size_t mining_threads() {
+    return mining_threads_;
+}
+
+void set_mining_galaxies(size_t n) {
+    observatory_cache::default_cache().set_max_observatories(n);
+}
+
+template<size_t N> static bool scan(observatory<N, double> *obs, uint64_t nonce_offset,
+		 projected_star &first_visible,
+		 std::vector<projected_star> &found, uint32_t &nonce) {
+    obs->set_num_workers(mining_threads());
+    return obs->scan(nonce_offset, first_visible, found, nonce);
+}
+
 static bool scan(void *obs, size_t super_difficulty, uint64_t nonce_offset,
 		 projected_star &first_visible,
 		 std::vector<projected_star> &found, uint32_t &nonce) {
@@ -13,11 +34,11 @@ static bool scan(void *obs, size_t super_difficulty, uint64_t nonce_offset,
 
     bool r = false;
     switch (super_difficulty) {
-    case 7: r = reinterpret_cast<observatory<7, double> *>(obs)->scan(
+    case 7: r = scan(reinterpret_cast<observatory<7, double> *>(obs),
    	          nonce_offset, first_visible, found, nonce); break;
-    case 8: r = reinterpret_cast<observatory<8, double> *>(obs)->scan(
+    case 8: r = scan(reinterpret_cast<observatory<8, double> *>(obs),
 	          nonce_offset, first_visible, found, nonce); break;
-    case 9: r = reinterpret_cast<observatory<9, double> *>(obs)->scan(
+    case 9: r = scan(reinterpret_cast<observatory<9, double> *>(obs),
 	          nonce_offset, first_visible, found, nonce); break;
     default: assert("Not implemented" == nullptr);
     }
@@ -28,30 +49,229 @@ static bool scan(void *obs, size_t super_difficulty, uint64_t nonce_offset,
     }
 }
 
+observatory_cache::observatory_cache(size_t max_observatories, size_t max_bytes)
+    : max_observatories_(max_observatories == 0 ? 1 : max_observatories),
+      max_bytes_(max_bytes), total_bytes_(0), hits_(0), misses_(0),
+      fail_next_populate_(false) {
+}
+
+observatory_cache::~observatory_cache() {
+    for (auto &e : entries_) {
+	delete_observatory(e.obs, e.super_difficulty);
+    }
+}
+
+observatory_cache & observatory_cache::default_cache() {
+    static observatory_cache cache;
+    return cache;
+}
+
+bool observatory_cache::same_keys(const siphash_keys &a, const siphash_keys &b) {
+    return a.k0() == b.k0() && a.k1() == b.k1() &&
+	   a.k2() == b.k2() && a.k3() == b.k3();
+}
+
+void * observatory_cache::new_observatory(const siphash_keys &keys, size_t super_difficulty) {
+    switch (super_difficulty) {
+    case 7: return new observatory<7, double>(keys);
+    case 8: return new observatory<8, double>(keys);
+    case 9: return new observatory<9, double>(keys);
+    default: assert("Not implemented" == nullptr); return nullptr;
+    }
+}
+
+void observatory_cache::delete_observatory(void *obs, size_t super_difficulty) {
+    switch (super_difficulty) {
+    case 7: delete reinterpret_cast<observatory<7, double> *>(obs); break;
+    case 8: delete reinterpret_cast<observatory<8, double> *>(obs); break;
+    case 9: delete reinterpret_cast<observatory<9, double> *>(obs); break;
+    }
+}
+
+void observatory_cache::set_keys(void *obs, const siphash_keys &keys, size_t super_difficulty) {
+    switch (super_difficulty) {
+    case 7: reinterpret_cast<observatory<7, double> *>(obs)->set_keys(keys); break;
+    case 8: reinterpret_cast<observatory<8, double> *>(obs)->set_keys(keys); break;
+    case 9: reinterpret_cast<observatory<9, double> *>(obs)->set_keys(keys); break;
+    }
+}
+
+size_t observatory_cache::memory_size(void *obs, size_t super_difficulty) {
+    switch (super_difficulty) {
+    case 7: return reinterpret_cast<observatory<7, double> *>(obs)->memory_size();
+    case 8: return reinterpret_cast<observatory<8, double> *>(obs)->memory_size();
+    case 9: return reinterpret_cast<observatory<9, double> *>(obs)->memory_size();
+    }
+    return 0;
+}
+
+void observatory_cache::set_max_observatories(size_t n) {
+    boost::lock_guard<boost::mutex> guard(lock_);
+    max_observatories_ = n == 0 ? 1 : n;
+    evict();
+}
+
+void observatory_cache::set_max_bytes(size_t max_bytes) {
+    boost::lock_guard<boost::mutex> guard(lock_);
+    max_bytes_ = max_bytes;
+    evict();
+}
+
+size_t observatory_cache::memory_size() {
+    boost::lock_guard<boost::mutex> guard(lock_);
+    return total_bytes_;
+}
+
+size_t observatory_cache::num_observatories() {
+    boost::lock_guard<boost::mutex> guard(lock_);
+    return entries_.size();
+}
+
+// Room for another one of 'bytes'? (There's always room for one.)
+bool observatory_cache::fits(size_t bytes) const {
+    if (entries_.empty()) {
+	return true;
+    }
+    return entries_.size() < max_observatories_ &&
+	(max_bytes_ == 0 || total_bytes_ + bytes <= max_bytes_);
+}
+
+void * observatory_cache::acquire(const siphash_keys &keys, size_t super_difficulty) {
+    boost::unique_lock<boost::mutex> lock(lock_);
+
+    for (;;) {
+	auto recycle = entries_.end();
+	for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+	    if (it->in_use || it->super_difficulty != super_difficulty) {
+		continue;
+	    }
+	    if (same_keys(it->keys, keys)) {
+		hits_++;
+		it->in_use = true;
+		entries_.splice(entries_.begin(), entries_, it);
+		return it->obs;
+	    }
+	    recycle = it;
+	}
+
+	size_t bytes = sizes_[super_difficulty];
+	if (fits(bytes)) {
+	    // Count it before it's populated
+	    misses_++;
+	    entries_.emplace_front(keys, super_difficulty);
+	    auto it = entries_.begin();
+	    auto &e = *it;
+	    e.in_use = true;
+	    e.bytes = bytes;
+	    total_bytes_ += bytes;
+	    bool fail = fail_next_populate_;
+	    fail_next_populate_ = false;
+	    lock.unlock();
+
+	    void *obs = nullptr;
+	    size_t actual = 0;
+	    try {
+		if (fail) {
+		    throw std::bad_alloc();
+		}
+		obs = new_observatory(keys, super_difficulty);
+		actual = memory_size(obs, super_difficulty);
+	    } catch (...) {
+		// Uncount it, or it'll block the others forever
+		lock.lock();
+		total_bytes_ -= e.bytes;
+		entries_.erase(it);
+		released_.notify_all();
+		throw;
+	    }
+
+	    lock.lock();
+	    e.obs = obs;
+	    total_bytes_ = total_bytes_ - e.bytes + actual;
+	    e.bytes = actual;
+	    sizes_[super_difficulty] = actual;
+	    return obs;
+	}
+
+	// Repopulate the least recently used one if another one wouldn't fit
+	if (recycle != entries_.end()) {
+	    misses_++;
+	    recycle->in_use = true;
+	    recycle->keys = keys;
+	    entries_.splice(entries_.begin(), entries_, recycle);
+	    void *obs = recycle->obs;
+	    lock.unlock();
+	    try {
+		set_keys(obs, keys, super_difficulty);
+	    } catch (...) {
+		// Half populated, drop it
+		lock.lock();
+		total_bytes_ -= recycle->bytes;
+		entries_.erase(recycle);
+		delete_observatory(obs, super_difficulty);
+		released_.notify_all();
+		throw;
+	    }
+	    return obs;
+	}
+
+	// Make room by dropping an idle one (of another super difficulty)
+	// or wait until one is released.
+	if (!evict_one()) {
+	    released_.wait(lock);
+	}
+    }
+}
+
+void observatory_cache::release(void *obs) {
+    boost::lock_guard<boost::mutex> guard(lock_);
+    for (auto &e : entries_) {
+	if (e.obs == obs) {
+	    e.in_use = false;
+	    break;
+	}
+    }
+    evict();
+    released_.notify_all();
+}
+
+// Drop the least recently used idle one
+bool observatory_cache::evict_one() {
+    for (auto it = entries_.end(); it != entries_.begin();) {
+	--it;
+	if (!it->in_use) {
+	    total_bytes_ -= it->bytes;
+	    delete_observatory(it->obs, it->super_difficulty);
+	    entries_.erase(it);
+	    return true;
+	}
+    }
+    return false;
+}
+
+void observatory_cache::evict() {
+    while ((entries_.size() > max_observatories_ ||
+	    (max_bytes_ != 0 && total_bytes_ > max_bytes_)) && evict_one()) {
+    }
+}
+
 bool search_proof(const siphash_keys &key, size_t super_difficulty, const pow_difficulty &difficulty, pow_proof &out_proof, bool simple) {
-    void *obs = nullptr;
+    return search_proof(observatory_cache::default_cache(), key, super_difficulty, difficulty, out_proof, simple);
+}
 
+bool search_proof(observatory_cache &cache, const siphash_keys &key, size_t super_difficulty, const pow_difficulty &difficulty, pow_proof &out_proof, bool simple) {
     class cleanup {
     public:
-        cleanup(size_t super_difficulty, void *obs) : super_difficulty_(super_difficulty), obs_(obs) { }
+        cleanup(observatory_cache &cache, void *obs) : cache_(cache), obs_(obs) { }
         ~cleanup() {
-	  switch (super_difficulty_) {
-	  case 7: delete reinterpret_cast<observatory<7, double> *>(obs_); break;
-	  case 8: delete reinterpret_cast<observatory<8, double> *>(obs_); break;
-	  case 9: delete reinterpret_cast<observatory<9, double> *>(obs_); break;
-	  }
+	    cache_.release(obs_);
         }
-        size_t super_difficulty_;
+        observatory_cache &cache_;
         void *obs_;
     };
-    
-    switch (super_difficulty) {
-    case 7: obs = new observatory<7, double>(key); break;
-    case 8: obs = new observatory<8, double>(key); break;
-    case 9: obs = new observatory<9, double>(key); break;
-    }
 
-    cleanup c(super_difficulty, obs);
+    void *obs = cache.acquire(key, super_difficulty);
+    cleanup c(cache, obs);
     
     uint32_t nonce_sum = 0;
     for (size_t proof_no = 0; proof_no < pow_proof::NUM_ROWS; proof_no++) {
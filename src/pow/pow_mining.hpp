@@ -3,6 +3,9 @@
 #ifndef _pow_mining_hpp
 #define _pow_mining_hpp
 
+#include <list>
+#include <map>
+#include <boost/thread.hpp>
 #include "siphash.hpp"
 #include "fxp.hpp"
 #include "pow_verifier.hpp"
@@ -11,7 +14,94 @@
 namespace epilog { namespace pow {
 #endif
 
+//
+// Populating an observatory (every bucket of its galaxy from siphash)
+// is the expensive part of a search. This keeps populated observatories
+// around, keyed by siphash keys and super difficulty, up to
+// 'max_observatories' of them and (if not 0) 'max_bytes' of galaxy
+// memory. A galaxy is big (about 2.3 GB at super difficulty 8), so by
+// default only one is kept.
+//
+// On a miss the least recently used idle observatory is repopulated
+// with the new keys (reusing its buckets) rather than allocating
+// another one, if the bounds would otherwise be exceeded. A new one is
+// counted (with the size of the last one of its super difficulty)
+// before it's populated, so concurrent misses can't overshoot; if all
+// of them are in use, acquire() waits for one to be released.
+//
+class observatory_cache {
+public:
+    static const size_t DEFAULT_MAX_OBSERVATORIES = 1;
+
+    observatory_cache(size_t max_observatories = DEFAULT_MAX_OBSERVATORIES,
+		      size_t max_bytes = 0);
+    ~observatory_cache();
+
+    inline size_t max_observatories() const { return max_observatories_; }
+    void set_max_observatories(size_t n);
+    inline size_t max_bytes() const { return max_bytes_; }
+    void set_max_bytes(size_t max_bytes);
+
+    // Returns an observatory<super_difficulty, double> populated for
+    // 'keys'. It is not shared until it is given back by release().
+    void * acquire(const siphash_keys &keys, size_t super_difficulty);
+    void release(void *obs);
+
+    size_t memory_size();
+    size_t num_observatories();
+    inline size_t num_hits() const { return hits_; }
+    inline size_t num_misses() const { return misses_; }
+
+    // For testing: populating the next observatory throws bad_alloc
+    inline void set_fail_next_populate(bool b) { fail_next_populate_ = b; }
+
+    // Shared by search_proof()
+    static observatory_cache & default_cache();
+
+private:
+    struct entry {
+	entry(const siphash_keys &k, size_t sd)
+	    : keys(k), super_difficulty(sd), obs(nullptr), bytes(0),
+	      in_use(false) { }
+	siphash_keys keys;
+	size_t super_difficulty;
+	void *obs;
+	size_t bytes;
+	bool in_use;
+    };
+
+    static bool same_keys(const siphash_keys &a, const siphash_keys &b);
+    static void * new_observatory(const siphash_keys &keys, size_t super_difficulty);
+    static void delete_observatory(void *obs, size_t super_difficulty);
+    static void set_keys(void *obs, const siphash_keys &keys, size_t super_difficulty);
+    static size_t memory_size(void *obs, size_t super_difficulty);
+
+    bool fits(size_t bytes) const;
+    bool evict_one();
+    void evict();
+
+    size_t max_observatories_;
+    size_t max_bytes_;
+    size_t total_bytes_;
+    size_t hits_, misses_;
+    bool fail_next_populate_;
+    boost::mutex lock_;
+    boost::condition_variable released_;
+    std::list<entry> entries_; // Most recently used first
+    std::map<size_t, size_t> sizes_; // Super difficulty -> bytes
+};
+
+// Number of threads a search uses, 0 (the default) means one per
+// hardware thread.
+void set_mining_threads(size_t n);
+size_t mining_threads();
+
+// Number of populated galaxies kept by the default cache (see
+// observatory_cache above.)
+void set_mining_galaxies(size_t n);
+
 bool search_proof(const siphash_keys &key, size_t super_difficulty, const pow_difficulty &difficulty, pow_proof &out_proof, bool simple);
+bool search_proof(observatory_cache &cache, const siphash_keys &key, size_t super_difficulty, const pow_difficulty &difficulty, pow_proof &out_proof, bool simple);
 
 #ifndef DIPPER_DONT_USE_NAMESPACE
 }}
@@ -9,6 +9,7 @@
 #include "observatory.hpp"
 #include "star.hpp"
 #include "pow_verifier.hpp"
+#include "pow_mining.hpp"
 #include "fxp.hpp"
 
 #include <iostream>
@@ -387,6 +388,7 @@ pow_server::pow_server(const std::string &address, const std::string &port,
 
     siphash_keys keys("hello42", 7);
     observatory_ = new observatory<8,arith_t>(keys);
+    set_num_threads(mining_threads());
 
     std::cout << "Galaxy initialized" << std::endl;
     o<8,arith_t>(observatory_).status();
@@ -423,6 +425,16 @@ bool pow_server::scan(uint64_t nonce_offset, projected_star &first_visible, std:
     return o<8,arith_t>(observatory_).scan(nonce_offset, first_visible, stars, nonce);
 }
 
+void pow_server::set_num_threads(size_t n)
+{
+    o<8,arith_t>(observatory_).set_num_workers(n);
+}
+
+size_t pow_server::num_threads() const
+{
+    return reinterpret_cast<const observatory<8,arith_t> *>(observatory_)->num_workers();
+}
+
 void pow_server::run()
 {
     io_service_.run();
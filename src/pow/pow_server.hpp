@@ -137,6 +137,10 @@ public:
     vec3<arith_t> get_target() const;
     bool scan(uint64_t nonce_offset, projected_star &first_visible, std::vector<projected_star> &stars, uint32_t &nonce);
 
+    // Threads used by scan(), 0 = one per hardware thread.
+    void set_num_threads(size_t n);
+    size_t num_threads() const;
+
 private:
     void do_accept();
     void setup_shutdown();
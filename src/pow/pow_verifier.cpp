@@ -1,3 +1,5 @@
+#include <atomic>
+#include <boost/thread.hpp>
 #include "pow_verifier.hpp"
 #include "galaxy.hpp"
 #include "camera.hpp"
@@ -58,6 +60,36 @@ bool verify_dipper(const siphash_keys &key, size_t super_difficulty, uint64_t no
     return true;
 }
 
+void verify_pow_batch(size_t super_difficulty, const std::vector<pow_batch_entry> &entries, std::vector<bool> &valid, bool simple, size_t num_threads) {
+    // Not std::vector<bool>, threads write to neighbouring entries
+    std::vector<char> ok(entries.size(), 0);
+    std::atomic<size_t> next(0);
+
+    auto work = [&]() {
+	for (size_t i = next++; i < entries.size(); i = next++) {
+	    auto &e = entries[i];
+	    ok[i] = verify_pow(e.key, super_difficulty, *e.difficulty, *e.proof, simple);
+	}
+    };
+
+    if (num_threads == 0) {
+	num_threads = std::max(1u, boost::thread::hardware_concurrency());
+    }
+    num_threads = std::min(num_threads, entries.size());
+    if (num_threads <= 1) {
+	work();
+    } else {
+	boost::thread_group threads;
+	for (size_t i = 1; i < num_threads; i++) {
+	    threads.create_thread(work);
+	}
+	work();
+	threads.join_all();
+    }
+
+    valid.assign(ok.begin(), ok.end());
+}
+
 bool verify_pow_simple(const siphash_keys &key, size_t super_difficulty, const pow_difficulty &difficulty, const pow_proof &proof) {
     return verify_pow(key, super_difficulty, difficulty, proof, true);
 }
@@ -8,6 +8,7 @@
 #include <math.h>
 #include <assert.h>
 #include <fstream>
+#include <vector>
 #include "siphash.hpp"
 #include "fxp.hpp"
 #include "flt.hpp"
@@ -163,7 +164,7 @@ public:
 	}
     }
 
-    inline void set_row(size_t row_number, uint32_t row[ROW_SIZE]) {
+    inline void set_row(size_t row_number, const uint32_t row[ROW_SIZE]) {
 	memcpy(&data_[row_number*ROW_SIZE], &row[0], ROW_SIZE*sizeof(uint32_t));
     }
 
@@ -233,6 +234,21 @@ bool verify_pow_simple(const siphash_keys &key, size_t super_difficulty, const p
 
 bool verify_dipper(const siphash_keys &key, size_t super_difficulty, uint64_t nonce_offset, uint32_t nonce, const uint32_t star_ids[7]);
 
+// One proof to check with verify_pow_batch() (difficulty and proof
+// must outlive the call.)
+struct pow_batch_entry {
+    inline pow_batch_entry(const siphash_keys &k, const pow_difficulty &d, const pow_proof &p)
+	: key(k), difficulty(&d), proof(&p) { }
+
+    siphash_keys key;
+    const pow_difficulty *difficulty;
+    const pow_proof *proof;
+};
+
+// Verify many proofs on 'num_threads' threads (0 = one per core.)
+// valid[i] is the result of entries[i].
+void verify_pow_batch(size_t super_difficulty, const std::vector<pow_batch_entry> &entries, std::vector<bool> &valid, bool simple = false, size_t num_threads = 0);
+
 #ifndef DIPPER_DONT_USE_NAMESPACE
 }}
 #endif
@@ -8,6 +8,7 @@
 
 #include "../pow_verifier.hpp"
 #include "../pow_mining.hpp"
+#include "../observatory.hpp"
 
 using namespace epilog::pow;
 
@@ -86,12 +87,202 @@ static void test_pow_mining()
 
 }
 
+//
+// First rows of (simple) proofs found by search_proof() for "hello42",
+// "hello43" and "hello44" at super difficulty 7.
+//
+static const uint32_t known_rows[3][pow_proof::ROW_SIZE] = {
+    { 343167, 1221, 4188059, 6242243, 6324904, 5102029, 9318904, 5596847, 8761075 },
+    { 4342057, 1998, 10990471, 12101686, 1798212, 10586863, 13526781, 14579145, 8340581 },
+    { 11241962, 4362, 16116012, 8538706, 7386303, 14952025, 6012374, 10789708, 1199452 }
+};
+
+static void test_verify_batch()
+{
+    header("test_verify_batch");
+
+    pow_difficulty difficulty(flt1648(1));
+
+    // Valid proofs and the same proofs with one star moved
+    std::vector<std::string> msgs;
+    std::vector<pow_proof> proofs;
+    std::vector<bool> expect;
+    for (size_t i = 0; i < 3; i++) {
+	std::string msg = "hello4" + std::to_string(2 + i);
+	pow_proof proof;
+	proof.set_row(0, known_rows[i]);
+	msgs.push_back(msg);
+	proofs.push_back(proof);
+	expect.push_back(true);
+
+	uint32_t row[pow_proof::ROW_SIZE];
+	memcpy(row, known_rows[i], sizeof(row));
+	row[4]++;
+	proof.set_row(0, row);
+	msgs.push_back(msg);
+	proofs.push_back(proof);
+	expect.push_back(false);
+    }
+
+    const size_t N = 1000;
+    std::vector<pow_batch_entry> entries;
+    for (size_t i = 0; i < N; i++) {
+	size_t j = i % proofs.size();
+	siphash_keys keys(msgs[j].c_str(), msgs[j].size());
+	entries.push_back(pow_batch_entry(keys, difficulty, proofs[j]));
+    }
+
+    auto start_time = boost::posix_time::microsec_clock::universal_time();
+    for (size_t i = 0; i < N; i++) {
+	auto &e = entries[i];
+	bool r = verify_pow(e.key, 7, *e.difficulty, *e.proof, true);
+	assert(r == expect[i % proofs.size()]);
+    }
+    auto mid_time = boost::posix_time::microsec_clock::universal_time();
+    std::vector<bool> valid;
+    verify_pow_batch(7, entries, valid, true);
+    auto end_time = boost::posix_time::microsec_clock::universal_time();
+
+    assert(valid.size() == N);
+    for (size_t i = 0; i < N; i++) {
+	assert(valid[i] == expect[i % proofs.size()]);
+    }
+
+    std::cout << "Proofs:     " << N << std::endl;
+    std::cout << "Sequential: " << (mid_time - start_time).total_microseconds() << " us" << std::endl;
+    std::cout << "Batch:      " << (end_time - mid_time).total_microseconds() << " us ("
+	      << boost::thread::hardware_concurrency() << " cores)" << std::endl;
+}
+
+static void test_mining_throughput()
+{
+    header("test_mining_throughput");
+
+    // A sparse galaxy is enough to time the scanning (and keeps the
+    // test fast); the number of stars in view is what a picture costs.
+    const size_t NUM_STARS = 1 << 21;
+    const uint64_t NUM_NONCES = 1000;
+
+    char msg[8] = "hello42";
+    siphash_keys keys(msg, strlen(msg));
+    observatory<7,double> obs(keys, NUM_STARS);
+
+    size_t max_workers = worker_pool<7,double>::default_num_workers();
+    bool has_expect = false, expect_r = false;
+    uint32_t expect_nonce = 0;
+    std::vector<uint32_t> expect_ids;
+
+    for (size_t num_workers = 1; num_workers <= std::max<size_t>(max_workers, 4); num_workers *= 2) {
+	worker_pool<7,double> workers(obs, num_workers);
+	projected_star first_visible;
+	std::vector<projected_star> found;
+	uint32_t nonce = 0;
+
+	auto start_time = boost::posix_time::microsec_clock::universal_time();
+	bool r = workers.search(0, NUM_NONCES, first_visible, found, nonce);
+	auto end_time = boost::posix_time::microsec_clock::universal_time();
+
+	// Same answer regardless of the number of workers
+	std::vector<uint32_t> ids;
+	for (auto &star : found) {
+	    ids.push_back(star.id());
+	}
+	if (!has_expect) {
+	    has_expect = true;
+	    expect_r = r;
+	    expect_nonce = nonce;
+	    expect_ids = ids;
+	}
+	assert(r == expect_r);
+	assert(!r || (nonce == expect_nonce && ids == expect_ids));
+
+	uint64_t us = (end_time - start_time).total_microseconds();
+	uint64_t pictures = workers.num_pictures();
+	uint64_t rate = us == 0 ? 0 : pictures * 1000000 / us;
+	std::cout << "Workers: " << std::setw(3) << num_workers
+		  << "  nonces: " << std::setw(6) << pictures
+		  << "  nonces/sec: " << std::setw(8) << rate
+		  << "  per core: " << std::setw(8) << rate / std::min(num_workers, max_workers)
+		  << std::endl;
+    }
+}
+
+static void test_observatory_cache()
+{
+    header("test_observatory_cache");
+
+    observatory_cache cache; // One galaxy
+    siphash_keys keys1("hello42", 7), keys2("hello43", 7);
+
+    void *obs1 = cache.acquire(keys1, 7);
+    size_t galaxy_bytes = cache.memory_size();
+
+    // A concurrent miss waits for the one in use instead of allocating
+    // another galaxy.
+    std::atomic<bool> acquired(false);
+    void *obs2 = nullptr;
+    boost::thread other([&]() {
+	obs2 = cache.acquire(keys2, 7);
+	acquired = true;
+    });
+    boost::this_thread::sleep(boost::posix_time::milliseconds(200));
+    assert(!acquired);
+    assert(cache.num_observatories() == 1);
+    cache.release(obs1);
+    other.join();
+    assert(acquired);
+    assert(obs2 == obs1); // Repopulated
+    assert(cache.num_observatories() == 1);
+    assert(cache.memory_size() == galaxy_bytes);
+    cache.release(obs2);
+
+    // Hit
+    void *obs3 = cache.acquire(keys2, 7);
+    assert(obs3 == obs2);
+    cache.release(obs3);
+    assert(cache.num_hits() == 1 && cache.num_misses() == 2);
+
+    // Two galaxies
+    cache.set_max_observatories(2);
+    void *obs4 = cache.acquire(keys1, 7);
+    assert(obs4 != obs3);
+    assert(cache.num_observatories() == 2);
+    cache.release(obs4);
+    cache.set_max_observatories(1);
+    assert(cache.num_observatories() == 1);
+
+    // A failed allocation isn't left counted (and in use), so it
+    // doesn't block the next one.
+    void *obs5 = cache.acquire(keys1, 7);
+    cache.release(obs5);
+    cache.set_max_observatories(2);
+    cache.set_fail_next_populate(true);
+    bool thrown = false;
+    try {
+	cache.acquire(keys2, 7);
+    } catch (std::bad_alloc &) {
+	thrown = true;
+    }
+    assert(thrown);
+    assert(cache.num_observatories() == 1);
+    assert(cache.memory_size() == galaxy_bytes);
+    cache.set_max_observatories(1);
+    void *obs6 = cache.acquire(keys2, 7);
+    assert(obs6 == obs5);
+    cache.release(obs6);
+
+    std::cout << "Galaxy: " << galaxy_bytes / (1024*1024) << " MB" << std::endl;
+}
+
 int main(int argc, char *argv[])
 {
     if (argc == 2 && strcmp(argv[1], "--mining") == 0) {
 	test_pow_mining();
     } else {
         header("main");
+	test_verify_batch();
+	test_observatory_cache();
+	test_mining_throughput();
     }
 
     return 0;
@@ -1,6 +1,7 @@
 #include "../ec/builtins.hpp"
 #include "../ec/mnemonic.hpp"
 #include "../coin/builtins.hpp"
+#include "../common/golomb_filter.hpp"
 #include "wallet_interpreter.hpp"
 #include "wallet.hpp"
 #include <boost/filesystem/path.hpp>
@@ -27,6 +28,8 @@ void wallet_interpreter::init()
     // Make wallet inherit everything from wallet_impl
     use_module(functor("wallet_impl",0));
     set_auto_wam(true);
+    // Its cost is only seen locally
+    set_tiered_compilation(true);
     set_retain_state_between_queries(true);
 }
 
@@ -47,6 +50,7 @@ void wallet_interpreter::setup_local_builtins()
     load_builtin(M, functor("auto_save",1), &wallet_interpreter::auto_save_1);
     load_builtin(M, con_cell("load",0), &wallet_interpreter::load_0);
     load_builtin(M, con_cell("file",1), &wallet_interpreter::file_1);
+    load_builtin(M, functor("filter_match",2), &wallet_interpreter::filter_match_2);
 }
 
 void wallet_interpreter::setup_wallet_impl()
@@ -83,27 +87,77 @@ sync(N) :-
     
 
 %
-% Iterate through next 100 frozen closures to see if we have received
-% something we recognize.
+% Get the frozen closures paying to our addresses from the node's
+% address index (in one round trip.)
 %
 sync :- 
-    '$cache_addresses', sync(100), !.
+    '$cache_addresses',
+    findall(Address, cache:valid_address(Address,_), Addresses),
+    Addresses = [_|_],
+    wallet:'@'(((frozena(Addresses, HeapAddrs), frozen(HeapAddrs, Closures)) @ global), node),
+    wallet:'@'(discard, node),
+    forall('$member2'(Closure, HeapAddress, Closures, HeapAddrs),
+            ('$new_utxo_closure'(HeapAddress, Closure) ; true)), !.
 sync.
 
-sync_all :-
-    '$cache_addresses', sync_all0.
-sync_all0 :-
-    sync(100), !, sync_all0.
-sync_all0.
+sync_all :- sync.
+
+%
+% Iterate through all frozen closures (100 at a time) instead of
+% using the index.
+%
+scan_all :-
+    '$cache_addresses', scan_all0.
+scan_all0 :-
+    sync(100), !, scan_all0.
+scan_all0.
+
+%
+% Sync with the per block address filters: only the closures of the
+% blocks whose filter matches one of our addresses are fetched, so
+% the node doesn't learn our addresses.
+%
+sync_filters :-
+    '$cache_addresses',
+    findall(Address, cache:valid_address(Address,_), Addresses),
+    '$sync_filters'(Addresses).
+
+'$sync_filters'(Addresses) :-
+    (current_predicate(wallet:lastheight/1) -> wallet:lastheight(H) ; H = -1),
+    H1 is H + 1,
+    wallet:'@'((frozenf(H1, 100, Filters) @ global), node),
+    wallet:'@'(discard, node),
+    last(Filters, filter(LastH, _, _, _)), !,
+    forall((member(filter(_, From, To, Filter), Filters),
+            wallet:filter_match(Filter, Addresses)),
+           '$sync_range'(From, To)),
+    retractall(wallet:lastheight(_)),
+    assert(wallet:lastheight(LastH)),
+    '$sync_filters'(Addresses).
+'$sync_filters'(_).
+
+%
+% Check the frozen closures at heap addresses From..To-1
+%
+'$sync_range'(From, To) :-
+    From < To,
+    wallet:'@'(((frozenk(From, 100, HeapAddrs), frozen(HeapAddrs, Closures)) @ global), node),
+    wallet:'@'(discard, node),
+    forall('$member2'(Closure, HeapAddress, Closures, HeapAddrs),
+            ((HeapAddress < To, '$new_utxo_closure'(HeapAddress, Closure)) ; true)),
+    last(HeapAddrs, LastH), !,
+    Next is LastH + 1,
+    '$sync_range'(Next, To).
+'$sync_range'(_, _).
 
 %
 % Restart wallet sweep. Clean UTXO database and start from heap address 0.
-% Call one sync step (which syncs 100 UTXOs)
 %
 resync :-
     retractall(wallet:utxo(_,_,_,_)),
     retractall(lastheap(_)),
     assert(lastheap(0)),
+    retractall(wallet:lastheight(_)),
     sync.
 
 %
@@ -390,6 +444,43 @@ bool wallet_interpreter::auto_save_1(interpreter_base &interp, size_t arity, ter
     }
 }
 
+static std::vector<uint8_t> big_bytes(interpreter_base &interp, term t)
+{
+    auto &big = reinterpret_cast<big_cell &>(t);
+    std::vector<uint8_t> bytes(interp.num_bytes(big));
+    interp.get_big(big, &bytes[0], bytes.size());
+    return bytes;
+}
+
+//
+// filter_match(Filter, Addresses)
+//  True if (probably) any of the addresses is in the filter (as
+//  returned by frozenf/3.)
+//
+bool wallet_interpreter::filter_match_2(interpreter_base &interp, size_t arity, term args[])
+{
+    if (args[0].tag() != tag_t::BIG) {
+	throw interp::interpreter_exception_wrong_arg_type("filter_match/2: First argument must be a bignum; was " + interp.to_string(args[0]));
+    }
+    auto bytes = big_bytes(interp, args[0]);
+    golomb_filter filter;
+    if (!filter.read(&bytes[0], bytes.size())) {
+	return false;
+    }
+
+    std::vector<uint64_t> hashes;
+    term lst = args[1];
+    while (interp.is_dotted_pair(lst)) {
+	auto address = interp.deref(interp.arg(lst, 0));
+	if (address.tag() == tag_t::BIG) {
+	    auto addr = big_bytes(interp, address);
+	    hashes.push_back(golomb_filter::hash(&addr[0], addr.size()));
+	}
+	lst = interp.deref(interp.arg(lst, 1));
+    }
+    return filter.match_any(hashes);
+}
+
 bool wallet_interpreter::load_0(interpreter_base &interp, size_t arity, term args[])
 {
     auto &w = reinterpret_cast<wallet_interpreter &>(interp).get_wallet();
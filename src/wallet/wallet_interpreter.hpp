@@ -33,6 +33,7 @@ private:
     static bool load_0(interpreter_base &interp, size_t arity, term args[]);    
     static bool file_1(interpreter_base &interp, size_t arity, term args[]);
     static bool auto_save_1(interpreter_base &interp, size_t arity, term args[]);
+    static bool filter_match_2(interpreter_base &interp, size_t arity, term args[]);
     static bool operator_at_impl(interpreter_base &interp, size_t arity, term args[], const std::string &name, interp::remote_execute_mode mode);
     static bool operator_at_2(interpreter_base &interp, size_t arity, term args[]);
     static bool operator_at_silent_2(interpreter_base &interp, size_t arity, term args[]);